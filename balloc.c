@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "libdisksimul.h"
+#include "bufcache.h"
+#include "balloc.h"
+
+/* Sector allocation bitmap.
+ *
+ * One bit per sector, 1 when the sector is in use. The bitmap is stored in
+ * bitmap_sectors sectors starting at bitmap_start and kept in memory while
+ * the disk is open, as 64-bit words so full and empty stretches are skipped
+ * a word at a time. Each bitmap sector covers a group of sectors whose free
+ * count is kept alongside, so full groups are skipped without scanning.
+ * Bytes on disk are in little-endian bit order: sector n is bit n%8 of
+ * byte n/8.
+ *
+ * Sectors from the high-water mark on were never allocated. Their bitmap
+ * sectors are neither written by format nor read by mount (a sparse disk
+ * reads them as zeros anyway), and the allocator takes the space past the
+ * mark as one free run without scanning it.
+ *
+ * Every function takes the bitmap mutex, allocations from several threads
+ * never hand out the same sector.
+ */
+
+#define WORD_BITS 64
+
+/* Bitmap sectors read by one disk request. */
+#define BA_IO_SECTORS 256
+
+/**
+ * Bitmap of one disk.
+ */
+struct ba_bitmap{
+	struct ds_device *dev;		/**< Disk, bitmap sectors are loaded from it. */
+	struct bc_cache *cache;		/**< Cache, bitmap sectors are written through it. */
+	uint64_t *bits;			/**< One bit per sector. */
+	uint64_t n_words;		/**< Words of bits. */
+	uint64_t total;			/**< Number of sectors of the disk. */
+	uint64_t first_sector;		/**< First bitmap sector. */
+	uint64_t n_sectors;		/**< Number of bitmap sectors (groups). */
+	int sector_size;		/**< Sector size in bytes. */
+	uint64_t high_water;		/**< First sector never allocated. */
+	unsigned int *group_free;	/**< Free sectors per group. */
+	unsigned char *group_dirty;	/**< Modified groups. */
+	unsigned int words_per_group;	/**< Words of bits per bitmap sector. */
+	pthread_mutex_t lock;		/**< Protects everything above. */
+};
+
+
+static uint64_t group_of(struct ba_bitmap *bm, uint64_t sector_number){
+	return sector_number / WORD_BITS / bm->words_per_group;
+}
+
+/**
+ * @brief Allocate an in-memory bitmap.
+ * @return Bitmap, NULL on error.
+ */
+static struct ba_bitmap *ba_alloc(struct ds_device *dev, struct bc_cache *cache, uint64_t bitmap_start, uint64_t bitmap_sectors, uint64_t total_sectors, int sector_size){
+	struct ba_bitmap *bm;
+
+	if( (bm = calloc(1, sizeof(struct ba_bitmap))) == NULL){
+		perror("calloc()");
+		return NULL;
+	}
+
+	pthread_mutex_init(&bm->lock, NULL);
+	bm->dev = dev;
+	bm->cache = cache;
+	bm->first_sector = bitmap_start;
+	bm->n_sectors = bitmap_sectors;
+	bm->total = total_sectors;
+	bm->sector_size = sector_size;
+	bm->words_per_group = sector_size * 8 / WORD_BITS;
+	bm->n_words = bm->n_sectors * bm->words_per_group;
+
+	if(bm->n_words * WORD_BITS < bm->total){
+		printf("Error: Bitmap too small for %" PRIu64 " sectors\n", bm->total);
+		ba_release(bm);
+		return NULL;
+	}
+
+	bm->bits = calloc(bm->n_words, sizeof(uint64_t));
+	bm->group_free = calloc(bm->n_sectors, sizeof(unsigned int));
+	bm->group_dirty = calloc(bm->n_sectors, 1);
+
+	if(bm->bits == NULL || bm->group_free == NULL || bm->group_dirty == NULL){
+		perror("calloc()");
+		ba_release(bm);
+		return NULL;
+	}
+
+	return bm;
+}
+
+/**
+ * @brief Mark the bits past the last sector as used, so they are never allocated.
+ */
+static void ba_mark_padding(struct ba_bitmap *bm){
+	uint64_t i;
+
+	for(i = bm->total; i < bm->n_words * WORD_BITS; i++){
+		bm->bits[i / WORD_BITS] |= (uint64_t)1 << (i % WORD_BITS);
+	}
+}
+
+/**
+ * @brief Count the free sectors of every group.
+ */
+static void ba_count_groups(struct ba_bitmap *bm){
+	uint64_t g, w;
+
+	for(g = 0; g < bm->n_sectors; g++){
+		bm->group_free[g] = 0;
+		for(w = g * bm->words_per_group; w < (g + 1) * bm->words_per_group; w++){
+			bm->group_free[g] += WORD_BITS - __builtin_popcountll(bm->bits[w]);
+		}
+	}
+}
+
+/**
+ * @brief Create an empty bitmap (every sector free) for a new disk.
+ *
+ * Nothing is written until sectors are marked used, and then only the
+ * bitmap sectors holding them.
+ *
+ * @param dev Disk.
+ * @param cache Cache of the disk.
+ * @param bitmap_start First bitmap sector.
+ * @param bitmap_sectors Number of bitmap sectors.
+ * @param total_sectors Number of sectors of the disk.
+ * @param sector_size Sector size in bytes.
+ * @return Bitmap, NULL on error.
+ */
+struct ba_bitmap *ba_create(struct ds_device *dev, struct bc_cache *cache, uint64_t bitmap_start, uint64_t bitmap_sectors, uint64_t total_sectors, int sector_size){
+	struct ba_bitmap *bm;
+
+	if( (bm = ba_alloc(dev, cache, bitmap_start, bitmap_sectors, total_sectors, sector_size)) == NULL){
+		return NULL;
+	}
+
+	ba_mark_padding(bm);
+	ba_count_groups(bm);
+	bm->high_water = 0;
+
+	return bm;
+}
+
+/**
+ * @brief Load the bitmap of a disk.
+ * @param dev Disk.
+ * @param cache Cache of the disk.
+ * @param bitmap_start First bitmap sector.
+ * @param bitmap_sectors Number of bitmap sectors.
+ * @param total_sectors Number of sectors of the disk.
+ * @param sector_size Sector size in bytes.
+ * @param high_water_mark First sector never allocated.
+ * @return Bitmap, NULL on error.
+ */
+struct ba_bitmap *ba_load(struct ds_device *dev, struct bc_cache *cache, uint64_t bitmap_start, uint64_t bitmap_sectors, uint64_t total_sectors, int sector_size, uint64_t high_water_mark){
+	struct ba_bitmap *bm;
+	uint64_t g, groups;
+	int count;
+
+	if( (bm = ba_alloc(dev, cache, bitmap_start, bitmap_sectors, total_sectors, sector_size)) == NULL){
+		return NULL;
+	}
+
+	bm->high_water = high_water_mark < bm->total ? high_water_mark : bm->total;
+
+	/* The bitmap up to the high-water mark in large requests, the rest is free. */
+	groups = bm->high_water ? group_of(bm, bm->high_water - 1) + 1 : 0;
+	for(g = 0; g < groups; g += count){
+		count = groups - g < BA_IO_SECTORS ? groups - g : BA_IO_SECTORS;
+		if(ds_read_sectors(dev, bm->first_sector + g, count, (void*)(bm->bits + g * bm->words_per_group), bm->sector_size) != 0){
+			ba_release(bm);
+			return NULL;
+		}
+	}
+
+	ba_mark_padding(bm);
+	ba_count_groups(bm);
+
+	return bm;
+}
+
+/**
+ * @brief Write the modified bitmap sectors.
+ * @param bm Bitmap.
+ * @return 0 on success.
+ */
+int ba_flush(struct ba_bitmap *bm){
+	uint64_t g;
+	int ret = 0;
+
+	pthread_mutex_lock(&bm->lock);
+	for(g = 0; g < bm->n_sectors; g++){
+		if(bm->group_dirty[g]){
+			if(bc_write_sector(bm->cache, bm->first_sector + g, (void*)(bm->bits + g * bm->words_per_group)) != 0){
+				ret = 1;
+				continue;
+			}
+			bm->group_dirty[g] = 0;
+		}
+	}
+	pthread_mutex_unlock(&bm->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Release the in-memory bitmap, without writing it.
+ * @param bm Bitmap, may be NULL.
+ */
+void ba_release(struct ba_bitmap *bm){
+	if(bm == NULL){
+		return;
+	}
+
+	pthread_mutex_destroy(&bm->lock);
+	free(bm->bits);
+	free(bm->group_free);
+	free(bm->group_dirty);
+	free(bm);
+}
+
+/**
+ * @brief Mark a run of sectors as used or free, with the bitmap locked.
+ */
+static void mark_run(struct ba_bitmap *bm, uint64_t start, uint64_t length, int used){
+	uint64_t i, w, g, n;
+	uint64_t mask, changed;
+
+	for(i = start; i < start + length; i += n){
+		w = i / WORD_BITS;
+		n = WORD_BITS - i % WORD_BITS;
+		if(n > start + length - i){
+			n = start + length - i;
+		}
+		mask = (n == WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << (i % WORD_BITS);
+
+		/* Only count the bm->bits that really change. */
+		changed = used ? (mask & ~bm->bits[w]) : (mask & bm->bits[w]);
+		g = group_of(bm, i);
+		if(used){
+			bm->bits[w] |= mask;
+			bm->group_free[g] -= __builtin_popcountll(changed);
+		}else{
+			bm->bits[w] &= ~mask;
+			bm->group_free[g] += __builtin_popcountll(changed);
+		}
+
+		if(changed){
+			bm->group_dirty[g] = 1;
+		}
+	}
+
+	if(used && start + length > bm->high_water){
+		bm->high_water = start + length;
+	}
+}
+
+/**
+ * @brief Mark a run of sectors as used or free.
+ * @param bm Bitmap.
+ * @param start First sector.
+ * @param length Number of sectors.
+ * @param used 1 for used, 0 for free.
+ */
+void ba_mark(struct ba_bitmap *bm, uint64_t start, uint64_t length, int used){
+	pthread_mutex_lock(&bm->lock);
+	mark_run(bm, start, length, used);
+	pthread_mutex_unlock(&bm->lock);
+}
+
+/**
+ * @brief Verify if a sector is in use.
+ * @param bm Bitmap.
+ * @param sector_number Number of the sector.
+ * @return 1 if it is used.
+ */
+int ba_is_used(struct ba_bitmap *bm, uint64_t sector_number){
+	int used;
+
+	pthread_mutex_lock(&bm->lock);
+	used = (bm->bits[sector_number / WORD_BITS] >> (sector_number % WORD_BITS)) & 1;
+	pthread_mutex_unlock(&bm->lock);
+
+	return used;
+}
+
+/**
+ * @brief Scan the bitmap for free runs.
+ *
+ * @param bm Bitmap.
+ * @param want Stop at the first run of at least want sectors, 0 to scan all.
+ * @param start Output start of the run found.
+ * @return Length of the first run of want sectors, or of the longest run
+ * when there is none. 0 if the disk is full.
+ */
+static uint64_t ba_find_run(struct ba_bitmap *bm, uint64_t want, uint64_t *start){
+	uint64_t w, g, b, n;
+	uint64_t run_start = 0, run_len = 0;
+	uint64_t best_start = 0, best_len = 0;
+	uint64_t word;
+
+	for(w = 0; w < bm->n_words; w++){
+		/* Everything past the high-water mark is one free run. */
+		if(w * WORD_BITS >= bm->high_water){
+			if(run_len == 0){
+				run_start = w * WORD_BITS;
+			}
+			run_len += bm->total - w * WORD_BITS;
+			break;
+		}
+
+		/* Full group, jump over it. */
+		if(w % bm->words_per_group == 0 && bm->group_free[w / bm->words_per_group] == 0){
+			g = w / bm->words_per_group;
+			if(run_len > best_len){
+				best_start = run_start;
+				best_len = run_len;
+			}
+			run_len = 0;
+			w = (g + 1) * bm->words_per_group - 1;
+			continue;
+		}
+
+		word = bm->bits[w];
+
+		if(word == 0){
+			if(run_len == 0){
+				run_start = w * WORD_BITS;
+			}
+			run_len += WORD_BITS;
+		}else{
+			for(b = 0; b < WORD_BITS; b += n){
+				if( !((word >> b) & 1)){
+					/* Free bm->bits up to the next used one. */
+					n = (word >> b) ? __builtin_ctzll(word >> b) : WORD_BITS - b;
+					if(run_len == 0){
+						run_start = w * WORD_BITS + b;
+					}
+					run_len += n;
+					if(want > 0 && run_len >= want){
+						break;
+					}
+				}else{
+					/* Used bm->bits up to the next free one. */
+					n = (~word >> b) ? __builtin_ctzll(~word >> b) : WORD_BITS - b;
+					if(run_len > best_len){
+						best_start = run_start;
+						best_len = run_len;
+					}
+					run_len = 0;
+				}
+			}
+		}
+
+		if(want > 0 && run_len >= want){
+			*start = run_start;
+			return want;
+		}
+	}
+
+	if(run_len > best_len){
+		best_start = run_start;
+		best_len = run_len;
+	}
+
+	*start = best_start;
+
+	return best_len;
+}
+
+/**
+ * @brief Allocate a run of free sectors (first fit).
+ *
+ * Takes the first free run of want sectors. When the free space is too
+ * fragmented for that, takes the longest free run instead, so the caller
+ * needs as few extents as possible.
+ *
+ * @param bm Bitmap.
+ * @param want Number of sectors wanted.
+ * @param start Output first sector of the run.
+ * @return Number of sectors allocated, 0 if the disk is full.
+ */
+uint64_t ba_alloc_run(struct ba_bitmap *bm, uint64_t want, uint64_t *start){
+	uint64_t length;
+
+	if(want == 0){
+		return 0;
+	}
+
+	pthread_mutex_lock(&bm->lock);
+	if( (length = ba_find_run(bm, want, start)) > 0){
+		if(length > want){
+			length = want;
+		}
+		mark_run(bm, *start, length, 1);
+	}
+	pthread_mutex_unlock(&bm->lock);
+
+	return length;
+}
+
+/**
+ * @brief Allocate the free sectors starting at a given sector.
+ *
+ * Used to grow a run in place: takes the free sectors from start on, up to
+ * want or the first used sector.
+ *
+ * @param bm Bitmap.
+ * @param start First sector wanted.
+ * @param want Number of sectors wanted.
+ * @return Number of sectors allocated from start, 0 if start is used.
+ */
+uint64_t ba_alloc_at(struct ba_bitmap *bm, uint64_t start, uint64_t want){
+	uint64_t length = 0, i;
+
+	pthread_mutex_lock(&bm->lock);
+	if(start < bm->total && want > bm->total - start){
+		want = bm->total - start;
+	}
+	for(i = start; i < bm->total && length < want; i++, length++){
+		/* Everything past the high-water mark is free. */
+		if(i >= bm->high_water){
+			length = want;
+			break;
+		}
+		if((bm->bits[i / WORD_BITS] >> (i % WORD_BITS)) & 1){
+			break;
+		}
+	}
+	if(length > 0){
+		mark_run(bm, start, length, 1);
+	}
+	pthread_mutex_unlock(&bm->lock);
+
+	return length;
+}
+
+/**
+ * @brief First sector never allocated.
+ * @param bm Bitmap.
+ * @return High-water mark.
+ */
+uint64_t ba_high_water(struct ba_bitmap *bm){
+	uint64_t n;
+
+	pthread_mutex_lock(&bm->lock);
+	n = bm->high_water;
+	pthread_mutex_unlock(&bm->lock);
+
+	return n;
+}
+
+/**
+ * @brief Number of free sectors.
+ * @param bm Bitmap.
+ * @return Free sectors, from the per-group counts.
+ */
+uint64_t ba_free_count(struct ba_bitmap *bm){
+	uint64_t g, n = 0;
+
+	pthread_mutex_lock(&bm->lock);
+	for(g = 0; g < bm->n_sectors; g++){
+		n += bm->group_free[g];
+	}
+	pthread_mutex_unlock(&bm->lock);
+
+	return n;
+}
+
+/**
+ * @brief Length of the longest free run.
+ * @param bm Bitmap.
+ * @return Number of sectors.
+ */
+uint64_t ba_largest_free_run(struct ba_bitmap *bm){
+	uint64_t start, length;
+
+	pthread_mutex_lock(&bm->lock);
+	length = ba_find_run(bm, 0, &start);
+	pthread_mutex_unlock(&bm->lock);
+
+	return length;
+}
+
+/**
+ * @brief Number of used sectors in a range.
+ * @param bm Bitmap.
+ * @param start First sector.
+ * @param length Number of sectors.
+ * @return Used sectors.
+ */
+uint64_t ba_count_used(struct ba_bitmap *bm, uint64_t start, uint64_t length){
+	uint64_t w, end, n = 0, word;
+
+	pthread_mutex_lock(&bm->lock);
+
+	/* Nothing past the high-water mark was allocated. */
+	end = start + length < bm->high_water ? start + length : bm->high_water;
+
+	while(start < end){
+		w = start / WORD_BITS;
+		word = bm->bits[w] >> (start % WORD_BITS);
+		if(end - start < WORD_BITS - start % WORD_BITS){
+			word &= ((uint64_t)1 << (end - start)) - 1;
+			n += __builtin_popcountll(word);
+			break;
+		}
+		n += __builtin_popcountll(word);
+		start = (w + 1) * WORD_BITS;
+	}
+
+	pthread_mutex_unlock(&bm->lock);
+
+	return n;
+}
+
+/**
+ * @brief Number of runs of free sectors.
+ * @param bm Bitmap.
+ * @return Free runs, 1 on an empty disk.
+ */
+uint64_t ba_free_runs(struct ba_bitmap *bm){
+	uint64_t w, word, prev = 1, n = 0;
+
+	pthread_mutex_lock(&bm->lock);
+
+	for(w = 0; w < bm->n_words; w++){
+		/* Everything past the high-water mark is one free run. */
+		if(w * WORD_BITS >= bm->high_water){
+			n += prev;
+			break;
+		}
+
+		/* A run starts at a free sector after a used one. */
+		word = bm->bits[w];
+		n += __builtin_popcountll(~word & ((word << 1) | prev));
+		prev = word >> (WORD_BITS - 1);
+	}
+
+	pthread_mutex_unlock(&bm->lock);
+
+	return n;
+}
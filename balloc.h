@@ -0,0 +1,22 @@
+/* Sector allocation bitmap. */
+
+#include <stdint.h>
+
+/* Bitmap of one disk, see ba_create and ba_load. */
+struct ba_bitmap;
+struct ds_device;
+struct bc_cache;
+
+struct ba_bitmap *ba_create(struct ds_device *dev, struct bc_cache *cache, uint64_t bitmap_start, uint64_t bitmap_sectors, uint64_t total_sectors, int sector_size);
+struct ba_bitmap *ba_load(struct ds_device *dev, struct bc_cache *cache, uint64_t bitmap_start, uint64_t bitmap_sectors, uint64_t total_sectors, int sector_size, uint64_t high_water_mark);
+int ba_flush(struct ba_bitmap *bm);
+void ba_release(struct ba_bitmap *bm);
+uint64_t ba_alloc_run(struct ba_bitmap *bm, uint64_t want, uint64_t *start);
+uint64_t ba_alloc_at(struct ba_bitmap *bm, uint64_t start, uint64_t want);
+void ba_mark(struct ba_bitmap *bm, uint64_t start, uint64_t length, int used);
+int ba_is_used(struct ba_bitmap *bm, uint64_t sector_number);
+uint64_t ba_high_water(struct ba_bitmap *bm);
+uint64_t ba_free_count(struct ba_bitmap *bm);
+uint64_t ba_largest_free_run(struct ba_bitmap *bm);
+uint64_t ba_count_used(struct ba_bitmap *bm, uint64_t start, uint64_t length);
+uint64_t ba_free_runs(struct ba_bitmap *bm);
@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "libdisksimul.h"
+#include "journal.h"
+#include "bufcache.h"
+#include "opstats.h"
+
+/* LRU write-back cache of disk sectors.
+ *
+ * Metadata sectors (root, directory tables, free list links) are read and
+ * written through here, so repeated updates to the same sector are merged
+ * in memory and reach the disk once, in sector order, on bc_sync.
+ * A mutex protects the slots, callers serialise updates to a sector's
+ * contents themselves (see the directory locks in filesystem.c).
+ *
+ * With a journal (bc_set_journal) the dirty sectors are committed to it
+ * instead, and are never evicted: when every slot is dirty the cache grows
+ * by extra slots until the next write-back, which the filesystem only runs
+ * between operations, so a commit never holds half of one.
+ */
+
+/* Sector number of a free slot. */
+#define NO_SECTOR UINT64_MAX
+
+/**
+ * Cached sector.
+ */
+struct bc_entry{
+	uint64_t sector;		/**< Sector number, NO_SECTOR if the slot is free. */
+	int dirty;			/**< Modified since it was read or written back. */
+	int pinned;			/**< Never evicted. */
+	struct bc_entry *prev;		/**< LRU list, towards the most recently used. */
+	struct bc_entry *next;		/**< LRU list, towards the least recently used. */
+	struct bc_entry *hnext;		/**< Hash bucket chain. */
+	struct bc_entry *xnext;		/**< Extra slots, see grow_entry. */
+	unsigned char *data;		/**< Sector contents. */
+};
+
+/**
+ * Cache of one disk.
+ */
+struct bc_cache{
+	struct ds_device *dev;		/**< Cached disk. */
+	struct bc_entry *entries;	/**< Slots. */
+	struct bc_entry **buckets;	/**< Hash table of the cached sectors. */
+	unsigned char *buffers;		/**< Sector contents of every slot. */
+	int n_entries;			/**< Number of slots. */
+	int n_buckets;			/**< Hash table size, a power of two. */
+	int sector_size;		/**< Sector size in bytes. */
+	struct bc_entry *lru_head;	/**< Most recently used slot. */
+	struct bc_entry *lru_tail;	/**< Least recently used slot. */
+	struct bc_stats stats;		/**< Counters. */
+	int n_dirty;			/**< Dirty slots. */
+	struct bc_entry *extra;		/**< Slots added while every slot was dirty, freed by write_back. */
+	struct jn_journal *journal;	/**< Journal of the write-backs, may be NULL. */
+	pthread_mutex_t lock;		/**< Protects everything above. */
+};
+
+
+static int bucket_of(struct bc_cache *c, uint64_t sector_number){
+	return (sector_number * 0x9E3779B97F4A7C15ull >> 32) & (c->n_buckets - 1);
+}
+
+static void lru_unlink(struct bc_cache *c, struct bc_entry *e){
+	if(e->prev) e->prev->next = e->next; else c->lru_head = e->next;
+	if(e->next) e->next->prev = e->prev; else c->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct bc_cache *c, struct bc_entry *e){
+	e->prev = NULL;
+	e->next = c->lru_head;
+	if(c->lru_head) c->lru_head->prev = e;
+	c->lru_head = e;
+	if(c->lru_tail == NULL) c->lru_tail = e;
+}
+
+static struct bc_entry *find_entry(struct bc_cache *c, uint64_t sector_number){
+	struct bc_entry *e;
+
+	for(e = c->buckets[bucket_of(c, sector_number)]; e != NULL; e = e->hnext){
+		if(e->sector == sector_number){
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void hash_remove(struct bc_cache *c, struct bc_entry *e){
+	struct bc_entry **p = &c->buckets[bucket_of(c, e->sector)];
+
+	while(*p != e){
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+	e->hnext = NULL;
+}
+
+static int write_back(struct bc_cache *c);
+
+/**
+ * @brief Add a slot to a cache whose slots are all dirty.
+ * @return New free slot, NULL if out of memory.
+ */
+static struct bc_entry *grow_entry(struct bc_cache *c){
+	struct bc_entry *e;
+
+	if( (e = calloc(1, sizeof(struct bc_entry) + c->sector_size)) == NULL){
+		return NULL;
+	}
+
+	e->sector = NO_SECTOR;
+	e->data = (unsigned char*)(e + 1);
+	e->xnext = c->extra;
+	c->extra = e;
+
+	lru_push_front(c, e);
+
+	return e;
+}
+
+/**
+ * @brief Free the extra slots that are clean and not pinned.
+ */
+static void shrink_entries(struct bc_cache *c){
+	struct bc_entry **p = &c->extra, *e;
+
+	while( (e = *p) != NULL){
+		if(e->dirty || e->pinned){
+			p = &e->xnext;
+			continue;
+		}
+
+		*p = e->xnext;
+		if(e->sector != NO_SECTOR){
+			hash_remove(c, e);
+		}
+		lru_unlink(c, e);
+		free(e);
+	}
+}
+
+/**
+ * @brief Get a slot for a new sector, evicting the least recently used one.
+ * @return Free slot or NULL if every sector is pinned.
+ */
+static struct bc_entry *alloc_entry(struct bc_cache *c, uint64_t sector_number){
+	struct bc_entry *e;
+
+	/* Walk from the LRU end, skipping pinned sectors, and dirty ones when journaling. */
+	for(e = c->lru_tail; e != NULL && (e->pinned || (c->journal != NULL && e->dirty)); e = e->prev);
+
+	/* Everything is dirty: grow until the operation is over, a commit now would split it. */
+	if(e == NULL && c->journal != NULL && c->n_dirty > 0 && (e = grow_entry(c)) == NULL){
+		/* Out of memory, a split commit is still better than writing in place. */
+		write_back(c);
+		for(e = c->lru_tail; e != NULL && e->pinned; e = e->prev);
+	}
+
+	if(e == NULL){
+		return NULL;
+	}
+
+	if(e->sector != NO_SECTOR){
+		if(e->dirty){
+			ds_write_sector(c->dev, e->sector, e->data, c->sector_size);
+			c->stats.writebacks++;
+			c->n_dirty--;
+		}
+		hash_remove(c, e);
+		c->stats.evictions++;
+	}
+
+	e->sector = sector_number;
+	e->dirty = 0;
+	e->pinned = 0;
+	e->hnext = c->buckets[bucket_of(c, sector_number)];
+	c->buckets[bucket_of(c, sector_number)] = e;
+
+	lru_unlink(c, e);
+	lru_push_front(c, e);
+
+	return e;
+}
+
+/**
+ * @brief Create a cache for a disk.
+ * @param dev Disk.
+ * @param sector_size Sector size in bytes.
+ * @param capacity Number of sectors kept in memory.
+ * @return Cache, NULL on error.
+ */
+struct bc_cache *bc_init(struct ds_device *dev, int sector_size, int capacity){
+	struct bc_cache *c;
+	int i;
+
+	if( (c = calloc(1, sizeof(struct bc_cache))) == NULL){
+		perror("calloc()");
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->dev = dev;
+	c->sector_size = sector_size;
+	c->n_entries = capacity;
+	for(c->n_buckets = 1; c->n_buckets < capacity * 2; c->n_buckets <<= 1);
+
+	c->entries = calloc(c->n_entries, sizeof(struct bc_entry));
+	c->buckets = calloc(c->n_buckets, sizeof(struct bc_entry*));
+	c->buffers = malloc((size_t)c->n_entries * sector_size);
+
+	if(c->entries == NULL || c->buckets == NULL || c->buffers == NULL){
+		perror("malloc()");
+		bc_stop(c);
+		return NULL;
+	}
+
+	for(i = 0; i < c->n_entries; i++){
+		c->entries[i].sector = NO_SECTOR;
+		c->entries[i].data = c->buffers + (size_t)i * sector_size;
+		lru_push_front(c, &c->entries[i]);
+	}
+
+	return c;
+}
+
+/**
+ * @brief Read a sector, with the cache locked.
+ */
+static int cache_read(struct bc_cache *c, uint64_t sector_number, void *data){
+	struct bc_entry *e;
+	int ret;
+
+	if( (e = find_entry(c, sector_number)) != NULL){
+		c->stats.hits++;
+		os_count_cache(1);
+		lru_unlink(c, e);
+		lru_push_front(c, e);
+		memcpy(data, e->data, c->sector_size);
+		return 0;
+	}
+
+	c->stats.misses++;
+	os_count_cache(0);
+
+	if( (e = alloc_entry(c, sector_number)) == NULL){
+		if(c->journal != NULL && jn_read(c->journal, sector_number, data) == 0){
+			return 0;
+		}
+		return ds_read_sector(c->dev, sector_number, data, c->sector_size);
+	}
+
+	/* A committed sector may not be in place yet. */
+	if(c->journal != NULL && jn_read(c->journal, sector_number, e->data) == 0){
+		ret = 0;
+	}else if( (ret = ds_read_sector(c->dev, sector_number, e->data, c->sector_size)) != 0){
+		hash_remove(c, e);
+		e->sector = NO_SECTOR;
+		return ret;
+	}
+
+	memcpy(data, e->data, c->sector_size);
+
+	return 0;
+}
+
+/**
+ * @brief Read a sector, from memory when it is cached.
+ * @param c Cache.
+ * @param sector_number Number of the sector.
+ * @param data Buffer to store the sector.
+ * @return 0 on success.
+ */
+int bc_read_sector(struct bc_cache *c, uint64_t sector_number, void *data){
+	int ret;
+
+	pthread_mutex_lock(&c->lock);
+	ret = cache_read(c, sector_number, data);
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Write a sector to the cache. It reaches the disk on bc_sync or eviction.
+ * @param c Cache.
+ * @param sector_number Number of the sector.
+ * @param data Sector contents.
+ * @return 0 on success.
+ */
+int bc_write_sector(struct bc_cache *c, uint64_t sector_number, void *data){
+	struct bc_entry *e;
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+
+	if( (e = find_entry(c, sector_number)) != NULL){
+		if(e->dirty){
+			c->stats.merged++;
+		}
+		lru_unlink(c, e);
+		lru_push_front(c, e);
+	}else if( (e = alloc_entry(c, sector_number)) == NULL){
+		ret = ds_write_sector(c->dev, sector_number, data, c->sector_size);
+	}
+
+	if(e != NULL){
+		memcpy(e->data, data, c->sector_size);
+		c->n_dirty += !e->dirty;
+		e->dirty = 1;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Write contiguous sectors straight to the disk, keeping cached copies coherent.
+ *
+ * Used for bulk file data, which would otherwise push the metadata out.
+ *
+ * @param c Cache.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Sectors contents.
+ * @return 0 on success.
+ */
+int bc_write_through(struct bc_cache *c, uint64_t first_sector, int count, void *data){
+	struct bc_entry *e;
+	int i;
+
+	if(c->journal != NULL && jn_barrier(c->journal, first_sector, count) != 0){
+		return 1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < count; i++){
+		if( (e = find_entry(c, first_sector + i)) != NULL){
+			memcpy(e->data, (unsigned char*)data + (size_t)i * c->sector_size, c->sector_size);
+			c->n_dirty -= e->dirty;
+			e->dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return ds_write_sectors(c->dev, first_sector, count, data, c->sector_size);
+}
+
+/**
+ * @brief Start writing contiguous sectors straight to the disk, see bc_write_through.
+ *
+ * @param c Cache.
+ * @param batch Batch of the request, waited for with ds_wait.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Sectors contents, left alone until ds_wait.
+ * @return 0 if the write was started.
+ */
+int bc_submit_write(struct bc_cache *c, struct ds_batch *batch, uint64_t first_sector, int count, void *data){
+	struct bc_entry *e;
+	int i;
+
+	if(c->journal != NULL && jn_barrier(c->journal, first_sector, count) != 0){
+		return 1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < count; i++){
+		if( (e = find_entry(c, first_sector + i)) != NULL){
+			memcpy(e->data, (unsigned char*)data + (size_t)i * c->sector_size, c->sector_size);
+			c->n_dirty -= e->dirty;
+			e->dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return ds_submit_write(c->dev, batch, first_sector, count, data, c->sector_size);
+}
+
+/**
+ * @brief Keep a sector in the cache until bc_stop.
+ * @param c Cache.
+ * @param sector_number Number of the sector, loaded if it is not cached.
+ */
+void bc_pin(struct bc_cache *c, uint64_t sector_number){
+	struct bc_entry *e;
+	unsigned char *tmp;
+
+	if( (tmp = malloc(c->sector_size)) == NULL){
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if( (e = find_entry(c, sector_number)) == NULL){
+		cache_read(c, sector_number, tmp);
+		e = find_entry(c, sector_number);
+	}
+
+	if(e != NULL){
+		e->pinned = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	free(tmp);
+}
+
+static int cmp_sector(const void *a, const void *b){
+	const struct bc_entry *x = *(struct bc_entry * const *)a;
+	const struct bc_entry *y = *(struct bc_entry * const *)b;
+
+	return (x->sector > y->sector) - (x->sector < y->sector);
+}
+
+/**
+ * @brief Write every dirty sector back, with the cache locked.
+ *
+ * Without a journal the sectors are written in place, in sector order,
+ * all in flight at once on the asynchronous backends. With a journal they
+ * are committed as one group.
+ *
+ * @param c Cache.
+ * @return 0 on success.
+ */
+static int write_back(struct bc_cache *c){
+	struct bc_entry **dirty, *e;
+	struct ds_batch batch;
+	uint64_t *sectors;
+	unsigned char **data;
+	int i, n = 0, ret = 0;
+
+	if(c->n_dirty == 0){
+		return 0;
+	}
+
+	dirty = malloc(c->n_dirty * sizeof(struct bc_entry*));
+	sectors = malloc(c->n_dirty * sizeof(uint64_t));
+	data = malloc(c->n_dirty * sizeof(unsigned char*));
+	if(dirty == NULL || sectors == NULL || data == NULL){
+		free(dirty);
+		free(sectors);
+		free(data);
+		return 1;
+	}
+
+	for(i = 0; i < c->n_entries && n < c->n_dirty; i++){
+		if(c->entries[i].sector != NO_SECTOR && c->entries[i].dirty){
+			dirty[n++] = &c->entries[i];
+		}
+	}
+	for(e = c->extra; e != NULL && n < c->n_dirty; e = e->xnext){
+		if(e->sector != NO_SECTOR && e->dirty){
+			dirty[n++] = e;
+		}
+	}
+
+	qsort(dirty, n, sizeof(struct bc_entry*), cmp_sector);
+
+	for(i = 0; i < n; i++){
+		sectors[i] = dirty[i]->sector;
+		data[i] = dirty[i]->data;
+	}
+
+	if(c->journal != NULL){
+		ret = jn_commit(c->journal, n, sectors, data);
+	}else{
+		ds_batch_init(&batch);
+		for(i = 0; i < n; i++){
+			ds_submit_write(c->dev, &batch, sectors[i], 1, data[i], c->sector_size);
+		}
+		ret = ds_wait(c->dev, &batch) != 0;
+	}
+
+	if(ret == 0){
+		for(i = 0; i < n; i++){
+			dirty[i]->dirty = 0;
+		}
+		c->n_dirty = 0;
+		c->stats.writebacks += n;
+		shrink_entries(c);
+	}
+
+	free(dirty);
+	free(sectors);
+	free(data);
+
+	return ret;
+}
+
+/**
+ * @brief Write every dirty sector back to the disk, or commit it to the journal.
+ * @param c Cache.
+ * @return 0 on success.
+ */
+int bc_sync(struct bc_cache *c){
+	int ret;
+
+	if(c->entries == NULL){
+		return 0;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	ret = write_back(c);
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Commit the write-backs of a cache to a journal.
+ *
+ * Dirty sectors are written back first.
+ *
+ * @param c Cache.
+ * @param j Journal, NULL to write in place again.
+ */
+void bc_set_journal(struct bc_cache *c, struct jn_journal *j){
+	pthread_mutex_lock(&c->lock);
+	write_back(c);
+	c->journal = j;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Number of dirty sectors, a write-back would commit that many.
+ * @param c Cache.
+ * @return Dirty sectors.
+ */
+int bc_dirty_count(struct bc_cache *c){
+	int n;
+
+	pthread_mutex_lock(&c->lock);
+	n = c->n_dirty;
+	pthread_mutex_unlock(&c->lock);
+
+	return n;
+}
+
+/**
+ * @brief Release the cache. Dirty sectors are dropped, call bc_sync first
+ * to keep them.
+ * @param c Cache, may be NULL.
+ */
+void bc_stop(struct bc_cache *c){
+	struct bc_entry *e;
+
+	if(c == NULL){
+		return;
+	}
+
+	/* Extra slots, dirty ones included. */
+	while( (e = c->extra) != NULL){
+		c->extra = e->xnext;
+		free(e);
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->entries);
+	free(c->buckets);
+	free(c->buffers);
+	free(c);
+}
+
+/**
+ * @brief Get the cache counters since bc_init.
+ * @param c Cache.
+ * @param st Output counters.
+ */
+void bc_get_stats(struct bc_cache *c, struct bc_stats *st){
+	pthread_mutex_lock(&c->lock);
+	*st = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,34 @@
+/* Write-back sector buffer cache on top of libdisksimul. */
+
+#include <stdint.h>
+
+#define BC_DEFAULT_SECTORS	256
+
+/**
+ * Cache counters.
+ */
+struct bc_stats{
+	unsigned long hits;		/**< Reads served from the cache. */
+	unsigned long misses;		/**< Reads that went to the disk. */
+	unsigned long merged;		/**< Writes to a sector that was already dirty. */
+	unsigned long writebacks;	/**< Dirty sectors written to the disk. */
+	unsigned long evictions;	/**< Sectors dropped to make room. */
+};
+
+/* Cache of one disk, see bc_init. */
+struct bc_cache;
+struct ds_device;
+struct ds_batch;
+struct jn_journal;
+
+struct bc_cache *bc_init(struct ds_device *dev, int sector_size, int capacity);
+int bc_read_sector(struct bc_cache *c, uint64_t sector_number, void *data);
+int bc_write_sector(struct bc_cache *c, uint64_t sector_number, void *data);
+int bc_write_through(struct bc_cache *c, uint64_t first_sector, int count, void *data);
+int bc_submit_write(struct bc_cache *c, struct ds_batch *batch, uint64_t first_sector, int count, void *data);
+void bc_pin(struct bc_cache *c, uint64_t sector_number);
+int bc_sync(struct bc_cache *c);
+void bc_set_journal(struct bc_cache *c, struct jn_journal *j);
+int bc_dirty_count(struct bc_cache *c);
+void bc_stop(struct bc_cache *c);
+void bc_get_stats(struct bc_cache *c, struct bc_stats *stats);
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "filesystem.h"
+#include "dcache.h"
+#include "opstats.h"
+
+/* Dentry cache.
+ *
+ * Remembers the result of looking up a name in a directory, including
+ * names that do not exist, so resolving the same paths again touches no
+ * directory sector. The filesystem updates the cache whenever it adds or
+ * removes an entry; each open disk has its own cache, behind a mutex.
+ */
+
+/**
+ * Cached lookup result.
+ */
+struct dc_entry{
+	uint64_t parent;		/**< Directory header sector, 0 if the slot is free. */
+	uint32_t hash;			/**< Hash of parent and name. */
+	int found;			/**< 0 for a cached "not found". */
+	struct file_dir_entry entry;	/**< Entry, without the name, when found. */
+	struct dc_entry *prev;		/**< LRU list, towards the most recently used. */
+	struct dc_entry *next;		/**< LRU list, towards the least recently used. */
+	struct dc_entry *hnext;		/**< Hash bucket chain. */
+	char name[DIR_NAME_MAX + 1];	/**< Entry name. */
+};
+
+/**
+ * Dentry cache of one disk.
+ */
+struct dc_cache{
+	struct dc_entry *entries;	/**< Slots. */
+	struct dc_entry **buckets;	/**< Hash table of the cached names. */
+	int n_entries;			/**< Number of slots. */
+	int n_buckets;			/**< Hash table size, a power of two. */
+	struct dc_entry *lru_head;	/**< Most recently used slot. */
+	struct dc_entry *lru_tail;	/**< Least recently used slot, reused first. */
+	struct dc_stats stats;		/**< Counters. */
+	pthread_mutex_t lock;		/**< Protects everything above. */
+};
+
+
+static uint32_t key_hash(uint64_t parent, char *name){
+	uint32_t h = 2166136261u ^ (uint32_t)(parent * 0x9E3779B97F4A7C15ull >> 32);
+
+	while(*name){
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	}
+
+	return h;
+}
+
+static void lru_unlink(struct dc_cache *dc, struct dc_entry *e){
+	if(e->prev) e->prev->next = e->next; else dc->lru_head = e->next;
+	if(e->next) e->next->prev = e->prev; else dc->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct dc_cache *dc, struct dc_entry *e){
+	e->prev = NULL;
+	e->next = dc->lru_head;
+	if(dc->lru_head) dc->lru_head->prev = e;
+	dc->lru_head = e;
+	if(dc->lru_tail == NULL) dc->lru_tail = e;
+}
+
+static void lru_push_back(struct dc_cache *dc, struct dc_entry *e){
+	e->next = NULL;
+	e->prev = dc->lru_tail;
+	if(dc->lru_tail) dc->lru_tail->next = e;
+	dc->lru_tail = e;
+	if(dc->lru_head == NULL) dc->lru_head = e;
+}
+
+static void hash_remove(struct dc_cache *dc, struct dc_entry *e){
+	struct dc_entry **p = &dc->buckets[e->hash & (dc->n_buckets - 1)];
+
+	while(*p != e){
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+	e->hnext = NULL;
+}
+
+static struct dc_entry *find_entry(struct dc_cache *dc, uint64_t parent, char *name, uint32_t hash){
+	struct dc_entry *e;
+
+	for(e = dc->buckets[hash & (dc->n_buckets - 1)]; e != NULL; e = e->hnext){
+		if(e->hash == hash && e->parent == parent && strcmp(e->name, name) == 0){
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Create an empty cache.
+ * @param capacity Number of names kept in memory.
+ * @return Cache, NULL on error.
+ */
+struct dc_cache *dc_init(int capacity){
+	struct dc_cache *dc;
+	int i;
+
+	if( (dc = calloc(1, sizeof(struct dc_cache))) == NULL){
+		perror("calloc()");
+		return NULL;
+	}
+
+	pthread_mutex_init(&dc->lock, NULL);
+	dc->n_entries = capacity;
+	for(dc->n_buckets = 1; dc->n_buckets < capacity * 2; dc->n_buckets <<= 1);
+
+	dc->entries = calloc(dc->n_entries, sizeof(struct dc_entry));
+	dc->buckets = calloc(dc->n_buckets, sizeof(struct dc_entry*));
+
+	if(dc->entries == NULL || dc->buckets == NULL){
+		perror("calloc()");
+		dc_stop(dc);
+		return NULL;
+	}
+
+	for(i = 0; i < dc->n_entries; i++){
+		lru_push_front(dc, &dc->entries[i]);
+	}
+
+	return dc;
+}
+
+/**
+ * @brief Look up a name in the cache.
+ * @param dc Cache.
+ * @param parent Directory header sector.
+ * @param name Entry name.
+ * @param entry Output entry when found.
+ * @return 1 if found, 0 if cached as not found, -1 if not cached.
+ */
+int dc_lookup(struct dc_cache *dc, uint64_t parent, char *name, struct file_dir_entry *entry){
+	struct dc_entry *e;
+	int found = -1;
+
+	pthread_mutex_lock(&dc->lock);
+
+	if( (e = find_entry(dc, parent, name, key_hash(parent, name))) == NULL){
+		dc->stats.misses++;
+		os_count_dentry(0);
+	}else{
+		lru_unlink(dc, e);
+		lru_push_front(dc, e);
+
+		if( !e->found){
+			dc->stats.negative_hits++;
+			os_count_dentry(1);
+			found = 0;
+		}else{
+			dc->stats.hits++;
+			os_count_dentry(1);
+			*entry = e->entry;
+			found = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&dc->lock);
+
+	return found;
+}
+
+/**
+ * @brief Remember the result of a lookup, replacing what was cached for the name.
+ * @param dc Cache.
+ * @param parent Directory header sector.
+ * @param name Entry name.
+ * @param entry Entry, or NULL if the name does not exist.
+ */
+void dc_add(struct dc_cache *dc, uint64_t parent, char *name, struct file_dir_entry *entry){
+	struct dc_entry *e;
+	uint32_t hash = key_hash(parent, name);
+
+	if(strlen(name) > DIR_NAME_MAX){
+		return;
+	}
+
+	pthread_mutex_lock(&dc->lock);
+
+	if( (e = find_entry(dc, parent, name, hash)) == NULL){
+		/* Reuse the least recently used slot. */
+		e = dc->lru_tail;
+		if(e->parent != 0){
+			hash_remove(dc, e);
+		}
+
+		e->parent = parent;
+		e->hash = hash;
+		strcpy(e->name, name);
+		e->hnext = dc->buckets[hash & (dc->n_buckets - 1)];
+		dc->buckets[hash & (dc->n_buckets - 1)] = e;
+	}
+
+	e->found = (entry != NULL);
+	if(entry != NULL){
+		e->entry = *entry;
+	}
+
+	lru_unlink(dc, e);
+	lru_push_front(dc, e);
+
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/**
+ * @brief Forget every name cached under a directory, when it is removed.
+ * @param dc Cache.
+ * @param parent Directory header sector.
+ */
+void dc_purge(struct dc_cache *dc, uint64_t parent){
+	int i;
+
+	pthread_mutex_lock(&dc->lock);
+	for(i = 0; i < dc->n_entries; i++){
+		if(dc->entries[i].parent == parent){
+			hash_remove(dc, &dc->entries[i]);
+			dc->entries[i].parent = 0;
+			/* Free slots are reused first. */
+			lru_unlink(dc, &dc->entries[i]);
+			lru_push_back(dc, &dc->entries[i]);
+		}
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/**
+ * @brief Release the cache.
+ * @param dc Cache, may be NULL.
+ */
+void dc_stop(struct dc_cache *dc){
+	if(dc == NULL){
+		return;
+	}
+
+	pthread_mutex_destroy(&dc->lock);
+	free(dc->entries);
+	free(dc->buckets);
+	free(dc);
+}
+
+/**
+ * @brief Get the cache counters since dc_init.
+ * @param dc Cache.
+ * @param st Output counters.
+ */
+void dc_get_stats(struct dc_cache *dc, struct dc_stats *st){
+	pthread_mutex_lock(&dc->lock);
+	*st = dc->stats;
+	pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,25 @@
+/* Directory entry (dentry) cache, keyed by parent directory and name. */
+
+#include <stdint.h>
+
+#define DC_DEFAULT_ENTRIES	4096
+
+/**
+ * Dentry cache counters.
+ */
+struct dc_stats{
+	unsigned long hits;		/**< Lookups answered with a cached entry. */
+	unsigned long negative_hits;	/**< Lookups answered with a cached "not found". */
+	unsigned long misses;		/**< Lookups that went to the directory. */
+};
+
+/* Dentry cache of one disk, see dc_init. */
+struct dc_cache;
+struct file_dir_entry;
+
+struct dc_cache *dc_init(int capacity);
+int dc_lookup(struct dc_cache *dc, uint64_t parent, char *name, struct file_dir_entry *entry);
+void dc_add(struct dc_cache *dc, uint64_t parent, char *name, struct file_dir_entry *entry);
+void dc_purge(struct dc_cache *dc, uint64_t parent);
+void dc_stop(struct dc_cache *dc);
+void dc_get_stats(struct dc_cache *dc, struct dc_stats *stats);
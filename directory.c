@@ -0,0 +1,751 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bufcache.h"
+#include "balloc.h"
+#include "filesystem.h"
+#include "directory.h"
+#include "fs_internal.h"
+
+/* Hashed directories.
+ *
+ * Each directory is a linear hash table (see struct dir_header). Lookup,
+ * insert and delete read the header, one index sector and the sectors of
+ * one bucket, which stays short because buckets are split one at a time
+ * as the directory grows. Every sector goes through the buffer cache.
+ * The records of inline files carry the file data after the name.
+ */
+
+/* Size of a record header, the name follows. */
+#define REC_HEADER	sizeof(struct file_dir_entry)
+
+/* Largest record, with inline data. */
+#define REC_MAX		((REC_HEADER + DIR_NAME_MAX + FS_INLINE_MAX(MAX_SECTOR_SIZE) + 7) & ~7)
+
+/* Record size assumed when deciding to split: buckets are split once they
+ * average more than a sector of records this size. */
+#define SPLIT_RECORD_BYTES	64
+
+static uint64_t index_slots(struct fs_handle *fs){
+	return (fs->sb.sector_size - offsetof(struct dir_header, index)) / sizeof(uint64_t);
+}
+
+static uint64_t buckets_per_index(struct fs_handle *fs){
+	return fs->sb.sector_size / sizeof(uint64_t);
+}
+
+static uint64_t bucket_capacity(struct fs_handle *fs){
+	return fs->sb.sector_size - offsetof(struct dir_bucket, records);
+}
+
+/**
+ * @brief FNV-1a hash of a name.
+ */
+static uint32_t name_hash(char *name, int len){
+	uint32_t h = 2166136261u;
+	int i;
+
+	for(i = 0; i < len; i++){
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static uint64_t bucket_count(struct dir_header *hdr){
+	return ((uint64_t)1 << hdr->level) + hdr->split;
+}
+
+static uint64_t bucket_of(struct dir_header *hdr, uint32_t hash){
+	uint64_t b = hash & (((uint64_t)1 << hdr->level) - 1);
+
+	if(b < hdr->split){
+		b = hash & (((uint64_t)2 << hdr->level) - 1);
+	}
+
+	return b;
+}
+
+/**
+ * @brief Get the head sector of a bucket.
+ * @return Sector number, 0 if the bucket is empty.
+ */
+static uint64_t bucket_head(struct fs_handle *fs, struct dir_header *hdr, uint64_t b){
+	struct dir_index idx;
+	uint64_t s = hdr->index[b / buckets_per_index(fs)];
+
+	if(s == 0){
+		return 0;
+	}
+
+	bc_read_sector(fs->cache, s, (void*)&idx);
+
+	return idx.buckets[b % buckets_per_index(fs)];
+}
+
+/**
+ * @brief Set the head sector of a bucket, allocating its index sector if needed.
+ * @return 0 on success, 1 if the disk is full.
+ */
+static int set_bucket_head(struct fs_handle *fs, struct dir_header *hdr, uint64_t b, uint64_t sector_number){
+	struct dir_index idx;
+	uint64_t *s = &hdr->index[b / buckets_per_index(fs)];
+
+	if(*s == 0){
+		if(sector_number == 0){
+			return 0;
+		}
+		if(ba_alloc_run(fs->bitmap, 1, s) == 0){
+			return 1;
+		}
+		memset(&idx, 0, fs->sb.sector_size);
+	}else{
+		bc_read_sector(fs->cache, *s, (void*)&idx);
+	}
+
+	idx.buckets[b % buckets_per_index(fs)] = sector_number;
+	bc_write_sector(fs->cache, *s, (void*)&idx);
+
+	return 0;
+}
+
+/**
+ * @brief Find a record in a bucket sector.
+ * @return Offset of the record or -1 if it is not there.
+ */
+static long find_record(struct dir_bucket *bk, char *name, int len, uint32_t hash){
+	struct file_dir_entry *rec;
+	uint32_t off;
+
+	for(off = 0; off < bk->used; off += rec->rec_len){
+		rec = (struct file_dir_entry*)(bk->records + off);
+		if(rec->hash == hash && rec->name_len == len && memcmp(rec->name, name, len) == 0){
+			return off;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Add a record to a bucket, in the first sector with room for it.
+ * @return 0 on success, 1 if the disk is full.
+ */
+static int bucket_append(struct fs_handle *fs, struct dir_header *hdr, uint64_t b, struct file_dir_entry *rec){
+	struct dir_bucket bk;
+	uint64_t s, prev = 0;
+
+	for(s = bucket_head(fs, hdr, b); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if(bk.used + rec->rec_len <= bucket_capacity(fs)){
+			memcpy(bk.records + bk.used, rec, rec->rec_len);
+			bk.used += rec->rec_len;
+			bk.count++;
+			bc_write_sector(fs->cache, s, (void*)&bk);
+			return 0;
+		}
+		prev = s;
+	}
+
+	/* Every sector is full, chain a new one. */
+	if(ba_alloc_run(fs->bitmap, 1, &s) == 0){
+		return 1;
+	}
+
+	memset(&bk, 0, fs->sb.sector_size);
+	memcpy(bk.records, rec, rec->rec_len);
+	bk.used = rec->rec_len;
+	bk.count = 1;
+	bc_write_sector(fs->cache, s, (void*)&bk);
+
+	if(prev != 0){
+		bc_read_sector(fs->cache, prev, (void*)&bk);
+		bk.next = s;
+		bc_write_sector(fs->cache, prev, (void*)&bk);
+	}else if(set_bucket_head(fs, hdr, b, s) != 0){
+		ba_mark(fs->bitmap, s, 1, 0);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Free the sectors of a bucket chain.
+ * @param head First sector of the chain, 0 for none.
+ */
+static void free_chain(struct fs_handle *fs, uint64_t head){
+	struct dir_bucket bk;
+	uint64_t s;
+
+	for(s = head; s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		ba_mark(fs->bitmap, s, 1, 0);
+	}
+}
+
+/**
+ * @brief Split the next bucket, moving about half of its records to a new bucket.
+ *
+ * Skipped when the index is full or the disk could run out of space while
+ * the records are moved. The old chain is only freed once every record is
+ * in a new one; if the disk fills up meanwhile, the split is undone.
+ */
+static void split_bucket(struct fs_handle *fs, struct dir_header *hdr){
+	struct dir_bucket bk;
+	struct file_dir_entry *rec;
+	unsigned char *records = NULL, *p;
+	uint64_t s, old, b = hdr->split, nb = hdr->split + ((uint64_t)1 << hdr->level);
+	uint64_t n_sectors = 0, split = hdr->split, level = hdr->level;
+	size_t size = 0;
+	uint32_t off;
+	int failed = 0;
+
+	if(bucket_count(hdr) >= index_slots(fs) * buckets_per_index(fs)){
+		return;
+	}
+
+	for(s = bucket_head(fs, hdr, b); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		n_sectors++;
+	}
+
+	/* Both buckets may end with a partial sector, plus a new index sector. */
+	if(ba_free_count(fs->bitmap) < n_sectors + 3){
+		return;
+	}
+
+	/* Take the records out of the old bucket. */
+	for(s = bucket_head(fs, hdr, b); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if( (p = realloc(records, size + bk.used)) == NULL){
+			perror("realloc()");
+			free(records);
+			return;
+		}
+		records = p;
+		memcpy(records + size, bk.records, bk.used);
+		size += bk.used;
+	}
+
+	old = bucket_head(fs, hdr, b);
+	set_bucket_head(fs, hdr, b, 0);
+
+	hdr->split++;
+	if(hdr->split == ((uint64_t)1 << hdr->level)){
+		hdr->level++;
+		hdr->split = 0;
+	}
+
+	/* Put them back with one more hash bit. */
+	for(off = 0; off < size && !failed; off += rec->rec_len){
+		rec = (struct file_dir_entry*)(records + off);
+		failed = bucket_append(fs, hdr, bucket_of(hdr, rec->hash), rec) != 0;
+	}
+
+	if(failed){
+		free_chain(fs, bucket_head(fs, hdr, b));
+		free_chain(fs, bucket_head(fs, hdr, nb));
+		set_bucket_head(fs, hdr, nb, 0);
+		hdr->split = split;
+		hdr->level = level;
+		set_bucket_head(fs, hdr, b, old);
+	}else{
+		free_chain(fs, old);
+	}
+
+	free(records);
+}
+
+/**
+ * @brief Build a record.
+ * @param rec Output record, REC_MAX bytes.
+ * @return 0 on success, 1 if the inline data is too large.
+ */
+static int make_record(struct fs_handle *fs, struct file_dir_entry *rec, char *name, struct file_dir_entry *entry, const void *data){
+	int len = strlen(name);
+	uint64_t size = data != NULL ? entry->size_bytes : 0;
+
+	if(size > FS_INLINE_MAX(fs->sb.sector_size)){
+		return 1;
+	}
+
+	memset(rec, 0, REC_MAX);
+	rec->sector_start = entry->sector_start;
+	rec->size_bytes = entry->size_bytes;
+	rec->dir = entry->dir;
+	rec->hash = name_hash(name, len);
+	rec->name_len = len;
+	rec->rec_len = (REC_HEADER + len + size + 7) & ~7;
+	memcpy(rec->name, name, len);
+	if(size > 0){
+		memcpy(rec->name + len, data, size);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Find an entry by name.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param name Entry name.
+ * @param dir 1 for directories, 0 for files, -1 for both.
+ * @param entry Output entry, without the name. May be NULL.
+ * @return 0 if found, 1 otherwise.
+ */
+int dir_lookup(struct fs_handle *fs, uint64_t dir_sector, char *name, int dir, struct file_dir_entry *entry){
+	struct dir_header hdr;
+	struct dir_bucket bk;
+	struct file_dir_entry *rec;
+	uint32_t hash;
+	uint64_t s;
+	long off;
+	int len = strlen(name);
+
+	if(len > DIR_NAME_MAX){
+		return 1;
+	}
+
+	hash = name_hash(name, len);
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	for(s = bucket_head(fs, &hdr, bucket_of(&hdr, hash)); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if( (off = find_record(&bk, name, len, hash)) >= 0){
+			rec = (struct file_dir_entry*)(bk.records + off);
+			if(dir != -1 && rec->dir != dir){
+				return 1;
+			}
+			if(entry != NULL){
+				memcpy(entry, rec, REC_HEADER);
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Add an entry to a directory. The name must not be there already.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param name Entry name, up to DIR_NAME_MAX characters.
+ * @param entry Entry, only sector_start, size_bytes and dir are used.
+ * @param data Data of an inline file, size_bytes bytes, NULL for the other entries.
+ * @return 0 on success, 1 if the disk is full.
+ */
+int dir_insert(struct fs_handle *fs, uint64_t dir_sector, char *name, struct file_dir_entry *entry, const void *data){
+	struct dir_header hdr;
+	uint64_t rec_buf[REC_MAX / sizeof(uint64_t)];
+	struct file_dir_entry *rec = (struct file_dir_entry*)rec_buf;
+	int len = strlen(name);
+
+	if(len > DIR_NAME_MAX || make_record(fs, rec, name, entry, data) != 0){
+		return 1;
+	}
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	if(bucket_append(fs, &hdr, bucket_of(&hdr, rec->hash), rec) != 0){
+		return 1;
+	}
+
+	hdr.entries++;
+
+	if(hdr.entries > bucket_count(&hdr) * (bucket_capacity(fs) / SPLIT_RECORD_BYTES)){
+		split_bucket(fs, &hdr);
+	}
+
+	bc_write_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	return 0;
+}
+
+/**
+ * @brief Remove an entry from a directory. Emptied bucket sectors are freed.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param name Entry name.
+ * @return 0 on success, 1 if it is not found.
+ */
+int dir_remove(struct fs_handle *fs, uint64_t dir_sector, char *name){
+	struct dir_header hdr;
+	struct dir_bucket bk, prev_bk;
+	struct file_dir_entry *rec;
+	uint64_t s, b, prev = 0;
+	uint32_t hash;
+	long off;
+	int len = strlen(name);
+
+	if(len > DIR_NAME_MAX){
+		return 1;
+	}
+
+	hash = name_hash(name, len);
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+	b = bucket_of(&hdr, hash);
+
+	for(s = bucket_head(fs, &hdr, b); s != 0; prev = s, s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if( (off = find_record(&bk, name, len, hash)) < 0){
+			continue;
+		}
+
+		rec = (struct file_dir_entry*)(bk.records + off);
+		bk.used -= rec->rec_len;
+		memmove(bk.records + off, bk.records + off + rec->rec_len, bk.used - off);
+		bk.count--;
+
+		if(bk.count > 0){
+			bc_write_sector(fs->cache, s, (void*)&bk);
+		}else{
+			/* Unlink the empty sector. */
+			if(prev != 0){
+				bc_read_sector(fs->cache, prev, (void*)&prev_bk);
+				prev_bk.next = bk.next;
+				bc_write_sector(fs->cache, prev, (void*)&prev_bk);
+			}else{
+				set_bucket_head(fs, &hdr, b, bk.next);
+			}
+			ba_mark(fs->bitmap, s, 1, 0);
+		}
+
+		hdr.entries--;
+		bc_write_sector(fs->cache, dir_sector, (void*)&hdr);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Change the sector, size and inline data of an entry.
+ *
+ * The record is rewritten in its bucket sector when it still fits there,
+ * otherwise it moves to another sector of the same bucket.
+ *
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param name Entry name.
+ * @param entry New entry, only sector_start and size_bytes are used.
+ * @param data Data of an inline file, size_bytes bytes, NULL for the other entries.
+ * @return 0 on success, 1 if it is not found or the disk is full.
+ */
+int dir_update(struct fs_handle *fs, uint64_t dir_sector, char *name, struct file_dir_entry *entry, const void *data){
+	struct dir_header hdr;
+	struct dir_bucket bk;
+	struct file_dir_entry *rec;
+	uint64_t rec_buf[REC_MAX / sizeof(uint64_t)];
+	struct file_dir_entry *new_rec = (struct file_dir_entry*)rec_buf;
+	uint64_t old_buf[REC_MAX / sizeof(uint64_t)];
+	uint32_t hash, old_len;
+	uint64_t s, b;
+	long off;
+	int len = strlen(name);
+
+	if(len > DIR_NAME_MAX){
+		return 1;
+	}
+
+	hash = name_hash(name, len);
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+	b = bucket_of(&hdr, hash);
+
+	for(s = bucket_head(fs, &hdr, b); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if( (off = find_record(&bk, name, len, hash)) < 0){
+			continue;
+		}
+
+		rec = (struct file_dir_entry*)(bk.records + off);
+		if(make_record(fs, new_rec, name, entry, data) != 0){
+			return 1;
+		}
+		new_rec->dir = rec->dir;
+		old_len = rec->rec_len;
+
+		/* Same sector, the records after it shift. */
+		if(bk.used - old_len + new_rec->rec_len <= bucket_capacity(fs)){
+			memmove(bk.records + off + new_rec->rec_len, bk.records + off + old_len, bk.used - off - old_len);
+			memcpy(bk.records + off, new_rec, new_rec->rec_len);
+			bk.used = bk.used - old_len + new_rec->rec_len;
+			bc_write_sector(fs->cache, s, (void*)&bk);
+			return 0;
+		}
+
+		/* Too large for this sector, which holds other records then: move it. */
+		memcpy(old_buf, rec, old_len);
+		bk.used -= old_len;
+		memmove(bk.records + off, bk.records + off + old_len, bk.used - off);
+		bk.count--;
+		bc_write_sector(fs->cache, s, (void*)&bk);
+
+		if(bucket_append(fs, &hdr, b, new_rec) != 0){
+			/* Put the old record back where it was freed. */
+			bc_read_sector(fs->cache, s, (void*)&bk);
+			memcpy(bk.records + bk.used, old_buf, old_len);
+			bk.used += old_len;
+			bk.count++;
+			bc_write_sector(fs->cache, s, (void*)&bk);
+			return 1;
+		}
+		bc_write_sector(fs->cache, dir_sector, (void*)&hdr);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Copy the data of an inline file.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param name File name.
+ * @param data Output data, size_bytes of the entry.
+ * @return 0 on success, 1 if it is not found.
+ */
+int dir_read_inline(struct fs_handle *fs, uint64_t dir_sector, char *name, void *data){
+	struct dir_header hdr;
+	struct dir_bucket bk;
+	struct file_dir_entry *rec;
+	uint32_t hash;
+	uint64_t s;
+	long off;
+	int len = strlen(name);
+
+	if(len > DIR_NAME_MAX){
+		return 1;
+	}
+
+	hash = name_hash(name, len);
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	for(s = bucket_head(fs, &hdr, bucket_of(&hdr, hash)); s != 0; s = bk.next){
+		bc_read_sector(fs->cache, s, (void*)&bk);
+		if( (off = find_record(&bk, name, len, hash)) >= 0){
+			rec = (struct file_dir_entry*)(bk.records + off);
+			memcpy(data, rec->name + len, rec->size_bytes);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Number of entries of a directory.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @return Number of entries.
+ */
+uint64_t dir_entries(struct fs_handle *fs, uint64_t dir_sector){
+	struct dir_header hdr;
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	return hdr.entries;
+}
+
+/**
+ * @brief Call a function for every entry of a directory, in hash order.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param fn Function called with the entry, its name and arg.
+ * @param arg Argument of fn.
+ * @return Number of entries.
+ */
+uint64_t dir_list(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(struct file_dir_entry *entry, char *name, void *arg), void *arg){
+	struct dir_header hdr;
+	struct dir_index idx;
+	struct dir_bucket bk;
+	struct file_dir_entry *rec;
+	char name[DIR_NAME_MAX + 1];
+	uint64_t i, j, s, count = 0;
+	uint32_t off;
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	for(i = 0; i < index_slots(fs); i++){
+		if(hdr.index[i] == 0){
+			continue;
+		}
+
+		bc_read_sector(fs->cache, hdr.index[i], (void*)&idx);
+
+		for(j = 0; j < buckets_per_index(fs); j++){
+			for(s = idx.buckets[j]; s != 0; s = bk.next){
+				bc_read_sector(fs->cache, s, (void*)&bk);
+				for(off = 0; off < bk.used; off += rec->rec_len){
+					rec = (struct file_dir_entry*)(bk.records + off);
+					memcpy(name, rec->name, rec->name_len);
+					name[rec->name_len] = '\0';
+					fn(rec, name, arg);
+					count++;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+/**
+ * @brief Call a function for every sector of a directory, its header included.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @param fn Function called with the sector number and arg.
+ * @param arg Argument of fn.
+ */
+void dir_sectors(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(uint64_t sector_number, void *arg), void *arg){
+	struct dir_header hdr;
+	struct dir_index idx;
+	struct dir_bucket bk;
+	uint64_t i, j, s;
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+	fn(dir_sector, arg);
+
+	for(i = 0; i < index_slots(fs); i++){
+		if(hdr.index[i] == 0){
+			continue;
+		}
+
+		bc_read_sector(fs->cache, hdr.index[i], (void*)&idx);
+		fn(hdr.index[i], arg);
+
+		for(j = 0; j < buckets_per_index(fs); j++){
+			for(s = idx.buckets[j]; s != 0; s = bk.next){
+				bc_read_sector(fs->cache, s, (void*)&bk);
+				fn(s, arg);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Free every sector of a directory, its header included.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ */
+void dir_free(struct fs_handle *fs, uint64_t dir_sector){
+	struct dir_header hdr;
+	struct dir_index idx;
+	struct dir_bucket bk;
+	uint64_t i, j, s;
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	for(i = 0; i < index_slots(fs); i++){
+		if(hdr.index[i] == 0){
+			continue;
+		}
+
+		bc_read_sector(fs->cache, hdr.index[i], (void*)&idx);
+
+		for(j = 0; j < buckets_per_index(fs); j++){
+			for(s = idx.buckets[j]; s != 0; s = bk.next){
+				bc_read_sector(fs->cache, s, (void*)&bk);
+				ba_mark(fs->bitmap, s, 1, 0);
+			}
+		}
+
+		ba_mark(fs->bitmap, hdr.index[i], 1, 0);
+	}
+
+	ba_mark(fs->bitmap, dir_sector, 1, 0);
+}
+
+/**
+ * @brief Move the index and bucket sectors of a directory to one run of sectors.
+ *
+ * The sectors are laid out in the order dir_list reads them, each index
+ * sector followed by its buckets. Directories already laid out that way,
+ * or too large for any free run, are left alone. The header stays where
+ * it is, the parent entry and the locks refer to it.
+ *
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector, locked for writing.
+ * @param fn Function called with every sector given up and arg. The caller frees them.
+ * @param arg Argument of fn.
+ * @return Number of sectors moved.
+ */
+uint64_t dir_compact(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(uint64_t sector_number, void *arg), void *arg){
+	struct dir_header hdr;
+	struct dir_index idx;
+	struct dir_bucket bk;
+	uint64_t i, j, s, next, start, n = 0, prev = 0;
+	int in_order = 1;
+
+	bc_read_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	/* Count the sectors, and see if they already follow each other. */
+	for(i = 0; i < index_slots(fs); i++){
+		if(hdr.index[i] == 0){
+			continue;
+		}
+
+		bc_read_sector(fs->cache, hdr.index[i], (void*)&idx);
+		in_order &= n == 0 || hdr.index[i] == prev + 1;
+		prev = hdr.index[i];
+		n++;
+
+		for(j = 0; j < buckets_per_index(fs); j++){
+			for(s = idx.buckets[j]; s != 0; s = bk.next){
+				bc_read_sector(fs->cache, s, (void*)&bk);
+				in_order &= s == prev + 1;
+				prev = s;
+				n++;
+			}
+		}
+	}
+
+	if(n == 0 || in_order){
+		return 0;
+	}
+
+	if( (i = ba_alloc_run(fs->bitmap, n, &start)) != n){
+		if(i > 0){
+			ba_mark(fs->bitmap, start, i, 0);
+		}
+		return 0;
+	}
+
+	/* Copy every sector to the next one of the run, the next bucket sector of a chain follows it. */
+	for(i = 0; i < index_slots(fs); i++){
+		if(hdr.index[i] == 0){
+			continue;
+		}
+
+		bc_read_sector(fs->cache, hdr.index[i], (void*)&idx);
+		fn(hdr.index[i], arg);
+		hdr.index[i] = start++;
+
+		for(j = 0; j < buckets_per_index(fs); j++){
+			s = idx.buckets[j];
+			if(s != 0){
+				idx.buckets[j] = start;
+			}
+			for(; s != 0; s = next){
+				bc_read_sector(fs->cache, s, (void*)&bk);
+				next = bk.next;
+				if(next != 0){
+					bk.next = start + 1;
+				}
+				bc_write_sector(fs->cache, start++, (void*)&bk);
+				fn(s, arg);
+			}
+		}
+
+		bc_write_sector(fs->cache, hdr.index[i], (void*)&idx);
+	}
+
+	bc_write_sector(fs->cache, dir_sector, (void*)&hdr);
+
+	return n;
+}
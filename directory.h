@@ -0,0 +1,14 @@
+/* Hashed directories. */
+
+#include <stdint.h>
+
+int dir_lookup(struct fs_handle *fs, uint64_t dir_sector, char *name, int dir, struct file_dir_entry *entry);
+int dir_insert(struct fs_handle *fs, uint64_t dir_sector, char *name, struct file_dir_entry *entry, const void *data);
+int dir_remove(struct fs_handle *fs, uint64_t dir_sector, char *name);
+int dir_update(struct fs_handle *fs, uint64_t dir_sector, char *name, struct file_dir_entry *entry, const void *data);
+int dir_read_inline(struct fs_handle *fs, uint64_t dir_sector, char *name, void *data);
+uint64_t dir_entries(struct fs_handle *fs, uint64_t dir_sector);
+uint64_t dir_list(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(struct file_dir_entry *entry, char *name, void *arg), void *arg);
+void dir_sectors(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(uint64_t sector_number, void *arg), void *arg);
+void dir_free(struct fs_handle *fs, uint64_t dir_sector);
+uint64_t dir_compact(struct fs_handle *fs, uint64_t dir_sector, void (*fn)(uint64_t sector_number, void *arg), void *arg);
@@ -1,754 +1,3419 @@
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "libdisksimul.h"
+#include "bufcache.h"
+#include "balloc.h"
 #include "filesystem.h"
+#include "directory.h"
+#include "dcache.h"
+#include "fs_legacy.h"
+#include "journal.h"
+#include "opstats.h"
+#include "sectormap.h"
+#include "lz.h"
+#include "fs_internal.h"
 
-#define MAX_ROOT_ENTRIES 15
-#define MAX_DIR_ENTRIES 16
-#define SECTOR_DATA_SIZE 508
+/* Extents of an extent table, for the sector size of the disk. */
+#define TABLE_EXTENTS(fs)	((int)(((fs)->sb.sector_size - offsetof(struct extent_table, extents)) / sizeof(struct extent)))
 
+/* Bytes of a chunk of a compressed file, a whole sector at least. */
+#define COMPRESS_CHUNK	(32 * 1024)
+
+/* Largest file packed in a shared sector, larger ones get extents. */
+#define PACK_MAX(fs)	((fs)->sb.sector_size - offsetof(struct pack_sector, data))
+
+/* Cells of the sector map drawn by fs_free_map, larger disks share cells. */
+#define MAP_MAX_CELLS 65536
+
+/* Passes of fs_defrag over the tree. */
+#define DEFRAG_PASSES 2
+
+/* Dirty metadata sectors that make an operation commit a group to the journal. */
+#define GROUP_COMMIT_SECTORS (BC_DEFAULT_SECTORS / 2)
+
+/* Contiguous sectors moved by one multi-sector disk request, and at most bytes. */
+#define IO_RUN_SECTORS 64
+#define IO_RUN_BYTES (128 * 1024)
+
+/* File data requests kept in flight on the asynchronous backends. */
+#define IO_QUEUE_RUNS 16
 
 /**
- * @brief Verify if dir exist and return its sector
- * @param t_dir table_directory pointer.
- * @param s_path dir path.
- * @param cur_entries root entries (then used for current entries).
- * @return dir sector number or -1 if not found.
+ * In-memory list of extents.
  */
-int find_dir(struct table_directory *t_dir, char *s_path, struct file_dir_entry *cur_entries){
-	int exists = 0;
-	int i;
-	int s_dir = 0;
-	printf("- Searching path: %s \n", s_path);
-	const char delimiter[2] = "/";
-	char *e_name = strtok(s_path, delimiter);
+struct extent_list{
+	struct extent *extents;		/**< Extents, in file order. */
+	int count;			/**< Extents used. */
+	int size;			/**< Extents allocated. */
+};
 
-	// Verify if path exists and navigate through
-	while( e_name != NULL ) 
-	{	
-		printf("- Searching dir: %s \n", e_name);
-		exists = 0;
-
-		//verify if	dir exist on current entries
-		for(i = 0; i < MAX_DIR_ENTRIES; i++){
-			if(strcmp(cur_entries[i].name, e_name) == 0 && cur_entries[i].dir == 1){
-				exists = 1;
-				s_dir = cur_entries[i].sector_start;
-				ds_read_sector(cur_entries[i].sector_start, (void*)t_dir, SECTOR_SIZE);
-				cur_entries = t_dir->entries;
-				break;
-			}
-		}
 
-		e_name = strtok(NULL, delimiter);
+/**
+ * @brief Verify a disk geometry.
+ * @param sector_size Sector size in bytes.
+ * @param number_of_sectors Number of sectors.
+ * @return 1 if it is supported.
+ */
+static int valid_geometry(uint64_t sector_size, uint64_t number_of_sectors){
+	return sector_size >= MIN_SECTOR_SIZE && sector_size <= MAX_SECTOR_SIZE &&
+	       (sector_size & (sector_size - 1)) == 0 &&
+	       number_of_sectors > 0 && number_of_sectors <= (uint64_t)INT64_MAX / sector_size;
+}
 
-		if(exists == 0){
-			printf("Error: The path doesn't exist\n");
-			return -1;
-		}
-	}
+/**
+ * @brief Put the superblock in sector 0, keeping the rest of the sector.
+ * @param fs Open filesystem.
+ */
+static void write_superblock(struct fs_handle *fs){
+	unsigned char sector[MAX_SECTOR_SIZE];
 
-	return s_dir;
+	bc_read_sector(fs->cache, 0, (void*)sector);
+	memcpy(sector, &fs->sb, sizeof(fs->sb));
+	bc_write_sector(fs->cache, 0, (void*)sector);
 }
 
 /**
- * @brief Format disk.
- * 
- */
-int fs_format(){
-	int ret, i;
-	struct root_table_directory root_dir;
-	struct sector_data sector;
-	
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 1)) != 0 ){
-		return ret;
+ * @brief Put the bitmap and the superblock in the cache, if modified.
+ * @param fs Open filesystem.
+ */
+static void fs_flush_meta(struct fs_handle *fs){
+	if(fs->legacy){
+		return;
 	}
-	
-	memset(&root_dir, 0, sizeof(root_dir));
-	
-	root_dir.free_sectors_list = 1; /* first free sector. */
-	
-	ds_write_sector(0, (void*)&root_dir, SECTOR_SIZE);
-	
-	/* Create a list of free sectors. */
-	memset(&sector, 0, sizeof(sector));
-	
-	for(i=1;i<NUMBER_OF_SECTORS;i++){
-		if(i<NUMBER_OF_SECTORS-1){
-			sector.next_sector = i+1;
-		}else{
-			sector.next_sector = 0;
-		}
-		ds_write_sector(i, (void*)&sector, SECTOR_SIZE);
+
+	ba_flush(fs->bitmap);
+
+	if(fs->sb.free_sectors != ba_free_count(fs->bitmap) || fs->sb.high_water != ba_high_water(fs->bitmap)){
+		fs->sb_dirty = 1;
+	}
+
+	if(fs->sb_dirty){
+		fs->sb.free_sectors = ba_free_count(fs->bitmap);
+		fs->sb.high_water = ba_high_water(fs->bitmap);
+		write_superblock(fs);
+		fs->sb_dirty = 0;
 	}
-	
-	ds_stop();
-	
-	printf("Disk size %d kbytes, %d sectors.\n", (SECTOR_SIZE*NUMBER_OF_SECTORS)/1024, NUMBER_OF_SECTORS);
-	
-	return 0;
 }
 
 /**
- * @brief Create a new file on the simulated filesystem.
- * @param input_file Source file path.
- * @param simul_file Destination file path on the simulated file system.
- * @return 0 on success.
+ * @brief Allocate an empty handle.
+ * @return Handle, NULL on error.
  */
-int fs_create(char* input_file, char* simul_file){
-	int ret;
-	
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
+static struct fs_handle *fs_alloc(){
+	struct fs_handle *fs;
+	int i;
+
+	if( (fs = calloc(1, sizeof(struct fs_handle))) == NULL){
+		perror("calloc()");
+		return NULL;
 	}
 
-	/* Write the code to load a new file to the simulated filesystem. */
-	printf("- Creating '%s' at '%s'\n", input_file, simul_file);
-	
-	/* initiate base */
-	struct sector_data sector;
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-
-	/* set path */
-	char *s_name = strdup(basename(simul_file));
-	char *s_path = strdup(dirname(simul_file));
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
+	pthread_rwlock_init(&fs->ns_lock, NULL);
+	for(i = 0; i < FS_DIR_LOCKS; i++){
+		pthread_rwlock_init(&fs->dir_locks[i], NULL);
+	}
+	pthread_mutex_init(&fs->meta_lock, NULL);
 
-	int i = 0;
-	int isRoot = 1;
-	int length;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	cur_entries = root_dir.entries;
+	return fs;
+}
 
-	/* open file */
-	FILE *fileptr;
-	long filelen;
+/**
+ * @brief Release everything held by a handle, without writing anything.
+ * @param fs Open filesystem.
+ */
+static void fs_release(struct fs_handle *fs){
+	int i;
 
-	/* amount data for current sector */ 
-	int data_amount = 0;
-	/* sector number for data */
-	int sector_number;
+	pthread_rwlock_destroy(&fs->ns_lock);
+	for(i = 0; i < FS_DIR_LOCKS; i++){
+		pthread_rwlock_destroy(&fs->dir_locks[i]);
+	}
+	pthread_mutex_destroy(&fs->meta_lock);
+
+	ba_release(fs->bitmap);
+	dc_stop(fs->dentries);
+	bc_stop(fs->cache);
+	jn_close(fs->journal);
+	ds_close(fs->dev);
+	os_stop(fs->stats);
+	free(fs);
+}
 
-	/* file info */
-	fileptr = fopen(input_file, "rb");
-	fseek(fileptr, 0, SEEK_END);
-	filelen = ftell(fileptr);
-	rewind(fileptr);
-
-	// is not root, search dir
-	if( e_name != NULL ) {
-		isRoot = 0;
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
-			return 1;
-		}
+/**
+ * @brief Open a disk image and load its superblock.
+ *
+ * The image stays open, with its metadata cached, until fs_close. Handles
+ * share nothing, so several images can be open in one process, and the
+ * operations on one handle can be called from several threads.
+ *
+ * @param image Disk image path.
+ * @param backend DS_BACKEND_FILE or DS_BACKEND_MMAP.
+ * @return Open filesystem, NULL on error.
+ */
+struct fs_handle *fs_open(char *image, int backend){
+	struct fs_handle *fs;
 
-		length = MAX_DIR_ENTRIES;
-		cur_entries = t_dir.entries;
-	}else{
-		length = MAX_ROOT_ENTRIES;
-		cur_entries = root_dir.entries;
+	if( (fs = fs_alloc()) == NULL){
+		return NULL;
 	}
 
-	// Verify which is the next free entry position
-	for(i=0; i < length; i++){
-		if(strcmp(cur_entries[i].name, s_name) == 0 && cur_entries[i].dir == 0){
-			printf("Error: Already exist a file with the same name\n");
-			return 1;
-		}
+	/* The geometry is read from the superblock. */
+	if( (fs->dev = ds_open(image, 0, 0, 0, backend)) == NULL){
+		fs_release(fs);
+		return NULL;
+	}
 
-		if(cur_entries[i].sector_start == 0){
-			break;
-		}
+	/* The superblock fits in the smallest sector, whatever the sector size is. */
+	if( ds_read_sector(fs->dev, 0, (void*)&fs->sb, MIN_SECTOR_SIZE) != 0){
+		fs_release(fs);
+		return NULL;
+	}
 
-		// if didnt break, all slots are in use
-		if(i == length - 1){
-			printf("Error: Cant write anymore at this dir\n");
-			return 1;
-		}
+	fs->legacy = (fs->sb.magic != FS_MAGIC);
+	if(fs->legacy){
+		fs->sb.sector_size = LEGACY_SECTOR_SIZE;
+		fs->sb.number_of_sectors = LEGACY_NUMBER_OF_SECTORS;
+	}else if( !valid_geometry(fs->sb.sector_size, fs->sb.number_of_sectors) ||
+	          fs->sb.number_of_sectors * fs->sb.sector_size > ds_size(fs->dev)){
+		printf("Error: Invalid superblock\n");
+		fs_release(fs);
+		return NULL;
 	}
 
-	// set entry file
-	cur_entries[i].dir = 0;
-	strcpy(cur_entries[i].name, s_name);
-	cur_entries[i].sector_start = root_dir.free_sectors_list;
-	cur_entries[i].size_bytes = filelen;	
+	/* Replay the journal before anything else is read, the superblock included. */
+	if( !fs->legacy && fs->sb.journal_sectors > 0){
+		if( (fs->journal = jn_open(fs->dev, fs->sb.journal_start, fs->sb.journal_sectors, fs->sb.sector_size)) == NULL ||
+		    ds_read_sector(fs->dev, 0, (void*)&fs->sb, MIN_SECTOR_SIZE) != 0){
+			fs_release(fs);
+			return NULL;
+		}
+	}
 
-	if(isRoot){
-		root_dir.entries[i] = cur_entries[i];
-	}else{
-		t_dir.entries[i] = cur_entries[i];
-		ds_write_sector(s_dir, (void*)&t_dir, SECTOR_SIZE);
+	if( (fs->cache = bc_init(fs->dev, fs->sb.sector_size, BC_DEFAULT_SECTORS)) == NULL ||
+	    (fs->dentries = dc_init(DC_DEFAULT_ENTRIES)) == NULL){
+		fs_release(fs);
+		return NULL;
 	}
+	bc_set_journal(fs->cache, fs->journal);
+	fs->compress = !fs->legacy && (fs->sb.flags & FS_FLAG_COMPRESS);
 
-	/* set sector to the first free */
-	memset(&sector, root_dir.free_sectors_list, sizeof(sector));
-	sector_number = root_dir.free_sectors_list;
-	
-	do{
+	/* The superblock and the root table stay resident, every operation uses them. */
+	bc_pin(fs->cache, 0);
+	if(!fs->legacy){
+		bc_pin(fs->cache, fs->sb.root_sector);
 
-		// have read all file
-		if( ftell(fileptr) == filelen ){
-			break;
+		if( (fs->bitmap = ba_load(fs->dev, fs->cache, fs->sb.bitmap_start, fs->sb.bitmap_sectors, fs->sb.number_of_sectors, fs->sb.sector_size, fs->sb.high_water)) == NULL){
+			fs_release(fs);
+			return NULL;
 		}
+	}
 
-		// clear sector data
-		memset(sector.data, 0, sizeof(sector.data));
-		//sprintf(sector.data, "%d", SECTOR_DATA_SIZE);
-
-		// have more than 508 bytes to read	
+	return fs;
+}
 
-		// write data to sector
-		data_amount = fread(sector.data, 1, SECTOR_DATA_SIZE, fileptr);
+/**
+ * @brief Write back the metadata and close a disk image.
+ * No other operation on the handle may be running.
+ * @param fs Open filesystem.
+ * @return 0 on success.
+ */
+int fs_close(struct fs_handle *fs){
+	int ret;
 
-		if(data_amount == SECTOR_DATA_SIZE){
-			sector.next_sector = sector_number + 1;
-		} else{
-			sector.next_sector = 0;
-			root_dir.free_sectors_list = sector_number + 1;
-			ds_write_sector(0, (void*)&root_dir, SECTOR_SIZE);
-		}
-		
-		// move the file pointer for the data_amount available at this iteration
-		ds_write_sector(sector_number, (void*)&sector, SECTOR_SIZE);
-		sector_number++;
-	} while(data_amount == SECTOR_DATA_SIZE);
+	fs_flush_meta(fs);
+	ret = bc_sync(fs->cache);
+	fs_release(fs);
 
-	// save root_dir current context
-	ds_write_sector(0, (void*)&root_dir, SECTOR_SIZE);
+	return ret;
+}
 
-	printf("free sector: %d\n", root_dir.free_sectors_list);
+/**
+ * @brief Refuse to modify a version 1 disk.
+ * @param fs Open filesystem.
+ * @return 1 if the disk can be written.
+ */
+static int writable(struct fs_handle *fs){
+	if(fs->legacy){
+		printf("Error: Version 1 disk is read-only, format it to write\n");
+		return 0;
+	}
 
-	fclose(fileptr);	
-	ds_stop();
-	
-	return 0;
+	return 1;
 }
 
 /**
- * @brief Read file from the simulated filesystem.
- * @param output_file Output file path.
- * @param simul_file Source file path from the simulated file system.
+ * @brief Write the superblock and every dirty cached sector to the disk.
+ *
+ * On a disk with a journal they are committed to it as one group. The
+ * group waits for the running operations, so it never holds half of one.
+ *
+ * @param fs Open filesystem.
  * @return 0 on success.
  */
-int fs_read(char* output_file, char* simul_file){
+int fs_sync(struct fs_handle *fs){
+	struct os_op op;
 	int ret;
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
-	}
-	
-	printf("- Copying: '%s' to '%s'\n", simul_file, output_file);
-	
-	/* initiate base */
-	struct sector_data sector;
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-
-	/* set path */
-	char *s_name = strdup(basename(simul_file));
-	char *s_path = strdup(dirname(simul_file));
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);	
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
 
-	int i = 0;
-	int length;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	cur_entries = root_dir.entries;
-	int data_amount = 0;
-	int left_data;
+	os_begin(fs->stats, &op);
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	pthread_mutex_lock(&fs->meta_lock);
+	fs_flush_meta(fs);
+	pthread_mutex_unlock(&fs->meta_lock);
 
+	ret = bc_sync(fs->cache);
+	pthread_rwlock_unlock(&fs->ns_lock);
 
-	FILE *fileptr;
+	return os_end(fs->stats, &op, OS_SYNC, ret);
+}
 
-	fileptr = fopen(output_file, "w");
+/**
+ * @brief Commit a group to the journal once enough operations are cached.
+ * @param fs Open filesystem, no lock held.
+ */
+static void commit_group(struct fs_handle *fs){
+	int group = GROUP_COMMIT_SECTORS;
 
-	// is not root, search dir
-	if( e_name != NULL ) {
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
-			return 1;
-		}
+	/* A group must fit in a quarter of a small journal. */
+	if((uint64_t)group > fs->sb.journal_sectors / 4){
+		group = fs->sb.journal_sectors / 4;
+	}
 
-		length = MAX_DIR_ENTRIES;
-		cur_entries = t_dir.entries;
-	}else{
-		length = MAX_ROOT_ENTRIES;
-		cur_entries = root_dir.entries;
+	if(fs->journal != NULL && bc_dirty_count(fs->cache) >= group){
+		fs_sync(fs);
 	}
+}
 
-	// Verify which is the next free entry position
-	for(i=0; i < length; i++){
-		if(strcmp(cur_entries[i].name, s_name) == 0 && cur_entries[i].dir == 0){
-			break;
-		}
+/**
+ * @brief Get the cache counters of an open disk.
+ * @param fs Open filesystem.
+ * @param cache Output sector cache counters.
+ * @param dentries Output dentry cache counters.
+ */
+void fs_get_stats(struct fs_handle *fs, struct bc_stats *cache, struct dc_stats *dentries){
+	bc_get_stats(fs->cache, cache);
+	dc_get_stats(fs->dentries, dentries);
+}
 
-		// if didnt break, all slots are in use
-		if(i == length - 1){
-			printf("File does not exist\n");
-			return 1;
-		}
-	}
+/**
+ * @brief Get the disk counters of an open disk.
+ * @param fs Open filesystem.
+ * @param io Output disk counters.
+ */
+void fs_get_io_stats(struct fs_handle *fs, struct ds_stats *io){
+	ds_get_stats(fs->dev, io);
+}
 
-	left_data = cur_entries[i].size_bytes;
-	ds_read_sector(cur_entries[i].sector_start, (void*)&sector, SECTOR_SIZE);
+/**
+ * @brief Sector size of an open disk.
+ * @param fs Open filesystem.
+ * @return Sector size in bytes.
+ */
+int fs_sector_size(struct fs_handle *fs){
+	return fs->sb.sector_size;
+}
 
-	while(left_data > 0){
-		if(left_data > SECTOR_DATA_SIZE){
-			data_amount = SECTOR_DATA_SIZE;
-			left_data -= SECTOR_DATA_SIZE;
-		} else {
-			data_amount = left_data;
-			left_data = 0;
-		}
-		
-		fwrite(sector.data, sizeof(char), data_amount, fileptr);
+/**
+ * @brief Charge the disk requests the time of a timing model and order them with a scheduler.
+ *
+ * The simulated time is reported by fs_get_io_stats. Call it before the
+ * operations to simulate start.
+ *
+ * @param fs Open filesystem.
+ * @param model Timing model, NULL to charge nothing.
+ * @param scheduler DS_SCHED_FIFO, DS_SCHED_SCAN or DS_SCHED_DEADLINE.
+ */
+void fs_set_model(struct fs_handle *fs, struct ds_model *model, int scheduler){
+	ds_set_model(fs->dev, model, scheduler);
+}
 
-		ds_read_sector(sector.next_sector, (void*)&sector, SECTOR_SIZE);
+/**
+ * @brief Compress the files created from now on, or not.
+ *
+ * Files are compressed in chunks of COMPRESS_CHUNK bytes. Reads and writes
+ * of compressed files are transparent, whatever the setting.
+ *
+ * @param fs Open filesystem.
+ * @param on 1 to compress.
+ * @param save 1 to make it the default of the disk, for the next opens.
+ */
+void fs_set_compression(struct fs_handle *fs, int on, int save){
+	fs->compress = on;
+
+	if(save && !fs->legacy){
+		pthread_mutex_lock(&fs->meta_lock);
+		fs->sb.flags = on ? fs->sb.flags | FS_FLAG_COMPRESS : fs->sb.flags & ~FS_FLAG_COMPRESS;
+		fs->sb_dirty = 1;
+		pthread_mutex_unlock(&fs->meta_lock);
 	}
-
-	fclose(fileptr);
-	
-	ds_stop();
-	
-	return 0;
 }
 
 /**
- * @brief Delete file from file system.
- * @param simul_file Source file path.
+ * @brief Count the I/O and the latency of every operation on an open disk.
+ *
+ * Call it before the operations to count start, statistics are off until
+ * then and cost nothing.
+ *
+ * @param fs Open filesystem.
  * @return 0 on success.
  */
-int fs_del(char* simul_file){
-	int ret;
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
+int fs_enable_stats(struct fs_handle *fs){
+	if(fs->stats == NULL && (fs->stats = os_init()) == NULL){
+		return 1;
 	}
-	
-	printf("- Deleting: '%s' \n", simul_file);
-	
-	/* initiate base */
-	struct sector_data sector;
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-
-	/* set path */
-	char *s_name = strdup(basename(simul_file));
-	char *s_path = strdup(dirname(simul_file));
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);	
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
-
-	int i = 0;
-	int length;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	cur_entries = root_dir.entries;
-	int isRoot = 1;
-	int sector_number;
-
-	// is not root, search dir
-	if( e_name != NULL ) {
-		isRoot = 0;
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
-			return 1;
-		}
 
-		length = MAX_DIR_ENTRIES;
-		cur_entries = t_dir.entries;
-	}else{
-		length = MAX_ROOT_ENTRIES;
-		cur_entries = root_dir.entries;
+	return 0;
+}
+
+/**
+ * @brief Get the per-operation statistics of an open disk.
+ * @param fs Open filesystem.
+ * @param stats Output statistics since fs_enable_stats or fs_reset_stats.
+ * @return 0 on success, 1 if statistics are off.
+ */
+int fs_get_op_stats(struct fs_handle *fs, struct os_stats *stats){
+	if(fs->stats == NULL){
+		return 1;
 	}
 
-	// Verify which is the next free entry position
-	for(i=0; i < length; i++){
-		if(strcmp(cur_entries[i].name, s_name) == 0 && cur_entries[i].dir == 0){
-			break;
-		}
+	os_get(fs->stats, stats);
 
-		// if didnt break, all slots are in use
-		if(i == length - 1){
-			printf("File does not exist\n");
-			return 1;
-		}
-	}
+	return 0;
+}
 
-	ds_read_sector(cur_entries[i].sector_start, (void*)&sector, SECTOR_SIZE);
-	while(sector.next_sector != 0){
-		sector_number = sector.next_sector;
-		ds_read_sector(sector.next_sector, (void*)&sector, SECTOR_SIZE);
+/**
+ * @brief Clear the per-operation statistics of an open disk.
+ * @param fs Open filesystem.
+ */
+void fs_reset_stats(struct fs_handle *fs){
+	if(fs->stats != NULL){
+		os_reset(fs->stats);
 	}
+}
 
-	// sectors added to the beggining of free_sectors_list
-	sector.next_sector = root_dir.free_sectors_list;
-	root_dir.free_sectors_list = cur_entries[i].sector_start;
-	
-	// cleaned entry
-	cur_entries[i].dir = 0;
-	memset(cur_entries[i].name, 0, strlen(cur_entries[i].name));
-	cur_entries[i].size_bytes = 0;
-	cur_entries[i].sector_start = 0;	
+/**
+ * @brief Split a path in its parent directory and entry name.
+ * @param path Full path.
+ * @param s_path Parent directory output buffer (PATH_MAX bytes).
+ * @param s_name Entry name output buffer (PATH_MAX bytes).
+ */
+static void split_path(char *path, char *s_path, char *s_name){
+	char tmp[PATH_MAX];
 
-	if(isRoot == 0){
-		ds_write_sector(s_dir, (void*)&t_dir, SECTOR_SIZE);
-	}
-	ds_write_sector(sector_number, (void*)&sector, SECTOR_SIZE);
-	ds_write_sector(0, (void*)&root_dir, SECTOR_SIZE);
-	printf("Deleted successfully\n");
-	
-	ds_stop();
-	
-	return 0;
+	strncpy(tmp, path, PATH_MAX - 1);
+	tmp[PATH_MAX - 1] = '\0';
+	strcpy(s_name, basename(tmp));
+
+	strncpy(tmp, path, PATH_MAX - 1);
+	tmp[PATH_MAX - 1] = '\0';
+	strcpy(s_path, dirname(tmp));
 }
 
 /**
- * @brief List files from a directory.
- * @param simul_file Source file path.
+ * @brief Make room in a list for more extents.
+ * @param list Extent list.
+ * @param n Number of extents that must fit after the last one.
  * @return 0 on success.
  */
-int fs_ls(char *dir_path){
-	int ret;
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
-	}
-	
-	/* initiate base */
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
+static int extent_reserve(struct extent_list *list, int n){
+	struct extent *extents;
+	int size = list->size ? list->size : 8;
 
-	/* set path */
-	char *s_path = dir_path;
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
-
-	int i = 0;
-	int length;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	cur_entries = root_dir.entries;
-	int count = 0;
-
-		// is not root, search dir
-	if( e_name != NULL ) {
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
+	while(size - list->count < n){
+		size *= 2;
+	}
+	if(size != list->size){
+		if( (extents = realloc(list->extents, size * sizeof(struct extent))) == NULL){
+			perror("realloc()");
 			return 1;
 		}
-		length = MAX_DIR_ENTRIES;
-		cur_entries = t_dir.entries;
-	}else{
-		length = MAX_ROOT_ENTRIES;
-		cur_entries = root_dir.entries;
+		list->extents = extents;
+		list->size = size;
 	}
 
-	printf("- Listing entries at: '%s'\n", dir_path);
-	for(i=0; i < length; i++){
-		// Verify if is file or dir
-		if(cur_entries[i].dir == 0){
-			// dir = 0 and size_byte = 0, means unused entry
-			if(cur_entries[i].size_bytes == 0){
-				break;
-			}
-			printf("f ");
-		}else {
-			printf("d ");
-		}
+	return 0;
+}
 
-		printf("%s", cur_entries[i].name);
-		if(cur_entries[i].size_bytes > 0){
-			printf("\t%d bytes", cur_entries[i].size_bytes);
-		}
-		printf("\n");
-		count++;
+/**
+ * @brief Append an extent to a list.
+ * @param list Extent list.
+ * @param ext Extent.
+ * @return 0 on success.
+ */
+static int extent_push(struct extent_list *list, struct extent *ext){
+	if(extent_reserve(list, 1) != 0){
+		return 1;
 	}
 
-	if(count == 0){
-		printf("This directory is empty\n");
-	}else if(count == 1){
-		printf("%d entry found\n", count);
-	} else{
-		printf("%d entries found\n", count);
-	}
-	
-	ds_stop();
-	
+	list->extents[list->count++] = *ext;
+
 	return 0;
 }
 
 /**
- * @brief Create a new directory on the simulated filesystem.
- * @param directory_path directory path.
+ * @brief Append a sector to an extent list, growing the last extent when contiguous.
+ * @param list Extent list.
+ * @param sector_number Number of the sector.
  * @return 0 on success.
  */
-int fs_mkdir(char* directory_path){
-	int ret;
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
+static int extent_add(struct extent_list *list, uint64_t sector_number){
+	struct extent *last;
+	struct extent ext;
+
+	if(list->count > 0){
+		last = &list->extents[list->count - 1];
+		if(last->start + last->length == sector_number){
+			last->length++;
+			return 0;
+		}
 	}
-	
-	printf("- Creating directory: '%s' \n", directory_path);
-	
-	/* initiate base */
-	struct table_directory table_dir;
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-
-	/* set path */
-	char *s_name = strdup(basename(directory_path));
-	char *s_path = strdup(dirname(directory_path));
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
-
-	int i = 0;
-	int length;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	cur_entries = root_dir.entries;
-	int isRoot = 1;
-	int sector_number;
-
-
-	// is not root, search dir
-	if( e_name != NULL ) {
-		isRoot = 0;
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
-			return 1;
-		}		
 
-		length = MAX_DIR_ENTRIES;
-		cur_entries = t_dir.entries;
-	}else{
-		length = MAX_ROOT_ENTRIES;
-		cur_entries = root_dir.entries;
+	ext.start = sector_number;
+	ext.length = 1;
+
+	return extent_push(list, &ext);
+}
+
+/**
+ * @brief Mark every sector of an extent list as free.
+ * @param fs Open filesystem.
+ * @param list Extent list.
+ */
+static void free_extents(struct fs_handle *fs, struct extent_list *list){
+	int i;
+
+	for(i = 0; i < list->count; i++){
+		ba_mark(fs->bitmap, list->extents[i].start, list->extents[i].length, 0);
 	}
 
-	for(i=0; i < length; i++){
-		if(strcmp(cur_entries[i].name, s_name) == 0 && cur_entries[i].dir == 1){
-			printf("Directory already exists\n");
-			return 1;
-		}
+	list->count = 0;
+}
+
+/**
+ * @brief Allocate sectors as a list of extents, as few as the free space allows.
+ * @param fs Open filesystem.
+ * @param n Number of sectors.
+ * @param list Extent list, extended with the new sectors.
+ * @return 0 on success, 1 if the disk is full (nothing is allocated).
+ */
+static int alloc_extents(struct fs_handle *fs, uint64_t n, struct extent_list *list){
+	struct extent ext;
+	int first = list->count;
+	int i;
 
-		if(cur_entries[i].sector_start == 0){
+	for(; n > 0; n -= ext.length){
+		if( (ext.length = ba_alloc_run(fs->bitmap, n, &ext.start)) == 0){
 			break;
 		}
-
-		// if didnt break, all slots are in use
-		if(i == length - 1){
-			printf("File does not exist\n");
-			return 1;
+		if(extent_push(list, &ext) != 0){
+			ba_mark(fs->bitmap, ext.start, ext.length, 0);
+			break;
 		}
 	}
 
-	sector_number = root_dir.free_sectors_list;
-	root_dir.free_sectors_list++;
-
-	// set entry dir
-	cur_entries[i].dir = 1;
-	strcpy(cur_entries[i].name, s_name);
-	cur_entries[i].sector_start = sector_number;
-	cur_entries[i].size_bytes = 0;
-
-	// write dir
-	memset(&table_dir, 0, sizeof(table_dir));	
-	ds_write_sector(sector_number, (void*)&table_dir, SECTOR_SIZE);
-
-	// dir owner
-	if(isRoot == 1){
-		root_dir.entries[i] = cur_entries[i];
-	}else{
-		t_dir.entries[i] = cur_entries[i];
-		ds_write_sector(s_dir, (void*)&t_dir, SECTOR_SIZE);
+	/* Out of space or memory, give everything back. */
+	if(n > 0){
+		for(i = first; i < list->count; i++){
+			ba_mark(fs->bitmap, list->extents[i].start, list->extents[i].length, 0);
+		}
+		list->count = first;
+		return 1;
 	}
-	
-	ds_write_sector(0, (void*)&root_dir, SECTOR_SIZE);
 
-	printf("Directory created successfully\n");
-	
-	ds_stop();
-	
 	return 0;
 }
 
 /**
- * @brief Remove directory from the simulated filesystem.
- * @param directory_path directory path.
+ * @brief Load the extent tables of a file.
+ * @param fs Open filesystem.
+ * @param table_sector First extent table.
+ * @param data Output list of data extents.
+ * @param tables Output list of extent table sectors, may be NULL.
  * @return 0 on success.
  */
-int fs_rmdir(char *dir_path){
-	int ret;
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
-	}
-	
-	/* initiate base */
-	struct root_table_directory root_dir;
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-
-	/* set path */
-	char *s_name = basename(dir_path);
-	char *s_path = dirname(dir_path);
-	char *str = malloc(sizeof(s_path));
-	strcpy(str, s_path);
-	
-	const char delimiter[2] = "/";
-	char *e_name = strtok(str, delimiter);
-
-	int i, j = 0;
-	struct file_dir_entry* cur_entries;
-	int s_dir;
-	struct table_directory t_dir;
-	struct table_directory delete_dir;
-	cur_entries = root_dir.entries;
-	int sector_number;
-	int is_empty = 1;
-
-	// is not root, search dir
-	if( e_name != NULL ) {
-		if((s_dir = find_dir(&t_dir, s_path, cur_entries)) < 1){
+static int load_extents(struct fs_handle *fs, uint64_t table_sector, struct extent_list *data, struct extent_list *tables){
+	struct extent_table table;
+	int i;
+
+	while(table_sector != 0){
+		bc_read_sector(fs->cache, table_sector, (void*)&table);
+
+		if(tables != NULL && extent_add(tables, table_sector) != 0){
 			return 1;
 		}
-		cur_entries = t_dir.entries;
-	}else{
-		printf("ERROR: You cannot remove root dir.\n");
-		return 1;
-	}
 
-	for(i=0; i < MAX_DIR_ENTRIES; i++){
-		// Verify if is file or dir
-		if(strcmp(cur_entries[i].name, s_name)== 0){
-			sector_number = cur_entries[i].sector_start;
-			break;
+		for(i = 0; i < (int)table.count && i < TABLE_EXTENTS(fs); i++){
+			if(extent_push(data, &table.extents[i]) != 0){
+				return 1;
+			}
 		}
 
-		if(i == MAX_DIR_ENTRIES-1){
-			printf("Error: The path doesn't exist\n");
-			return 1;
-		}
+		table_sector = table.next_table;
 	}
 
-	ds_read_sector(sector_number, (void*)&delete_dir, SECTOR_SIZE);
+	return 0;
+}
 
-	for(j=0; j < MAX_DIR_ENTRIES; j++){
-		if(delete_dir.entries[j].sector_start != 0){
-			is_empty = 0;
-		}
+/**
+ * @brief Write the extent tables of a file to sectors already allocated.
+ * @param fs Open filesystem.
+ * @param data Data extents.
+ * @param tables Table sectors, enough for the data extents.
+ * @param first First table to write, the ones before it are unchanged.
+ * @param table_sector Output first extent table.
+ */
+static void write_tables(struct fs_handle *fs, struct extent_list *data, struct extent_list *tables, int first, uint64_t *table_sector){
+	struct extent_table table;
+	uint64_t sector_number, next;
+	int n_tables, t, i, k;
+
+	n_tables = (data->count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs);
+	if(n_tables == 0){
+		n_tables = 1;
 	}
 
-	if(is_empty == 1){
-		// remove reference from parent dir
-		
-		t_dir.entries[i].dir = 0;
-		memset(t_dir.entries[i].name, 0, strlen(t_dir.entries[i].name));
-		t_dir.entries[i].size_bytes = 0;
-		t_dir.entries[i].sector_start = 0;
+	/* Walk the table sectors in order, each one pointing to the next. */
+	sector_number = tables->extents[0].start;
+	*table_sector = sector_number;
+	k = 0;
+	i = 0;
+	for(t = 0; t < n_tables; t++){
+		memset(&table, 0, sizeof(table));
 
-		ds_write_sector(s_dir, (void*)&t_dir, SECTOR_SIZE);
-		printf("Directory was successfully removed\n");
-	}else{
-		printf("Error: Directory is not empty\n");
+		for(table.count = 0; (int)table.count < TABLE_EXTENTS(fs) && i < data->count; table.count++){
+			table.extents[table.count] = data->extents[i++];
+		}
+
+		next = 0;
+		if(t < n_tables - 1){
+			if(sector_number + 1 < tables->extents[k].start + tables->extents[k].length){
+				next = sector_number + 1;
+			}else{
+				next = tables->extents[++k].start;
+			}
+		}
+		table.next_table = next;
+
+		if(t >= first){
+			bc_write_sector(fs->cache, sector_number, (void*)&table);
+		}
+		sector_number = next;
 	}
-	
-	ds_stop();
-	
-	return 0;
 }
 
 /**
- * @brief Generate a map of used/available sectors. 
- * @param log_f Log file with the sector map.
- * @return 0 on success.
+ * @brief Allocate and write the extent tables of a file.
+ * @param fs Open filesystem.
+ * @param data Data extents.
+ * @param table_sector Output first extent table.
+ * @return 0 on success, 1 if the disk is full.
  */
-int fs_free_map(char *log_f){
-	int ret, i, next;
-	struct root_table_directory root_dir;
-	struct sector_data sector;
-	char *sector_array;
-	FILE* log;
-	int pid, status;
-	int free_space = 0;
-	char* exec_params[] = {"gnuplot", "sector_map.gnuplot" , NULL};
+static int store_extents(struct fs_handle *fs, struct extent_list *data, uint64_t *table_sector){
+	struct extent_list tables = {NULL, 0, 0};
+	int n_tables;
 
-	if ( (ret = ds_init(FILENAME, SECTOR_SIZE, NUMBER_OF_SECTORS, 0)) != 0 ){
-		return ret;
+	n_tables = (data->count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs);
+	if(n_tables == 0){
+		n_tables = 1;
 	}
-	
-	/* each byte represents a sector. */
-	sector_array = (char*)malloc(NUMBER_OF_SECTORS);
-
-	/* set 0 to all sectors. Zero means that the sector is used. */
-	memset(sector_array, 0, NUMBER_OF_SECTORS);
-	
-	/* Read the root dir to get the free blocks list. */
-	ds_read_sector(0, (void*)&root_dir, SECTOR_SIZE);
-	
-	next = root_dir.free_sectors_list;
-
-	while(next){
-		/* The sector is in the free list, mark with 1. */
-		sector_array[next] = 1;
-		
-		/* move to the next free sector. */
-		ds_read_sector(next, (void*)&sector, SECTOR_SIZE);
-		
-		next = sector.next_sector;
-		
-		free_space += SECTOR_SIZE;
-	}
-
-	/* Create a log file. */
-	if( (log = fopen(log_f, "w")) == NULL){
-		perror("fopen()");
-		free(sector_array);
-		ds_stop();
-		return 1;
-	}
-	
-	/* Write the the sector map to the log file. */
-	for(i=0;i<NUMBER_OF_SECTORS;i++){
-		if(i%32==0) fprintf(log, "%s", "\n");
-		fprintf(log, " %d", sector_array[i]);
-	}
-	
-	fclose(log);
-	
-	/* Execute gnuplot to generate the sector's free map. */
-	pid = fork();
-	if(pid==0){
-		execvp("gnuplot", exec_params);
-	}
-	
-	wait(&status);
-	
-	free(sector_array);
-	
-	ds_stop();
-	
-	printf("Free space %d kbytes.\n", free_space/1024);
-	
-	return 0;
-}
 
+	if(alloc_extents(fs, n_tables, &tables) != 0){
+		free(tables.extents);
+		return 1;
+	}
+
+	write_tables(fs, data, &tables, 0, table_sector);
+
+	free(tables.extents);
+
+	return 0;
+}
+
+/**
+ * @brief Verify if a file is small: inline or packed, with no extents.
+ * @param entry File or directory entry.
+ * @return 1 if it is a small file.
+ */
+static int is_small(struct file_dir_entry *entry){
+	return !entry->dir && (entry->sector_start == 0 || (entry->sector_start & FS_PACKED));
+}
+
+/**
+ * @brief Put the data of a small file in the current pack sector, or in a new one.
+ *
+ * The current pack sector stays the one with more room left, so a file
+ * that does not fit only wastes the room it leaves behind.
+ *
+ * @param fs Open filesystem.
+ * @param data File data.
+ * @param size Bytes, up to PACK_MAX.
+ * @param addr Output sector_start of the file.
+ * @return 0 on success, 1 if the disk is full.
+ */
+static int pack_alloc(struct fs_handle *fs, const void *data, uint64_t size, uint64_t *addr){
+	struct pack_sector pk;
+	uint64_t s, room = 0;
+
+	pthread_mutex_lock(&fs->meta_lock);
+
+	if( (s = fs->sb.pack_sector) != 0){
+		bc_read_sector(fs->cache, s, (void*)&pk);
+		room = PACK_MAX(fs) - pk.used;
+	}
+
+	if(s == 0 || size > room){
+		if(ba_alloc_run(fs->bitmap, 1, &s) == 0){
+			pthread_mutex_unlock(&fs->meta_lock);
+			return 1;
+		}
+		memset(&pk, 0, fs->sb.sector_size);
+		if(PACK_MAX(fs) - size >= room){
+			fs->sb.pack_sector = s;
+			fs->sb_dirty = 1;
+		}
+	}
+
+	memcpy(pk.data + pk.used, data, size);
+	*addr = FS_PACKED | (s * fs->sb.sector_size + offsetof(struct pack_sector, data) + pk.used);
+	pk.used += size;
+	pk.live += size;
+	bc_write_sector(fs->cache, s, (void*)&pk);
+
+	pthread_mutex_unlock(&fs->meta_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Give back the data of a packed file. The pack sector is freed with its last file.
+ * @param fs Open filesystem.
+ * @param addr sector_start of the file.
+ * @param size Bytes of the file.
+ */
+static void pack_free(struct fs_handle *fs, uint64_t addr, uint64_t size){
+	struct pack_sector pk;
+	uint64_t s = (addr & ~FS_PACKED) / fs->sb.sector_size;
+
+	pthread_mutex_lock(&fs->meta_lock);
+
+	bc_read_sector(fs->cache, s, (void*)&pk);
+	pk.live -= size;
+	if(pk.live > 0){
+		bc_write_sector(fs->cache, s, (void*)&pk);
+	}else if(s == fs->sb.pack_sector){
+		/* Empty again, new files start over from its beginning. */
+		pk.used = 0;
+		bc_write_sector(fs->cache, s, (void*)&pk);
+	}else{
+		ba_mark(fs->bitmap, s, 1, 0);
+	}
+
+	pthread_mutex_unlock(&fs->meta_lock);
+}
+
+/**
+ * @brief Store the data of a small file: inline if it fits in the record, packed otherwise.
+ * @param fs Open filesystem.
+ * @param entry File entry, sector_start is set from size_bytes.
+ * @param data File data, given to dir_insert or dir_update when inline.
+ * @return 0 on success, 1 if the disk is full.
+ */
+static int small_store(struct fs_handle *fs, struct file_dir_entry *entry, const void *data){
+	if(entry->size_bytes <= FS_INLINE_MAX(fs->sb.sector_size)){
+		entry->sector_start = 0;
+		return 0;
+	}
+
+	return pack_alloc(fs, data, entry->size_bytes, &entry->sector_start);
+}
+
+/**
+ * @brief Free the data of a small file. Inline data goes with its record.
+ */
+static void small_free(struct fs_handle *fs, struct file_dir_entry *entry){
+	if(entry->sector_start & FS_PACKED){
+		pack_free(fs, entry->sector_start, entry->size_bytes);
+	}
+}
+
+/**
+ * @brief Read the data of a small file, one sector at most.
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked.
+ * @param s_name File name.
+ * @param entry File entry.
+ * @param data Output data, size_bytes of the entry.
+ * @return 0 on success.
+ */
+static int small_read(struct fs_handle *fs, uint64_t s_dir, char *s_name, struct file_dir_entry *entry, unsigned char *data){
+	struct pack_sector pk;
+	uint64_t addr = entry->sector_start & ~FS_PACKED;
+
+	if(entry->sector_start == 0){
+		return dir_read_inline(fs, s_dir, s_name, data);
+	}
+
+	if(bc_read_sector(fs->cache, addr / fs->sb.sector_size, (void*)&pk) != 0){
+		return 1;
+	}
+	memcpy(data, (unsigned char*)&pk + addr % fs->sb.sector_size, entry->size_bytes);
+
+	return 0;
+}
+
+/**
+ * @brief Sectors of one file data request.
+ * @param fs Open filesystem.
+ * @return Number of sectors.
+ */
+static int run_sectors(struct fs_handle *fs){
+	int n = IO_RUN_BYTES / fs->sb.sector_size;
+
+	return n < 1 ? 1 : (n > IO_RUN_SECTORS ? IO_RUN_SECTORS : n);
+}
+
+/**
+ * @brief Copy a host file to the data sectors of an extent list.
+ *
+ * Up to IO_QUEUE_RUNS writes are in flight while the next runs are read
+ * from the host file.
+ *
+ * @param fs Open filesystem.
+ * @param fileptr Source file.
+ * @param data Data extents.
+ * @return 0 on success.
+ */
+static int write_file_data(struct fs_handle *fs, FILE *fileptr, struct extent_list *data){
+	struct ds_batch batch;
+	unsigned char *buf, *p;
+	uint64_t off, count;
+	size_t bytes, n, run_bytes;
+	int i, last, slot = 0, failed = 0;
+
+	run_bytes = (size_t)run_sectors(fs) * fs->sb.sector_size;
+	if( (buf = malloc(IO_QUEUE_RUNS * run_bytes)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	ds_batch_init(&batch);
+	for(i = 0; i < data->count && !failed; i++){
+		for(off = 0; off < data->extents[i].length && !failed; off += count){
+			count = data->extents[i].length - off;
+			if(count > (uint64_t)run_sectors(fs)){
+				count = run_sectors(fs);
+			}
+
+			/* Every buffer is in flight, wait for them. */
+			if(slot == IO_QUEUE_RUNS){
+				failed |= ds_wait(fs->dev, &batch) != 0;
+				ds_batch_init(&batch);
+				slot = 0;
+			}
+			p = buf + slot++ * run_bytes;
+
+			// the last sector of the file is padded with zeros
+			bytes = (size_t)count * fs->sb.sector_size;
+			n = fread(p, 1, bytes, fileptr);
+			memset(p + n, 0, bytes - n);
+
+			/* Only the last sector may be short, else the file shrank while read. */
+			last = i == data->count - 1 && off + count == data->extents[i].length;
+			if(n < bytes && (!last || bytes - n >= fs->sb.sector_size)){
+				printf("Error: Could not read the input\n");
+				failed = 1;
+			}else{
+				failed |= bc_submit_write(fs->cache, &batch, data->extents[i].start + off, count, (void*)p) != 0;
+			}
+		}
+	}
+	failed |= ds_wait(fs->dev, &batch) != 0;
+
+	free(buf);
+
+	return failed;
+}
+
+/**
+ * @brief Copy a stream of unknown length to data sectors allocated as it is read.
+ *
+ * Sectors are allocated a run at a time; the runs mostly follow each other
+ * and merge into a few extents. Up to IO_QUEUE_RUNS writes are in flight
+ * while the next runs are read.
+ *
+ * @param fs Open filesystem.
+ * @param fileptr Source stream, read to its end.
+ * @param head Bytes already read from the stream, written first.
+ * @param head_len Number of bytes of head, up to a sector.
+ * @param data Output data extents, to be freed by the caller on error too.
+ * @param size Output length of the stream in bytes.
+ * @return 0 on success, 1 on error, 2 if the disk is full.
+ */
+static int stream_file_data(struct fs_handle *fs, FILE *fileptr, unsigned char *head, size_t head_len, struct extent_list *data, uint64_t *size){
+	struct ds_batch batch;
+	struct extent ext, *last;
+	unsigned char *buf, *p;
+	uint64_t sectors, off;
+	size_t n, run_bytes;
+	int slot = 0, ret = 0;
+
+	run_bytes = (size_t)run_sectors(fs) * fs->sb.sector_size;
+	if( (buf = malloc(IO_QUEUE_RUNS * run_bytes)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	*size = 0;
+	ds_batch_init(&batch);
+	while(ret == 0){
+		/* Every buffer is in flight, wait for them. */
+		if(slot == IO_QUEUE_RUNS){
+			ret = ds_wait(fs->dev, &batch) != 0;
+			ds_batch_init(&batch);
+			slot = 0;
+		}
+		p = buf + slot++ * run_bytes;
+
+		memcpy(p, head, head_len);
+		if( (n = head_len + fread(p + head_len, 1, run_bytes - head_len, fileptr)) == 0){
+			break;
+		}
+		head_len = 0;
+		*size += n;
+
+		// the last sector of the file is padded with zeros
+		sectors = (n + fs->sb.sector_size - 1) / fs->sb.sector_size;
+		memset(p + n, 0, sectors * fs->sb.sector_size - n);
+
+		for(off = 0; off < sectors && ret == 0; off += ext.length){
+			if( (ext.length = ba_alloc_run(fs->bitmap, sectors - off, &ext.start)) == 0){
+				ret = 2;
+				break;
+			}
+
+			last = data->count > 0 ? &data->extents[data->count - 1] : NULL;
+			if(last != NULL && last->start + last->length == ext.start){
+				last->length += ext.length;
+			}else if(extent_push(data, &ext) != 0){
+				ba_mark(fs->bitmap, ext.start, ext.length, 0);
+				ret = 1;
+				break;
+			}
+
+			ret = bc_submit_write(fs->cache, &batch, ext.start, ext.length, (void*)(p + off * fs->sb.sector_size)) != 0;
+		}
+	}
+
+	if(ferror(fileptr)){
+		printf("Error: Could not read the input\n");
+		ret = 1;
+	}
+
+	if(ds_wait(fs->dev, &batch) != 0 && ret == 0){
+		ret = 1;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Wait for the pending data reads and write them out in order.
+ * @param fs Open filesystem.
+ * @param fileptr Destination file.
+ * @param batch Pending reads, reset.
+ * @param buf Read buffers, run_bytes apart.
+ * @param run_bytes Size of a buffer.
+ * @param lengths Bytes of each buffer to write.
+ * @param n Number of buffers.
+ * @return 0 on success.
+ */
+static int write_runs(struct fs_handle *fs, FILE *fileptr, struct ds_batch *batch, unsigned char *buf, size_t run_bytes, size_t *lengths, int n){
+	int k, failed = ds_wait(fs->dev, batch) != 0;
+
+	for(k = 0; k < n; k++){
+		fwrite(buf + k * run_bytes, 1, lengths[k], fileptr);
+	}
+	ds_batch_init(batch);
+
+	return failed;
+}
+
+/**
+ * @brief Copy the data sectors of a file to a host file.
+ *
+ * Up to IO_QUEUE_RUNS reads are started before the first one is written out.
+ * A pipe gets each extent in one ds_send, spliced from the disk image.
+ *
+ * @param fs Open filesystem.
+ * @param fileptr Destination file.
+ * @param data Data extents.
+ * @param size_bytes File size.
+ * @return 0 on success.
+ */
+static int read_file_data(struct fs_handle *fs, FILE *fileptr, struct extent_list *data, uint64_t size_bytes){
+	struct ds_batch batch;
+	struct stat st;
+	unsigned char *buf, *p;
+	uint64_t off, count, bytes;
+	size_t run_bytes, lengths[IO_QUEUE_RUNS];
+	int i, slot = 0, failed = 0, pipe_fd = -1;
+
+	/* A pipe is fed whole extents by ds_send, behind what was buffered. */
+	if(fstat(fileno(fileptr), &st) == 0 && S_ISFIFO(st.st_mode)){
+		fflush(fileptr);
+		pipe_fd = fileno(fileptr);
+	}
+
+	run_bytes = (size_t)run_sectors(fs) * fs->sb.sector_size;
+	if( (buf = malloc(IO_QUEUE_RUNS * run_bytes)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	ds_batch_init(&batch);
+	for(i = 0; i < data->count && size_bytes > 0; i++){
+		if(pipe_fd >= 0){
+			bytes = data->extents[i].length * fs->sb.sector_size;
+			if(bytes > size_bytes){
+				bytes = size_bytes;
+			}
+			failed |= ds_send(fs->dev, data->extents[i].start, bytes, pipe_fd, fs->sb.sector_size) != 0;
+			size_bytes -= bytes;
+			continue;
+		}
+
+		/* A mapped extent is written straight from the disk image. */
+		if( (p = ds_sector_ptr(fs->dev, data->extents[i].start, fs->sb.sector_size)) != NULL &&
+		    ds_sector_ptr(fs->dev, data->extents[i].start + data->extents[i].length - 1, fs->sb.sector_size) != NULL){
+			failed |= write_runs(fs, fileptr, &batch, buf, run_bytes, lengths, slot);
+			slot = 0;
+
+			bytes = data->extents[i].length * fs->sb.sector_size;
+			if(bytes > size_bytes){
+				bytes = size_bytes;
+			}
+			fwrite(p, 1, bytes, fileptr);
+			size_bytes -= bytes;
+			continue;
+		}
+
+		for(off = 0; off < data->extents[i].length && size_bytes > 0; off += count){
+			count = data->extents[i].length - off;
+			if(count > (uint64_t)run_sectors(fs)){
+				count = run_sectors(fs);
+			}
+
+			bytes = count * fs->sb.sector_size;
+			if(bytes > size_bytes){
+				bytes = size_bytes;
+			}
+			size_bytes -= bytes;
+
+			lengths[slot] = bytes;
+			ds_submit_read(fs->dev, &batch, data->extents[i].start + off, count, (void*)(buf + slot * run_bytes), fs->sb.sector_size);
+
+			if(++slot == IO_QUEUE_RUNS){
+				failed |= write_runs(fs, fileptr, &batch, buf, run_bytes, lengths, slot);
+				slot = 0;
+			}
+		}
+	}
+	failed |= write_runs(fs, fileptr, &batch, buf, run_bytes, lengths, slot);
+
+	free(buf);
+
+	return failed;
+}
+
+/**
+ * @brief Bytes of a chunk of a compressed file.
+ * @param fs Open filesystem.
+ * @return COMPRESS_CHUNK, or a sector when sectors are larger.
+ */
+static uint64_t chunk_bytes(struct fs_handle *fs){
+	return fs->sb.sector_size > COMPRESS_CHUNK ? fs->sb.sector_size : COMPRESS_CHUNK;
+}
+
+/**
+ * @brief Verify if a file is compressed, one extent per chunk.
+ * @param entry File or directory entry.
+ * @return 1 if it is a compressed file.
+ */
+static int is_compressed(struct file_dir_entry *entry){
+	return !entry->dir && !is_small(entry) && (entry->sector_start & FS_COMPRESSED);
+}
+
+/**
+ * @brief First extent table of a file with extents, compressed or not.
+ * @param entry File entry.
+ * @return Sector number.
+ */
+static uint64_t table_of(struct file_dir_entry *entry){
+	return entry->sector_start & ~FS_COMPRESSED;
+}
+
+/**
+ * @brief Count the runs of contiguous sectors of an extent list.
+ *
+ * The extents of a compressed file are never merged, chunks that follow
+ * each other on the disk are one run.
+ *
+ * @param list Extent list.
+ * @return Number of runs.
+ */
+static int pieces(struct extent_list *list){
+	int i, n = list->count > 0;
+
+	for(i = 1; i < list->count; i++){
+		n += list->extents[i].start != list->extents[i - 1].start + list->extents[i - 1].length;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Compress a chunk and start writing it to a new extent.
+ *
+ * The chunk is kept as is when compressing it would not save a sector, so
+ * the length of its extent tells how it is stored.
+ *
+ * @param fs Open filesystem.
+ * @param batch Pending writes, the chunk is added.
+ * @param raw Chunk, up to chunk_bytes.
+ * @param len Bytes of the chunk.
+ * @param out Buffer of chunk_bytes, written from until the batch is waited for.
+ * @param data Data extents, extended by one.
+ * @return 0 on success, 1 on error, 2 if the disk is full, 3 if no free run
+ * of sectors is long enough for the chunk.
+ */
+static int store_chunk(struct fs_handle *fs, struct ds_batch *batch, const unsigned char *raw, size_t len, unsigned char *out, struct extent_list *data){
+	struct extent ext;
+	uint64_t ss = fs->sb.sector_size, sectors = (len + ss - 1) / ss;
+	size_t n = 0;
+
+	if(sectors > 1){
+		n = lz_compress(raw, len, out, (sectors - 1) * ss);
+	}
+	if(n > 0){
+		sectors = (n + ss - 1) / ss;
+	}else{
+		memcpy(out, raw, len);
+		n = len;
+	}
+	memset(out + n, 0, sectors * ss - n);
+
+	/* A chunk is one extent, in one run of sectors. */
+	if( (ext.length = ba_alloc_run(fs->bitmap, sectors, &ext.start)) < sectors){
+		if(ext.length > 0){
+			ba_mark(fs->bitmap, ext.start, ext.length, 0);
+		}
+		return ba_free_count(fs->bitmap) >= sectors ? 3 : 2;
+	}
+	if(extent_push(data, &ext) != 0){
+		ba_mark(fs->bitmap, ext.start, ext.length, 0);
+		return 1;
+	}
+
+	return bc_submit_write(fs->cache, batch, ext.start, sectors, (void*)out) != 0;
+}
+
+/**
+ * @brief Read a chunk of a compressed file.
+ *
+ * A compressed chunk of a mapped disk image is decompressed straight from
+ * the mapping.
+ *
+ * @param fs Open filesystem.
+ * @param ext Extent of the chunk.
+ * @param len Bytes of the chunk.
+ * @param out Output chunk, len bytes.
+ * @param z Buffer of chunk_bytes.
+ * @return 0 on success.
+ */
+static int load_chunk(struct fs_handle *fs, struct extent *ext, size_t len, unsigned char *out, unsigned char *z){
+	uint64_t ss = fs->sb.sector_size, sectors = (len + ss - 1) / ss;
+	unsigned char *p;
+
+	if(ext->length > sectors){
+		printf("Error: Corrupt compressed data\n");
+		return 1;
+	}
+
+	if(ext->length == sectors){
+		if(ds_read_sectors(fs->dev, ext->start, sectors, z, ss) != 0){
+			return 1;
+		}
+		memcpy(out, z, len);
+		return 0;
+	}
+
+	if( (p = ds_sector_ptr(fs->dev, ext->start, ss)) == NULL ||
+	    ds_sector_ptr(fs->dev, ext->start + ext->length - 1, ss) == NULL){
+		if(ds_read_sectors(fs->dev, ext->start, ext->length, z, ss) != 0){
+			return 1;
+		}
+		p = z;
+	}
+
+	if(lz_decompress(p, ext->length * ss, out, len) != 0){
+		printf("Error: Corrupt compressed data\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Copy a stream to new compressed chunks, allocated as it is read.
+ *
+ * Up to IO_QUEUE_RUNS chunks are written while the next ones are read
+ * and compressed.
+ *
+ * @param fs Open filesystem.
+ * @param fileptr Source stream, read to its end.
+ * @param head Bytes already read from the stream, written first.
+ * @param head_len Number of bytes of head, up to a sector.
+ * @param data Output data extents, one per chunk, to be freed by the caller on error too.
+ * @param size Output length of the stream in bytes.
+ * @return 0 on success, 1 on error, 2 if the disk is full, 3 if no free run
+ * of sectors is long enough for a chunk.
+ */
+static int compress_file_data(struct fs_handle *fs, FILE *fileptr, unsigned char *head, size_t head_len, struct extent_list *data, uint64_t *size){
+	struct ds_batch batch;
+	unsigned char *buf, *raw;
+	size_t n, chunk = chunk_bytes(fs);
+	int slot = 0, ret = 0;
+
+	/* Output buffers, then the chunk being read. */
+	if( (buf = malloc((IO_QUEUE_RUNS + 1) * chunk)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+	raw = buf + IO_QUEUE_RUNS * chunk;
+
+	*size = 0;
+	ds_batch_init(&batch);
+	while(ret == 0){
+		memcpy(raw, head, head_len);
+		if( (n = head_len + fread(raw + head_len, 1, chunk - head_len, fileptr)) == 0){
+			break;
+		}
+		head_len = 0;
+		*size += n;
+
+		/* Every buffer is in flight, wait for them. */
+		if(slot == IO_QUEUE_RUNS){
+			ret = ds_wait(fs->dev, &batch) != 0;
+			ds_batch_init(&batch);
+			slot = 0;
+		}
+
+		if(ret == 0){
+			ret = store_chunk(fs, &batch, raw, n, buf + slot++ * chunk, data);
+		}
+	}
+
+	if(ferror(fileptr)){
+		printf("Error: Could not read the input\n");
+		ret = 1;
+	}
+
+	if(ds_wait(fs->dev, &batch) != 0 && ret == 0){
+		ret = 1;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Copy the chunks of a compressed file to a host file.
+ * @param fs Open filesystem.
+ * @param fileptr Destination file.
+ * @param data Data extents, one per chunk.
+ * @param size_bytes File size.
+ * @return 0 on success.
+ */
+static int read_compressed(struct fs_handle *fs, FILE *fileptr, struct extent_list *data, uint64_t size_bytes){
+	unsigned char *buf;
+	size_t len, chunk = chunk_bytes(fs);
+	int i, failed = 0;
+
+	if( (buf = malloc(2 * chunk)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	for(i = 0; i < data->count && size_bytes > 0 && !failed; i++){
+		len = size_bytes < chunk ? size_bytes : chunk;
+		failed = load_chunk(fs, &data->extents[i], len, buf, buf + chunk) != 0 ||
+			fwrite(buf, 1, len, fileptr) != len;
+		size_bytes -= len;
+	}
+
+	free(buf);
+
+	return failed || size_bytes > 0;
+}
+
+/**
+ * @brief Directory lock of a directory.
+ * @param fs Open filesystem.
+ * @param dir_sector Directory header sector.
+ * @return Lock.
+ */
+static pthread_rwlock_t *dir_lock(struct fs_handle *fs, uint64_t dir_sector){
+	return &fs->dir_locks[dir_sector % FS_DIR_LOCKS];
+}
+
+/**
+ * @brief Find an entry by name, through the dentry cache.
+ * @param fs Open filesystem.
+ * @param parent Directory header sector.
+ * @param name Entry name.
+ * @param dir 1 for directories, 0 for files, -1 for both.
+ * @param entry Output entry. May be NULL.
+ * @return 0 if found, 1 otherwise.
+ */
+static int lookup(struct fs_handle *fs, uint64_t parent, char *name, int dir, struct file_dir_entry *entry){
+	struct file_dir_entry e;
+	int found;
+
+	if( (found = dc_lookup(fs->dentries, parent, name, &e)) < 0){
+		found = (dir_lookup(fs, parent, name, -1, &e) == 0);
+		dc_add(fs->dentries, parent, name, found ? &e : NULL);
+	}
+
+	if( !found || (dir != -1 && (int)e.dir != dir)){
+		return 1;
+	}
+
+	if(entry != NULL){
+		*entry = e;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Verify if dir exist and return its sector
+ * @param fs Open filesystem.
+ * @param s_path dir path.
+ * @return dir header sector number or 0 if not found.
+ */
+uint64_t find_dir(struct fs_handle *fs, char *s_path){
+	uint64_t s_dir = fs->sb.root_sector;
+	struct file_dir_entry entry;
+	char path[PATH_MAX];
+	int ret;
+	printf("- Searching path: %s \n", s_path);
+	const char delimiter[2] = "/";
+	char *saveptr;
+
+	strncpy(path, s_path, PATH_MAX - 1);
+	path[PATH_MAX - 1] = '\0';
+	char *e_name = strtok_r(path, delimiter, &saveptr);
+
+	// Verify if path exists and navigate through
+	while( e_name != NULL )
+	{
+		printf("- Searching dir: %s \n", e_name);
+
+		pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+		ret = lookup(fs, s_dir, e_name, 1, &entry);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+
+		if(ret != 0){
+			printf("Error: The path doesn't exist\n");
+			return 0;
+		}
+		s_dir = entry.sector_start;
+
+		e_name = strtok_r(NULL, delimiter, &saveptr);
+	}
+
+	return s_dir;
+}
+
+/**
+ * @brief Find the parent directory of a path.
+ * @param fs Open filesystem.
+ * @param path Full path.
+ * @param s_name Entry name output buffer (PATH_MAX bytes).
+ * @return Parent directory sector or 0 on error.
+ */
+static uint64_t open_parent(struct fs_handle *fs, char *path, char *s_name){
+	char s_path[PATH_MAX];
+
+	split_path(path, s_path, s_name);
+
+	if(strlen(s_name) > DIR_NAME_MAX){
+		printf("Error: Name too long (max %d characters)\n", DIR_NAME_MAX);
+		return 0;
+	}
+
+	return find_dir(fs, s_path);
+}
+
+/**
+ * @brief Format disk.
+ *
+ * Layout: superblock, allocation bitmap, root directory, journal, data.
+ * The journal gets 1/32 of the disk, from JN_MIN_SECTORS to JN_MAX_SECTORS;
+ * disks too small for it have none. Only the metadata sectors are written,
+ * the rest of the disk is left as a hole and marked free by the bitmap
+ * high-water mark. The image must not be open.
+ *
+ * @param image Disk image path, created or truncated.
+ * @param sector_size Sector size in bytes, a power of two from MIN_SECTOR_SIZE to MAX_SECTOR_SIZE.
+ * @param number_of_sectors Number of sectors.
+ * @return 0 on success.
+ */
+int fs_format(char *image, int sector_size, uint64_t number_of_sectors){
+	int ret;
+	struct fs_handle *fs;
+	struct dir_header root;
+	uint64_t bitmap_sectors = (number_of_sectors + (uint64_t)sector_size * 8 - 1) / ((uint64_t)sector_size * 8);
+	uint64_t journal_sectors = number_of_sectors / 32;
+
+	if( !valid_geometry(sector_size, number_of_sectors)){
+		printf("Error: Sector size must be a power of two from %d to %d bytes\n", MIN_SECTOR_SIZE, MAX_SECTOR_SIZE);
+		return 1;
+	}
+
+	/* Superblock, bitmap, root and at least one data sector. */
+	if(number_of_sectors < bitmap_sectors + 3){
+		printf("Error: Disk too small, %" PRIu64 " sectors at least\n", bitmap_sectors + 3);
+		return 1;
+	}
+
+	if(journal_sectors < JN_MIN_SECTORS){
+		journal_sectors = 0;
+	}else if(journal_sectors > JN_MAX_SECTORS){
+		journal_sectors = JN_MAX_SECTORS;
+	}
+
+	if( (fs = fs_alloc()) == NULL){
+		return 1;
+	}
+
+	if( (fs->dev = ds_open(image, sector_size, number_of_sectors, 1, DS_BACKEND_FILE)) == NULL ||
+	    (fs->cache = bc_init(fs->dev, sector_size, BC_DEFAULT_SECTORS)) == NULL){
+		fs_release(fs);
+		return 1;
+	}
+
+	fs->sb.magic = FS_MAGIC;
+	fs->sb.version = FS_VERSION;
+	fs->sb.sector_size = sector_size;
+	fs->sb.number_of_sectors = number_of_sectors;
+	fs->sb.bitmap_start = 1;
+	fs->sb.bitmap_sectors = bitmap_sectors;
+	fs->sb.root_sector = fs->sb.bitmap_start + fs->sb.bitmap_sectors;
+	fs->sb.journal_start = fs->sb.root_sector + 1;
+	fs->sb.journal_sectors = journal_sectors;
+
+	/* Every sector is free but the metadata. */
+	if( (fs->bitmap = ba_create(fs->dev, fs->cache, fs->sb.bitmap_start, fs->sb.bitmap_sectors, number_of_sectors, sector_size)) == NULL ||
+	    (journal_sectors > 0 && jn_create(fs->dev, fs->sb.journal_start, journal_sectors, sector_size) != 0)){
+		fs_release(fs);
+		return 1;
+	}
+	ba_mark(fs->bitmap, 0, fs->sb.journal_start + journal_sectors, 1);
+
+	/* Empty root directory. */
+	memset(&root, 0, sector_size);
+	bc_write_sector(fs->cache, fs->sb.root_sector, (void*)&root);
+
+	fs->sb_dirty = 1;
+	if( (ret = fs_close(fs)) != 0){
+		return ret;
+	}
+
+	printf("Disk size %" PRIu64 " kbytes, %" PRIu64 " sectors of %d bytes.\n", number_of_sectors * sector_size / 1024, number_of_sectors, sector_size);
+
+	return 0;
+}
+
+/**
+ * @brief Check that a name is free in a directory.
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked.
+ * @param s_name Entry name.
+ * @return 1 if the name is free.
+ */
+static int name_free(struct fs_handle *fs, uint64_t s_dir, char *s_name){
+	if(lookup(fs, s_dir, s_name, -1, NULL) == 0){
+		printf("Error: Already exist a file with the same name\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Create a file in a directory.
+ *
+ * The data and the extent tables are written first, without the directory
+ * lock: nothing can reach those sectors yet. The lock is only taken to add
+ * the entry, so files of one directory are written in parallel. A file is
+ * allocated at once from its size; a pipe, whose size is only known at its
+ * end, is allocated as it is read. Files up to PACK_MAX bytes get no
+ * extents, they are inline or packed (see small_store). Larger ones are
+ * compressed chunk by chunk when compression is on (see fs_set_compression).
+ * A file is stored as is when the free space has no run long enough for a
+ * chunk; a pipe cannot be read again and fails.
+ *
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector.
+ * @param s_name File name.
+ * @param fileptr Source file.
+ * @return 0 on success.
+ */
+static int create_file(struct fs_handle *fs, uint64_t s_dir, char *s_name, FILE *fileptr){
+	struct file_dir_entry entry;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	struct extent_list scratch = {NULL, 0, 0};
+	unsigned char *small;
+	uint64_t table_sector, size = 0;
+	long filelen;
+	size_t n;
+	int compress = fs->compress, ret = 0;
+
+	/* Cheap check first, the name is checked again when the entry is added. */
+	pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+	ret = !name_free(fs, s_dir, s_name);
+	pthread_rwlock_unlock(dir_lock(fs, s_dir));
+
+	if(ret){
+		return 1;
+	}
+
+	if( (small = malloc(fs->sb.sector_size)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	/* file info */
+	if(fseek(fileptr, 0, SEEK_END) == 0 && (filelen = ftell(fileptr)) >= 0 && fseek(fileptr, 0, SEEK_SET) == 0){
+		size = filelen;
+		if(size <= PACK_MAX(fs)){
+			ret = fread(small, 1, size, fileptr) != size;
+		}else if(compress){
+			ret = compress_file_data(fs, fileptr, small, 0, &data, &size);
+
+			/* The file changed size while it was read. */
+			if(ret == 0 && size != (uint64_t)filelen){
+				printf("Error: Could not read the input\n");
+				ret = 1;
+			}
+		}else if(alloc_extents(fs, (size + fs->sb.sector_size - 1) / fs->sb.sector_size, &data) != 0){
+			ret = 2;
+		}else{
+			ret = write_file_data(fs, fileptr, &data);
+		}
+
+		/* The free space is too fragmented for whole chunks, store the file as is. */
+		if(ret == 3 && fseek(fileptr, 0, SEEK_SET) == 0){
+			free_extents(fs, &data);
+			compress = 0;
+			size = filelen;
+			if(alloc_extents(fs, (size + fs->sb.sector_size - 1) / fs->sb.sector_size, &data) != 0){
+				ret = 2;
+			}else{
+				ret = write_file_data(fs, fileptr, &data);
+			}
+		}
+	}else{
+		/* A pipe that ends within PACK_MAX bytes is a small file too. */
+		n = fread(small, 1, PACK_MAX(fs) + 1, fileptr);
+		if(ferror(fileptr)){
+			ret = 1;
+		}else if(n <= PACK_MAX(fs)){
+			size = n;
+		}else if(compress){
+			ret = compress_file_data(fs, fileptr, small, n, &data, &size);
+		}else{
+			ret = stream_file_data(fs, fileptr, small, n, &data, &size);
+		}
+	}
+
+	// set entry file
+	entry.dir = 0;
+	entry.size_bytes = size;
+
+	if(ret == 0 && size <= PACK_MAX(fs) && data.count == 0){
+		ret = small_store(fs, &entry, small) != 0 ? 2 : 0;
+	}else if(ret == 0){
+		ret = store_extents(fs, &data, &table_sector) != 0 ? 2 : 0;
+		entry.sector_start = compress ? table_sector | FS_COMPRESSED : table_sector;
+	}
+
+	if(ret){
+		printf(ret == 2 ? "Error: Disk full\n" : ret == 3 ? "Error: No free run of sectors for a compressed chunk\n" : "Error: Could not write the file data\n");
+		free_extents(fs, &data);
+		free(data.extents);
+		free(small);
+		return 1;
+	}
+
+	pthread_rwlock_wrlock(dir_lock(fs, s_dir));
+	if( !name_free(fs, s_dir, s_name)){
+		ret = 1;
+	}else if(dir_insert(fs, s_dir, s_name, &entry, entry.sector_start == 0 ? small : NULL) != 0){
+		printf("Error: Disk full\n");
+		ret = 1;
+	}else{
+		dc_add(fs->dentries, s_dir, s_name, &entry);
+	}
+	pthread_rwlock_unlock(dir_lock(fs, s_dir));
+
+	if(ret && is_small(&entry)){
+		small_free(fs, &entry);
+	}else if(ret){
+		/* Only the table sectors, the data sectors are in data and freed once. */
+		load_extents(fs, table_sector, &scratch, &tables);
+		free_extents(fs, &tables);
+		free_extents(fs, &data);
+		free(tables.extents);
+		free(scratch.extents);
+	}
+
+	if(ret == 0 && is_small(&entry)){
+		printf("%s, free sectors: %" PRIu64 "\n", entry.sector_start == 0 ? "Inline" : "Packed", ba_free_count(fs->bitmap));
+	}else if(ret == 0 && is_compressed(&entry)){
+		printf("Compressed in %d chunks, free sectors: %" PRIu64 "\n", data.count, ba_free_count(fs->bitmap));
+	}else if(ret == 0){
+		printf("%d extents, free sectors: %" PRIu64 "\n", data.count, ba_free_count(fs->bitmap));
+	}
+
+	free(data.extents);
+	free(small);
+
+	return ret;
+}
+
+/**
+ * @brief Create a file from an open stream.
+ * @param fs Open filesystem.
+ * @param fileptr Source stream.
+ * @param simul_file Destination file path on the simulated file system.
+ * @return 0 on success.
+ */
+static int create_from(struct fs_handle *fs, FILE *fileptr, char *simul_file){
+	char s_name[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int ret = 1;
+
+	os_begin(fs->stats, &op);
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( writable(fs) && (s_dir = open_parent(fs, simul_file, s_name)) != 0){
+		ret = create_file(fs, s_dir, s_name, fileptr);
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	commit_group(fs);
+
+	return os_end(fs->stats, &op, OS_CREATE, ret);
+}
+
+/**
+ * @brief Create a new file on the simulated filesystem.
+ * @param fs Open filesystem.
+ * @param input_file Source file path.
+ * @param simul_file Destination file path on the simulated file system.
+ * @return 0 on success.
+ */
+int fs_create(struct fs_handle *fs, char* input_file, char* simul_file){
+	FILE *fileptr;
+	int ret;
+
+	/* Write the code to load a new file to the simulated filesystem. */
+	printf("- Creating '%s' at '%s'\n", input_file, simul_file);
+
+	if( (fileptr = fopen(input_file, "rb")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
+
+	ret = create_from(fs, fileptr, simul_file);
+	fclose(fileptr);
+
+	return ret;
+}
+
+/**
+ * @brief Create a new file from a stream, such as a pipe, read to its end.
+ *
+ * The size is only recorded once the stream is over, so the stream does
+ * not need to be seekable.
+ *
+ * @param fs Open filesystem.
+ * @param input Source stream, left open.
+ * @param simul_file Destination file path on the simulated file system.
+ * @return 0 on success.
+ */
+int fs_create_stream(struct fs_handle *fs, FILE *input, char *simul_file){
+	printf("- Creating '%s' from a stream\n", simul_file);
+
+	return create_from(fs, input, simul_file);
+}
+
+/**
+ * @brief Find a file or directory.
+ * @param fs Open filesystem.
+ * @param path Full path.
+ * @param entry Output entry, may be NULL. The root is a directory entry.
+ * @return 0 if it exists.
+ */
+int fs_lookup(struct fs_handle *fs, char *path, struct file_dir_entry *entry){
+	char s_name[PATH_MAX];
+	struct file_dir_entry e;
+	uint64_t s_dir;
+	int ret = 1;
+
+	if(fs->legacy){
+		return 1;
+	}
+
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( (s_dir = open_parent(fs, path, s_name)) != 0){
+		if(strcmp(s_name, "/") == 0){
+			memset(&e, 0, sizeof(e));
+			e.dir = 1;
+			e.sector_start = fs->sb.root_sector;
+			ret = 0;
+		}else{
+			pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+			ret = lookup(fs, s_dir, s_name, -1, &e);
+			pthread_rwlock_unlock(dir_lock(fs, s_dir));
+		}
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	if(ret == 0 && entry != NULL){
+		*entry = e;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Read a file of a locked directory.
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked for reading.
+ * @param s_name File name.
+ * @param output_file Output file path, opened once the file is found.
+ * @param out Output stream, used instead of output_file when not NULL.
+ * @return 0 on success.
+ */
+static int read_file(struct fs_handle *fs, uint64_t s_dir, char *s_name, char *output_file, FILE *out){
+	struct file_dir_entry entry;
+	struct extent_list data = {NULL, 0, 0};
+	unsigned char *small = NULL;
+	FILE *fileptr = out;
+	int ret;
+
+	if(lookup(fs, s_dir, s_name, 0, &entry) != 0){
+		printf("File does not exist\n");
+		return 1;
+	}
+
+	if(is_small(&entry)){
+		if( (small = malloc(fs->sb.sector_size)) == NULL || small_read(fs, s_dir, s_name, &entry, small) != 0){
+			free(small);
+			return 1;
+		}
+	}else if(load_extents(fs, table_of(&entry), &data, NULL) != 0){
+		free(data.extents);
+		return 1;
+	}
+
+	if(out == NULL && (fileptr = fopen(output_file, "w")) == NULL){
+		perror("fopen()");
+		free(data.extents);
+		free(small);
+		return 1;
+	}
+
+	if(small != NULL){
+		ret = fwrite(small, 1, entry.size_bytes, fileptr) != entry.size_bytes;
+	}else if(is_compressed(&entry)){
+		ret = read_compressed(fs, fileptr, &data, entry.size_bytes);
+	}else{
+		ret = read_file_data(fs, fileptr, &data, entry.size_bytes);
+	}
+
+	free(data.extents);
+	free(small);
+	if(out == NULL){
+		fclose(fileptr);
+	}else if(fflush(out) != 0){
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Read a file to a path or a stream.
+ * @param fs Open filesystem.
+ * @param output_file Output file path.
+ * @param out Output stream, used instead of output_file when not NULL.
+ * @param simul_file Source file path from the simulated file system.
+ * @return 0 on success.
+ */
+static int read_to(struct fs_handle *fs, char *output_file, FILE *out, char *simul_file){
+	char s_name[PATH_MAX];
+	char s_path[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int ret = 1;
+
+	os_begin(fs->stats, &op);
+
+	if(fs->legacy){
+		split_path(simul_file, s_path, s_name);
+		ret = legacy_read(fs, output_file, out, s_path, s_name);
+		return os_end(fs->stats, &op, OS_READ, ret);
+	}
+
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( (s_dir = open_parent(fs, simul_file, s_name)) != 0){
+		pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+		ret = read_file(fs, s_dir, s_name, output_file, out);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	return os_end(fs->stats, &op, OS_READ, ret);
+}
+
+/**
+ * @brief Read file from the simulated filesystem.
+ *
+ * Files of different directories, or of the same directory, are read in
+ * parallel. Only writers of the directory wait.
+ *
+ * @param fs Open filesystem.
+ * @param output_file Output file path.
+ * @param simul_file Source file path from the simulated file system.
+ * @return 0 on success.
+ */
+int fs_read(struct fs_handle *fs, char* output_file, char* simul_file){
+	printf("- Copying: '%s' to '%s'\n", simul_file, output_file);
+
+	return read_to(fs, output_file, NULL, simul_file);
+}
+
+/**
+ * @brief Read file from the simulated filesystem to a stream.
+ *
+ * A pipe is fed straight from the disk image, see ds_send.
+ *
+ * @param fs Open filesystem.
+ * @param out Output stream, flushed and left open.
+ * @param simul_file Source file path from the simulated file system.
+ * @return 0 on success.
+ */
+int fs_read_stream(struct fs_handle *fs, FILE *out, char *simul_file){
+	printf("- Copying: '%s' to a stream\n", simul_file);
+
+	return read_to(fs, NULL, out, simul_file);
+}
+
+/**
+ * @brief Load the extents of a file up to the one holding a given sector.
+ *
+ * Extent tables past that one are not read, so a range near the start of a
+ * large file only costs the tables before it.
+ *
+ * @param fs Open filesystem.
+ * @param table_sector First extent table.
+ * @param last_sector Sector of the file, counted from its start, the list must reach.
+ * @param data Output list of data extents.
+ * @param offsets Output file sector where each extent starts, to be freed.
+ * @return 0 on success.
+ */
+static int load_range(struct fs_handle *fs, uint64_t table_sector, uint64_t last_sector, struct extent_list *data, uint64_t **offsets){
+	struct extent_table table;
+	uint64_t *p, pos = 0;
+	int i, size = 0;
+
+	*offsets = NULL;
+
+	while(table_sector != 0 && pos <= last_sector){
+		bc_read_sector(fs->cache, table_sector, (void*)&table);
+
+		for(i = 0; i < (int)table.count && i < TABLE_EXTENTS(fs); i++){
+			if(extent_push(data, &table.extents[i]) != 0){
+				return 1;
+			}
+			if(data->count > size){
+				size = data->size;
+				if( (p = realloc(*offsets, size * sizeof(uint64_t))) == NULL){
+					perror("realloc()");
+					return 1;
+				}
+				*offsets = p;
+			}
+			(*offsets)[data->count - 1] = pos;
+			pos += table.extents[i].length;
+		}
+
+		table_sector = table.next_table;
+	}
+
+	return pos <= last_sector;
+}
+
+/**
+ * @brief Read a byte range of a compressed file.
+ *
+ * Extent i holds chunk i, so the extent tables are only read up to the
+ * last chunk of the range, and only the chunks of the range are read. A
+ * chunk the range covers whole is decompressed straight to the buffer.
+ *
+ * @param fs Open filesystem.
+ * @param entry File entry.
+ * @param buf Output buffer, len bytes.
+ * @param offset First byte, within the file.
+ * @param len Number of bytes, within the file.
+ * @return Bytes read, -1 on error.
+ */
+static int64_t read_chunks(struct fs_handle *fs, struct file_dir_entry *entry, unsigned char *buf, uint64_t offset, uint64_t len){
+	struct extent_table table;
+	struct extent_list data = {NULL, 0, 0};
+	unsigned char *tmp = NULL;
+	uint64_t chunk = chunk_bytes(fs), table_sector = table_of(entry);
+	uint64_t c, a, n, skip, last = (offset + len - 1) / chunk, done = 0;
+	int i, whole, failed = 0;
+
+	while(table_sector != 0 && (uint64_t)data.count <= last && !failed){
+		bc_read_sector(fs->cache, table_sector, (void*)&table);
+
+		for(i = 0; i < (int)table.count && i < TABLE_EXTENTS(fs) && !failed; i++){
+			failed = extent_push(&data, &table.extents[i]) != 0;
+		}
+
+		table_sector = table.next_table;
+	}
+
+	if(failed || (uint64_t)data.count <= last || (tmp = malloc(2 * chunk)) == NULL){
+		free(data.extents);
+		return -1;
+	}
+
+	for(c = offset / chunk; c <= last && !failed; c++){
+		a = c * chunk;
+		n = entry->size_bytes - a < chunk ? entry->size_bytes - a : chunk;
+		skip = offset > a ? offset - a : 0;
+
+		whole = skip == 0 && n <= len - done;
+		failed = load_chunk(fs, &data.extents[c], n, whole ? buf + done : tmp, tmp + chunk) != 0;
+
+		n -= skip;
+		if(n > len - done){
+			n = len - done;
+		}
+		if( !whole){
+			memcpy(buf + done, tmp + skip, n);
+		}
+		done += n;
+	}
+
+	free(tmp);
+	free(data.extents);
+
+	return failed ? -1 : (int64_t)done;
+}
+
+/**
+ * @brief Read a byte range of a file of a locked directory.
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked.
+ * @param s_name File name.
+ * @param entry File entry.
+ * @param buf Output buffer, len bytes.
+ * @param offset First byte.
+ * @param len Number of bytes.
+ * @return Bytes read, short at the end of the file, -1 on error.
+ */
+static int64_t read_range(struct fs_handle *fs, uint64_t s_dir, char *s_name, struct file_dir_entry *entry, unsigned char *buf, uint64_t offset, uint64_t len){
+	struct extent_list data = {NULL, 0, 0};
+	uint64_t *offsets = NULL;
+	unsigned char *run = NULL;
+	uint64_t first, last, sector, in, count, skip, n, done = 0;
+	int lo, hi, mid, failed = 0;
+
+	if(offset >= entry->size_bytes || len == 0){
+		return 0;
+	}
+	if(len > entry->size_bytes - offset){
+		len = entry->size_bytes - offset;
+	}
+
+	if(is_small(entry)){
+		if( (run = malloc(fs->sb.sector_size)) == NULL || small_read(fs, s_dir, s_name, entry, run) != 0){
+			free(run);
+			return -1;
+		}
+		memcpy(buf, run + offset, len);
+		free(run);
+		return len;
+	}
+
+	if(is_compressed(entry)){
+		return read_chunks(fs, entry, buf, offset, len);
+	}
+
+	first = offset / fs->sb.sector_size;
+	last = (offset + len - 1) / fs->sb.sector_size;
+
+	if(load_range(fs, entry->sector_start, last, &data, &offsets) != 0 ||
+	   (run = malloc((size_t)run_sectors(fs) * fs->sb.sector_size)) == NULL){
+		free(data.extents);
+		free(offsets);
+		return -1;
+	}
+
+	/* Last extent starting at or before the first sector. */
+	for(lo = 0, hi = data.count - 1; lo < hi; ){
+		mid = (lo + hi + 1) / 2;
+		if(offsets[mid] <= first){
+			lo = mid;
+		}else{
+			hi = mid - 1;
+		}
+	}
+
+	for(sector = first; sector <= last; sector += count){
+		if(sector - offsets[lo] == data.extents[lo].length){
+			lo++;
+		}
+
+		in = sector - offsets[lo];
+		count = data.extents[lo].length - in;
+		if(count > last - sector + 1){
+			count = last - sector + 1;
+		}
+		if(count > (uint64_t)run_sectors(fs)){
+			count = run_sectors(fs);
+		}
+
+		if(ds_read_sectors(fs->dev, data.extents[lo].start + in, count, run, fs->sb.sector_size) != 0){
+			failed = 1;
+			break;
+		}
+
+		skip = sector == first ? offset % fs->sb.sector_size : 0;
+		n = count * fs->sb.sector_size - skip;
+		if(n > len - done){
+			n = len - done;
+		}
+		memcpy(buf + done, run + skip, n);
+		done += n;
+	}
+
+	free(run);
+	free(data.extents);
+	free(offsets);
+
+	return failed ? -1 : (int64_t)done;
+}
+
+/**
+ * @brief Read a byte range of a file.
+ *
+ * The extent tables are the block map of the file: they are read up to
+ * the one covering the end of the range, then the extent holding the
+ * offset is found by a binary search, so only the sectors of the range
+ * are read.
+ *
+ * @param fs Open filesystem.
+ * @param simul_file File path on the simulated file system.
+ * @param buf Output buffer, len bytes.
+ * @param offset First byte.
+ * @param len Number of bytes.
+ * @return Bytes read, short at the end of the file, -1 on error.
+ */
+int64_t fs_pread(struct fs_handle *fs, char *simul_file, void *buf, uint64_t offset, uint64_t len){
+	char s_name[PATH_MAX];
+	struct file_dir_entry entry;
+	struct os_op op;
+	uint64_t s_dir;
+	int64_t ret = -1;
+
+	os_begin(fs->stats, &op);
+
+	if(fs->legacy){
+		printf("Error: Version 1 disks can only be read whole\n");
+		os_end(fs->stats, &op, OS_READ, 1);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( (s_dir = open_parent(fs, simul_file, s_name)) != 0){
+		pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+		if(lookup(fs, s_dir, s_name, 0, &entry) != 0){
+			printf("File does not exist\n");
+		}else{
+			ret = read_range(fs, s_dir, s_name, &entry, buf, offset, len);
+		}
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	os_end(fs->stats, &op, OS_READ, ret < 0);
+
+	return ret;
+}
+
+/**
+ * @brief Grow the data sectors of a file, extending its last extent in place when the next sectors are free.
+ * @param fs Open filesystem.
+ * @param data Data extents, extended.
+ * @param n Number of sectors to add.
+ * @param changed Output first extent that changed.
+ * @return 0 on success, 1 if the disk is full (nothing is allocated).
+ */
+static int grow_extents(struct fs_handle *fs, struct extent_list *data, uint64_t n, int *changed){
+	struct extent *last = NULL;
+	uint64_t got = 0;
+
+	*changed = data->count;
+
+	if(data->count > 0){
+		last = &data->extents[data->count - 1];
+		if( (got = ba_alloc_at(fs->bitmap, last->start + last->length, n)) > 0){
+			last->length += got;
+			*changed = data->count - 1;
+		}
+	}
+
+	if(got < n && alloc_extents(fs, n - got, data) != 0){
+		if(got > 0){
+			last->length -= got;
+			ba_mark(fs->bitmap, last->start + last->length, got, 0);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write a byte range of a small file of a locked directory.
+ *
+ * A file that stays within PACK_MAX bytes is stored again whole, inline or
+ * packed. One that outgrows it is moved to extents first, and the range is
+ * left to the caller.
+ *
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked for writing.
+ * @param s_name File name.
+ * @param entry File entry, updated.
+ * @param buf Data, len bytes.
+ * @param offset First byte.
+ * @param len Number of bytes.
+ * @return 0 if written, 1 on error, 2 if moved to extents.
+ */
+static int write_small(struct fs_handle *fs, uint64_t s_dir, char *s_name, struct file_dir_entry *entry, const unsigned char *buf, uint64_t offset, uint64_t len){
+	struct file_dir_entry e = *entry;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	struct extent_list scratch = {NULL, 0, 0};
+	unsigned char *old;
+	uint64_t end = offset + len;
+	int ret = 0;
+
+	if( (old = calloc(1, fs->sb.sector_size)) == NULL){
+		perror("calloc()");
+		return 1;
+	}
+	if(small_read(fs, s_dir, s_name, entry, old) != 0){
+		free(old);
+		return 1;
+	}
+
+	if(end <= PACK_MAX(fs)){
+		memcpy(old + offset, buf, len);
+		if(end > e.size_bytes){
+			e.size_bytes = end;
+		}
+		if(small_store(fs, &e, old) != 0){
+			ret = 1;
+		}else if(dir_update(fs, s_dir, s_name, &e, e.sector_start == 0 ? old : NULL) != 0){
+			small_free(fs, &e);
+			ret = 1;
+		}
+	}else{
+		/* Outgrown, the data moves to one sector with an extent table. */
+		ret = 1;
+		if(alloc_extents(fs, e.size_bytes > 0, &data) == 0){
+			if(data.count > 0 && bc_write_through(fs->cache, data.extents[0].start, 1, old) != 0){
+				free_extents(fs, &data);
+			}else if(store_extents(fs, &data, &e.sector_start) != 0){
+				free_extents(fs, &data);
+			}else if(dir_update(fs, s_dir, s_name, &e, NULL) != 0){
+				load_extents(fs, e.sector_start, &scratch, &tables);
+				free_extents(fs, &tables);
+				free_extents(fs, &data);
+			}else{
+				ret = 2;
+			}
+		}
+	}
+
+	if(ret == 1){
+		printf("Error: Disk full\n");
+	}else{
+		small_free(fs, entry);
+		dc_add(fs->dentries, s_dir, s_name, &e);
+		*entry = e;
+	}
+
+	free(data.extents);
+	free(tables.extents);
+	free(scratch.extents);
+	free(old);
+
+	return ret;
+}
+
+/**
+ * @brief Write a byte range of a compressed file of a locked directory.
+ *
+ * Each chunk of the range is read back, changed, and compressed again to
+ * a new extent; the old extents are only freed once every new chunk is
+ * written. The extent tables are rewritten from the one holding the first
+ * chunk. A gap between the old end and the offset reads as zeros.
+ *
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked for writing.
+ * @param s_name File name.
+ * @param entry File entry, updated.
+ * @param buf Data, len bytes.
+ * @param offset First byte.
+ * @param len Number of bytes, at least one.
+ * @return Bytes written, -1 on error.
+ */
+static int64_t write_chunks(struct fs_handle *fs, uint64_t s_dir, char *s_name, struct file_dir_entry *entry, const unsigned char *buf, uint64_t offset, uint64_t len){
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	struct extent_list fresh = {NULL, 0, 0};
+	struct ds_batch batch;
+	unsigned char *raw = NULL;
+	uint64_t chunk = chunk_bytes(fs), t_sectors = 0, n_tables, table_sector;
+	uint64_t start, end, size, first, last, c, a, n, old, from, to;
+	int i, k, old_count, old_tables, ret = 0;
+
+	/* Bytes written: the range, and the zeros of a gap before it. */
+	start = offset < entry->size_bytes ? offset : entry->size_bytes;
+	end = offset + len;
+	size = end > entry->size_bytes ? end : entry->size_bytes;
+	first = start / chunk;
+	last = (end - 1) / chunk;
+
+	if(load_extents(fs, table_of(entry), &data, &tables) != 0 ||
+	   (raw = malloc(3 * chunk)) == NULL){
+		ret = 1;
+		goto out;
+	}
+
+	for(i = 0; i < tables.count; i++){
+		t_sectors += tables.extents[i].length;
+	}
+	old_count = data.count;
+	old_tables = data.count > 0 ? (data.count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs) : 1;
+
+	/* Chunks of the range, whole, to new extents. */
+	for(c = first; c <= last && ret == 0; c++){
+		a = c * chunk;
+		n = size - a < chunk ? size - a : chunk;
+		old = entry->size_bytes > a ? entry->size_bytes - a : 0;
+		if(old > chunk){
+			old = chunk;
+		}
+
+		memset(raw, 0, n);
+		if(old > 0 && (c >= (uint64_t)data.count || load_chunk(fs, &data.extents[c], old, raw, raw + chunk) != 0)){
+			ret = 1;
+			break;
+		}
+
+		from = offset > a ? offset : a;
+		to = end < a + n ? end : a + n;
+		if(from < to){
+			memcpy(raw + (from - a), buf + (from - offset), to - from);
+		}
+
+		ds_batch_init(&batch);
+		ret = store_chunk(fs, &batch, raw, n, raw + 2 * chunk, &fresh);
+		if(ds_wait(fs->dev, &batch) != 0 && ret == 0){
+			ret = 1;
+		}
+	}
+
+	/* Chunks past the end, then the table chain if the extents no longer fit. */
+	for(i = 0; ret == 0 && i < fresh.count; i++){
+		if(first + i >= (uint64_t)old_count && extent_push(&data, &fresh.extents[i]) != 0){
+			ret = 1;
+		}
+	}
+	n_tables = (data.count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs);
+	if(ret == 0 && n_tables > t_sectors && alloc_extents(fs, n_tables - t_sectors, &tables) != 0){
+		ret = 2;
+	}
+
+	if(ret){
+		printf(ret == 2 ? "Error: Disk full\n" : ret == 3 ? "Error: No free run of sectors for a compressed chunk\n" : "Error: Could not write the file data\n");
+		free_extents(fs, &fresh);
+		ret = 1;
+		goto out;
+	}
+
+	for(i = 0; i < fresh.count && first + i < (uint64_t)old_count; i++){
+		ba_mark(fs->bitmap, data.extents[first + i].start, data.extents[first + i].length, 0);
+		data.extents[first + i] = fresh.extents[i];
+	}
+
+	k = first / TABLE_EXTENTS(fs);
+	write_tables(fs, &data, &tables, k < old_tables - 1 ? k : old_tables - 1, &table_sector);
+	entry->sector_start = table_sector | FS_COMPRESSED;
+
+	if(end > entry->size_bytes){
+		entry->size_bytes = end;
+		dir_update(fs, s_dir, s_name, entry, NULL);
+		dc_add(fs->dentries, s_dir, s_name, entry);
+	}
+
+out:
+	free(raw);
+	free(data.extents);
+	free(tables.extents);
+	free(fresh.extents);
+
+	return ret ? -1 : (int64_t)len;
+}
+
+/**
+ * @brief Write a byte range of a file of a locked directory.
+ *
+ * Only the sectors of the range are written, the first and last ones read
+ * back first when they keep bytes of the file. A range past the end grows
+ * the file: the new sectors extend the last extent when they follow it,
+ * only the extent tables from the one holding the first changed extent are
+ * rewritten, and the new size goes to the directory entry. A gap between
+ * the old end and the offset reads as zeros. Small files go through
+ * write_small, compressed ones through write_chunks.
+ *
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked for writing.
+ * @param s_name File name.
+ * @param buf Data, len bytes.
+ * @param offset First byte.
+ * @param len Number of bytes.
+ * @param append 1 to write at the end of the file, offset is ignored.
+ * @return Bytes written, -1 on error.
+ */
+static int64_t write_range(struct fs_handle *fs, uint64_t s_dir, char *s_name, const unsigned char *buf, uint64_t offset, uint64_t len, int append){
+	struct file_dir_entry entry;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	unsigned char *run = NULL;
+	uint64_t ss = fs->sb.sector_size, allocated = 0, need, n_tables, t_sectors = 0;
+	uint64_t start, end, sector, last, pos, in, count, from, to, a, b;
+	int i, k, changed, old_tables, old_table_count = 0, grown = 0, failed = 0;
+
+	if(lookup(fs, s_dir, s_name, 0, &entry) != 0){
+		printf("File does not exist\n");
+		return -1;
+	}
+
+	if(append){
+		offset = entry.size_bytes;
+	}
+	if(len == 0){
+		return 0;
+	}
+
+	if(is_small(&entry) && (k = write_small(fs, s_dir, s_name, &entry, buf, offset, len)) != 2){
+		return k == 0 ? (int64_t)len : -1;
+	}
+
+	if(is_compressed(&entry)){
+		return write_chunks(fs, s_dir, s_name, &entry, buf, offset, len);
+	}
+
+	/* Bytes written: the range, and the zeros of a gap before it. */
+	start = offset < entry.size_bytes ? offset : entry.size_bytes;
+	end = offset + len;
+
+	if(load_extents(fs, entry.sector_start, &data, &tables) != 0 ||
+	   (run = malloc((size_t)run_sectors(fs) * ss)) == NULL){
+		failed = 1;
+		goto out;
+	}
+
+	for(i = 0; i < data.count; i++){
+		allocated += data.extents[i].length;
+	}
+	for(i = 0; i < tables.count; i++){
+		t_sectors += tables.extents[i].length;
+	}
+	old_tables = data.count > 0 ? (data.count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs) : 1;
+	old_table_count = tables.count;
+
+	/* Grow the data, then the table chain if the extents no longer fit. */
+	need = (end + ss - 1) / ss;
+	if(need > allocated){
+		if(grow_extents(fs, &data, need - allocated, &changed) != 0){
+			printf("Error: Disk full\n");
+			failed = 1;
+			goto out;
+		}
+		grown = 1;
+		n_tables = (data.count + TABLE_EXTENTS(fs) - 1) / TABLE_EXTENTS(fs);
+		if(n_tables > t_sectors && alloc_extents(fs, n_tables - t_sectors, &tables) != 0){
+			printf("Error: Disk full\n");
+			failed = 1;
+			goto out;
+		}
+	}
+
+	/* Sectors of the range, in runs within one extent. */
+	sector = start / ss;
+	last = (end - 1) / ss;
+	for(i = 0, pos = 0; pos + data.extents[i].length <= sector; i++){
+		pos += data.extents[i].length;
+	}
+	for(; sector <= last; sector += count){
+		if(sector - pos == data.extents[i].length){
+			pos += data.extents[i++].length;
+		}
+
+		in = sector - pos;
+		count = data.extents[i].length - in;
+		if(count > last - sector + 1){
+			count = last - sector + 1;
+		}
+		if(count > (uint64_t)run_sectors(fs)){
+			count = run_sectors(fs);
+		}
+
+		memset(run, 0, count * ss);
+
+		/* Partial sectors keep the bytes of the file around the range. */
+		a = sector * ss;
+		b = (sector + count) * ss;
+		if(start > a && ds_read_sectors(fs->dev, data.extents[i].start + in, 1, run, ss) != 0){
+			failed = 1;
+			break;
+		}
+		if(end < b && end < entry.size_bytes && (count > 1 || start <= a) &&
+		   ds_read_sectors(fs->dev, data.extents[i].start + in + count - 1, 1, run + (count - 1) * ss, ss) != 0){
+			failed = 1;
+			break;
+		}
+
+		/* The gap past the old end reads as zeros, whatever the sector held. */
+		from = start > a ? start : a;
+		to = offset < b ? offset : b;
+		if(from < to){
+			memset(run + (from - a), 0, to - from);
+		}
+
+		from = offset > a ? offset : a;
+		to = end < b ? end : b;
+		if(from < to){
+			memcpy(run + (from - a), buf + (from - offset), to - from);
+		}
+
+		if(bc_write_through(fs->cache, data.extents[i].start + in, count, (void*)run) != 0){
+			failed = 1;
+			break;
+		}
+	}
+
+	if(!failed && need > allocated){
+		k = changed / TABLE_EXTENTS(fs);
+		write_tables(fs, &data, &tables, k < old_tables - 1 ? k : old_tables - 1, &entry.sector_start);
+	}
+
+	if(!failed && end > entry.size_bytes){
+		entry.size_bytes = end;
+		dir_update(fs, s_dir, s_name, &entry, NULL);
+		dc_add(fs->dentries, s_dir, s_name, &entry);
+	}
+
+out:
+	/* A failed write gives back the sectors it added, no table refers to them. */
+	if(failed && grown){
+		for(i = 0, pos = 0; i < data.count; i++){
+			if(pos + data.extents[i].length > allocated){
+				in = allocated > pos ? allocated - pos : 0;
+				ba_mark(fs->bitmap, data.extents[i].start + in, data.extents[i].length - in, 0);
+			}
+			pos += data.extents[i].length;
+		}
+		for(i = old_table_count; i < tables.count; i++){
+			ba_mark(fs->bitmap, tables.extents[i].start, tables.extents[i].length, 0);
+		}
+	}
+
+	free(run);
+	free(data.extents);
+	free(tables.extents);
+
+	return failed ? -1 : (int64_t)len;
+}
+
+/**
+ * @brief Write a byte range of a file, found by path.
+ */
+static int64_t write_to(struct fs_handle *fs, char *simul_file, const void *buf, uint64_t offset, uint64_t len, int append){
+	char s_name[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int64_t ret = -1;
+
+	os_begin(fs->stats, &op);
+
+	if(fs->legacy){
+		printf("Error: Version 1 disks can only be written whole\n");
+		os_end(fs->stats, &op, OS_WRITE, 1);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( writable(fs) && (s_dir = open_parent(fs, simul_file, s_name)) != 0){
+		pthread_rwlock_wrlock(dir_lock(fs, s_dir));
+		ret = write_range(fs, s_dir, s_name, buf, offset, len, append);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	commit_group(fs);
+
+	os_end(fs->stats, &op, OS_WRITE, ret < 0);
+
+	return ret;
+}
+
+/**
+ * @brief Overwrite a byte range of a file, growing it past its end.
+ *
+ * Only the sectors of the range are written; growing extends the last
+ * extent in place when the sectors after it are free, and rewrites only
+ * the last extent table.
+ *
+ * @param fs Open filesystem.
+ * @param simul_file File path on the simulated file system.
+ * @param buf Data, len bytes.
+ * @param offset First byte, past the end leaves a gap of zeros.
+ * @param len Number of bytes.
+ * @return Bytes written, -1 on error.
+ */
+int64_t fs_pwrite(struct fs_handle *fs, char *simul_file, const void *buf, uint64_t offset, uint64_t len){
+	return write_to(fs, simul_file, buf, offset, len, 0);
+}
+
+/**
+ * @brief Append bytes to a file.
+ *
+ * The end of the file is taken with the directory locked, so concurrent
+ * appends do not overwrite each other.
+ *
+ * @param fs Open filesystem.
+ * @param simul_file File path on the simulated file system.
+ * @param buf Data, len bytes.
+ * @param len Number of bytes.
+ * @return Bytes written, -1 on error.
+ */
+int64_t fs_append(struct fs_handle *fs, char *simul_file, const void *buf, uint64_t len){
+	return write_to(fs, simul_file, buf, 0, len, 1);
+}
+
+/**
+ * @brief Delete a file of a locked directory.
+ * @param fs Open filesystem.
+ * @param s_dir Directory header sector, locked for writing.
+ * @param s_name File name.
+ * @return 0 on success.
+ */
+static int delete_file(struct fs_handle *fs, uint64_t s_dir, char *s_name){
+	struct file_dir_entry entry;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+
+	if(lookup(fs, s_dir, s_name, 0, &entry) != 0){
+		printf("File does not exist\n");
+		return 1;
+	}
+
+	if(is_small(&entry)){
+		small_free(fs, &entry);
+	}else if(load_extents(fs, table_of(&entry), &data, &tables) != 0){
+		free(data.extents);
+		free(tables.extents);
+		return 1;
+	}
+
+	// sectors marked free in the bitmap
+	free_extents(fs, &tables);
+	free_extents(fs, &data);
+
+	// cleaned entry
+	dir_remove(fs, s_dir, s_name);
+	dc_add(fs->dentries, s_dir, s_name, NULL);
+
+	printf("Deleted successfully\n");
+
+	free(data.extents);
+	free(tables.extents);
+
+	return 0;
+}
+
+/**
+ * @brief Delete file from file system.
+ * @param fs Open filesystem.
+ * @param simul_file Source file path.
+ * @return 0 on success.
+ */
+int fs_del(struct fs_handle *fs, char* simul_file){
+	char s_name[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int ret = 1;
+
+	printf("- Deleting: '%s' \n", simul_file);
+
+	os_begin(fs->stats, &op);
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( writable(fs) && (s_dir = open_parent(fs, simul_file, s_name)) != 0){
+		pthread_rwlock_wrlock(dir_lock(fs, s_dir));
+		ret = delete_file(fs, s_dir, s_name);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	commit_group(fs);
+
+	return os_end(fs->stats, &op, OS_DEL, ret);
+}
+
+/**
+ * @brief Print a directory entry.
+ * @param entry Entry.
+ * @param name Entry name.
+ * @param arg Not used.
+ */
+static void print_entry(struct file_dir_entry *entry, char *name, void *arg){
+	// Verify if is file or dir
+	if(entry->dir == 0){
+		printf("f %s\t%" PRIu64 " bytes\n", name, entry->size_bytes);
+	}else {
+		printf("d %s\n", name);
+	}
+}
+
+/**
+ * @brief List files from a directory.
+ * @param fs Open filesystem.
+ * @param simul_file Source file path.
+ * @return 0 on success.
+ */
+int fs_ls(struct fs_handle *fs, char *dir_path){
+	char s_path[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int64_t count = 0;
+
+	strncpy(s_path, dir_path, PATH_MAX - 1);
+	s_path[PATH_MAX - 1] = '\0';
+
+	os_begin(fs->stats, &op);
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if(fs->legacy){
+		printf("- Listing entries at: '%s'\n", dir_path);
+		count = legacy_ls(fs, s_path);
+	}else if( (s_dir = find_dir(fs, s_path)) != 0){
+		printf("- Listing entries at: '%s'\n", dir_path);
+		pthread_rwlock_rdlock(dir_lock(fs, s_dir));
+		count = dir_list(fs, s_dir, print_entry, NULL);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}else{
+		count = -1;
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	if(count < 0){
+		return os_end(fs->stats, &op, OS_LS, 1);
+	}
+
+	if(count == 0){
+		printf("This directory is empty\n");
+	}else if(count == 1){
+		printf("%" PRId64 " entry found\n", count);
+	} else{
+		printf("%" PRId64 " entries found\n", count);
+	}
+
+	return os_end(fs->stats, &op, OS_LS, 0);
+}
+
+/**
+ * @brief Create a directory in a locked directory.
+ * @param fs Open filesystem.
+ * @param s_dir Parent directory header sector, locked for writing.
+ * @param s_name Directory name.
+ * @return 0 on success.
+ */
+static int make_dir(struct fs_handle *fs, uint64_t s_dir, char *s_name){
+	struct file_dir_entry entry;
+	struct dir_header table_dir;
+	uint64_t sector_number;
+
+	if(lookup(fs, s_dir, s_name, -1, NULL) == 0){
+		printf("Directory already exists\n");
+		return 1;
+	}
+
+	if(ba_alloc_run(fs->bitmap, 1, &sector_number) == 0){
+		printf("Error: Disk full\n");
+		return 1;
+	}
+
+	// write dir, a zeroed header is an empty directory
+	memset(&table_dir, 0, fs->sb.sector_size);
+	bc_write_sector(fs->cache, sector_number, (void*)&table_dir);
+
+	// set entry dir
+	entry.dir = 1;
+	entry.sector_start = sector_number;
+	entry.size_bytes = 0;
+	if(dir_insert(fs, s_dir, s_name, &entry, NULL) != 0){
+		printf("Error: Disk full\n");
+		ba_mark(fs->bitmap, sector_number, 1, 0);
+		return 1;
+	}
+	dc_add(fs->dentries, s_dir, s_name, &entry);
+
+	printf("Directory created successfully\n");
+
+	return 0;
+}
+
+/**
+ * @brief Create a new directory on the simulated filesystem.
+ * @param fs Open filesystem.
+ * @param directory_path directory path.
+ * @return 0 on success.
+ */
+int fs_mkdir(struct fs_handle *fs, char* directory_path){
+	char s_name[PATH_MAX];
+	struct os_op op;
+	uint64_t s_dir;
+	int ret = 1;
+
+	printf("- Creating directory: '%s' \n", directory_path);
+
+	os_begin(fs->stats, &op);
+	pthread_rwlock_rdlock(&fs->ns_lock);
+
+	if( writable(fs) && (s_dir = open_parent(fs, directory_path, s_name)) != 0){
+		pthread_rwlock_wrlock(dir_lock(fs, s_dir));
+		ret = make_dir(fs, s_dir, s_name);
+		pthread_rwlock_unlock(dir_lock(fs, s_dir));
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	commit_group(fs);
+
+	return os_end(fs->stats, &op, OS_MKDIR, ret);
+}
+
+/**
+ * @brief Remove a directory, with every other operation locked out.
+ * @param fs Open filesystem.
+ * @param dir_path directory path.
+ * @return 0 on success.
+ */
+static int remove_dir(struct fs_handle *fs, char *dir_path){
+	char s_name[PATH_MAX];
+	uint64_t s_dir;
+	struct file_dir_entry entry;
+
+	if( !writable(fs) || (s_dir = open_parent(fs, dir_path, s_name)) == 0){
+		return 1;
+	}
+
+	if(strcmp(s_name, "/") == 0){
+		printf("ERROR: You cannot remove root dir.\n");
+		return 1;
+	}
+
+	if(lookup(fs, s_dir, s_name, 1, &entry) != 0){
+		printf("Error: The path doesn't exist\n");
+		return 1;
+	}
+
+	if(dir_entries(fs, entry.sector_start) != 0){
+		printf("Error: Directory is not empty\n");
+		return 1;
+	}
+
+	// remove reference from parent dir
+	dir_remove(fs, s_dir, s_name);
+	dc_add(fs->dentries, s_dir, s_name, NULL);
+
+	dir_free(fs, entry.sector_start);
+	dc_purge(fs->dentries, entry.sector_start);
+
+	printf("Directory was successfully removed\n");
+
+	return 0;
+}
+
+/**
+ * @brief Remove directory from the simulated filesystem.
+ *
+ * Other operations hold the directories of their path, so removing one
+ * waits for all of them to finish.
+ *
+ * @param fs Open filesystem.
+ * @param directory_path directory path.
+ * @return 0 on success.
+ */
+int fs_rmdir(struct fs_handle *fs, char *dir_path){
+	struct os_op op;
+	int ret;
+
+	os_begin(fs->stats, &op);
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	ret = remove_dir(fs, dir_path);
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	commit_group(fs);
+
+	return os_end(fs->stats, &op, OS_RMDIR, ret);
+}
+
+/**
+ * Sector map being built, see map_walk.
+ */
+struct map_walk{
+	struct fs_handle *fs;		/**< Open filesystem. */
+	struct fs_frag *frag;		/**< File counts, updated. */
+	uint32_t *meta;			/**< Metadata sectors of each cell, NULL when only counting. */
+	uint64_t per_cell;		/**< Sectors per cell. */
+	uint64_t *dirs;			/**< Directories left to walk, so deep trees do not recurse. */
+	uint64_t n_dirs;		/**< Directories in dirs. */
+	uint64_t size;			/**< Directories allocated. */
+	int failed;			/**< An extent table could not be loaded, or out of memory. */
+};
+
+static void map_meta(struct map_walk *m, uint64_t start, uint64_t length){
+	uint64_t s;
+
+	if(m->meta == NULL){
+		return;
+	}
+
+	for(s = start; s < start + length && s < m->fs->sb.number_of_sectors; s++){
+		m->meta[s / m->per_cell]++;
+	}
+}
+
+static void map_sector(uint64_t sector_number, void *arg){
+	map_meta(arg, sector_number, 1);
+}
+
+/**
+ * @brief Queue a directory to walk.
+ * @param m Walk.
+ * @param dir_sector Directory header sector.
+ */
+static void map_push(struct map_walk *m, uint64_t dir_sector){
+	uint64_t *dirs;
+
+	if(m->n_dirs == m->size){
+		m->size = m->size ? m->size * 2 : 64;
+		if( (dirs = realloc(m->dirs, m->size * sizeof(uint64_t))) == NULL){
+			perror("realloc()");
+			m->failed = 1;
+			return;
+		}
+		m->dirs = dirs;
+	}
+
+	m->dirs[m->n_dirs++] = dir_sector;
+}
+
+static void map_entry(struct file_dir_entry *entry, char *name, void *arg){
+	struct map_walk *m = arg;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	int i;
+
+	if(entry->dir){
+		map_push(m, entry->sector_start);
+		return;
+	}
+
+	/* A small file is in one piece, its pack sector is data. */
+	if(is_small(entry)){
+		m->frag->files++;
+		m->frag->extents++;
+		return;
+	}
+
+	if(load_extents(m->fs, table_of(entry), &data, &tables) != 0){
+		m->failed = 1;
+	}else{
+		for(i = 0; i < tables.count; i++){
+			map_meta(m, tables.extents[i].start, tables.extents[i].length);
+		}
+		m->frag->files++;
+		m->frag->extents += pieces(&data);
+		m->frag->fragmented_files += pieces(&data) > 1;
+	}
+
+	free(data.extents);
+	free(tables.extents);
+}
+
+/**
+ * @brief Walk the metadata of a version 2 disk.
+ *
+ * Counts the files and their extents, and the metadata sectors of each
+ * map cell: superblock, bitmap, journal, directory tables and extent
+ * tables. Every other used sector holds file data.
+ *
+ * @param fs Open filesystem, with ns_lock held.
+ * @param frag Output counts.
+ * @param meta Metadata sectors per cell, zeroed, NULL to count the files only.
+ * @param per_cell Sectors per cell.
+ * @return 0 on success.
+ */
+static int map_walk(struct fs_handle *fs, struct fs_frag *frag, uint32_t *meta, uint64_t per_cell){
+	struct map_walk m = {fs, frag, meta, per_cell, NULL, 0, 0, 0};
+	uint64_t dir_sector;
+
+	memset(frag, 0, sizeof(struct fs_frag));
+
+	map_meta(&m, 0, 1);
+	map_meta(&m, fs->sb.bitmap_start, fs->sb.bitmap_sectors);
+	map_meta(&m, fs->sb.journal_start, fs->sb.journal_sectors);
+
+	/* Directories are walked as they are found, from a list rather than recursively. */
+	map_push(&m, fs->sb.root_sector);
+	while(m.n_dirs > 0 && !m.failed){
+		dir_sector = m.dirs[--m.n_dirs];
+		dir_sectors(fs, dir_sector, map_sector, &m);
+		dir_list(fs, dir_sector, map_entry, &m);
+	}
+	free(m.dirs);
+
+	frag->free_sectors = ba_free_count(fs->bitmap);
+	frag->free_runs = ba_free_runs(fs->bitmap);
+	frag->largest_free_run = ba_largest_free_run(fs->bitmap);
+
+	/* Extents beyond one per file, and free space outside the largest run. */
+	frag->file_score = frag->extents ? 100.0 * (frag->extents - frag->files) / frag->extents : 0;
+	frag->free_score = frag->free_sectors ? 100.0 * (frag->free_sectors - frag->largest_free_run) / frag->free_sectors : 0;
+
+	return m.failed;
+}
+
+/**
+ * @brief Measure the fragmentation of the files and of the free space.
+ *
+ * The file score is the share of extents beyond one per file, the free
+ * space score the share of free sectors outside the largest free run.
+ * Both are 0 on a disk with no fragmentation.
+ *
+ * @param fs Open filesystem.
+ * @param frag Output measures.
+ * @return 0 on success.
+ */
+int fs_fragmentation(struct fs_handle *fs, struct fs_frag *frag){
+	int ret;
+
+	if(fs->legacy){
+		return 1;
+	}
+
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	ret = map_walk(fs, frag, NULL, 1);
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	return ret;
+}
+
+/**
+ * @brief Draw a map of the free, data and metadata sectors and report the fragmentation.
+ *
+ * Disks with more than MAP_MAX_CELLS sectors are scaled down: a cell is
+ * free when all its sectors are free, partial when only some are, and
+ * metadata when most of its used sectors are.
+ *
+ * @param fs Open filesystem.
+ * @param image Output image, PGM if it ends with ".pgm", PNG otherwise.
+ * @return 0 on success.
+ */
+int fs_free_map(struct fs_handle *fs, char *image){
+	uint64_t i, per_cell, cells, used, length;
+	unsigned char *cell;
+	uint32_t *meta;
+	struct fs_frag frag;
+	char *free_array;
+	int ret = 0;
+
+	per_cell = (fs->sb.number_of_sectors + MAP_MAX_CELLS - 1) / MAP_MAX_CELLS;
+	cells = (fs->sb.number_of_sectors + per_cell - 1) / per_cell;
+
+	cell = malloc(cells);
+	meta = calloc(cells, sizeof(uint32_t));
+	if(cell == NULL || meta == NULL){
+		perror("malloc()");
+		free(cell);
+		free(meta);
+		return 1;
+	}
+
+	pthread_rwlock_wrlock(&fs->ns_lock);
+
+	if(fs->legacy){
+		/* One cell per sector, the free ones are set by the free list walk. */
+		memset(&frag, 0, sizeof(frag));
+		free_array = (char*)meta;
+		memset(free_array, 0, cells);
+		frag.free_sectors = legacy_free_map(fs, free_array);
+
+		for(i = 0, length = 0; i < cells; i++){
+			cell[i] = free_array[i] ? SM_FREE : i == 0 ? SM_META : SM_DATA;
+			length = free_array[i] ? length + 1 : 0;
+			frag.free_runs += length == 1;
+			if(length > frag.largest_free_run){
+				frag.largest_free_run = length;
+			}
+		}
+		frag.free_score = frag.free_sectors ? 100.0 * (frag.free_sectors - frag.largest_free_run) / frag.free_sectors : 0;
+	}else{
+		ret = map_walk(fs, &frag, meta, per_cell);
+
+		for(i = 0; i < cells; i++){
+			length = i == cells - 1 ? fs->sb.number_of_sectors - i * per_cell : per_cell;
+			used = ba_count_used(fs->bitmap, i * per_cell, length);
+
+			if(used == 0){
+				cell[i] = SM_FREE;
+			}else if(meta[i] * 2 >= used){
+				cell[i] = SM_META;
+			}else{
+				cell[i] = used == length ? SM_DATA : SM_PARTIAL;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	ret |= sm_write(image, cell, cells);
+
+	printf("Sector map: %" PRIu64 " cells of %" PRIu64 " sectors in '%s'\n", cells, per_cell, image);
+	if( !fs->legacy){
+		printf("Files: %" PRIu64 ", %" PRIu64 " extents, %" PRIu64 " fragmented\n", frag.files, frag.extents, frag.fragmented_files);
+	}
+	printf("Largest free run %" PRIu64 " sectors, %" PRIu64 " free runs.\n", frag.largest_free_run, frag.free_runs);
+	printf("Fragmentation score: files %.1f%%, free space %.1f%%\n", frag.file_score, frag.free_score);
+	printf("Free space %" PRIu64 " kbytes.\n", frag.free_sectors * fs->sb.sector_size / 1024);
+
+	free(cell);
+	free(meta);
+
+	return ret;
+}
+
+/**
+ * Entry seen by the defragmenter, see defrag_collect.
+ */
+struct defrag_item{
+	uint64_t parent;		/**< Parent directory header sector, 0 for the root. */
+	uint64_t sector_start;		/**< Extent table or directory header when it was seen. */
+	int dir;			/**< 1 for a directory. */
+	char *name;			/**< Entry name, NULL for the root. */
+};
+
+/**
+ * Entries of the whole tree, see defrag_collect.
+ */
+struct defrag_list{
+	struct defrag_item *items;	/**< Entries, directories before their contents. */
+	uint64_t count;			/**< Entries used. */
+	uint64_t size;			/**< Entries allocated. */
+	uint64_t parent;		/**< Directory being listed. */
+	int failed;			/**< Out of memory. */
+};
+
+static int defrag_push(struct defrag_list *list, uint64_t parent, uint64_t sector_start, int dir, char *name){
+	struct defrag_item *items;
+
+	if(list->count == list->size){
+		list->size = list->size ? list->size * 2 : 64;
+		if( (items = realloc(list->items, list->size * sizeof(struct defrag_item))) == NULL){
+			perror("realloc()");
+			return 1;
+		}
+		list->items = items;
+	}
+
+	list->items[list->count].parent = parent;
+	list->items[list->count].sector_start = sector_start;
+	list->items[list->count].dir = dir;
+	list->items[list->count].name = NULL;
+
+	if(name != NULL && (list->items[list->count].name = strdup(name)) == NULL){
+		perror("strdup()");
+		return 1;
+	}
+	list->count++;
+
+	return 0;
+}
+
+static void defrag_entry(struct file_dir_entry *entry, char *name, void *arg){
+	struct defrag_list *list = arg;
+
+	/* Small files have no extents to move. */
+	if( !list->failed && !is_small(entry)){
+		list->failed = defrag_push(list, list->parent, entry->sector_start, entry->dir, name);
+	}
+}
+
+/**
+ * @brief List every file and directory of the disk.
+ * @param fs Open filesystem, ns_lock held.
+ * @param list Output entries, the root first.
+ * @return 0 on success.
+ */
+static int defrag_collect(struct fs_handle *fs, struct defrag_list *list){
+	uint64_t i;
+
+	if(defrag_push(list, 0, fs->sb.root_sector, 1, NULL) != 0){
+		return 1;
+	}
+
+	/* Directories are listed as they are reached, the list grows behind them. */
+	for(i = 0; i < list->count && !list->failed; i++){
+		if( !list->items[i].dir){
+			continue;
+		}
+		list->parent = list->items[i].sector_start;
+		pthread_rwlock_rdlock(dir_lock(fs, list->parent));
+		dir_list(fs, list->parent, defrag_entry, list);
+		pthread_rwlock_unlock(dir_lock(fs, list->parent));
+	}
+
+	return list->failed;
+}
+
+static int defrag_order(const void *a, const void *b){
+	const struct defrag_item *x = a, *y = b;
+	uint64_t s = x->sector_start & ~FS_COMPRESSED, t = y->sector_start & ~FS_COMPRESSED;
+
+	return s < t ? -1 : s > t;
+}
+
+static void defrag_release(uint64_t sector_number, void *arg){
+	extent_add(arg, sector_number);
+}
+
+/**
+ * @brief Move the data and extent tables of a file to one run of sectors.
+ *
+ * Files split in several extents, or with their tables apart from their
+ * data, are moved to the first free run that holds them. The others are
+ * only moved when that run is lower on the disk, which packs the files
+ * towards the start and leaves the free space in one run at the end. The
+ * chunks of a compressed file keep an extent each, one after the other.
+ *
+ * @param fs Open filesystem.
+ * @param item File, its parent locked for writing.
+ * @param old Sectors given up, appended. The caller frees them once the move is committed.
+ * @return Number of sectors moved, 0 if the file stays, -1 on error.
+ */
+static int64_t defrag_file(struct fs_handle *fs, struct defrag_item *item, struct extent_list *old){
+	struct file_dir_entry entry;
+	struct extent_list data = {NULL, 0, 0};
+	struct extent_list tables = {NULL, 0, 0};
+	struct extent_list new_data = {NULL, 0, 0};
+	struct extent_list new_tables = {NULL, 0, 0};
+	struct extent ext;
+	unsigned char *buf = NULL;
+	uint64_t n_data = 0, n_tables = 0, lowest, start, got, off, count, dest, table_sector;
+	int64_t moved = 0;
+	int i, in_place, failed = 0;
+
+	/* Deleted or replaced since it was listed. */
+	if(lookup(fs, item->parent, item->name, 0, &entry) != 0 || entry.sector_start != item->sector_start){
+		return 0;
+	}
+
+	if(load_extents(fs, table_of(&entry), &data, &tables) != 0 || tables.count == 0){
+		moved = -1;
+		goto out;
+	}
+
+	for(i = 0; i < data.count; i++){
+		n_data += data.extents[i].length;
+	}
+	for(i = 0; i < tables.count; i++){
+		n_tables += tables.extents[i].length;
+	}
+
+	lowest = tables.extents[0].start;
+	if(data.count > 0 && data.extents[0].start < lowest){
+		lowest = data.extents[0].start;
+	}
+
+	/* One data extent with the tables right before or after it. */
+	in_place = tables.count == 1 && pieces(&data) <= 1 && (data.count == 0 ||
+		data.extents[0].start + n_data == tables.extents[0].start ||
+		tables.extents[0].start + n_tables == data.extents[0].start);
+
+	if( (got = ba_alloc_run(fs->bitmap, n_data + n_tables, &start)) != n_data + n_tables || (in_place && start >= lowest)){
+		if(got > 0){
+			ba_mark(fs->bitmap, start, got, 0);
+		}
+		goto out;
+	}
+
+	/* Data first, then the tables, like a new file. */
+	if( (buf = malloc((size_t)run_sectors(fs) * fs->sb.sector_size)) == NULL){
+		perror("malloc()");
+		ba_mark(fs->bitmap, start, got, 0);
+		moved = -1;
+		goto out;
+	}
+
+	dest = start;
+	for(i = 0; i < data.count; i++){
+		for(off = 0; off < data.extents[i].length; off += count){
+			count = data.extents[i].length - off;
+			if(count > (uint64_t)run_sectors(fs)){
+				count = run_sectors(fs);
+			}
+			if(ds_read_sectors(fs->dev, data.extents[i].start + off, count, buf, fs->sb.sector_size) != 0 ||
+			   bc_write_through(fs->cache, dest, count, buf) != 0){
+				printf("Error: Could not move '%s'\n", item->name);
+				ba_mark(fs->bitmap, start, got, 0);
+				moved = -1;
+				goto out;
+			}
+			dest += count;
+		}
+	}
+
+	ext.start = start;
+	ext.length = n_data;
+	for(i = 0; is_compressed(&entry) && i < data.count && !failed; ext.start += ext.length, i++){
+		ext.length = data.extents[i].length;
+		failed = extent_push(&new_data, &ext) != 0;
+	}
+	/* Room for the old extents too, they must be given up once the move is done. */
+	if(failed || (!is_compressed(&entry) && n_data > 0 && extent_push(&new_data, &ext) != 0) ||
+	   (ext.start = start + n_data, ext.length = n_tables, extent_push(&new_tables, &ext) != 0) ||
+	   extent_reserve(old, data.count + tables.count) != 0){
+		ba_mark(fs->bitmap, start, got, 0);
+		moved = -1;
+		goto out;
+	}
+
+	write_tables(fs, &new_data, &new_tables, 0, &table_sector);
+	entry.sector_start = is_compressed(&entry) ? table_sector | FS_COMPRESSED : table_sector;
+	dir_update(fs, item->parent, item->name, &entry, NULL);
+	dc_add(fs->dentries, item->parent, item->name, &entry);
+	item->sector_start = entry.sector_start;
+
+	for(i = 0; i < data.count; i++){
+		extent_push(old, &data.extents[i]);
+	}
+	for(i = 0; i < tables.count; i++){
+		extent_push(old, &tables.extents[i]);
+	}
+	moved = n_data + n_tables;
+
+out:
+	free(buf);
+	free(data.extents);
+	free(tables.extents);
+	free(new_data.extents);
+	free(new_tables.extents);
+
+	return moved;
+}
+
+/**
+ * @brief Move the index and bucket sectors of a directory to one run of sectors.
+ * @param fs Open filesystem.
+ * @param item Directory.
+ * @param old Sectors given up, appended.
+ * @return Number of sectors moved.
+ */
+static int64_t defrag_dir(struct fs_handle *fs, struct defrag_item *item, struct extent_list *old){
+	struct file_dir_entry entry;
+	int64_t moved;
+	int ret = 0;
+
+	/* Removed since it was listed, the root always stays. */
+	if(item->parent != 0){
+		pthread_rwlock_rdlock(dir_lock(fs, item->parent));
+		ret = lookup(fs, item->parent, item->name, 1, &entry) != 0 || entry.sector_start != item->sector_start;
+		pthread_rwlock_unlock(dir_lock(fs, item->parent));
+	}
+
+	if(ret){
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(dir_lock(fs, item->sector_start));
+	moved = dir_compact(fs, item->sector_start, defrag_release, old);
+	pthread_rwlock_unlock(dir_lock(fs, item->sector_start));
+
+	return moved;
+}
+
+static void print_frag(char *label, struct fs_frag *frag){
+	printf("%s: files %.1f%% (%" PRIu64 " extents for %" PRIu64 " files), free space %.1f%% (%" PRIu64 " free runs, largest %" PRIu64 " sectors)\n",
+		label, frag->file_score, frag->extents, frag->files, frag->free_score, frag->free_runs, frag->largest_free_run);
+}
+
+/**
+ * @brief Move files and directories to contiguous runs and pack them towards the start of the disk.
+ *
+ * Runs alongside the other operations: entries are moved one at a time,
+ * each with its parent directory locked, in disk order. A second pass
+ * takes the files that only fit once the first one has packed the others.
+ * Every move is committed before the sectors it gave up are freed, so a
+ * crash leaves the file at its old place or its new one. A budget stops
+ * the run between two moves; the next run starts over and skips what is
+ * already in place.
+ *
+ * @param fs Open filesystem.
+ * @param seconds Time budget, 0 for none.
+ * @param max_sectors Budget of sectors moved, 0 for none.
+ * @return 0 on success.
+ */
+int fs_defrag(struct fs_handle *fs, double seconds, uint64_t max_sectors){
+	struct defrag_list list = {NULL, 0, 0, 0, 0};
+	struct extent_list old = {NULL, 0, 0};
+	struct fs_frag before, after;
+	struct defrag_item *item;
+	unsigned long start = os_clock();
+	uint64_t i, sectors = 0, files = 0, dirs = 0;
+	int64_t moved, moved_pass = 0;
+	int pass, ret = 0;
+
+	if( !writable(fs)){
+		return 1;
+	}
+
+	printf("- Defragmenting\n");
+
+	ret |= fs_fragmentation(fs, &before);
+
+	pthread_rwlock_rdlock(&fs->ns_lock);
+	ret |= defrag_collect(fs, &list);
+	pthread_rwlock_unlock(&fs->ns_lock);
+
+	qsort(list.items, list.count, sizeof(struct defrag_item), defrag_order);
+
+	/* A file with no run large enough the first time may find one once the others are packed. */
+	for(pass = 0; pass < DEFRAG_PASSES && (pass == 0 || moved_pass > 0); pass++){
+		moved_pass = 0;
+
+		for(i = 0; i < list.count && !ret; i++){
+			if((max_sectors > 0 && sectors >= max_sectors) || (seconds > 0 && (os_clock() - start) / 1e9 >= seconds)){
+				break;
+			}
+
+			item = &list.items[i];
+
+			pthread_rwlock_rdlock(&fs->ns_lock);
+			if(item->dir){
+				moved = defrag_dir(fs, item, &old);
+			}else{
+				pthread_rwlock_wrlock(dir_lock(fs, item->parent));
+				moved = defrag_file(fs, item, &old);
+				pthread_rwlock_unlock(dir_lock(fs, item->parent));
+			}
+			pthread_rwlock_unlock(&fs->ns_lock);
+
+			if(moved < 0){
+				ret = 1;
+			}else if(moved > 0){
+				sectors += moved;
+				moved_pass += moved;
+				files += !item->dir;
+				dirs += item->dir;
+
+				/* The new place is on the disk, the old one can be reused. */
+				ret |= fs_sync(fs);
+				free_extents(fs, &old);
+			}
+		}
+
+		if(i < list.count){
+			break;
+		}
+	}
+
+	ret |= fs_sync(fs);
+	ret |= fs_fragmentation(fs, &after);
+
+	printf("Moved %" PRIu64 " files and %" PRIu64 " directories, %" PRIu64 " sectors in %.3f s", files, dirs, sectors, (os_clock() - start) / 1e9);
+	if(i < list.count && !ret){
+		printf(", stopped by the budget with %" PRIu64 " entries left", list.count - i);
+	}
+	printf("\n");
+	print_frag("Before", &before);
+	print_frag("After", &after);
+
+	for(i = 0; i < list.count; i++){
+		free(list.items[i].name);
+	}
+	free(list.items);
+	free(old.extents);
 
+	return ret;
+}
@@ -1,52 +1,192 @@
-#define SECTOR_SIZE		512
-#define NUMBER_OF_SECTORS	2048
-#define FILENAME 		"simul.fs"
+#include <stdio.h>
+#include <stdint.h>
 
+#define DEFAULT_SECTOR_SIZE		512
+#define DEFAULT_NUMBER_OF_SECTORS	2048
+#define MIN_SECTOR_SIZE			512
+#define MAX_SECTOR_SIZE			65536
+#define FILENAME 			"simul.fs"
 
-/* Filesystem structures. */
+#define FS_MAGIC		0x32534653	/* "SFS2" */
+#define FS_VERSION		2
+
+
+/* Filesystem structures. Sector numbers and sizes are 64 bits wide. */
+
+/* Longest file or directory name. */
+#define DIR_NAME_MAX		255
+
+/* Largest file kept inline, in its directory record after the name. */
+#define FS_INLINE_MAX(sector_size)	((sector_size) / 8)
+
+/* Flag of a file packed in a shared sector, see struct pack_sector. */
+#define FS_PACKED		((uint64_t)1 << 63)
+
+/* Flag of a compressed file, the other bits are its extent table. */
+#define FS_COMPRESSED		((uint64_t)1 << 62)
+
+/* Superblock flags. */
+#define FS_FLAG_COMPRESS	1	/**< New files are compressed. */
 
 /**
- * File or directory entry. 
+ * File or directory entry.
+ * Variable length record in a directory bucket, followed by the name.
+ * Files up to FS_INLINE_MAX bytes have sector_start 0 and their data after
+ * the name. Other files up to a pack sector have FS_PACKED set in
+ * sector_start, the other bits are the byte address of their data.
+ * Compressed files have FS_COMPRESSED set, see struct extent_table.
  */
 struct file_dir_entry{
-	unsigned int dir; 		/**< File or directory representation. Use 1 for directory 0 for file. */
-	char name[20]; 			/**< File or directorty name. */
-	unsigned int size_bytes; 	/**< Size of the file in bytes. Use 0 for directories. */
-	unsigned int sector_start;	/**< Initial sector of the file ou sector of the directory table. */
+	uint64_t sector_start;		/**< Extent table of the file, or sector of the directory header. */
+	uint64_t size_bytes; 		/**< Size of the file in bytes. Use 0 for directories. */
+	uint32_t hash;			/**< Hash of the name. */
+	uint16_t rec_len;		/**< Record length, name included, a multiple of 8 bytes. */
+	uint8_t dir; 			/**< File or directory representation. Use 1 for directory 0 for file. */
+	uint8_t name_len;		/**< Name length, without terminator. */
+	char name[];			/**< File or directory name, not terminated. */
+};
+
+/**
+ * Superblock.
+ * Written to the first MIN_SECTOR_SIZE bytes of sector 0, so it can be read
+ * before the sector size is known. Images without FS_MAGIC use the version 1
+ * layout (see fs_legacy.h).
+ */
+struct superblock{
+	uint32_t magic;			/**< FS_MAGIC. */
+	uint32_t version;		/**< On-disk format version. */
+	uint32_t sector_size;		/**< Sector size in bytes, a power of two. */
+	uint32_t flags;			/**< FS_FLAG_COMPRESS. */
+	uint64_t number_of_sectors;	/**< Total number of sectors. */
+	uint64_t bitmap_start;		/**< First sector of the allocation bitmap. */
+	uint64_t bitmap_sectors;	/**< Number of bitmap sectors, one bit per sector. */
+	uint64_t root_sector;		/**< Sector of the root directory table. */
+	uint64_t free_sectors;		/**< Free sectors when the disk was last written. */
+	uint64_t high_water;		/**< First sector never allocated, the bitmap past it is not initialised. */
+	uint64_t journal_start;		/**< First sector of the metadata journal (see journal.h). */
+	uint64_t journal_sectors;	/**< Sectors of the journal, 0 if the disk has none. */
+	uint64_t pack_sector;		/**< Pack sector new small files go to, 0 for none yet. */
+	unsigned char not_used[424];	/**< Reserved, not used. */
+};
+
+/**
+ * Directory header.
+ * A directory is a linear hash table of buckets. There are 2^level + split
+ * buckets: a name goes to bucket hash % 2^level, or hash % 2^(level+1) when
+ * that is below split. Bucket head sectors are listed in index sectors.
+ * A zeroed sector is an empty directory.
+ */
+struct dir_header{
+	uint32_t level;			/**< Hash bits in use. */
+	uint32_t not_used;		/**< Reserved, not used. */
+	uint64_t split;			/**< Next bucket to split. */
+	uint64_t entries;		/**< Number of entries. */
+	uint64_t index[(MAX_SECTOR_SIZE - 24) / sizeof(uint64_t)];	/**< Index sectors, 0 if not allocated yet. */
+};
+
+/**
+ * Directory index sector. Head sector of each bucket, 0 for an empty bucket.
+ */
+struct dir_index{
+	uint64_t buckets[MAX_SECTOR_SIZE / sizeof(uint64_t)];	/**< Bucket head sectors. */
+};
+
+/**
+ * Directory bucket sector. Buckets that outgrow a sector are chained.
+ */
+struct dir_bucket{
+	uint64_t next;			/**< Next sector of the bucket. Use 0 if it is the last one. */
+	uint32_t used;			/**< Bytes of records. */
+	uint32_t count;			/**< Number of records. */
+	unsigned char records[MAX_SECTOR_SIZE - 16];	/**< file_dir_entry records. */
 };
 
 /**
- * Root directory table.
- * First directory table of the file system. Should be written to the sector 0.
+ * Run of contiguous data sectors.
  */
-struct root_table_directory{
-	unsigned int free_sectors_list;		/**< First free sector. */
-	struct file_dir_entry entries[15];	/**< List of file or directories. */
-	unsigned char not_used[28];		/**< Reserved, not used. */	
+struct extent{
+	uint64_t start;			/**< First sector of the run. */
+	uint64_t length;		/**< Number of sectors. */
 };
 
 /**
- * Subdirectories file table.
+ * File extent table.
+ * Lists the data sectors of a file, in file order. Data sectors hold a full
+ * sector of the file each. Sized for the largest sector, a disk uses as
+ * many extents as fit in its sector size.
+ *
+ * A compressed file has one extent per chunk of the file (see
+ * fs_set_compression): the chunk compressed with lz_compress and padded to
+ * a sector, or as is when that would not save a sector.
  */
-struct table_directory{
-	struct file_dir_entry entries[16]; 	/**< List of file or directories. */
+struct extent_table{
+	uint64_t next_table;		/**< Next extent table. Use 0 if it is the last one. */
+	uint32_t count;			/**< Extents used in this table. */
+	uint32_t not_used;		/**< Reserved, not used. */
+	struct extent extents[(MAX_SECTOR_SIZE - 16) / sizeof(struct extent)];	/**< File extents. */
 };
 
+
 /**
- * Sector data.
+ * Pack sector.
+ * Holds the data of small files, one after the other; a file never spans
+ * two pack sectors. Space is only taken at the end, the sector is freed
+ * when the last of its files goes.
  */
-struct sector_data{
-	unsigned char data[508];	/**< File data. */
-	unsigned int next_sector;	/**< Next sector. Use 0 if it is the last sector. */
+struct pack_sector{
+	uint32_t used;			/**< Bytes of data taken. */
+	uint32_t live;			/**< Bytes of data of files still there. */
+	unsigned char data[MAX_SECTOR_SIZE - 8];	/**< File data. */
 };
 
 
-int fs_format();
-int fs_create(char* input_file, char* simul_file);
-int fs_read(char* output_file, char* simul_file);
-int fs_del(char* simul_file);
-int fs_ls(char *dir_path);
-int fs_mkdir(char* directory_path);
-int fs_rmdir(char *directory_path);
-int fs_free_map(char *log_f);
+/**
+ * Fragmentation of a disk, see fs_fragmentation.
+ */
+struct fs_frag{
+	uint64_t files;			/**< Files. */
+	uint64_t extents;		/**< Data extents of all the files. */
+	uint64_t fragmented_files;	/**< Files with more than one extent. */
+	uint64_t free_sectors;		/**< Free sectors. */
+	uint64_t free_runs;		/**< Runs of contiguous free sectors. */
+	uint64_t largest_free_run;	/**< Longest free run, in sectors. */
+	double file_score;		/**< Percent of the extents beyond one per file. */
+	double free_score;		/**< Percent of the free sectors outside the largest run. */
+};
+
+/* Open disk image, see fs_open. */
+struct fs_handle;
+struct bc_stats;
+struct dc_stats;
+struct ds_stats;
+struct ds_model;
+struct os_stats;
 
+int fs_format(char *image, int sector_size, uint64_t number_of_sectors);
+struct fs_handle *fs_open(char *image, int backend);
+int fs_close(struct fs_handle *fs);
+int fs_sync(struct fs_handle *fs);
+void fs_get_stats(struct fs_handle *fs, struct bc_stats *cache, struct dc_stats *dentries);
+void fs_get_io_stats(struct fs_handle *fs, struct ds_stats *io);
+int fs_sector_size(struct fs_handle *fs);
+void fs_set_model(struct fs_handle *fs, struct ds_model *model, int scheduler);
+void fs_set_compression(struct fs_handle *fs, int on, int save);
+int fs_enable_stats(struct fs_handle *fs);
+int fs_get_op_stats(struct fs_handle *fs, struct os_stats *stats);
+void fs_reset_stats(struct fs_handle *fs);
+int fs_create(struct fs_handle *fs, char* input_file, char* simul_file);
+int fs_create_stream(struct fs_handle *fs, FILE *input, char *simul_file);
+int fs_read(struct fs_handle *fs, char* output_file, char* simul_file);
+int fs_read_stream(struct fs_handle *fs, FILE *out, char *simul_file);
+int64_t fs_pread(struct fs_handle *fs, char *simul_file, void *buf, uint64_t offset, uint64_t len);
+int64_t fs_pwrite(struct fs_handle *fs, char *simul_file, const void *buf, uint64_t offset, uint64_t len);
+int64_t fs_append(struct fs_handle *fs, char *simul_file, const void *buf, uint64_t len);
+int fs_del(struct fs_handle *fs, char* simul_file);
+int fs_ls(struct fs_handle *fs, char *dir_path);
+int fs_mkdir(struct fs_handle *fs, char* directory_path);
+int fs_rmdir(struct fs_handle *fs, char *directory_path);
+int fs_free_map(struct fs_handle *fs, char *image);
+int fs_fragmentation(struct fs_handle *fs, struct fs_frag *frag);
+int fs_defrag(struct fs_handle *fs, double seconds, uint64_t max_sectors);
+int fs_lookup(struct fs_handle *fs, char *path, struct file_dir_entry *entry);
+int fs_import(struct fs_handle *fs, char *host_dir, char *simul_dir, int threads);
@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "libdisksimul.h"
+#include "filesystem.h"
+
+/* Benchmark driver.
+ *
+ * Runs reproducible workloads against the library: a directory tree is
+ * created, files are created in its leaves, every directory is listed, a
+ * read/write mix runs on the files, then everything is deleted. Each phase
+ * reports its throughput, latency percentiles and sector I/O as one CSV
+ * row, and the simulated disk time when a timing model is given. Random
+ * choices come from a fixed seed, so two runs do the same operations. The
+ * "text" and "text-lz" workloads only differ by compression, they compare
+ * the compressed and raw throughput. A previous CSV can be given as a
+ * baseline, phases that got slower than the tolerance are reported and make
+ * the run fail.
+ */
+
+#define BENCH_IMAGE	"bench.fs"
+#define BENCH_SOURCES	"bench_src"
+
+/* Distinct source files a workload creates its files from. */
+#define SOURCE_FILES	32
+
+#define DIST_FIXED	0
+#define DIST_UNIFORM	1
+#define DIST_LOGNORMAL	2
+
+/**
+ * Workload parameters.
+ */
+struct workload{
+	char name[32];			/**< Workload name, first CSV column. */
+	int sector_size;		/**< Sector size in bytes. */
+	uint64_t disk_size;		/**< Disk size in bytes. */
+	int files;			/**< Files created. */
+	uint64_t size_min;		/**< Smallest file in bytes. */
+	uint64_t size_max;		/**< Largest file in bytes. */
+	int dist;			/**< DIST_FIXED (size_min), DIST_UNIFORM or DIST_LOGNORMAL. */
+	int depth;			/**< Directory levels under the workload root. */
+	int fanout;			/**< Subdirectories per directory. */
+	int read_pct;			/**< Reads in the mix phase, the rest are rewrites. */
+	int text;			/**< Source files hold log lines instead of random bytes. */
+	int compress;			/**< Files are created compressed. */
+};
+
+static struct workload workloads[] = {
+	/* name       sector   disk          files  min     max            dist            depth fanout reads text compress */
+	{"small",     512,     16ull << 20,  2000,  100,    4096,          DIST_UNIFORM,   2,    4,     80,   0,   0},
+	{"mixed",     4096,    1ull << 30,   1000,  1024,   4ull << 20,    DIST_LOGNORMAL, 3,    4,     50,   0,   0},
+	{"large",     4096,    1ull << 30,   64,    4ull << 20, 4ull << 20, DIST_FIXED,    1,    2,     50,   0,   0},
+	{"deep",      4096,    64ull << 20,  1000,  1024,   1024,          DIST_FIXED,     5,    3,     90,   0,   0},
+	{"text",      4096,    256ull << 20, 400,   16384,  2ull << 20,    DIST_LOGNORMAL, 2,    4,     80,   1,   0},
+	{"text-lz",   4096,    256ull << 20, 400,   16384,  2ull << 20,    DIST_LOGNORMAL, 2,    4,     80,   1,   1},
+};
+
+/**
+ * Results of one phase.
+ */
+struct result{
+	char workload[32];		/**< Workload name. */
+	char phase[16];			/**< Phase name. */
+	int ops;			/**< Operations. */
+	double seconds;			/**< Elapsed time. */
+	double bytes;			/**< File bytes moved. */
+	double p50, p90, p99;		/**< Latency percentiles in microseconds. */
+	unsigned long sectors_read;	/**< Sectors read from the disk. */
+	unsigned long sectors_written;	/**< Sectors written to the disk. */
+	double sim_seconds;		/**< Simulated disk time. */
+};
+
+/* Timing model and scheduler of -model and -sched. */
+static struct ds_model model;
+static int timed = 0;
+static int scheduler = DS_SCHED_FIFO;
+
+/* Random number generator state, reset for every workload. */
+static uint64_t rng_state;
+
+static uint64_t rng_next(){
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * @brief Uniform random number in [0, 1).
+ */
+static double rng_unit(){
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Parse a size in bytes, with an optional K, M or G suffix.
+ * @return 0 on success.
+ */
+static int parse_size(char *str, uint64_t *size){
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if(end == str || errno != 0){
+		return 1;
+	}
+
+	switch(*end){
+		case 'k': case 'K': *size <<= 10; end++; break;
+		case 'm': case 'M': *size <<= 20; end++; break;
+		case 'g': case 'G': *size <<= 30; end++; break;
+	}
+
+	return *end != '\0';
+}
+
+/**
+ * @brief Draw a file size from the distribution of a workload.
+ *
+ * The log-normal distribution has its median at the geometric mean of the
+ * bounds, which are two standard deviations away, and is clamped to them.
+ */
+static uint64_t draw_size(struct workload *w){
+	double mu, sigma, z, size;
+
+	switch(w->dist){
+		case DIST_UNIFORM:
+			return w->size_min + rng_next() % (w->size_max - w->size_min + 1);
+		case DIST_LOGNORMAL:
+			mu = (log((double)w->size_min) + log((double)w->size_max)) / 2;
+			sigma = (log((double)w->size_max) - mu) / 2;
+			z = sqrt(-2 * log(1 - rng_unit())) * cos(2 * M_PI * rng_unit());
+			size = exp(mu + sigma * z);
+			if(size < w->size_min) size = w->size_min;
+			if(size > w->size_max) size = w->size_max;
+			return (uint64_t)size;
+	}
+
+	return w->size_min;
+}
+
+/**
+ * @brief Fill a buffer with log lines, text that compresses like real logs.
+ * @param buf Output.
+ * @param n Bytes.
+ */
+static void make_text(char *buf, size_t n){
+	static char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+	static char *events[] = {"request served", "cache miss", "connection closed", "retrying upload", "session started"};
+	char line[160];
+	size_t len, k;
+
+	for(k = 0; k < n; k += len){
+		len = snprintf(line, sizeof(line), "2026-01-%02d %02d:%02d:%02d.%03d %-5s worker-%d %s id=%08x took %d ms\n",
+			(int)(rng_next() % 28) + 1, (int)(rng_next() % 24), (int)(rng_next() % 60), (int)(rng_next() % 60),
+			(int)(rng_next() % 1000), levels[rng_next() % 6], (int)(rng_next() % 16), events[rng_next() % 5],
+			(unsigned)rng_next(), (int)(rng_next() % 500));
+		if(len > n - k){
+			len = n - k;
+		}
+		memcpy(buf + k, line, len);
+	}
+}
+
+/**
+ * @brief Write the source files of a workload, with random contents or log lines.
+ * @param w Workload.
+ * @param sizes Output size of each source file.
+ * @return 0 on success.
+ */
+static int make_sources(struct workload *w, uint64_t *sizes){
+	char path[64];
+	uint64_t buf[4096], left;
+	size_t n, k;
+	FILE *f;
+	int i;
+
+	for(i = 0; i < SOURCE_FILES; i++){
+		sizes[i] = draw_size(w);
+
+		snprintf(path, sizeof(path), "%s/%d", BENCH_SOURCES, i);
+		if( (f = fopen(path, "wb")) == NULL){
+			perror("fopen()");
+			return 1;
+		}
+
+		for(left = sizes[i]; left > 0; left -= n){
+			n = left < sizeof(buf) ? left : sizeof(buf);
+			for(k = 0; k < (n + 7) / 8 && !w->text; k++){
+				buf[k] = rng_next();
+			}
+			if(w->text){
+				make_text((char*)buf, n);
+			}
+			fwrite(buf, 1, n, f);
+		}
+
+		fclose(f);
+	}
+
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b){
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Phase being measured.
+ */
+struct phase{
+	struct result *r;		/**< Results. */
+	struct fs_handle *fs;		/**< Disk. */
+	double *lat;			/**< Latency of each operation, seconds. */
+	int max_ops;			/**< Room in lat. */
+	double start;			/**< Start time. */
+	double op_start;		/**< Start time of the running operation. */
+	struct ds_stats io;		/**< Disk counters at the start. */
+};
+
+static void phase_begin(struct phase *p, struct result *r, struct workload *w, char *name){
+	memset(r, 0, sizeof(struct result));
+	strcpy(r->workload, w->name);
+	strcpy(r->phase, name);
+	p->r = r;
+	fs_get_io_stats(p->fs, &p->io);
+	p->start = now();
+}
+
+static void op_begin(struct phase *p){
+	p->op_start = now();
+}
+
+static void op_end(struct phase *p, uint64_t bytes){
+	if(p->r->ops < p->max_ops){
+		p->lat[p->r->ops] = now() - p->op_start;
+	}
+	p->r->ops++;
+	p->r->bytes += bytes;
+}
+
+static void phase_end(struct phase *p){
+	struct result *r = p->r;
+	struct ds_stats io;
+	int n = r->ops < p->max_ops ? r->ops : p->max_ops;
+
+	/* The metadata written back belongs to the phase. */
+	fs_sync(p->fs);
+
+	r->seconds = now() - p->start;
+	fs_get_io_stats(p->fs, &io);
+	r->sectors_read = io.sectors_read - p->io.sectors_read;
+	r->sectors_written = io.sectors_written - p->io.sectors_written;
+	r->sim_seconds = (io.sim_ns - p->io.sim_ns) / 1e9;
+
+	if(n > 0){
+		qsort(p->lat, n, sizeof(double), cmp_double);
+		r->p50 = p->lat[n * 50 / 100] * 1e6;
+		r->p90 = p->lat[n * 90 / 100] * 1e6;
+		r->p99 = p->lat[n * 99 / 100] * 1e6;
+	}
+}
+
+/**
+ * @brief Path of directory number i of the tree, numbered level by level.
+ *
+ * Directory 0 is /bench, the children of directory d are d * fanout + 1
+ * to d * fanout + fanout.
+ */
+static void dir_path(struct workload *w, int i, char *path, size_t len){
+	int levels[64], n = 0;
+	size_t used;
+
+	for(; i > 0 && n < 64; i = (i - 1) / w->fanout){
+		levels[n++] = (i - 1) % w->fanout;
+	}
+
+	used = snprintf(path, len, "/bench");
+	while(n > 0 && used < len){
+		used += snprintf(path + used, len - used, "/d%d", levels[--n]);
+	}
+}
+
+/**
+ * @brief Run a workload.
+ * @param w Workload.
+ * @param backend I/O backend.
+ * @param results Output, room for 5 phases.
+ * @return Number of phases run, -1 on error.
+ */
+static int run_workload(struct workload *w, int backend, struct result *results){
+	struct phase p;
+	uint64_t sizes[SOURCE_FILES];
+	int *file_src;
+	char path[4096], src[64];
+	int i, k, dirs = 1, leaves = 1, first_leaf = 0, n = 0, failed = 0;
+
+	rng_state = 0x9E3779B97F4A7C15ull;
+
+	for(i = 0; i < w->depth; i++){
+		first_leaf += leaves;
+		leaves *= w->fanout;
+		dirs += leaves;
+	}
+
+	if(make_sources(w, sizes) != 0 ||
+	   fs_format(BENCH_IMAGE, w->sector_size, w->disk_size / w->sector_size) != 0 ||
+	   (p.fs = fs_open(BENCH_IMAGE, backend)) == NULL){
+		return -1;
+	}
+	fs_set_model(p.fs, timed ? &model : NULL, scheduler);
+	fs_set_compression(p.fs, w->compress, 0);
+
+	p.max_ops = (dirs > w->files ? dirs : w->files) * 2;
+	p.lat = malloc(p.max_ops * sizeof(double));
+	file_src = malloc(w->files * sizeof(int));
+
+	/* Directory tree. */
+	phase_begin(&p, &results[n], w, "mkdir");
+	for(i = 0; i < dirs; i++){
+		dir_path(w, i, path, sizeof(path));
+		op_begin(&p);
+		failed += fs_mkdir(p.fs, path) != 0;
+		op_end(&p, 0);
+	}
+	phase_end(&p);
+	n++;
+
+	/* Files, spread over the leaves. */
+	phase_begin(&p, &results[n], w, "create");
+	for(i = 0; i < w->files; i++){
+		file_src[i] = rng_next() % SOURCE_FILES;
+		dir_path(w, first_leaf + i % leaves, path, sizeof(path));
+		snprintf(path + strlen(path), sizeof(path) - strlen(path), "/f%d", i);
+		snprintf(src, sizeof(src), "%s/%d", BENCH_SOURCES, file_src[i]);
+		op_begin(&p);
+		failed += fs_create(p.fs, src, path) != 0;
+		op_end(&p, sizes[file_src[i]]);
+	}
+	phase_end(&p);
+	n++;
+
+	phase_begin(&p, &results[n], w, "ls");
+	for(i = 0; i < dirs; i++){
+		dir_path(w, i, path, sizeof(path));
+		op_begin(&p);
+		failed += fs_ls(p.fs, path) != 0;
+		op_end(&p, 0);
+	}
+	phase_end(&p);
+	n++;
+
+	/* Reads, and rewrites from another source file. */
+	phase_begin(&p, &results[n], w, "mix");
+	for(k = 0; k < w->files; k++){
+		i = rng_next() % w->files;
+		dir_path(w, first_leaf + i % leaves, path, sizeof(path));
+		snprintf(path + strlen(path), sizeof(path) - strlen(path), "/f%d", i);
+
+		op_begin(&p);
+		if((int)(rng_next() % 100) < w->read_pct){
+			failed += fs_read(p.fs, "/dev/null", path) != 0;
+			op_end(&p, sizes[file_src[i]]);
+		}else{
+			file_src[i] = rng_next() % SOURCE_FILES;
+			snprintf(src, sizeof(src), "%s/%d", BENCH_SOURCES, file_src[i]);
+			failed += fs_del(p.fs, path) != 0 || fs_create(p.fs, src, path) != 0;
+			op_end(&p, sizes[file_src[i]]);
+		}
+	}
+	phase_end(&p);
+	n++;
+
+	phase_begin(&p, &results[n], w, "del");
+	for(i = 0; i < w->files; i++){
+		dir_path(w, first_leaf + i % leaves, path, sizeof(path));
+		snprintf(path + strlen(path), sizeof(path) - strlen(path), "/f%d", i);
+		op_begin(&p);
+		failed += fs_del(p.fs, path) != 0;
+		op_end(&p, 0);
+	}
+	phase_end(&p);
+	n++;
+
+	fs_close(p.fs);
+	free(p.lat);
+	free(file_src);
+	unlink(BENCH_IMAGE);
+
+	for(i = 0; i < SOURCE_FILES; i++){
+		snprintf(src, sizeof(src), "%s/%d", BENCH_SOURCES, i);
+		unlink(src);
+	}
+
+	if(failed > 0){
+		fprintf(stderr, "%s: %d operations failed\n", w->name, failed);
+		return -1;
+	}
+
+	return n;
+}
+
+static void print_header(FILE *out){
+	fprintf(out, "workload,phase,ops,seconds,ops_per_s,mb_per_s,p50_us,p90_us,p99_us,sector_reads,sector_writes,sim_ms,sim_ops_per_s\n");
+}
+
+static void print_result(FILE *out, struct result *r){
+	fprintf(out, "%s,%s,%d,%.6f,%.1f,%.2f,%.1f,%.1f,%.1f,%lu,%lu,%.3f,%.1f\n", r->workload, r->phase, r->ops, r->seconds,
+		r->ops / r->seconds, r->bytes / r->seconds / (1 << 20), r->p50, r->p90, r->p99, r->sectors_read, r->sectors_written,
+		r->sim_seconds * 1e3, r->sim_seconds > 0 ? r->ops / r->sim_seconds : 0.0);
+	fflush(out);
+}
+
+/**
+ * @brief Compare results with a baseline CSV.
+ * @param report Output of the comparison.
+ * @param baseline Baseline file written by an earlier run.
+ * @param results Results.
+ * @param n Number of results.
+ * @param tolerance Slowdown allowed, in percent.
+ * @return Number of regressions, -1 on error.
+ */
+static int compare(FILE *report, char *baseline, struct result *results, int n, double tolerance){
+	char line[512], workload[32], phase[16];
+	double base, change;
+	int i, regressions = 0, found;
+	FILE *f;
+
+	if( (f = fopen(baseline, "r")) == NULL){
+		perror("fopen()");
+		return -1;
+	}
+
+	fprintf(report, "\n%-10s %-8s %12s %12s %8s\n", "workload", "phase", "ops/s", "baseline", "change");
+
+	for(i = 0; i < n; i++){
+		rewind(f);
+		found = 0;
+		while( !found && fgets(line, sizeof(line), f) != NULL){
+			found = sscanf(line, "%31[^,],%15[^,],%*d,%*f,%lf", workload, phase, &base) == 3 &&
+			        !strcmp(workload, results[i].workload) && !strcmp(phase, results[i].phase);
+		}
+
+		if( !found || base <= 0){
+			fprintf(report, "%-10s %-8s %12.1f %12s\n", results[i].workload, results[i].phase, results[i].ops / results[i].seconds, "-");
+			continue;
+		}
+
+		change = (results[i].ops / results[i].seconds / base - 1) * 100;
+		fprintf(report, "%-10s %-8s %12.1f %12.1f %+7.1f%%%s\n", results[i].workload, results[i].phase,
+			results[i].ops / results[i].seconds, base, change, change < -tolerance ? " REGRESSION" : "");
+		regressions += change < -tolerance;
+	}
+
+	fclose(f);
+
+	return regressions;
+}
+
+static void usage(char *exec){
+	printf("%s [-o <csv>] [-baseline <csv>] [-tolerance <percent>] [-quick]\n", exec);
+	printf("   [-backend file|mmap|uring|threads] [-workload <name>]\n");
+	printf("   [-model hdd|ssd[,<param>=<value>...]] [-sched fifo|scan|deadline]\n");
+	printf("   [-sector <size>] [-disk <size>] [-files <n>] [-size <min>[:<max>]]\n");
+	printf("   [-dist fixed|uniform|lognormal] [-depth <n>] [-fanout <n>] [-reads <percent>]\n");
+	printf("   [-content random|text] [-compress]\n");
+	printf("Workload parameters run a custom workload, based on \"mixed\".\n");
+}
+
+int main(int argc, char **argv){
+	struct workload custom = workloads[1];
+	struct result *results;
+	char *output = NULL, *baseline = NULL, *only = NULL, *colon;
+	double tolerance = 20;
+	int i, n, total = 0, quick = 0, use_custom = 0, backend = DS_BACKEND_FILE, regressions = 0;
+	int n_workloads = sizeof(workloads) / sizeof(workloads[0]);
+	uint64_t v;
+	FILE *out = stdout, *report;
+
+	for(i = 1; i < argc; i++){
+		if( !strcmp(argv[i], "-quick")){
+			quick = 1;
+			continue;
+		}
+		if( !strcmp(argv[i], "-compress")){
+			custom.compress = 1;
+			use_custom = 1;
+			continue;
+		}
+		if(i + 1 >= argc){
+			usage(argv[0]);
+			return 1;
+		}
+
+		if( !strcmp(argv[i], "-o")){
+			output = argv[++i];
+		}else if( !strcmp(argv[i], "-baseline")){
+			baseline = argv[++i];
+		}else if( !strcmp(argv[i], "-tolerance")){
+			tolerance = atof(argv[++i]);
+		}else if( !strcmp(argv[i], "-workload")){
+			only = argv[++i];
+		}else if( !strcmp(argv[i], "-backend")){
+			i++;
+			backend = !strcmp(argv[i], "mmap") ? DS_BACKEND_MMAP : !strcmp(argv[i], "uring") ? DS_BACKEND_URING :
+			          !strcmp(argv[i], "threads") ? DS_BACKEND_THREADS : DS_BACKEND_FILE;
+		}else if( !strcmp(argv[i], "-model")){
+			if(ds_model_parse(argv[++i], &model) != 0){
+				usage(argv[0]);
+				return 1;
+			}
+			timed = 1;
+		}else if( !strcmp(argv[i], "-sched")){
+			if( (scheduler = ds_sched_parse(argv[++i])) < 0){
+				usage(argv[0]);
+				return 1;
+			}
+		}else if( !strcmp(argv[i], "-dist")){
+			i++;
+			custom.dist = !strcmp(argv[i], "fixed") ? DIST_FIXED : !strcmp(argv[i], "uniform") ? DIST_UNIFORM : DIST_LOGNORMAL;
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-size")){
+			i++;
+			if( (colon = strchr(argv[i], ':')) != NULL){
+				*colon = '\0';
+			}
+			if(parse_size(argv[i], &custom.size_min) != 0 || (colon != NULL && parse_size(colon + 1, &custom.size_max) != 0)){
+				usage(argv[0]);
+				return 1;
+			}
+			if(colon == NULL || custom.size_max < custom.size_min){
+				custom.size_max = custom.size_min;
+			}
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-sector") || !strcmp(argv[i], "-disk")){
+			if(parse_size(argv[i + 1], &v) != 0){
+				usage(argv[0]);
+				return 1;
+			}
+			if( !strcmp(argv[i], "-sector")){
+				custom.sector_size = v;
+			}else{
+				custom.disk_size = v;
+			}
+			i++;
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-files")){
+			custom.files = atoi(argv[++i]);
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-depth")){
+			custom.depth = atoi(argv[++i]);
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-fanout")){
+			custom.fanout = atoi(argv[++i]);
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-reads")){
+			custom.read_pct = atoi(argv[++i]);
+			use_custom = 1;
+		}else if( !strcmp(argv[i], "-content")){
+			custom.text = !strcmp(argv[++i], "text");
+			use_custom = 1;
+		}else{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(use_custom){
+		strcpy(custom.name, "custom");
+		if(custom.files < 1 || custom.fanout < 1 || custom.depth < 0 || custom.size_min < 1){
+			usage(argv[0]);
+			return 1;
+		}
+		workloads[0] = custom;
+		n_workloads = 1;
+	}
+
+	if(output != NULL && (out = fopen(output, "w")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
+
+	if( (results = calloc(n_workloads * 5, sizeof(struct result))) == NULL || (mkdir(BENCH_SOURCES, 0755) != 0 && errno != EEXIST)){
+		perror(BENCH_SOURCES);
+		return 1;
+	}
+
+	/* The filesystem reports every operation on stdout, keep only the results. */
+	fflush(stdout);
+	if( (report = fdopen(dup(STDOUT_FILENO), "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL){
+		perror("stdout");
+		return 1;
+	}
+	if(out == stdout){
+		out = report;
+	}
+
+	print_header(out);
+
+	for(i = 0; i < n_workloads; i++){
+		if(only != NULL && strcmp(only, workloads[i].name)){
+			continue;
+		}
+
+		/* A tenth of the work, on a smaller disk. */
+		if(quick){
+			workloads[i].files = (workloads[i].files + 9) / 10;
+			workloads[i].disk_size /= 4;
+		}
+
+		if( (n = run_workload(&workloads[i], backend, results + total)) < 0){
+			rmdir(BENCH_SOURCES);
+			return 1;
+		}
+
+		for(; n > 0; n--, total++){
+			print_result(out, &results[total]);
+		}
+	}
+
+	rmdir(BENCH_SOURCES);
+
+	if(baseline != NULL){
+		regressions = compare(report, baseline, results, total, tolerance);
+	}
+
+	if(out != report){
+		fclose(out);
+	}
+	fclose(report);
+	free(results);
+
+	return regressions != 0;
+}
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "filesystem.h"
+
+/* Recursive import of a host directory tree.
+ *
+ * The calling thread walks the host tree, creates the directories in tree
+ * order and queues the files. A pool of worker threads copies the files
+ * with fs_create, which allocates each file in one go from its size and
+ * writes its data outside the directory lock. The metadata kept in the
+ * cache is written back every IMPORT_SYNC_FILES files.
+ */
+
+/* Files waiting for a worker. */
+#define IMPORT_QUEUE	256
+
+/* Files imported between two metadata write-backs. */
+#define IMPORT_SYNC_FILES	1024
+
+/**
+ * File waiting to be imported.
+ */
+struct import_job{
+	char host_path[PATH_MAX];	/**< Source file. */
+	char simul_path[PATH_MAX];	/**< Destination path. */
+};
+
+/**
+ * Import state shared by the walker and the workers.
+ */
+struct import{
+	struct fs_handle *fs;		/**< Destination disk. */
+	struct import_job *jobs;	/**< Ring of IMPORT_QUEUE queued files. */
+	int head;			/**< Next job to take. */
+	int count;			/**< Queued jobs. */
+	int done;			/**< No more jobs will be queued. */
+	unsigned long files;		/**< Files imported. */
+	unsigned long dirs;		/**< Directories created. */
+	int failed;			/**< Failed files and directories. */
+	pthread_mutex_t lock;		/**< Protects everything above but fs. */
+	pthread_cond_t not_empty;	/**< Signalled when a job is queued or done is set. */
+	pthread_cond_t not_full;	/**< Signalled when a job is taken. */
+};
+
+
+static void *import_worker(void *arg){
+	struct import *im = arg;
+	struct import_job job;
+	int ret, sync;
+
+	for(;;){
+		pthread_mutex_lock(&im->lock);
+		while(im->count == 0 && !im->done){
+			pthread_cond_wait(&im->not_empty, &im->lock);
+		}
+		if(im->count == 0){
+			pthread_mutex_unlock(&im->lock);
+			return NULL;
+		}
+		job = im->jobs[im->head];
+		im->head = (im->head + 1) % IMPORT_QUEUE;
+		im->count--;
+		pthread_cond_signal(&im->not_full);
+		pthread_mutex_unlock(&im->lock);
+
+		ret = fs_create(im->fs, job.host_path, job.simul_path);
+
+		pthread_mutex_lock(&im->lock);
+		if(ret != 0){
+			im->failed++;
+		}else{
+			im->files++;
+		}
+		sync = (im->files % IMPORT_SYNC_FILES == 0 && ret == 0);
+		pthread_mutex_unlock(&im->lock);
+
+		/* Commit the metadata of the last batch of files. */
+		if(sync){
+			fs_sync(im->fs);
+		}
+	}
+}
+
+/**
+ * @brief Queue a file for the workers, waiting while the queue is full.
+ */
+static void queue_file(struct import *im, char *host_path, char *simul_path){
+	struct import_job *job;
+
+	pthread_mutex_lock(&im->lock);
+	while(im->count == IMPORT_QUEUE){
+		pthread_cond_wait(&im->not_full, &im->lock);
+	}
+	job = &im->jobs[(im->head + im->count) % IMPORT_QUEUE];
+	strcpy(job->host_path, host_path);
+	strcpy(job->simul_path, simul_path);
+	im->count++;
+	pthread_cond_signal(&im->not_empty);
+	pthread_mutex_unlock(&im->lock);
+}
+
+/**
+ * @brief Create a directory unless it already exists.
+ * @return 0 on success.
+ */
+static int import_mkdir(struct import *im, char *simul_path){
+	struct file_dir_entry entry;
+
+	if(fs_lookup(im->fs, simul_path, &entry) == 0){
+		if(entry.dir){
+			return 0;
+		}
+		printf("Error: '%s' is a file\n", simul_path);
+		return 1;
+	}
+
+	if(fs_mkdir(im->fs, simul_path) != 0){
+		return 1;
+	}
+
+	pthread_mutex_lock(&im->lock);
+	im->dirs++;
+	pthread_mutex_unlock(&im->lock);
+
+	return 0;
+}
+
+/**
+ * @brief Walk a host directory, creating its subdirectories and queuing its files.
+ * @param im Import state.
+ * @param host_dir Host directory.
+ * @param simul_dir Matching simulated directory, already created.
+ */
+static void import_dir(struct import *im, char *host_dir, char *simul_dir){
+	char host_path[PATH_MAX], simul_path[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+	int fail;
+
+	if( (dir = opendir(host_dir)) == NULL){
+		perror("opendir()");
+		pthread_mutex_lock(&im->lock);
+		im->failed++;
+		pthread_mutex_unlock(&im->lock);
+		return;
+	}
+
+	while( (d = readdir(dir)) != NULL){
+		if( !strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")){
+			continue;
+		}
+
+		fail = snprintf(host_path, PATH_MAX, "%s/%s", host_dir, d->d_name) >= PATH_MAX ||
+		       snprintf(simul_path, PATH_MAX, "%s/%s", strcmp(simul_dir, "/") ? simul_dir : "", d->d_name) >= PATH_MAX ||
+		       lstat(host_path, &st) != 0;
+
+		if( !fail && S_ISDIR(st.st_mode)){
+			if( !(fail = import_mkdir(im, simul_path))){
+				import_dir(im, host_path, simul_path);
+			}
+		}else if( !fail && S_ISREG(st.st_mode)){
+			queue_file(im, host_path, simul_path);
+		}
+		/* Links, devices and sockets are skipped. */
+
+		if(fail){
+			printf("Error: Cannot import '%s'\n", host_path);
+			pthread_mutex_lock(&im->lock);
+			im->failed++;
+			pthread_mutex_unlock(&im->lock);
+		}
+	}
+
+	closedir(dir);
+}
+
+/**
+ * @brief Copy a host directory tree into the simulated filesystem.
+ *
+ * The contents of host_dir go to simul_dir, which is created if needed.
+ * Existing directories are reused, existing files are reported as failed.
+ *
+ * @param fs Open filesystem.
+ * @param host_dir Host directory.
+ * @param simul_dir Destination directory.
+ * @param threads Number of worker threads.
+ * @return Number of files and directories that could not be imported, -1 on error.
+ */
+int fs_import(struct fs_handle *fs, char *host_dir, char *simul_dir, int threads){
+	struct import im;
+	pthread_t *workers;
+	int i, started;
+
+	memset(&im, 0, sizeof(im));
+	im.fs = fs;
+
+	if(threads < 1){
+		threads = 1;
+	}
+
+	im.jobs = malloc(IMPORT_QUEUE * sizeof(struct import_job));
+	workers = malloc(threads * sizeof(pthread_t));
+	if(im.jobs == NULL || workers == NULL){
+		perror("malloc()");
+		free(im.jobs);
+		free(workers);
+		return -1;
+	}
+
+	pthread_mutex_init(&im.lock, NULL);
+	pthread_cond_init(&im.not_empty, NULL);
+	pthread_cond_init(&im.not_full, NULL);
+
+	if(import_mkdir(&im, simul_dir) != 0){
+		pthread_mutex_destroy(&im.lock);
+		pthread_cond_destroy(&im.not_empty);
+		pthread_cond_destroy(&im.not_full);
+		free(im.jobs);
+		free(workers);
+		return -1;
+	}
+
+	for(started = 0; started < threads; started++){
+		if(pthread_create(&workers[started], NULL, import_worker, &im) != 0){
+			perror("pthread_create()");
+			break;
+		}
+	}
+
+	if(started == 0){
+		pthread_mutex_destroy(&im.lock);
+		pthread_cond_destroy(&im.not_empty);
+		pthread_cond_destroy(&im.not_full);
+		free(im.jobs);
+		free(workers);
+		return -1;
+	}
+
+	import_dir(&im, host_dir, simul_dir);
+
+	pthread_mutex_lock(&im.lock);
+	im.done = 1;
+	pthread_cond_broadcast(&im.not_empty);
+	pthread_mutex_unlock(&im.lock);
+
+	for(i = 0; i < started; i++){
+		pthread_join(workers[i], NULL);
+	}
+
+	fs_sync(fs);
+
+	printf("Imported %lu files and %lu directories, %d failed.\n", im.files, im.dirs, im.failed);
+
+	pthread_mutex_destroy(&im.lock);
+	pthread_cond_destroy(&im.not_empty);
+	pthread_cond_destroy(&im.not_full);
+	free(im.jobs);
+	free(workers);
+
+	return im.failed;
+}
@@ -0,0 +1,33 @@
+/* Open filesystem, shared by the filesystem modules. Library users only
+ * see the opaque struct fs_handle declared in filesystem.h. */
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Directory locks, a directory uses lock number header sector % FS_DIR_LOCKS. */
+#define FS_DIR_LOCKS	64
+
+/**
+ * Open disk image.
+ * Everything the filesystem keeps in memory for one image, so any number
+ * of images can be open at the same time.
+ *
+ * Operations on one handle can run from several threads. Locks are taken
+ * in this order: ns_lock, one directory lock, meta_lock, then the locks
+ * inside the bitmap and the caches.
+ */
+struct fs_handle{
+	struct ds_device *dev;		/**< Disk image. */
+	struct bc_cache *cache;		/**< Metadata sector cache. */
+	struct ba_bitmap *bitmap;	/**< Allocation bitmap, NULL on version 1 disks. */
+	struct dc_cache *dentries;	/**< Path lookup cache. */
+	struct jn_journal *journal;	/**< Metadata journal, NULL if the disk has none. */
+	struct os_table *stats;		/**< Per-operation statistics, NULL while they are off. */
+	struct superblock sb;		/**< Superblock, written back when sb_dirty is set. */
+	int sb_dirty;			/**< The superblock was modified. */
+	int legacy;			/**< Version 1 layout, only reading is supported. */
+	int compress;			/**< Compress the files created from now on. */
+	pthread_rwlock_t ns_lock;	/**< Shared by every operation, exclusive while a directory is freed. */
+	pthread_rwlock_t dir_locks[FS_DIR_LOCKS];	/**< Directory contents, shared to read, exclusive to modify. */
+	pthread_mutex_t meta_lock;	/**< Superblock. */
+};
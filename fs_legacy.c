@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libdisksimul.h"
+#include "bufcache.h"
+#include "filesystem.h"
+#include "fs_legacy.h"
+#include "fs_internal.h"
+
+/* Version 1 layout: the root table lives in sector 0 and file data is a
+ * chain of sector_data, 508 bytes per sector. Only reading is supported,
+ * images are upgraded by copying the files to a freshly formatted disk. */
+
+#define MAX_ROOT_ENTRIES 15
+#define MAX_DIR_ENTRIES 16
+#define SECTOR_DATA_SIZE 508
+
+/* Contiguous sectors read ahead while walking a chain. */
+#define IO_RUN_SECTORS 64
+
+
+/**
+ * @brief Verify if dir exist and load its table.
+ * @param fs Open filesystem.
+ * @param t_dir table_directory pointer.
+ * @param s_path dir path, modified while it is parsed.
+ * @param cur_entries root entries (then used for current entries).
+ * @return dir sector number or -1 if not found.
+ */
+static int legacy_find_dir(struct fs_handle *fs, struct legacy_table_directory *t_dir, char *s_path, struct legacy_dir_entry *cur_entries){
+	int exists = 0;
+	int i;
+	int s_dir = 0;
+	printf("- Searching path: %s \n", s_path);
+	const char delimiter[2] = "/";
+	char *saveptr;
+	char *e_name = strtok_r(s_path, delimiter, &saveptr);
+
+	// Verify if path exists and navigate through
+	while( e_name != NULL )
+	{
+		printf("- Searching dir: %s \n", e_name);
+		exists = 0;
+
+		//verify if	dir exist on current entries
+		for(i = 0; i < MAX_DIR_ENTRIES; i++){
+			if(strcmp(cur_entries[i].name, e_name) == 0 && cur_entries[i].dir == 1){
+				exists = 1;
+				s_dir = cur_entries[i].sector_start;
+				bc_read_sector(fs->cache, cur_entries[i].sector_start, (void*)t_dir);
+				cur_entries = t_dir->entries;
+				break;
+			}
+		}
+
+		e_name = strtok_r(NULL, delimiter, &saveptr);
+
+		if(exists == 0){
+			printf("Error: The path doesn't exist\n");
+			return -1;
+		}
+	}
+
+	return s_dir;
+}
+
+/**
+ * @brief Load the entries of a directory.
+ * @param fs Open filesystem.
+ * @param root Root table buffer.
+ * @param t_dir Directory table buffer.
+ * @param s_path dir path.
+ * @param length Output number of entries.
+ * @return Entries of the directory or NULL if not found.
+ */
+static struct legacy_dir_entry *legacy_entries(struct fs_handle *fs, struct root_table_directory *root, struct legacy_table_directory *t_dir, char *s_path, int *length){
+	bc_read_sector(fs->cache, 0, (void*)root);
+
+	if(s_path[strspn(s_path, "/")] == '\0'){
+		*length = MAX_ROOT_ENTRIES;
+		return root->entries;
+	}
+
+	if(legacy_find_dir(fs, t_dir, s_path, root->entries) < 1){
+		return NULL;
+	}
+
+	*length = MAX_DIR_ENTRIES;
+	return t_dir->entries;
+}
+
+/**
+ * @brief Read a file from a version 1 image.
+ * @param fs Open filesystem.
+ * @param output_file Output file path.
+ * @param out Output stream, used instead of output_file when not NULL.
+ * @param s_path Parent directory path.
+ * @param s_name File name.
+ * @return 0 on success.
+ */
+int legacy_read(struct fs_handle *fs, char *output_file, FILE *out, char *s_path, char *s_name){
+	struct root_table_directory root;
+	struct legacy_table_directory t_dir;
+	struct legacy_dir_entry *cur_entries;
+	struct sector_data *cur_sector;
+	struct sector_data *run;
+	int run_first = 0, run_count = 0;
+	int sector_number;
+	long left_sectors;
+	int i, length;
+	int data_amount = 0;
+	int left_data;
+	FILE *fileptr = out;
+
+	if( (cur_entries = legacy_entries(fs, &root, &t_dir, s_path, &length)) == NULL){
+		return 1;
+	}
+
+	for(i=0; i < length; i++){
+		if(strcmp(cur_entries[i].name, s_name) == 0 && cur_entries[i].dir == 0){
+			break;
+		}
+	}
+
+	if(i == length){
+		printf("File does not exist\n");
+		return 1;
+	}
+
+	if(out == NULL && (fileptr = fopen(output_file, "w")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
+
+	left_data = cur_entries[i].size_bytes;
+	left_sectors = (left_data + SECTOR_DATA_SIZE - 1) / SECTOR_DATA_SIZE;
+	sector_number = cur_entries[i].sector_start;
+
+	if( (run = malloc(IO_RUN_SECTORS * sizeof(struct sector_data))) == NULL){
+		perror("malloc()");
+		if(out == NULL){
+			fclose(fileptr);
+		}
+		return 1;
+	}
+
+	while(left_data > 0){
+		/* Without a mapped disk, read ahead the rest of the chain as one run. */
+		if( (cur_sector = ds_sector_ptr(fs->dev, sector_number, LEGACY_SECTOR_SIZE)) == NULL){
+			if(sector_number < run_first || sector_number >= run_first + run_count){
+				run_first = sector_number;
+				run_count = left_sectors < IO_RUN_SECTORS ? left_sectors : IO_RUN_SECTORS;
+				if(run_first + run_count > LEGACY_NUMBER_OF_SECTORS){
+					run_count = LEGACY_NUMBER_OF_SECTORS - run_first;
+				}
+				ds_read_sectors(fs->dev, run_first, run_count, (void*)run, LEGACY_SECTOR_SIZE);
+			}
+			cur_sector = &run[sector_number - run_first];
+		}
+
+		if(left_data > SECTOR_DATA_SIZE){
+			data_amount = SECTOR_DATA_SIZE;
+			left_data -= SECTOR_DATA_SIZE;
+		} else {
+			data_amount = left_data;
+			left_data = 0;
+		}
+
+		fwrite(cur_sector->data, sizeof(char), data_amount, fileptr);
+
+		left_sectors--;
+		sector_number = cur_sector->next_sector;
+	}
+
+	free(run);
+	if(out == NULL){
+		fclose(fileptr);
+	}else{
+		fflush(out);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief List a directory of a version 1 image.
+ * @param fs Open filesystem.
+ * @param s_path Directory path.
+ * @return Number of entries listed, -1 if the directory does not exist.
+ */
+int legacy_ls(struct fs_handle *fs, char *s_path){
+	struct root_table_directory root;
+	struct legacy_table_directory t_dir;
+	struct legacy_dir_entry *cur_entries;
+	int i, length;
+	int count = 0;
+
+	if( (cur_entries = legacy_entries(fs, &root, &t_dir, s_path, &length)) == NULL){
+		return -1;
+	}
+
+	for(i=0; i < length; i++){
+		// Verify if is file or dir
+		if(cur_entries[i].dir == 0){
+			// dir = 0 and size_byte = 0, means unused entry
+			if(cur_entries[i].size_bytes == 0){
+				break;
+			}
+			printf("f ");
+		}else {
+			printf("d ");
+		}
+
+		printf("%s", cur_entries[i].name);
+		if(cur_entries[i].size_bytes > 0){
+			printf("\t%d bytes", cur_entries[i].size_bytes);
+		}
+		printf("\n");
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * @brief Walk the free sectors list of a version 1 image.
+ * @param fs Open filesystem.
+ * @param sector_array One byte per sector, set to 1 for the free ones.
+ * @return Number of free sectors.
+ */
+uint64_t legacy_free_map(struct fs_handle *fs, char *sector_array){
+	struct root_table_directory root;
+	struct sector_data sector, *cur_sector;
+	unsigned int next;
+	uint64_t count = 0;
+
+	bc_read_sector(fs->cache, 0, (void*)&root);
+
+	for(next = root.free_sectors_list; next != 0 && next < LEGACY_NUMBER_OF_SECTORS && !sector_array[next]; count++){
+		/* The sector is in the free list, mark with 1. */
+		sector_array[next] = 1;
+
+		/* move to the next free sector. */
+		if( (cur_sector = ds_sector_ptr(fs->dev, next, LEGACY_SECTOR_SIZE)) == NULL){
+			ds_read_sector(fs->dev, next, (void*)&sector, LEGACY_SECTOR_SIZE);
+			cur_sector = &sector;
+		}
+		next = cur_sector->next_sector;
+	}
+
+	return count;
+}
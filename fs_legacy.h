@@ -0,0 +1,48 @@
+/* Read-only access to version 1 (chained sectors) images. */
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Version 1 geometry was fixed at build time. */
+#define LEGACY_SECTOR_SIZE		512
+#define LEGACY_NUMBER_OF_SECTORS	2048
+
+/**
+ * File or directory entry (version 1).
+ */
+struct legacy_dir_entry{
+	unsigned int dir; 		/**< File or directory representation. Use 1 for directory 0 for file. */
+	char name[20]; 			/**< File or directorty name. */
+	unsigned int size_bytes; 	/**< Size of the file in bytes. Use 0 for directories. */
+	unsigned int sector_start;	/**< Start sector of the file or directory table. */
+};
+
+/**
+ * Root directory table (version 1).
+ * First directory table of the file system. Should be written to the sector 0.
+ */
+struct root_table_directory{
+	unsigned int free_sectors_list;		/**< First free sector. */
+	struct legacy_dir_entry entries[15];	/**< List of file or directories. */
+	unsigned char not_used[28];		/**< Reserved, not used. */
+};
+
+/**
+ * Subdirectories file table (version 1).
+ */
+struct legacy_table_directory{
+	struct legacy_dir_entry entries[16]; 	/**< List of file or directories. */
+};
+
+/**
+ * Sector data (version 1).
+ * File data sector. Free sectors are linked through next_sector.
+ */
+struct sector_data{
+	unsigned char data[508];	/**< File data. */
+	unsigned int next_sector;	/**< Next sector. Use 0 if it is the last sector. */
+};
+
+int legacy_read(struct fs_handle *fs, char *output_file, FILE *out, char *s_path, char *s_name);
+int legacy_ls(struct fs_handle *fs, char *s_path);
+uint64_t legacy_free_map(struct fs_handle *fs, char *sector_array);
@@ -1,88 +1,662 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "libdisksimul.h"
+#include "bufcache.h"
 #include "filesystem.h"
+#include "dcache.h"
+#include "opstats.h"
+
+#define MAX_LINE	4096
+#define MAX_ARGS	8
+
+/* Worker threads of -import. */
+#define IMPORT_DEFAULT_THREADS	4
+
+/* Bytes copied by one fs_pread of -read-range, or one fs_pwrite of -write and -append. */
+#define RANGE_CHUNK	(1 << 20)
+
+/* Image written by -map without a path. */
+#define MAP_DEFAULT_IMAGE	"sector_map.png"
+
+/* Disk image and I/O backend, set by the global options. */
+static char *disk_image = FILENAME;
+static int disk_backend = DS_BACKEND_FILE;
+
+/* Per-operation statistics: 0 off, 1 text, 2 JSON. */
+static int stats_output = 0;
+
+/* Standard output of file data read with "-read -", see data_stdout. */
+static FILE *data_out = NULL;
+
+/* The batch script is read from stdin, it cannot be a file too. */
+static int batch_stdin = 0;
+
+/* Disk timing model and scheduler, set by -model and -sched. */
+static struct ds_model disk_model;
+static int disk_timed = 0;
+static int disk_scheduler = DS_SCHED_FIFO;
+
+/* Compress the files created by this run, set by -z. */
+static int disk_compress = 0;
 
 void usage(char *exec){
-	printf("%s -format\n", exec);
-	printf("%s -create <disk file> <simulated file>\n", exec);
-	printf("%s -read <disk file> <simulated file>\n", exec);
-    printf("%s -ls <absolute directory path>\n", exec);
+	printf("%s [-mmap | -uring | -threads] [-disk <image>] [-stats | -stats-json] [-z]\n", exec);
+	printf("   [-model hdd|ssd[,<param>=<value>...]] [-sched fifo|scan|deadline] <command>\n");
+	printf("%s -format [sector size] [disk size]\n", exec);
+	printf("%s -create <disk file | -> <simulated file>\n", exec);
+	printf("%s -read <disk file | -> <simulated file>\n", exec);
+	printf("%s -read-range <disk file | -> <simulated file> <offset> <length>\n", exec);
+	printf("%s -write <disk file | -> <simulated file> <offset>\n", exec);
+	printf("%s -append <disk file | -> <simulated file>\n", exec);
+	printf("%s -ls <absolute directory path>\n", exec);
 	printf("%s -del <simulated file>\n", exec);
 	printf("%s -mkdir <absolute directory path>\n", exec);
 	printf("%s -rmdir <absolute directory path>\n", exec);
+	printf("%s -import <host directory> <absolute directory path> [threads]\n", exec);
+	printf("%s -map [image.png | image.pgm]\n", exec);
+	printf("%s -defrag [<seconds>s | <sectors>]\n", exec);
+	printf("%s -compress on|off\n", exec);
+	printf("%s -batch <script file | ->\n", exec);
 }
 
+/**
+ * @brief Take the standard output for file data.
+ *
+ * The messages printed from then on go to the standard error, so the
+ * output only holds the data and can feed a pipeline.
+ *
+ * @return Stream on the original standard output, NULL on error.
+ */
+FILE *data_stdout(){
+	int fd;
 
-int main(int argc, char **argv){
-	
-	if(argc<2){
-		usage(argv[0]);
+	if(data_out != NULL){
+		return data_out;
+	}
+
+	fflush(stdout);
+	if( (fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (data_out = fdopen(fd, "w")) == NULL){
+		perror("dup()");
+		return NULL;
+	}
+
+	return data_out;
+}
+
+/**
+ * @brief Parse a size in bytes, with an optional K, M, G or T suffix.
+ * @param str Size string, e.g. "4096" or "4K".
+ * @param size Output size in bytes.
+ * @return 0 on success.
+ */
+int parse_size(char *str, uint64_t *size){
+	char *end;
+	int shift = 0;
+
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if(end == str || errno != 0){
+		return 1;
+	}
+
+	switch(*end){
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		case 't': case 'T': shift = 40; end++; break;
+	}
+
+	if(*end != '\0' || *size > (UINT64_MAX >> shift)){
+		return 1;
+	}
+
+	*size <<= shift;
+
+	return 0;
+}
+
+/**
+ * @brief Parse a defragmentation budget.
+ * @param str Seconds with an "s" suffix, e.g. "0.5s", or a number of sectors, with an optional K, M, G or T suffix.
+ * @param seconds Output time budget, unchanged for a sector budget.
+ * @param sectors Output sector budget, unchanged for a time budget.
+ * @return 0 on success.
+ */
+int parse_budget(char *str, double *seconds, uint64_t *sectors){
+	char *end;
+	size_t len = strlen(str);
+
+	if(len > 1 && str[len - 1] == 's'){
+		errno = 0;
+		*seconds = strtod(str, &end);
+		return end != str + len - 1 || errno != 0 || *seconds <= 0;
+	}
+
+	return parse_size(str, sectors) != 0 || *sectors == 0;
+}
+
+/**
+ * @brief Format the disk with the geometry given on the command line.
+ * @param exec Program name.
+ * @param argc Number of arguments, including the command itself.
+ * @param argv "-format" [sector size] [disk size].
+ * @return 0 on success.
+ */
+int run_format(char *exec, int argc, char **argv){
+	uint64_t sector_size = DEFAULT_SECTOR_SIZE;
+	uint64_t disk_size;
+
+	if(argc > 1 && (parse_size(argv[1], &sector_size) != 0 || sector_size == 0 || sector_size > MAX_SECTOR_SIZE)){
+		printf("%s -format [sector size] [disk size]\n", exec);
+		return 1;
+	}
+
+	/* Same capacity as the original disk by default. */
+	disk_size = (uint64_t)DEFAULT_SECTOR_SIZE * DEFAULT_NUMBER_OF_SECTORS;
+	if(argc > 2 && parse_size(argv[2], &disk_size) != 0){
+		printf("%s -format [sector size] [disk size]\n", exec);
+		return 1;
+	}
+
+	return fs_format(disk_image, sector_size, disk_size / sector_size);
+}
+
+/**
+ * @brief Copy a byte range of a file to a host file or stdout.
+ * @param exec Program name.
+ * @param fs Open filesystem.
+ * @param argc Number of arguments, including the command itself.
+ * @param argv "-read-range" <disk file | -> <simulated file> <offset> <length>.
+ * @return 0 on success.
+ */
+int run_read_range(char *exec, struct fs_handle *fs, int argc, char **argv){
+	uint64_t offset, length, want;
+	int64_t n = 0;
+	char *buf;
+	FILE *out;
+	int ret = 0;
+
+	if(argc < 5 || parse_size(argv[3], &offset) != 0 || parse_size(argv[4], &length) != 0){
+		printf("%s -read-range <disk file | -> <simulated file> <offset> <length>\n", exec);
+		return 1;
+	}
+
+	if( (buf = malloc(RANGE_CHUNK)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	if( !strcmp(argv[1], "-")){
+		out = data_stdout();
+	}else if( (out = fopen(argv[1], "w")) == NULL){
+		perror("fopen()");
+	}
+
+	printf("- Copying %" PRIu64 " bytes at %" PRIu64 " of '%s'\n", length, offset, argv[2]);
+
+	for(; out != NULL && length > 0; offset += n, length -= n){
+		want = length < RANGE_CHUNK ? length : RANGE_CHUNK;
+		if( (n = fs_pread(fs, argv[2], buf, offset, want)) <= 0){
+			ret = n < 0;
+			break;
+		}
+		fwrite(buf, 1, n, out);
+	}
+
+	if(out == NULL){
+		ret = 1;
+	}else if(out == data_out){
+		ret |= fflush(out) != 0;
 	}else{
-	
-		/* Disk formating. */
-		if( !strcmp(argv[1], "-format")){
-			fs_format();
+		ret |= fclose(out) != 0;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Write a host file or stdin into an existing file, at an offset or at its end.
+ * @param exec Program name.
+ * @param fs Open filesystem.
+ * @param argc Number of arguments, including the command itself.
+ * @param argv "-write" <disk file | -> <simulated file> <offset>, or "-append" <disk file | -> <simulated file>.
+ * @param append 1 for -append.
+ * @return 0 on success.
+ */
+int run_write(char *exec, struct fs_handle *fs, int argc, char **argv, int append){
+	uint64_t offset = 0, total = 0;
+	int64_t n = 0;
+	size_t got;
+	char *buf;
+	FILE *in;
+	int ret = 0;
+
+	if(argc < (append ? 3 : 4) || (!append && parse_size(argv[3], &offset) != 0)){
+		if(append){
+			printf("%s -append <disk file | -> <simulated file>\n", exec);
+		}else{
+			printf("%s -write <disk file | -> <simulated file> <offset>\n", exec);
 		}
+		return 1;
+	}
 
-		if( !strcmp(argv[1], "-create")){
-			if(argc < 4){
-				printf("%s -create <disk file> <simulated file>\n", argv[0]);
-			} else {
-				fs_create(argv[2], argv[3]);
-			}
+	if( !strcmp(argv[1], "-")){
+		if(batch_stdin){
+			printf("Error: stdin holds the batch script\n");
+			return 1;
 		}
+		in = stdin;
+	}else if( (in = fopen(argv[1], "r")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
 
-		if( !strcmp(argv[1], "-read")){
-			if(argc < 4){
-				printf("%s -read <disk file> <simulated file>\n", argv[0]);
-			} else {
-				fs_read(argv[2], argv[3]);
-			}
+	if( (buf = malloc(RANGE_CHUNK)) == NULL){
+		perror("malloc()");
+		if(in != stdin){
+			fclose(in);
 		}
+		return 1;
+	}
 
-		if( !strcmp(argv[1], "-ls")){
-			if(argc < 3){
-				printf("%s -ls <absolute directory path>\n", argv[0]);
-			} else {
-				fs_ls(argv[2]);
-			}
+	/* At least one call, so an empty input still finds the file. */
+	do{
+		got = fread(buf, 1, RANGE_CHUNK, in);
+		n = append ? fs_append(fs, argv[2], buf, got) : fs_pwrite(fs, argv[2], buf, offset + total, got);
+		if(n < 0){
+			ret = 1;
+			break;
 		}
+		total += n;
+	}while(got == RANGE_CHUNK);
 
-		if( !strcmp(argv[1], "-del")){
-			if(argc < 3){
-				printf("%s -del <simulated file>\n", argv[0]);
-			} else {
-				fs_del(argv[2]);
-			}
+	if(ferror(in)){
+		printf("Error: Could not read the input\n");
+		ret = 1;
+	}
+	if(ret == 0){
+		printf("Wrote %" PRIu64 " bytes %s '%s'\n", total, append ? "at the end of" : "into", argv[2]);
+	}
+
+	if(in != stdin){
+		fclose(in);
+	}
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Open the disk image, unless it is already open.
+ * @param fs Open filesystem, set when the disk is opened.
+ * @return 0 on success.
+ */
+int open_disk(struct fs_handle **fs){
+	if(*fs != NULL){
+		return 0;
+	}
+
+	if( (*fs = fs_open(disk_image, disk_backend)) == NULL){
+		printf("Error: Could not open the disk\n");
+		return 1;
+	}
+
+	if(stats_output && fs_enable_stats(*fs) != 0){
+		return 1;
+	}
+
+	fs_set_model(*fs, disk_timed ? &disk_model : NULL, disk_scheduler);
+
+	if(disk_compress){
+		fs_set_compression(*fs, 1, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Print the per-operation statistics and the simulated disk time, if asked for.
+ * @param fs Open filesystem.
+ */
+void print_stats(struct fs_handle *fs){
+	struct os_stats stats;
+	struct ds_stats io;
+	double seconds;
+
+	if(stats_output && fs_get_op_stats(fs, &stats) == 0){
+		os_print(stdout, &stats, stats_output == 2);
+	}
+
+	if(disk_timed){
+		fs_get_io_stats(fs, &io);
+		seconds = io.sim_ns / 1e9;
+		printf("Simulated disk: %lu requests, %lu sectors, %.3f ms, %.2f MB/s\n", io.reads + io.writes,
+			io.sectors_read + io.sectors_written, seconds * 1e3,
+			seconds > 0 ? (double)(io.sectors_read + io.sectors_written) * fs_sector_size(fs) / seconds / (1 << 20) : 0.0);
+	}
+}
+
+/**
+ * @brief Run a single filesystem command.
+ * @param exec Program name, used for the usage messages.
+ * @param fs Open filesystem, the disk is opened by the first command that needs it.
+ * @param argc Number of arguments, including the command itself.
+ * @param argv Command ("-create", "create", ...) followed by its arguments.
+ * @return 0 on success, -1 if the command is unknown, otherwise error.
+ */
+int run_command(char *exec, struct fs_handle **fs, int argc, char **argv){
+	char *cmd = argv[0];
+	int ret;
+
+	/* The leading dash is optional, so batch scripts can omit it. */
+	if(cmd[0] == '-'){
+		cmd++;
+	}
+
+	/* Disk formating. An open disk is closed and reopened around it. */
+	if( !strcmp(cmd, "format")){
+		if(*fs == NULL){
+			return run_format(exec, argc, argv);
+		}
+		fs_close(*fs);
+		*fs = NULL;
+		if( (ret = run_format(exec, argc, argv)) != 0){
+			return ret;
 		}
+		return open_disk(fs);
+	}
+
+	if( strcmp(cmd, "create") && strcmp(cmd, "read") && strcmp(cmd, "read-range") && strcmp(cmd, "write") &&
+	    strcmp(cmd, "append") && strcmp(cmd, "ls") && strcmp(cmd, "del") &&
+	    strcmp(cmd, "mkdir") && strcmp(cmd, "rmdir") && strcmp(cmd, "import") && strcmp(cmd, "sync") &&
+	    strcmp(cmd, "map") && strcmp(cmd, "defrag") && strcmp(cmd, "compress") && strcmp(cmd, "abort")){
+		return -1;
+	}
+
+	if(open_disk(fs) != 0){
+		return 1;
+	}
 
-		if( !strcmp(argv[1], "-mkdir")){
-			if(argc < 3){
-				printf("%s -mkdir <absolute directory path>\n", argv[0]);
-			} else {
-				fs_mkdir(argv[2]);
+	if( !strcmp(cmd, "create")){
+		if(argc < 3){
+			printf("%s -create <disk file | -> <simulated file>\n", exec);
+			return 1;
+		}
+		if( !strcmp(argv[1], "-")){
+			if(batch_stdin){
+				printf("Error: stdin holds the batch script\n");
+				return 1;
 			}
+			return fs_create_stream(*fs, stdin, argv[2]);
+		}
+		return fs_create(*fs, argv[1], argv[2]);
+	}
+
+	if( !strcmp(cmd, "read")){
+		if(argc < 3){
+			printf("%s -read <disk file | -> <simulated file>\n", exec);
+			return 1;
+		}
+		if( !strcmp(argv[1], "-")){
+			FILE *out = data_stdout();
+
+			return out == NULL || fs_read_stream(*fs, out, argv[2]) != 0;
+		}
+		return fs_read(*fs, argv[1], argv[2]);
+	}
+
+	if( !strcmp(cmd, "read-range")){
+		return run_read_range(exec, *fs, argc, argv);
+	}
+
+	if( !strcmp(cmd, "write") || !strcmp(cmd, "append")){
+		return run_write(exec, *fs, argc, argv, !strcmp(cmd, "append"));
+	}
+
+	if( !strcmp(cmd, "ls")){
+		if(argc < 2){
+			printf("%s -ls <absolute directory path>\n", exec);
+			return 1;
+		}
+		return fs_ls(*fs, argv[1]);
+	}
+
+	if( !strcmp(cmd, "del")){
+		if(argc < 2){
+			printf("%s -del <simulated file>\n", exec);
+			return 1;
+		}
+		return fs_del(*fs, argv[1]);
+	}
+
+	if( !strcmp(cmd, "mkdir")){
+		if(argc < 2){
+			printf("%s -mkdir <absolute directory path>\n", exec);
+			return 1;
+		}
+		return fs_mkdir(*fs, argv[1]);
+	}
+
+	if( !strcmp(cmd, "rmdir")){
+		if(argc < 2){
+			printf("%s -rmdir <absolute directory path>\n", exec);
+			return 1;
+		}
+		return fs_rmdir(*fs, argv[1]);
+	}
+
+	if( !strcmp(cmd, "import")){
+		if(argc < 3){
+			printf("%s -import <host directory> <absolute directory path> [threads]\n", exec);
+			return 1;
+		}
+		return fs_import(*fs, argv[1], argv[2], argc > 3 ? atoi(argv[3]) : IMPORT_DEFAULT_THREADS) != 0;
+	}
+
+	/* Map of the free, data and metadata sectors, with the fragmentation. */
+	if( !strcmp(cmd, "map")){
+		return fs_free_map(*fs, argc > 1 ? argv[1] : MAP_DEFAULT_IMAGE);
+	}
+
+	/* Defragment, at most for the time or the sectors given. */
+	if( !strcmp(cmd, "defrag")){
+		double seconds = 0;
+		uint64_t sectors = 0;
+
+		if(argc > 1 && parse_budget(argv[1], &seconds, &sectors) != 0){
+			printf("%s -defrag [<seconds>s | <sectors>]\n", exec);
+			return 1;
+		}
+		return fs_defrag(*fs, seconds, sectors);
+	}
+
+	/* Compression of the files created from now on, kept by the disk. */
+	if( !strcmp(cmd, "compress")){
+		if(argc < 2 || (strcmp(argv[1], "on") && strcmp(argv[1], "off"))){
+			printf("%s -compress on|off\n", exec);
+			return 1;
+		}
+		fs_set_compression(*fs, !strcmp(argv[1], "on"), 1);
+		printf("Compression %s\n", argv[1]);
+		return 0;
+	}
+
+	/* Flush the disk (batch mode). */
+	if( !strcmp(cmd, "sync")){
+		return fs_sync(*fs);
+	}
+
+	/* Stop without writing anything back, like a crash (batch mode). */
+	if( !strcmp(cmd, "abort")){
+		fflush(stdout);
+		_exit(2);
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Run a stream of commands against one open disk.
+ *
+ * Each line holds one command with its arguments separated by blanks, e.g.
+ * "create images/sun.jpg /home/sun.jpg". Blank lines and lines starting
+ * with '#' are skipped. The disk is opened once and flushed at the end,
+ * or earlier with a "sync" line. An "abort" line stops at once, leaving
+ * the disk as a crash would.
+ *
+ * @param exec Program name.
+ * @param script Script file path, "-" reads from stdin.
+ * @return Number of failed commands, or -1 if the batch could not start.
+ */
+int run_batch(char *exec, char *script){
+	struct fs_handle *fs = NULL;
+	FILE *input;
+	char line[MAX_LINE];
+	char *args[MAX_ARGS];
+	int argc, ret;
+	int lineno = 0, total = 0, failed = 0;
+	struct bc_stats cache;
+	struct dc_stats dentries;
+
+	if( !strcmp(script, "-")){
+		input = stdin;
+		batch_stdin = 1;
+	}else if( (input = fopen(script, "r")) == NULL){
+		perror("fopen()");
+		return -1;
+	}
+
+	if( open_disk(&fs) != 0){
+		if(input != stdin){
+			fclose(input);
+		}
+		return -1;
+	}
+
+	while( fgets(line, sizeof(line), input) != NULL){
+		lineno++;
+
+		argc = 0;
+		args[argc] = strtok(line, " \t\r\n");
+		while(args[argc] != NULL && argc < MAX_ARGS - 1){
+			args[++argc] = strtok(NULL, " \t\r\n");
 		}
 
-		if( !strcmp(argv[1], "-rmdir")){
-			if(argc < 3){
-				printf("%s -rmdir <absolute directory path>\n", argv[0]);
-			} else {
-				fs_rmdir(argv[2]);
+		if(argc == 0 || args[0][0] == '#'){
+			continue;
+		}
+
+		total++;
+		ret = run_command(exec, &fs, argc, args);
+
+		if(ret == -1){
+			printf("[%d] %s: unknown command\n", lineno, args[0]);
+		}else{
+			printf("[%d] %s: %s\n", lineno, args[0], ret == 0 ? "ok" : "failed");
+		}
+
+		if(ret != 0){
+			failed++;
+		}
+	}
+
+	if(input != stdin){
+		fclose(input);
+	}
+
+	printf("Batch finished: %d commands, %d failed.\n", total, failed);
+
+	/* A failed format leaves the disk closed. */
+	if(fs == NULL){
+		return failed;
+	}
+
+	fs_sync(fs);
+	fs_get_stats(fs, &cache, &dentries);
+	print_stats(fs);
+	fs_close(fs);
+
+	printf("Cache: %lu hits, %lu misses, %lu merged writes, %lu writebacks, %lu evictions.\n",
+		cache.hits, cache.misses, cache.merged, cache.writebacks, cache.evictions);
+
+	printf("Dentry cache: %lu hits, %lu negative hits, %lu misses.\n",
+		dentries.hits, dentries.negative_hits, dentries.misses);
+
+	return failed;
+}
+
+int main(int argc, char **argv){
+	struct fs_handle *fs = NULL;
+	int ret = 0;
+	char *exec = argv[0];
+
+	/* Global options come before the command. */
+	while(argc > 1){
+		if( !strcmp(argv[1], "-mmap")){
+			disk_backend = DS_BACKEND_MMAP;
+		}else if( !strcmp(argv[1], "-uring")){
+			disk_backend = DS_BACKEND_URING;
+		}else if( !strcmp(argv[1], "-threads")){
+			disk_backend = DS_BACKEND_THREADS;
+		}else if( !strcmp(argv[1], "-stats")){
+			stats_output = 1;
+		}else if( !strcmp(argv[1], "-stats-json")){
+			stats_output = 2;
+		}else if( !strcmp(argv[1], "-z")){
+			disk_compress = 1;
+		}else if( !strcmp(argv[1], "-model") && argc > 2){
+			if(ds_model_parse(argv[2], &disk_model) != 0){
+				printf("Error: Unknown timing model '%s'\n", argv[2]);
+				return 1;
 			}
+			disk_timed = 1;
+			argv++;
+			argc--;
+		}else if( !strcmp(argv[1], "-sched") && argc > 2){
+			if( (disk_scheduler = ds_sched_parse(argv[2])) < 0){
+				printf("Error: Unknown scheduler '%s'\n", argv[2]);
+				return 1;
+			}
+			argv++;
+			argc--;
+		}else if( !strcmp(argv[1], "-disk") && argc > 2){
+			disk_image = argv[2];
+			argv++;
+			argc--;
+		}else{
+			break;
+		}
+		argv++;
+		argc--;
+	}
+	argv[0] = exec;
+
+	if(argc<2){
+		usage(argv[0]);
+		return 0;
+	}
+
+	if( !strcmp(argv[1], "-batch")){
+		if(argc < 3){
+			printf("%s -batch <script file | ->\n", argv[0]);
+			return 1;
 		}
-		
-	}
-	
-	
-	/* Implement the other filesystem calls here!! */
-	
-	
-	
-	/* Create a map of used/free disk sectors. */
-	fs_free_map("log.dat");
-	
-	return 	0; 
+		ret = run_batch(argv[0], argv[2]);
+	}else if( (ret = run_command(argv[0], &fs, argc - 1, argv + 1)) == -1){
+		usage(argv[0]);
+	}
+
+	if(fs != NULL){
+		print_stats(fs);
+		fs_close(fs);
+	}
+
+	return ret != 0;
 }
-	
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "libdisksimul.h"
+#include "filesystem.h"
+
+/* Multi-threaded stress test.
+ *
+ * Runs the same workload with 1, 2, 4 ... threads on one open disk: each
+ * thread creates files in its own directory, then every thread reads the
+ * files of all the directories, then each thread deletes its files. The
+ * throughput of every phase is reported, and the files read back are
+ * compared with the source.
+ */
+
+#define STRESS_IMAGE	"stress.fs"
+#define STRESS_SOURCE	"images/earth.jpg"
+
+/**
+ * Work of one thread.
+ */
+struct worker{
+	pthread_t thread;		/**< Thread. */
+	struct fs_handle *fs;		/**< Shared disk. */
+	int id;				/**< Thread number, its directory is /t<id>. */
+	int n_threads;			/**< Number of threads of the run. */
+	int files;			/**< Files per thread. */
+	int phase;			/**< 0 create, 1 read, 2 delete. */
+	int failed;			/**< Failed operations. */
+};
+
+static unsigned char *source = NULL;
+static long source_len = 0;
+
+/**
+ * @brief Load the source file, to check what is read back.
+ * @param path Source file path.
+ * @return 0 on success.
+ */
+static int load_source(char *path){
+	FILE *f;
+
+	if( (f = fopen(path, "rb")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	source_len = ftell(f);
+	rewind(f);
+
+	if( (source = malloc(source_len)) == NULL || (long)fread(source, 1, source_len, f) != source_len){
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/**
+ * @brief Compare a file read back with the source.
+ * @param path File path.
+ * @return 0 if they are equal.
+ */
+static int check_file(char *path){
+	unsigned char *buf;
+	FILE *f;
+	int ret = 1;
+
+	if( (f = fopen(path, "rb")) == NULL){
+		return 1;
+	}
+
+	if( (buf = malloc(source_len + 1)) != NULL){
+		ret = (long)fread(buf, 1, source_len + 1, f) != source_len || memcmp(buf, source, source_len) != 0;
+		free(buf);
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+static void *work(void *arg){
+	struct worker *w = arg;
+	char path[64], out[64];
+	int i, t;
+
+	snprintf(out, sizeof(out), "stress_%d.out", w->id);
+
+	for(i = 0; i < w->files; i++){
+		snprintf(path, sizeof(path), "/t%d/f%d", w->id, i);
+
+		if(w->phase == 0){
+			w->failed += fs_create(w->fs, STRESS_SOURCE, path) != 0;
+		}else if(w->phase == 2){
+			w->failed += fs_del(w->fs, path) != 0;
+		}else{
+			/* Every thread reads from every directory. */
+			for(t = 0; t < w->n_threads; t++){
+				snprintf(path, sizeof(path), "/t%d/f%d", (w->id + t) % w->n_threads, i);
+				if(fs_read(w->fs, out, path) != 0 || check_file(out) != 0){
+					w->failed++;
+				}
+			}
+		}
+	}
+
+	unlink(out);
+
+	return NULL;
+}
+
+/**
+ * @brief Run one phase on every thread and time it.
+ * @return Elapsed seconds.
+ */
+static double run_phase(struct worker *workers, int n_threads, int phase){
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < n_threads; i++){
+		workers[i].phase = phase;
+		pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+	}
+
+	for(i = 0; i < n_threads; i++){
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Run the workload with a number of threads.
+ * @param report Output of the results.
+ * @param n_threads Number of threads.
+ * @param files Files per thread.
+ * @return Number of failed operations.
+ */
+static int run(FILE *report, int n_threads, int files){
+	struct worker *workers;
+	struct fs_handle *fs;
+	double t_create, t_read, t_del;
+	char path[64];
+	int i, failed = 0;
+
+	/* Room for every file, with 4K sectors. */
+	if(fs_format(STRESS_IMAGE, 4096, ((uint64_t)n_threads * files * (source_len / 4096 + 2)) + 1024) != 0 ||
+	   (fs = fs_open(STRESS_IMAGE, DS_BACKEND_FILE)) == NULL){
+		return 1;
+	}
+
+	workers = calloc(n_threads, sizeof(struct worker));
+	for(i = 0; i < n_threads; i++){
+		snprintf(path, sizeof(path), "/t%d", i);
+		failed += fs_mkdir(fs, path) != 0;
+
+		workers[i].fs = fs;
+		workers[i].id = i;
+		workers[i].n_threads = n_threads;
+		workers[i].files = files;
+	}
+
+	t_create = run_phase(workers, n_threads, 0);
+	t_read = run_phase(workers, n_threads, 1);
+	t_del = run_phase(workers, n_threads, 2);
+
+	for(i = 0; i < n_threads; i++){
+		failed += workers[i].failed;
+	}
+
+	fs_close(fs);
+	free(workers);
+
+	fprintf(report, "%2d threads: %8.0f creates/s %8.0f reads/s %8.0f deletes/s, %d failed\n", n_threads,
+		n_threads * files / t_create, (double)n_threads * n_threads * files / t_read, n_threads * files / t_del, failed);
+	fflush(report);
+
+	return failed;
+}
+
+int main(int argc, char **argv){
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int files = argc > 2 ? atoi(argv[2]) : 200;
+	int n, failed = 0;
+	FILE *report;
+
+	if(max_threads < 1 || files < 1){
+		printf("%s [max threads] [files per thread]\n", argv[0]);
+		return 1;
+	}
+
+	if(load_source(STRESS_SOURCE) != 0){
+		return 1;
+	}
+
+	/* The filesystem reports every operation on stdout, keep only the results. */
+	fflush(stdout);
+	if( (report = fdopen(dup(STDOUT_FILENO), "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL){
+		perror("stdout");
+		return 1;
+	}
+
+	fprintf(report, "%ld byte files, %d per thread, %ld cores\n", source_len, files, sysconf(_SC_NPROCESSORS_ONLN));
+
+	for(n = 1; n <= max_threads; n *= 2){
+		failed += run(report, n, files);
+	}
+
+	unlink(STRESS_IMAGE);
+	free(source);
+	fclose(report);
+
+	return failed != 0;
+}
@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "libdisksimul.h"
+#include "journal.h"
+
+/* Write-ahead journal of the metadata sectors.
+ *
+ * The sector cache hands every write-back to jn_commit, which appends the
+ * dirty sectors to a ring as one transaction and flushes the disk. The
+ * sectors are written in place later by a checkpoint, from copies kept in
+ * memory until then; jn_read serves them to the cache meanwhile. The
+ * checkpoint thread runs when half the ring is used, or after
+ * JN_CHECKPOINT_SECONDS. jn_open replays the transactions that were
+ * committed but not checkpointed.
+ *
+ * File data is not journaled. jn_barrier checkpoints before data overwrites
+ * a sector that is still in the journal, so a replay never puts back
+ * metadata over it.
+ */
+
+/* Seconds a committed transaction waits for the checkpoint thread at most. */
+#define JN_CHECKPOINT_SECONDS	5
+
+/**
+ * Committed sector not written in place yet.
+ */
+struct jn_pending{
+	uint64_t sector;		/**< Home sector. */
+	uint64_t seq;			/**< Last transaction that logged it. */
+	struct jn_pending *next;	/**< Hash bucket chain. */
+	unsigned char data[];		/**< Sector contents. */
+};
+
+/**
+ * Journal of one disk.
+ */
+struct jn_journal{
+	struct ds_device *dev;		/**< Disk. */
+	uint64_t header;		/**< Header sector. */
+	uint64_t ring_start;		/**< First ring sector. */
+	uint64_t ring_len;		/**< Ring sectors. */
+	int sector_size;		/**< Sector size in bytes. */
+	int per_record;			/**< Logged sectors per record. */
+	uint64_t head;			/**< Next position to write. */
+	uint64_t committed;		/**< End of the last complete transaction. */
+	uint64_t committed_seq;		/**< Sequence number following it. */
+	uint64_t tail;			/**< Start of the oldest transaction not checkpointed. */
+	uint64_t seq;			/**< Sequence number of the next transaction. */
+	struct jn_pending **buckets;	/**< Pending sectors by home sector. */
+	int n_buckets;			/**< Hash table size, a power of two. */
+	int n_pending;			/**< Pending sectors. */
+	struct jn_stats stats;		/**< Counters. */
+	int stopping;			/**< Set by jn_close. */
+	pthread_mutex_t lock;		/**< Protects everything above. */
+	pthread_mutex_t cp_lock;	/**< Held while a checkpoint runs. */
+	pthread_cond_t wake;		/**< Wakes the checkpoint thread. */
+	pthread_t thread;		/**< Checkpoint thread. */
+};
+
+
+static int bucket_of(struct jn_journal *j, uint64_t sector_number){
+	return (sector_number * 0x9E3779B97F4A7C15ull >> 32) & (j->n_buckets - 1);
+}
+
+static struct jn_pending *find_pending(struct jn_journal *j, uint64_t sector_number){
+	struct jn_pending *p;
+
+	for(p = j->buckets[bucket_of(j, sector_number)]; p != NULL; p = p->next){
+		if(p->sector == sector_number){
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief FNV-1a checksum.
+ * @param h Checksum of the previous bytes, 2166136261 to start.
+ * @param data Bytes.
+ * @param len Number of bytes.
+ * @return Checksum.
+ */
+static uint32_t checksum(uint32_t h, const void *data, size_t len){
+	const unsigned char *p = data;
+
+	while(len-- > 0){
+		h = (h ^ *p++) * 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Checksum of a record and the sectors it logs.
+ * @param r Record.
+ * @param data Logged sectors, one after the other.
+ * @param sector_size Sector size in bytes.
+ * @return Checksum.
+ */
+static uint32_t record_checksum(struct jn_record *r, unsigned char *data, int sector_size){
+	uint32_t h = 2166136261u;
+
+	h = checksum(h, &r->seq, sizeof(r->seq));
+	h = checksum(h, r->sectors, r->count * sizeof(uint64_t));
+
+	return checksum(h, data, (size_t)r->count * sector_size);
+}
+
+/**
+ * @brief Write the journal header.
+ * @return 0 on success.
+ */
+static int write_header(struct ds_device *dev, uint64_t sector, int sector_size, uint64_t tail, uint64_t tail_seq){
+	struct jn_header *h;
+	int ret;
+
+	if( (h = calloc(1, sector_size)) == NULL){
+		perror("calloc()");
+		return 1;
+	}
+
+	h->magic = JN_MAGIC;
+	h->tail = tail;
+	h->tail_seq = tail_seq;
+	ret = ds_write_sector(dev, sector, (void*)h, sector_size);
+	free(h);
+
+	return ret;
+}
+
+/**
+ * @brief Write consecutive positions of the ring, wrapping at its end.
+ * @return 0 on success.
+ */
+static int write_ring(struct jn_journal *j, uint64_t pos, unsigned char *buf, uint64_t count){
+	uint64_t first = pos % j->ring_len;
+	uint64_t n = count < j->ring_len - first ? count : j->ring_len - first;
+
+	if(ds_write_sectors(j->dev, j->ring_start + first, n, buf, j->sector_size) != 0){
+		return 1;
+	}
+
+	if(n < count){
+		return ds_write_sectors(j->dev, j->ring_start, count - n, buf + n * j->sector_size, j->sector_size);
+	}
+
+	return 0;
+}
+
+static int read_ring(struct jn_journal *j, uint64_t pos, void *data){
+	return ds_read_sector(j->dev, j->ring_start + pos % j->ring_len, data, j->sector_size);
+}
+
+/**
+ * @brief Write an empty journal.
+ *
+ * @param dev Disk.
+ * @param start First sector of the journal region.
+ * @param n_sectors Sectors of the region, header included.
+ * @param sector_size Sector size in bytes.
+ * @return 0 on success.
+ */
+int jn_create(struct ds_device *dev, uint64_t start, uint64_t n_sectors, int sector_size){
+	if(n_sectors < JN_MIN_SECTORS){
+		return 1;
+	}
+
+	return write_header(dev, start, sector_size, 0, 1);
+}
+
+/**
+ * @brief Check a transaction of the ring.
+ *
+ * @param j Journal.
+ * @param pos Position of the first record.
+ * @param seq Expected sequence number.
+ * @param record Buffer of one sector.
+ * @param data Buffer of per_record sectors.
+ * @return Position after the transaction, pos if it is not complete.
+ */
+static uint64_t check_transaction(struct jn_journal *j, uint64_t pos, uint64_t seq, struct jn_record *record, unsigned char *data){
+	uint64_t p = pos;
+	uint32_t i;
+
+	do{
+		if(p - pos >= j->ring_len || read_ring(j, p, record) != 0 ||
+		   record->magic != JN_RECORD_MAGIC || record->seq != seq ||
+		   record->count == 0 || record->count > (uint32_t)j->per_record){
+			return pos;
+		}
+
+		for(i = 0; i < record->count; i++){
+			if(read_ring(j, p + 1 + i, data + (size_t)i * j->sector_size) != 0){
+				return pos;
+			}
+		}
+
+		if(record_checksum(record, data, j->sector_size) != record->checksum){
+			return pos;
+		}
+
+		p += 1 + record->count;
+	}while( !(record->flags & JN_LAST));
+
+	return p - pos <= j->ring_len ? p : pos;
+}
+
+/**
+ * @brief Write the sectors of a checked transaction in place.
+ * @return 0 on success.
+ */
+static int apply_transaction(struct jn_journal *j, uint64_t pos, uint64_t end, struct jn_record *record, unsigned char *data){
+	uint32_t i;
+
+	while(pos < end){
+		if(read_ring(j, pos, record) != 0){
+			return 1;
+		}
+
+		for(i = 0; i < record->count; i++){
+			if(read_ring(j, pos + 1 + i, data) != 0 ||
+			   ds_write_sector(j->dev, record->sectors[i], data, j->sector_size) != 0){
+				return 1;
+			}
+		}
+
+		pos += 1 + record->count;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Replay the committed transactions that were not checkpointed.
+ * @param j Journal, header loaded in tail and seq.
+ * @return 0 on success.
+ */
+static int replay(struct jn_journal *j){
+	struct jn_record *record;
+	unsigned char *data;
+	uint64_t end;
+	int ret = 0;
+
+	record = malloc(j->sector_size);
+	data = malloc((size_t)j->per_record * j->sector_size);
+	if(record == NULL || data == NULL){
+		perror("malloc()");
+		free(record);
+		free(data);
+		return 1;
+	}
+
+	while( (end = check_transaction(j, j->tail, j->seq, record, data)) != j->tail){
+		if(apply_transaction(j, j->tail, end, record, data) != 0){
+			ret = 1;
+			break;
+		}
+		j->tail = end;
+		j->seq++;
+		j->stats.replayed++;
+	}
+
+	free(record);
+	free(data);
+
+	if(ret == 0 && j->stats.replayed > 0){
+		printf("Journal: replayed %lu transactions\n", j->stats.replayed);
+		if(ds_flush(j->dev) != 0 || write_header(j->dev, j->header, j->sector_size, j->tail, j->seq) != 0 || ds_flush(j->dev) != 0){
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+static void *checkpoint_thread(void *arg){
+	struct jn_journal *j = arg;
+	struct timespec deadline;
+	int timeout, full;
+
+	pthread_mutex_lock(&j->lock);
+	while( !j->stopping){
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JN_CHECKPOINT_SECONDS;
+
+		timeout = pthread_cond_timedwait(&j->wake, &j->lock, &deadline) == ETIMEDOUT;
+		full = j->committed - j->tail > j->ring_len / 2;
+
+		if( !j->stopping && (full || (timeout && j->committed != j->tail))){
+			pthread_mutex_unlock(&j->lock);
+			jn_checkpoint(j);
+			pthread_mutex_lock(&j->lock);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Open the journal of a disk, replaying it.
+ *
+ * Must be called before anything else reads the metadata.
+ *
+ * @param dev Disk.
+ * @param start First sector of the journal region.
+ * @param n_sectors Sectors of the region, header included.
+ * @param sector_size Sector size in bytes.
+ * @return Journal, NULL on error.
+ */
+struct jn_journal *jn_open(struct ds_device *dev, uint64_t start, uint64_t n_sectors, int sector_size){
+	struct jn_journal *j;
+	struct jn_header *h;
+
+	if(n_sectors < JN_MIN_SECTORS){
+		printf("Error: Invalid journal\n");
+		return NULL;
+	}
+
+	if( (j = calloc(1, sizeof(struct jn_journal))) == NULL || (h = malloc(sector_size)) == NULL){
+		perror("malloc()");
+		free(j);
+		return NULL;
+	}
+
+	j->dev = dev;
+	j->header = start;
+	j->ring_start = start + 1;
+	j->ring_len = n_sectors - 1;
+	j->sector_size = sector_size;
+	j->per_record = (sector_size - offsetof(struct jn_record, sectors)) / sizeof(uint64_t);
+
+	if(ds_read_sector(dev, start, (void*)h, sector_size) != 0 || h->magic != JN_MAGIC){
+		printf("Error: Invalid journal\n");
+		free(h);
+		free(j);
+		return NULL;
+	}
+	j->tail = h->tail;
+	j->seq = h->tail_seq;
+	free(h);
+
+	if(replay(j) != 0){
+		printf("Error: Journal replay failed\n");
+		free(j);
+		return NULL;
+	}
+	j->head = j->committed = j->tail;
+	j->committed_seq = j->seq;
+
+	/* At most one pending sector per ring position. */
+	for(j->n_buckets = 1; (uint64_t)j->n_buckets < j->ring_len; j->n_buckets <<= 1);
+	if( (j->buckets = calloc(j->n_buckets, sizeof(struct jn_pending*))) == NULL){
+		perror("calloc()");
+		free(j);
+		return NULL;
+	}
+
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_mutex_init(&j->cp_lock, NULL);
+	pthread_cond_init(&j->wake, NULL);
+
+	if(pthread_create(&j->thread, NULL, checkpoint_thread, j) != 0){
+		perror("pthread_create()");
+		pthread_mutex_destroy(&j->lock);
+		pthread_mutex_destroy(&j->cp_lock);
+		pthread_cond_destroy(&j->wake);
+		free(j->buckets);
+		free(j);
+		return NULL;
+	}
+
+	return j;
+}
+
+/**
+ * @brief Keep a committed sector until it is checkpointed, with the journal locked.
+ * @return 0 on success.
+ */
+static int keep_pending(struct jn_journal *j, uint64_t sector_number, unsigned char *data, uint64_t seq){
+	struct jn_pending *p;
+
+	if( (p = find_pending(j, sector_number)) == NULL){
+		if( (p = malloc(sizeof(struct jn_pending) + j->sector_size)) == NULL){
+			return 1;
+		}
+		p->sector = sector_number;
+		p->next = j->buckets[bucket_of(j, sector_number)];
+		j->buckets[bucket_of(j, sector_number)] = p;
+		j->n_pending++;
+	}
+
+	memcpy(p->data, data, j->sector_size);
+	p->seq = seq;
+
+	return 0;
+}
+
+/**
+ * @brief Commit sectors to the journal as one transaction.
+ *
+ * The sectors are durable when it returns, and are written in place by a
+ * later checkpoint; one runs first when the ring has no room left. A
+ * transaction is replayed whole or not at all, so a group larger than the
+ * ring is refused. Commits are serialised by the caller.
+ *
+ * @param j Journal.
+ * @param n Number of sectors, at least one.
+ * @param sectors Home sector of each one.
+ * @param data Contents of each one.
+ * @return 0 on success.
+ */
+int jn_commit(struct jn_journal *j, int n, uint64_t *sectors, unsigned char **data){
+	struct jn_record *r;
+	unsigned char *buf, *p;
+	uint64_t need, start, seq;
+	int i, k, count, ret = 0;
+
+	need = n + (n + j->per_record - 1) / j->per_record;
+	if(need > j->ring_len){
+		printf("Error: Transaction of %d sectors larger than the journal\n", n);
+		return 1;
+	}
+
+	/* Records, each followed by the sectors it logs. They are built before
+	 * the ring space is taken, a sequence number is never left unwritten. */
+	if( (buf = calloc(need, j->sector_size)) == NULL){
+		perror("calloc()");
+		return 1;
+	}
+	for(i = 0, p = buf; i < n; i += count){
+		count = n - i < j->per_record ? n - i : j->per_record;
+
+		r = (struct jn_record*)p;
+		r->magic = JN_RECORD_MAGIC;
+		r->flags = i + count == n ? JN_LAST : 0;
+		r->count = count;
+		p += j->sector_size;
+
+		for(k = 0; k < count; k++){
+			r->sectors[k] = sectors[i + k];
+			memcpy(p + (size_t)k * j->sector_size, data[i + k], j->sector_size);
+		}
+		p += (size_t)count * j->sector_size;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	if(j->head - j->tail + need > j->ring_len){
+		/* Make room: everything committed goes in place. */
+		pthread_mutex_unlock(&j->lock);
+		jn_checkpoint(j);
+		pthread_mutex_lock(&j->lock);
+	}
+	if(j->head - j->tail + need > j->ring_len){
+		pthread_mutex_unlock(&j->lock);
+		printf("Error: Journal full\n");
+		free(buf);
+		return 1;
+	}
+	start = j->head;
+	seq = j->seq++;
+	j->head += need;
+	pthread_mutex_unlock(&j->lock);
+
+	for(p = buf; p < buf + need * j->sector_size; p += (1 + (size_t)r->count) * j->sector_size){
+		r = (struct jn_record*)p;
+		r->seq = seq;
+		r->checksum = record_checksum(r, p + j->sector_size, j->sector_size);
+	}
+
+	if(write_ring(j, start, buf, need) != 0 || ds_flush(j->dev) != 0){
+		ret = 1;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&j->lock);
+	for(i = 0; i < n && ret == 0; i++){
+		ret = keep_pending(j, sectors[i], data[i], seq);
+	}
+	j->committed = start + need;
+	j->committed_seq = seq + 1;
+	j->stats.commits++;
+	j->stats.logged += n;
+	if(j->committed - j->tail > j->ring_len / 2){
+		pthread_cond_signal(&j->wake);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	/* A failed transaction is not replayed, the next one must not be either. */
+	if(ret != 0){
+		printf("Error: Journal commit failed\n");
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Read a committed sector that is not written in place yet.
+ * @param j Journal.
+ * @param sector_number Number of the sector.
+ * @param data Buffer to store the sector.
+ * @return 0 if the sector was found, 1 if the disk has it.
+ */
+int jn_read(struct jn_journal *j, uint64_t sector_number, void *data){
+	struct jn_pending *p;
+
+	pthread_mutex_lock(&j->lock);
+	if( (p = find_pending(j, sector_number)) != NULL){
+		memcpy(data, p->data, j->sector_size);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return p == NULL;
+}
+
+/**
+ * @brief Get sectors out of the journal before they are overwritten in place.
+ *
+ * Checkpoints if any of them is still logged.
+ *
+ * @param j Journal.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @return 0 on success.
+ */
+int jn_barrier(struct jn_journal *j, uint64_t first_sector, uint64_t count){
+	struct jn_pending *p;
+	uint64_t i;
+	int b, found = 0;
+
+	pthread_mutex_lock(&j->lock);
+	if(count <= (uint64_t)j->n_buckets){
+		for(i = 0; i < count && !found; i++){
+			found = find_pending(j, first_sector + i) != NULL;
+		}
+	}else{
+		for(b = 0; b < j->n_buckets && !found; b++){
+			for(p = j->buckets[b]; p != NULL && !found; p = p->next){
+				found = p->sector >= first_sector && p->sector - first_sector < count;
+			}
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return found ? jn_checkpoint(j) : 0;
+}
+
+static int cmp_pending(const void *a, const void *b){
+	uint64_t x = (*(struct jn_pending**)a)->sector, y = (*(struct jn_pending**)b)->sector;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Write every committed sector in place and free the journal space.
+ * @param j Journal.
+ * @return 0 on success.
+ */
+int jn_checkpoint(struct jn_journal *j){
+	struct jn_pending **list, *p, **pp;
+	struct ds_batch batch;
+	unsigned char *copies;
+	uint64_t *homes, end, end_seq;
+	int b, i, n = 0, ret = 0;
+
+	pthread_mutex_lock(&j->cp_lock);
+	pthread_mutex_lock(&j->lock);
+
+	end = j->committed;
+	end_seq = j->committed_seq;
+	if(end == j->tail){
+		pthread_mutex_unlock(&j->lock);
+		pthread_mutex_unlock(&j->cp_lock);
+		return 0;
+	}
+
+	/* Copy the sectors, commits go on while they are written. */
+	list = malloc((j->n_pending + 1) * sizeof(struct jn_pending*));
+	homes = malloc((j->n_pending + 1) * sizeof(uint64_t));
+	copies = malloc(((size_t)j->n_pending + 1) * j->sector_size);
+	if(list == NULL || homes == NULL || copies == NULL){
+		pthread_mutex_unlock(&j->lock);
+		pthread_mutex_unlock(&j->cp_lock);
+		free(list);
+		free(homes);
+		free(copies);
+		return 1;
+	}
+	for(b = 0; b < j->n_buckets; b++){
+		for(p = j->buckets[b]; p != NULL; p = p->next){
+			list[n++] = p;
+		}
+	}
+	qsort(list, n, sizeof(struct jn_pending*), cmp_pending);
+	for(i = 0; i < n; i++){
+		memcpy(copies + (size_t)i * j->sector_size, list[i]->data, j->sector_size);
+		homes[i] = list[i]->sector;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	ds_batch_init(&batch);
+	for(i = 0; i < n; i++){
+		ds_submit_write(j->dev, &batch, homes[i], 1, copies + (size_t)i * j->sector_size, j->sector_size);
+	}
+	if(ds_wait(j->dev, &batch) != 0 || ds_flush(j->dev) != 0 ||
+	   write_header(j->dev, j->header, j->sector_size, end, end_seq) != 0 || ds_flush(j->dev) != 0){
+		printf("Error: Journal checkpoint failed\n");
+		ret = 1;
+	}
+
+	free(list);
+	free(homes);
+	free(copies);
+
+	pthread_mutex_lock(&j->lock);
+	if(ret == 0){
+		j->tail = end;
+
+		/* Sectors logged again since the copy stay pending. */
+		for(b = 0; b < j->n_buckets; b++){
+			for(pp = &j->buckets[b]; (p = *pp) != NULL; ){
+				if(p->seq < end_seq){
+					*pp = p->next;
+					free(p);
+					j->n_pending--;
+				}else{
+					pp = &p->next;
+				}
+			}
+		}
+		j->stats.checkpoints++;
+	}
+	pthread_mutex_unlock(&j->lock);
+	pthread_mutex_unlock(&j->cp_lock);
+
+	return ret;
+}
+
+/**
+ * @brief Checkpoint and release the journal.
+ * @param j Journal, may be NULL.
+ */
+void jn_close(struct jn_journal *j){
+	int b;
+	struct jn_pending *p;
+
+	if(j == NULL){
+		return;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->stopping = 1;
+	pthread_cond_signal(&j->wake);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+
+	jn_checkpoint(j);
+
+	for(b = 0; b < j->n_buckets; b++){
+		while( (p = j->buckets[b]) != NULL){
+			j->buckets[b] = p->next;
+			free(p);
+		}
+	}
+
+	pthread_mutex_destroy(&j->lock);
+	pthread_mutex_destroy(&j->cp_lock);
+	pthread_cond_destroy(&j->wake);
+	free(j->buckets);
+	free(j);
+}
+
+/**
+ * @brief Get the journal counters since jn_open.
+ * @param j Journal.
+ * @param stats Output counters.
+ */
+void jn_get_stats(struct jn_journal *j, struct jn_stats *stats){
+	pthread_mutex_lock(&j->lock);
+	*stats = j->stats;
+	pthread_mutex_unlock(&j->lock);
+}
@@ -0,0 +1,62 @@
+/* Metadata write-ahead journal. */
+
+#include <stdint.h>
+
+#define JN_MAGIC		0x4c4e524a	/* "JRNL" */
+#define JN_RECORD_MAGIC		0x4443524a	/* "JRCD" */
+
+/* Record flag: last record of a transaction. */
+#define JN_LAST			1
+
+/* Journal size chosen at format time, in sectors. */
+#define JN_MIN_SECTORS		32
+#define JN_MAX_SECTORS		8192
+
+/**
+ * Journal header, the first sector of the journal region.
+ * The rest of the region is a ring of records. Positions count ring
+ * sectors from the format, the ring sector is position % ring length.
+ */
+struct jn_header{
+	uint32_t magic;			/**< JN_MAGIC. */
+	uint32_t not_used;		/**< Reserved, not used. */
+	uint64_t tail;			/**< Position of the oldest transaction not checkpointed. */
+	uint64_t tail_seq;		/**< Sequence number of that transaction. */
+};
+
+/**
+ * Journal record sector, followed in the ring by the logged sectors.
+ * A transaction is one or more records with the same sequence number, the
+ * last one flagged JN_LAST. It is replayed only if every record is valid.
+ */
+struct jn_record{
+	uint32_t magic;			/**< JN_RECORD_MAGIC. */
+	uint32_t flags;			/**< JN_LAST on the last record of a transaction. */
+	uint64_t seq;			/**< Transaction sequence number. */
+	uint32_t count;			/**< Logged sectors following the record. */
+	uint32_t checksum;		/**< Checksum of seq, the sector numbers and the logged sectors. */
+	uint64_t sectors[];		/**< Home sector of each logged sector. */
+};
+
+/**
+ * Journal counters.
+ */
+struct jn_stats{
+	unsigned long commits;		/**< Transactions written. */
+	unsigned long logged;		/**< Sectors written to the journal. */
+	unsigned long checkpoints;	/**< Checkpoints that wrote sectors in place. */
+	unsigned long replayed;		/**< Transactions replayed when the journal was opened. */
+};
+
+/* Journal of one disk, see jn_open. */
+struct jn_journal;
+struct ds_device;
+
+int jn_create(struct ds_device *dev, uint64_t start, uint64_t n_sectors, int sector_size);
+struct jn_journal *jn_open(struct ds_device *dev, uint64_t start, uint64_t n_sectors, int sector_size);
+int jn_commit(struct jn_journal *j, int n, uint64_t *sectors, unsigned char **data);
+int jn_read(struct jn_journal *j, uint64_t sector_number, void *data);
+int jn_barrier(struct jn_journal *j, uint64_t first_sector, uint64_t count);
+int jn_checkpoint(struct jn_journal *j);
+void jn_close(struct jn_journal *j);
+void jn_get_stats(struct jn_journal *j, struct jn_stats *stats);
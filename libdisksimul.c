@@ -1,125 +1,1437 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 #include "libdisksimul.h"
+#include "opstats.h"
 
 /* Simple library to simul read/write access to disk sectors. */
- 
-static FILE* simulfile =  NULL;
+
+/* Bounce buffer of ds_send when the destination cannot be spliced to. */
+#define DS_SEND_BUFFER		65536
+
+/* Threads of the DS_BACKEND_THREADS backend. */
+#define DS_POOL_THREADS		4
+
+/* Queued io_uring requests handed to the kernel in one system call. */
+#define DS_SUBMIT_BATCH		16
+
+/* Time after which DS_SCHED_DEADLINE serves a request first (see ds_sched_now). */
+#define DS_READ_EXPIRE_NS	500000000ul
+#define DS_WRITE_EXPIRE_NS	5000000000ul
+
+/**
+ * Asynchronous request.
+ */
+struct ds_request{
+	int write;			/**< 1 to write, 0 to read. */
+	void *data;			/**< Caller buffer. */
+	size_t len;			/**< Length in bytes. */
+	off_t offset;			/**< File offset. */
+	struct ds_batch *batch;		/**< Batch of the caller. */
+	struct ds_request *next;	/**< Free list or thread pool queue. */
+};
+
+/**
+ * Request waiting in the scheduler queue.
+ */
+struct ds_queued{
+	int write;			/**< 1 to write, 0 to read. */
+	uint64_t first_sector;		/**< First sector. */
+	int count;			/**< Number of sectors. */
+	void *data;			/**< Caller buffer. */
+	int sector_size;		/**< Sector size in bytes. */
+	struct ds_batch *batch;		/**< Batch of the caller. */
+	unsigned long deadline;		/**< Time it expires, DS_SCHED_DEADLINE. */
+};
+
+/**
+ * io_uring rings, set up with the raw system calls.
+ */
+struct ds_uring{
+	int fd;				/**< Ring file descriptor. */
+	void *sq_ring;			/**< Submission ring mapping. */
+	void *cq_ring;			/**< Completion ring mapping, may be sq_ring. */
+	size_t sq_ring_size;		/**< Length of the sq_ring mapping. */
+	size_t cq_ring_size;		/**< Length of the cq_ring mapping. */
+	struct io_uring_sqe *sqes;	/**< Submission entries. */
+	size_t sqes_size;		/**< Length of the sqes mapping. */
+	unsigned *sq_tail;		/**< Submission ring tail, written by us. */
+	unsigned *sq_mask;		/**< Submission ring index mask. */
+	unsigned *sq_array;		/**< Submission ring slots. */
+	unsigned *cq_head;		/**< Completion ring head, written by us. */
+	unsigned *cq_tail;		/**< Completion ring tail, written by the kernel. */
+	unsigned *cq_mask;		/**< Completion ring index mask. */
+	struct io_uring_cqe *cqes;	/**< Completion entries. */
+	int unsubmitted;		/**< Queued entries the kernel has not seen yet. */
+};
+
+/**
+ * Open simulation file.
+ */
+struct ds_device{
+	int backend;			/**< DS_BACKEND_FILE, DS_BACKEND_MMAP, DS_BACKEND_URING or DS_BACKEND_THREADS. */
+	int fd;				/**< Simulation file. */
+	off_t size;			/**< Size of the file in bytes. */
+	unsigned char *map;		/**< Whole file, memory mapped backend only. */
+	struct ds_stats stats;		/**< Counters, updated atomically. */
+	uint64_t head;			/**< Sector after the last request, for the seek distances of os_count_io. */
+
+	/* Timing model and scheduler, see ds_set_model. */
+	struct ds_model model;		/**< Timing model. */
+	int timed;			/**< model is set, requests are charged simulated time. */
+	int scheduler;			/**< DS_SCHED_FIFO, DS_SCHED_SCAN or DS_SCHED_DEADLINE. */
+	uint64_t sim_head;		/**< Sector after the last request, for the seeks of the model. */
+	pthread_mutex_t sim_lock;	/**< Protects sim_head and stats.sim_ns. */
+	struct ds_queued sched_queue[DS_QUEUE_DEPTH];	/**< Requests not handed to the backend yet. */
+	int n_queued;			/**< Queued requests. */
+	int sweep_down;			/**< The elevator moves towards sector 0. */
+	pthread_mutex_t sched_lock;	/**< Protects the queue, held while it is dispatched. */
+
+	/* Asynchronous backends only. */
+	struct ds_request *requests;	/**< DS_QUEUE_DEPTH requests. */
+	struct ds_request *free_req;	/**< Requests not in flight. */
+	pthread_mutex_t aio_lock;	/**< Protects the requests, the batches and the rings. */
+	pthread_cond_t aio_done;	/**< Signalled when a request completes. */
+	struct ds_uring uring;		/**< DS_BACKEND_URING rings. */
+	struct ds_request *queue_head;	/**< DS_BACKEND_THREADS queued requests. */
+	struct ds_request *queue_tail;	/**< Last queued request. */
+	pthread_cond_t queued;		/**< Signalled when a request is queued or on close. */
+	pthread_t threads[DS_POOL_THREADS];	/**< io_uring reaper or thread pool workers. */
+	int n_threads;			/**< Started threads. */
+	int stopping;			/**< Set by ds_close. */
+};
+
+static int ds_transfer(struct ds_device *dev, struct iovec *iov, int iovcnt, off_t offset, int write);
+static int ds_aio_start(struct ds_device *dev);
+static void ds_aio_stop(struct ds_device *dev);
+
+/**
+ * @brief Map the whole simulation file in memory.
+ *
+ * @param dev Disk.
+ * @return 0 on success, otherwise error.
+ */
+static int ds_map(struct ds_device *dev){
+	dev->map = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+	if(dev->map == MAP_FAILED){
+		perror("mmap: ");
+		dev->map = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Charge the simulated time of a request and move the head.
+ * @param dev Disk.
+ * @param first_sector First sector of the request.
+ * @param bytes Length of the request in bytes.
+ * @param sector_size Sector size in bytes.
+ */
+static void ds_charge(struct ds_device *dev, uint64_t first_sector, size_t bytes, int sector_size){
+	struct ds_model *m = &dev->model;
+	uint64_t distance;
+	double us;
+
+	pthread_mutex_lock(&dev->sim_lock);
+
+	if(dev->timed){
+		us = m->overhead_us + bytes / (m->rate_mb_s * (1 << 20)) * 1e6;
+
+		if(first_sector != dev->sim_head){
+			distance = first_sector > dev->sim_head ? first_sector - dev->sim_head : dev->sim_head - first_sector;
+			us += m->seek_min_us + (m->seek_max_us - m->seek_min_us) * sqrt((double)distance * sector_size / dev->size);
+			if(m->rpm > 0){
+				us += 30e6 / m->rpm;
+			}
+		}
+
+		__atomic_fetch_add(&dev->stats.sim_ns, (unsigned long)(us * 1000), __ATOMIC_RELAXED);
+	}
+
+	dev->sim_head = first_sector + bytes / sector_size;
+
+	pthread_mutex_unlock(&dev->sim_lock);
+}
+
+/**
+ * @brief Count a request.
+ * @param dev Disk.
+ * @param first_sector First sector of the request.
+ * @param bytes Length of the request in bytes.
+ * @param sector_size Sector size in bytes.
+ * @param write 1 for a write, 0 for a read.
+ */
+static void ds_count(struct ds_device *dev, uint64_t first_sector, size_t bytes, int sector_size, int write){
+	os_count_io(&dev->head, first_sector, bytes, sector_size, write);
+
+	if(dev->timed || dev->scheduler != DS_SCHED_FIFO){
+		ds_charge(dev, first_sector, bytes, sector_size);
+	}
+
+	if(write){
+		__atomic_fetch_add(&dev->stats.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dev->stats.sectors_written, bytes / sector_size, __ATOMIC_RELAXED);
+	}else{
+		__atomic_fetch_add(&dev->stats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dev->stats.sectors_read, bytes / sector_size, __ATOMIC_RELAXED);
+	}
+}
 
 /**
- * @brief Disk Simulator Init.
- * 
- * Create or open (if it already exist) the simulation file.
- * 
+ * @brief Check that a range of sectors is inside the disk.
+ *
+ * @param dev Disk.
+ * @param first_sector First sector of the range.
+ * @param bytes Length of the range in bytes.
+ * @param sector_size Sector size in bytes.
+ * @return 1 if the range is valid.
+ */
+static int ds_in_range(struct ds_device *dev, uint64_t first_sector, size_t bytes, int sector_size){
+	return first_sector <= (uint64_t)dev->size / sector_size &&
+	       (off_t)first_sector * sector_size + (off_t)bytes <= dev->size;
+}
+
+/**
+ * @brief Disk Simulator Open.
+ *
+ * Create or open (if it already exist) a simulation file. Each open file is
+ * independent, a process can use several at the same time.
+ *
  * @param filename Name of the input/output file.
  * @param sector_size Sector size in number of bytes.
  * @param number_sector Total number of sectors.
- * @param format Force create new file.
- * @return Return 0 on success, otherwise error.
+ * @param format Force create new file. When opening an existing file the
+ * geometry is not used, it is read from the superblock by the caller.
+ * @param io_backend DS_BACKEND_FILE, DS_BACKEND_MMAP, DS_BACKEND_URING or
+ * DS_BACKEND_THREADS. DS_BACKEND_URING falls back to DS_BACKEND_THREADS when
+ * the kernel does not provide io_uring.
+ * @return Open disk, NULL on error.
  */
-int ds_init(char* filename, int sector_size, int number_sectors, int format){
+struct ds_device *ds_open(char* filename, int sector_size, uint64_t number_sectors, int format, int io_backend){
+	struct ds_device *dev;
 	struct stat b;
-	
+
+	if( (dev = calloc(1, sizeof(struct ds_device))) == NULL){
+		perror("calloc()");
+		return NULL;
+	}
+	dev->backend = io_backend;
+	dev->fd = -1;
+	pthread_mutex_init(&dev->sim_lock, NULL);
+	pthread_mutex_init(&dev->sched_lock, NULL);
+
 	if(format == 0){
-		/* Check if the file already exists */
-		if( stat(filename, &b) == 0){
-			/* File exists, open for read/write. */
-			if( (simulfile = fopen(filename, "r+b")) == NULL){
-				/* error openning the file */
-				perror("fopen: ");
-				return 1;
-			}
-			return 0;
+		/* File must exist, open for read/write. */
+		if( (dev->fd = open(filename, O_RDWR)) < 0){
+			free(dev);
+			return NULL;
+		}
+	}else{
+		/* Create file  */
+		if( (dev->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+			/* error openning the file */
+			perror("open: ");
+			free(dev);
+			return NULL;
+		}
+
+		/* Set file size */
+		if( ftruncate(dev->fd, (off_t)sector_size*number_sectors) != 0){
+			perror("ftruncate: ");
+			ds_close(dev);
+			return NULL;
 		}
-		return 1;
 	}
 
-	/* File doesn't exist initialize it. */
-	
-	/* Create file  */
-	if( (simulfile = fopen(filename, "w")) == NULL){
-		/* error openning the file */
-		perror("fopen: ");
-		return 1;
+	if( fstat(dev->fd, &b) != 0){
+		perror("fstat: ");
+		ds_close(dev);
+		return NULL;
 	}
-	
-	/* Set file size */
-	ftruncate(fileno(simulfile), (sector_size*number_sectors));
-	
-	fclose(simulfile);
-	
-	/* Reopen the file for input/output */
-	if( (simulfile = fopen(filename, "r+b")) == NULL){
-		/* error openning the file */
-		perror("fopen: ");
-		return 1;
+	dev->size = b.st_size;
+
+	if(dev->backend == DS_BACKEND_MMAP && ds_map(dev) != 0){
+		ds_close(dev);
+		return NULL;
 	}
-	
-	return 0;
+
+	if( (dev->backend == DS_BACKEND_URING || dev->backend == DS_BACKEND_THREADS) && ds_aio_start(dev) != 0){
+		ds_close(dev);
+		return NULL;
+	}
+
+	return dev;
 }
 
 /**
  * Disk Simulator Read Sector.
- * 
+ *
  * Read a sector and load the data to the memory in data.
- * 
+ *
+ * @param dev Disk.
  * @param sector_number Number of the sector.
  * @param data Pointer to buffer to store the data.
  * @param sector_size Sector size in bytes.
  * @return 0 if success, otherwise error.
  */
-int ds_read_sector(int sector_number, void *data, int sector_size){
-	int ret;
-	/* locate the sector .*/
-	if ( (ret = fseek(simulfile, sector_number*sector_size, SEEK_SET)) != 0){
-		return ret;
-	}
-	
-	/* read the sector the memory buffer pointed by data. */
-	if ( (ret = fread(data, sizeof(char), sector_size, simulfile)) == 0){
-		return ret;
-	}
-	
-	return 0;
+int ds_read_sector(struct ds_device *dev, uint64_t sector_number, void *data, int sector_size){
+	return ds_read_sectors(dev, sector_number, 1, data, sector_size);
 }
 
 /**
  * Disk Simulator Write Sector.
- * 
+ *
  * Write a sector from data in memory.
- * 
+ *
+ * @param dev Disk.
  * @param sector_number Number of the sector.
  * @param data Pointer to buffer to store the data.
  * @param sector_size Sector size in bytes.
  * @return 0 if success, otherwise error.
  */
-int ds_write_sector(int sector_number, void *data, int sector_size){
+int ds_write_sector(struct ds_device *dev, uint64_t sector_number, void *data, int sector_size){
+	return ds_write_sectors(dev, sector_number, 1, data, sector_size);
+}
+
+/**
+ * @brief Transfer a list of buffers at a file offset, retrying short transfers.
+ *
+ * @param dev Disk.
+ * @param iov Buffers, modified while the transfer progresses.
+ * @param iovcnt Number of buffers.
+ * @param offset File offset.
+ * @param write 1 to write, 0 to read.
+ * @return 0 on success, otherwise error.
+ */
+static int ds_transfer(struct ds_device *dev, struct iovec *iov, int iovcnt, off_t offset, int write){
+	ssize_t done;
+
+	while(iovcnt > 0){
+		if(iovcnt == 1){
+			done = write ? pwrite(dev->fd, iov->iov_base, iov->iov_len, offset)
+			             : pread(dev->fd, iov->iov_base, iov->iov_len, offset);
+		}else{
+			done = write ? pwritev(dev->fd, iov, iovcnt, offset)
+			             : preadv(dev->fd, iov, iovcnt, offset);
+		}
+
+		if(done < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return 1;
+		}
+		if(done == 0){
+			/* Past the end of file. */
+			return 1;
+		}
+
+		offset += done;
+
+		/* Skip what was transferred. */
+		while(iovcnt > 0 && (size_t)done >= iov->iov_len){
+			done -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0){
+			iov->iov_base = (char*)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Disk Simulator Read Sectors.
+ *
+ * Read count contiguous sectors in one request.
+ *
+ * @param dev Disk.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Buffer with room for count sectors.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if success, otherwise error.
+ */
+int ds_read_sectors(struct ds_device *dev, uint64_t first_sector, int count, void *data, int sector_size){
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = (size_t)count * sector_size;
+
+	return ds_readv_sectors(dev, first_sector, &iov, 1, sector_size);
+}
+
+/**
+ * Disk Simulator Write Sectors.
+ *
+ * Write count contiguous sectors in one request.
+ *
+ * @param dev Disk.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Buffer holding count sectors.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if success, otherwise error.
+ */
+int ds_write_sectors(struct ds_device *dev, uint64_t first_sector, int count, void *data, int sector_size){
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = (size_t)count * sector_size;
+
+	return ds_writev_sectors(dev, first_sector, &iov, 1, sector_size);
+}
+
+/**
+ * Disk Simulator Scatter Read.
+ *
+ * Read contiguous sectors, starting at first_sector, into a list of buffers.
+ *
+ * @param dev Disk.
+ * @param first_sector Number of the first sector.
+ * @param iov Destination buffers, filled in order.
+ * @param iovcnt Number of buffers.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if success, otherwise error.
+ */
+int ds_readv_sectors(struct ds_device *dev, uint64_t first_sector, const struct iovec *iov, int iovcnt, int sector_size){
+	struct iovec local[DS_MAX_IOV];
+	unsigned char *p;
+	unsigned long start;
+	size_t bytes = 0;
+	int i, ret;
+
+	if(iovcnt > DS_MAX_IOV){
+		return 1;
+	}
+
+	for(i = 0; i < iovcnt; i++){
+		bytes += iov[i].iov_len;
+	}
+
+	if( !ds_in_range(dev, first_sector, bytes, sector_size)){
+		return 1;
+	}
+	ds_count(dev, first_sector, bytes, sector_size, 0);
+
+	start = os_io_begin();
+
+	if(dev->backend == DS_BACKEND_MMAP){
+		p = dev->map + (off_t)first_sector * sector_size;
+		for(i = 0; i < iovcnt; i++){
+			memcpy(iov[i].iov_base, p, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		ret = 0;
+	}else{
+		memcpy(local, iov, iovcnt * sizeof(struct iovec));
+		ret = ds_transfer(dev, local, iovcnt, (off_t)first_sector * sector_size, 0);
+	}
+
+	os_io_end(start);
+
+	return ret;
+}
+
+/**
+ * Disk Simulator Gather Write.
+ *
+ * Write a list of buffers to contiguous sectors, starting at first_sector.
+ *
+ * @param dev Disk.
+ * @param first_sector Number of the first sector.
+ * @param iov Source buffers, written in order.
+ * @param iovcnt Number of buffers.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if success, otherwise error.
+ */
+int ds_writev_sectors(struct ds_device *dev, uint64_t first_sector, const struct iovec *iov, int iovcnt, int sector_size){
+	struct iovec local[DS_MAX_IOV];
+	unsigned char *p;
+	unsigned long start;
+	size_t bytes = 0;
+	int i, ret;
+
+	if(iovcnt > DS_MAX_IOV){
+		return 1;
+	}
+
+	for(i = 0; i < iovcnt; i++){
+		bytes += iov[i].iov_len;
+	}
+
+	if( !ds_in_range(dev, first_sector, bytes, sector_size)){
+		return 1;
+	}
+	ds_count(dev, first_sector, bytes, sector_size, 1);
+
+	start = os_io_begin();
+
+	if(dev->backend == DS_BACKEND_MMAP){
+		p = dev->map + (off_t)first_sector * sector_size;
+		for(i = 0; i < iovcnt; i++){
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		ret = 0;
+	}else{
+		memcpy(local, iov, iovcnt * sizeof(struct iovec));
+		ret = ds_transfer(dev, local, iovcnt, (off_t)first_sector * sector_size, 1);
+	}
+
+	os_io_end(start);
+
+	return ret;
+}
+
+/**
+ * Disk Simulator Sector Pointer.
+ *
+ * Get a pointer to the sector inside the mapped file, so the caller can use
+ * the sector without copying it. Writes through the pointer reach the disk
+ * on ds_close.
+ *
+ * @param dev Disk.
+ * @param sector_number Number of the sector.
+ * @param sector_size Sector size in bytes.
+ * @return Pointer to the sector or NULL if the backend is not memory mapped.
+ */
+void *ds_sector_ptr(struct ds_device *dev, uint64_t sector_number, int sector_size){
+	if(dev->backend != DS_BACKEND_MMAP){
+		return NULL;
+	}
+
+	if( !ds_in_range(dev, sector_number, sector_size, sector_size)){
+		return NULL;
+	}
+
+	return dev->map + (off_t)sector_number * sector_size;
+}
+
+/**
+ * @brief Write all of a buffer to a file descriptor.
+ * @return 0 on success.
+ */
+static int ds_write_all(int fd, unsigned char *p, size_t bytes){
+	ssize_t done;
+
+	while(bytes > 0){
+		if( (done = write(fd, p, bytes)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return 1;
+		}
+		p += done;
+		bytes -= done;
+	}
+
+	return 0;
+}
+
+/**
+ * Disk Simulator Send.
+ *
+ * Copy bytes starting at a sector to a pipe, counted as one read request.
+ * The file backends splice them from the image without a copy through user
+ * space, the memory mapped backend writes them straight from the mapping.
+ *
+ * @param dev Disk.
+ * @param first_sector Number of the first sector.
+ * @param bytes Number of bytes, the last sector may be partly sent.
+ * @param fd Destination, a pipe for the copy to be spliced.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if success, otherwise error.
+ */
+int ds_send(struct ds_device *dev, uint64_t first_sector, size_t bytes, int fd, int sector_size){
+	size_t sectors_bytes = (bytes + sector_size - 1) / sector_size * sector_size;
+	loff_t offset = (loff_t)first_sector * sector_size;
+	unsigned char buf[DS_SEND_BUFFER];
+	unsigned long start;
+	ssize_t done;
+	int ret = 0;
+
+	if( !ds_in_range(dev, first_sector, sectors_bytes, sector_size)){
+		return 1;
+	}
+	ds_count(dev, first_sector, sectors_bytes, sector_size, 0);
+
+	start = os_io_begin();
+
+	if(dev->backend == DS_BACKEND_MMAP){
+		ret = ds_write_all(fd, dev->map + offset, bytes);
+		bytes = 0;
+	}
+
+	while(bytes > 0){
+		if( (done = splice(dev->fd, &offset, fd, NULL, bytes, SPLICE_F_MOVE)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno != EINVAL){
+				ret = 1;
+				break;
+			}
+
+			/* Not a pipe, copy through a buffer. */
+			done = pread(dev->fd, buf, bytes < sizeof(buf) ? bytes : sizeof(buf), offset);
+			if(done <= 0 || ds_write_all(fd, buf, done) != 0){
+				ret = 1;
+				break;
+			}
+			offset += done;
+		}else if(done == 0){
+			ret = 1;
+			break;
+		}
+		bytes -= done;
+	}
+
+	os_io_end(start);
+
+	return ret;
+}
+
+/**
+ * @brief Give a completed request back, with the lock held.
+ *
+ * @param dev Disk.
+ * @param req Request.
+ * @param failed 1 if the transfer failed.
+ */
+static void ds_finish(struct ds_device *dev, struct ds_request *req, int failed){
+	req->batch->pending--;
+	req->batch->failed += failed;
+	req->next = dev->free_req;
+	dev->free_req = req;
+	pthread_cond_broadcast(&dev->aio_done);
+}
+
+/**
+ * @brief Complete a request.
+ *
+ * @param dev Disk.
+ * @param req Request.
+ * @param res Bytes transferred, negative on error.
+ */
+static void ds_complete(struct ds_device *dev, struct ds_request *req, long res){
+	struct iovec iov;
+	int failed = res < 0;
+
+	/* The request was filled in under the lock. */
+	pthread_mutex_lock(&dev->aio_lock);
+
+	/* Finish a short transfer here. */
+	if( !failed && (size_t)res < req->len){
+		iov.iov_base = (char*)req->data + res;
+		iov.iov_len = req->len - res;
+		pthread_mutex_unlock(&dev->aio_lock);
+		failed = ds_transfer(dev, &iov, 1, req->offset + res, req->write) != 0;
+		pthread_mutex_lock(&dev->aio_lock);
+	}
+
+	ds_finish(dev, req, failed);
+	pthread_mutex_unlock(&dev->aio_lock);
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * @brief Hand the queued io_uring entries to the kernel, with the lock held.
+ *
+ * Entries the kernel refuses are taken back and transferred synchronously.
+ *
+ * @param dev Disk.
+ */
+static void ds_uring_flush(struct ds_device *dev){
+	struct ds_uring *u = &dev->uring;
+	struct ds_request *req;
+	struct iovec iov;
+	unsigned tail;
 	int ret;
-	/* locate the sector .*/
-	if ( (ret = fseek(simulfile, sector_number*sector_size, SEEK_SET)) != 0){
-		return ret;
+
+	while(u->unsubmitted > 0){
+		if( (ret = sys_io_uring_enter(u->fd, u->unsubmitted, 0, 0)) >= 0){
+			u->unsubmitted -= ret;
+			continue;
+		}
+		if(errno == EINTR || errno == EAGAIN){
+			continue;
+		}
+
+		perror("io_uring_enter: ");
+		for(; u->unsubmitted > 0; u->unsubmitted--){
+			tail = *u->sq_tail - 1;
+			req = (struct ds_request*)(uintptr_t)u->sqes[tail & *u->sq_mask].user_data;
+			__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+			if(req != NULL){
+				iov.iov_base = req->data;
+				iov.iov_len = req->len;
+				ds_finish(dev, req, ds_transfer(dev, &iov, 1, req->offset, req->write) != 0);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Queue a request on the io_uring submission ring, with the lock held.
+ *
+ * @param dev Disk.
+ * @param req Request, NULL queues the entry that stops the reaper.
+ */
+static void ds_uring_queue(struct ds_device *dev, struct ds_request *req){
+	struct ds_uring *u = &dev->uring;
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail;
+
+	sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	if(req == NULL){
+		sqe->opcode = IORING_OP_NOP;
+	}else{
+		sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = dev->fd;
+		sqe->addr = (uintptr_t)req->data;
+		sqe->len = req->len;
+		sqe->off = req->offset;
+		sqe->user_data = (uintptr_t)req;
+	}
+
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if(++u->unsubmitted >= DS_SUBMIT_BATCH || req == NULL){
+		ds_uring_flush(dev);
 	}
-	
-	/* load the sector to the memory buffer pointed by data. */
-	if ( (ret = fwrite(data, sizeof(char), sector_size, simulfile)) == 0){
+}
+
+/**
+ * @brief Complete the io_uring requests as the kernel posts them.
+ */
+static void *ds_uring_reaper(void *arg){
+	struct ds_device *dev = arg;
+	struct ds_uring *u = &dev->uring;
+	struct io_uring_cqe *cqe;
+	struct ds_request *req;
+	unsigned head, tail;
+	int stop = 0;
+	long res;
+
+	while( !stop){
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		if(head == tail){
+			sys_io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		for(; head != tail; head++){
+			cqe = &u->cqes[head & *u->cq_mask];
+			req = (struct ds_request*)(uintptr_t)cqe->user_data;
+			res = cqe->res;
+
+			if(req == NULL){
+				stop = 1;
+			}else{
+				ds_complete(dev, req, res);
+			}
+		}
+
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Unmap and close the io_uring rings.
+ * @param u Rings.
+ */
+static void ds_uring_release(struct ds_uring *u){
+	if(u->sqes != NULL){
+		munmap(u->sqes, u->sqes_size);
+	}
+	if(u->cq_ring != NULL && u->cq_ring != u->sq_ring){
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if(u->sq_ring != NULL){
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	if(u->fd >= 0){
+		close(u->fd);
+	}
+	memset(u, 0, sizeof(struct ds_uring));
+	u->fd = -1;
+}
+
+/**
+ * @brief Set up the io_uring rings.
+ *
+ * @param dev Disk.
+ * @return 0 on success, 1 if io_uring can not be used.
+ */
+static int ds_uring_start(struct ds_device *dev){
+	struct ds_uring *u = &dev->uring;
+	struct io_uring_params p;
+	void *m;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+	if( (u->fd = sys_io_uring_setup(DS_QUEUE_DEPTH, &p)) < 0){
+		return 1;
+	}
+
+	/* The READ and WRITE operations came with this feature (Linux 5.6). */
+	if( !(p.features & IORING_FEAT_RW_CUR_POS)){
+		ds_uring_release(u);
+		return 1;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(u->cq_ring_size > u->sq_ring_size){
+			u->sq_ring_size = u->cq_ring_size;
+		}
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	if( (m = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED){
+		ds_uring_release(u);
+		return 1;
+	}
+	u->sq_ring = m;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		u->cq_ring = u->sq_ring;
+	}else if( (m = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) != MAP_FAILED){
+		u->cq_ring = m;
+	}else{
+		ds_uring_release(u);
+		return 1;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if( (m = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES)) == MAP_FAILED){
+		ds_uring_release(u);
+		return 1;
+	}
+	u->sqes = m;
+
+	u->sq_tail = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+
+	/* Ring slot i always holds entry i. */
+	for(i = 0; i < p.sq_entries; i++){
+		u->sq_array[i] = i;
+	}
+
+	if(pthread_create(&dev->threads[0], NULL, ds_uring_reaper, dev) != 0){
+		ds_uring_release(u);
+		return 1;
+	}
+	dev->n_threads = 1;
+
+	return 0;
+}
+
+/**
+ * @brief Run the queued requests of the thread pool backend.
+ */
+static void *ds_pool_worker(void *arg){
+	struct ds_device *dev = arg;
+	struct ds_request *req;
+	struct iovec iov;
+
+	for(;;){
+		pthread_mutex_lock(&dev->aio_lock);
+		while(dev->queue_head == NULL && !dev->stopping){
+			pthread_cond_wait(&dev->queued, &dev->aio_lock);
+		}
+		if( (req = dev->queue_head) == NULL){
+			pthread_mutex_unlock(&dev->aio_lock);
+			return NULL;
+		}
+		if( (dev->queue_head = req->next) == NULL){
+			dev->queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&dev->aio_lock);
+
+		iov.iov_base = req->data;
+		iov.iov_len = req->len;
+		ds_complete(dev, req, ds_transfer(dev, &iov, 1, req->offset, req->write) == 0 ? (long)req->len : -1);
+	}
+}
+
+/**
+ * @brief Start the asynchronous backend of a disk.
+ *
+ * DS_BACKEND_URING becomes DS_BACKEND_THREADS when io_uring is not available.
+ *
+ * @param dev Disk.
+ * @return 0 on success.
+ */
+static int ds_aio_start(struct ds_device *dev){
+	int i;
+
+	if( (dev->requests = calloc(DS_QUEUE_DEPTH, sizeof(struct ds_request))) == NULL){
+		perror("calloc()");
+		return 1;
+	}
+	for(i = 0; i < DS_QUEUE_DEPTH; i++){
+		dev->requests[i].next = dev->free_req;
+		dev->free_req = &dev->requests[i];
+	}
+
+	pthread_mutex_init(&dev->aio_lock, NULL);
+	pthread_cond_init(&dev->aio_done, NULL);
+	pthread_cond_init(&dev->queued, NULL);
+	dev->uring.fd = -1;
+
+	if(dev->backend == DS_BACKEND_URING && ds_uring_start(dev) != 0){
+		dev->backend = DS_BACKEND_THREADS;
+	}
+
+	if(dev->backend == DS_BACKEND_THREADS){
+		for(i = 0; i < DS_POOL_THREADS; i++){
+			if(pthread_create(&dev->threads[i], NULL, ds_pool_worker, dev) != 0){
+				perror("pthread_create()");
+				return 1;
+			}
+			dev->n_threads++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the asynchronous backend of a disk.
+ *
+ * Every batch must have been waited for.
+ *
+ * @param dev Disk.
+ */
+static void ds_aio_stop(struct ds_device *dev){
+	int i;
+
+	pthread_mutex_lock(&dev->aio_lock);
+	dev->stopping = 1;
+	if(dev->backend == DS_BACKEND_URING && dev->n_threads > 0){
+		ds_uring_queue(dev, NULL);
+	}
+	pthread_cond_broadcast(&dev->queued);
+	pthread_mutex_unlock(&dev->aio_lock);
+
+	for(i = 0; i < dev->n_threads; i++){
+		pthread_join(dev->threads[i], NULL);
+	}
+
+	ds_uring_release(&dev->uring);
+
+	pthread_mutex_destroy(&dev->aio_lock);
+	pthread_cond_destroy(&dev->aio_done);
+	pthread_cond_destroy(&dev->queued);
+	free(dev->requests);
+	dev->requests = NULL;
+}
+
+/**
+ * @brief Start an asynchronous transfer.
+ *
+ * @param dev Disk.
+ * @param batch Batch of the request.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Buffer, left alone by the caller until ds_wait.
+ * @param sector_size Sector size in bytes.
+ * @param write 1 to write, 0 to read.
+ * @return 0 if the request was started or done, otherwise error.
+ */
+static int ds_submit(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size, int write){
+	struct ds_request *req;
+	size_t bytes = (size_t)count * sector_size;
+	int ret;
+
+	/* The synchronous backends transfer right away. */
+	if(dev->requests == NULL){
+		ret = write ? ds_write_sectors(dev, first_sector, count, data, sector_size)
+		            : ds_read_sectors(dev, first_sector, count, data, sector_size);
+		batch->failed += ret != 0;
 		return ret;
 	}
-	
+
+	pthread_mutex_lock(&dev->aio_lock);
+
+	if( !ds_in_range(dev, first_sector, bytes, sector_size)){
+		batch->failed++;
+		pthread_mutex_unlock(&dev->aio_lock);
+		return 1;
+	}
+
+	while(dev->free_req == NULL){
+		if(dev->backend == DS_BACKEND_URING){
+			ds_uring_flush(dev);
+		}
+		pthread_cond_wait(&dev->aio_done, &dev->aio_lock);
+	}
+	req = dev->free_req;
+	dev->free_req = req->next;
+	ds_count(dev, first_sector, bytes, sector_size, write);
+
+	req->write = write;
+	req->data = data;
+	req->len = bytes;
+	req->offset = (off_t)first_sector * sector_size;
+	req->batch = batch;
+	req->next = NULL;
+	batch->pending++;
+
+	if(dev->backend == DS_BACKEND_URING){
+		ds_uring_queue(dev, req);
+	}else{
+		if(dev->queue_tail != NULL){
+			dev->queue_tail->next = req;
+		}else{
+			dev->queue_head = req;
+		}
+		dev->queue_tail = req;
+		pthread_cond_signal(&dev->queued);
+	}
+
+	pthread_mutex_unlock(&dev->aio_lock);
+
 	return 0;
 }
 
 /**
- * Disk Simulator Stop.
- * 
- * Stop disk simulation. 
- * 
- * @param fp File pointer to the I/O file.
+ * @brief Time of the deadlines of DS_SCHED_DEADLINE.
+ *
+ * The simulated time only advances with a timing model; without one,
+ * requests expire in wall time.
+ *
+ * @param dev Disk.
+ * @return Time in nanoseconds.
+ */
+static unsigned long ds_sched_now(struct ds_device *dev){
+	struct timespec t;
+
+	if(dev->timed){
+		return __atomic_load_n(&dev->stats.sim_ns, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ul + t.tv_nsec;
+}
+
+/**
+ * @brief Choose the next queued request, with sched_lock held.
+ * @param dev Disk, with at least one queued request.
+ * @return Index of the request in the queue.
  */
-void ds_stop(){
-	fclose(simulfile);
-	simulfile = NULL;
+static int ds_sched_pick(struct ds_device *dev){
+	struct ds_queued *q = dev->sched_queue;
+	uint64_t head;
+	int i, best = -1, pass;
+
+	if(dev->scheduler == DS_SCHED_DEADLINE){
+		for(i = 1, best = 0; i < dev->n_queued; i++){
+			if(q[i].deadline < q[best].deadline){
+				best = i;
+			}
+		}
+		if(q[best].deadline <= ds_sched_now(dev)){
+			return best;
+		}
+		best = -1;
+	}
+
+	pthread_mutex_lock(&dev->sim_lock);
+	head = dev->sim_head;
+	pthread_mutex_unlock(&dev->sim_lock);
+
+	/* A request continuing the last one needs no seek. */
+	for(i = 0; i < dev->n_queued; i++){
+		if(q[i].first_sector == head){
+			return i;
+		}
+	}
+
+	/* Nearest request ahead of the head. SCAN turns around at the last
+	 * one, DEADLINE only sweeps up and starts again from the lowest. */
+	for(pass = 0; pass < 2 && best < 0; pass++){
+		for(i = 0; i < dev->n_queued; i++){
+			if(dev->sweep_down ? q[i].first_sector < head && (best < 0 || q[i].first_sector > q[best].first_sector)
+			                   : q[i].first_sector >= head && (best < 0 || q[i].first_sector < q[best].first_sector)){
+				best = i;
+			}
+		}
+		if(best < 0 && dev->scheduler == DS_SCHED_SCAN){
+			dev->sweep_down = !dev->sweep_down;
+		}else if(best < 0){
+			head = 0;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * @brief Hand every queued request to the backend, in scheduler order.
+ * @param dev Disk, with sched_lock held.
+ */
+static void ds_dispatch(struct ds_device *dev){
+	struct ds_queued q;
+	int i;
+
+	while(dev->n_queued > 0){
+		i = ds_sched_pick(dev);
+		q = dev->sched_queue[i];
+		dev->sched_queue[i] = dev->sched_queue[--dev->n_queued];
+		ds_submit(dev, q.batch, q.first_sector, q.count, q.data, q.sector_size, q.write);
+	}
+}
+
+/**
+ * @brief Queue a request for the scheduler, dispatching the queue when it is full.
+ * @return 0 if the request was queued, otherwise error.
+ */
+static int ds_enqueue(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size, int write){
+	struct ds_queued *q;
+
+	pthread_mutex_lock(&dev->sched_lock);
+
+	if( !ds_in_range(dev, first_sector, (size_t)count * sector_size, sector_size)){
+		batch->failed++;
+		pthread_mutex_unlock(&dev->sched_lock);
+		return 1;
+	}
+
+	if(dev->n_queued == DS_QUEUE_DEPTH){
+		ds_dispatch(dev);
+	}
+
+	q = &dev->sched_queue[dev->n_queued++];
+	q->write = write;
+	q->first_sector = first_sector;
+	q->count = count;
+	q->data = data;
+	q->sector_size = sector_size;
+	q->batch = batch;
+	q->deadline = ds_sched_now(dev) + (write ? DS_WRITE_EXPIRE_NS : DS_READ_EXPIRE_NS);
+
+	pthread_mutex_unlock(&dev->sched_lock);
+
+	return 0;
+}
+
+/**
+ * Disk Simulator Batch Init.
+ *
+ * @param batch Empty batch.
+ */
+void ds_batch_init(struct ds_batch *batch){
+	batch->pending = 0;
+	batch->failed = 0;
+}
+
+/**
+ * Disk Simulator Submit Read.
+ *
+ * Start reading count contiguous sectors. Up to DS_QUEUE_DEPTH requests of
+ * all the callers are in flight; the synchronous backends read right away.
+ * With a scheduler other than DS_SCHED_FIFO, requests wait in its queue
+ * until it is full or ds_wait is called, and are started in its order.
+ *
+ * @param dev Disk.
+ * @param batch Batch of the request.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Buffer with room for count sectors, valid until ds_wait.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if the request was started, otherwise error.
+ */
+int ds_submit_read(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size){
+	if(dev->scheduler != DS_SCHED_FIFO){
+		return ds_enqueue(dev, batch, first_sector, count, data, sector_size, 0);
+	}
+
+	return ds_submit(dev, batch, first_sector, count, data, sector_size, 0);
+}
+
+/**
+ * Disk Simulator Submit Write.
+ *
+ * Start writing count contiguous sectors, see ds_submit_read.
+ *
+ * @param dev Disk.
+ * @param batch Batch of the request.
+ * @param first_sector Number of the first sector.
+ * @param count Number of sectors.
+ * @param data Buffer holding count sectors, valid until ds_wait.
+ * @param sector_size Sector size in bytes.
+ * @return 0 if the request was started, otherwise error.
+ */
+int ds_submit_write(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size){
+	if(dev->scheduler != DS_SCHED_FIFO){
+		return ds_enqueue(dev, batch, first_sector, count, data, sector_size, 1);
+	}
+
+	return ds_submit(dev, batch, first_sector, count, data, sector_size, 1);
+}
+
+/**
+ * Disk Simulator Wait.
+ *
+ * Wait until every request of a batch is complete.
+ *
+ * @param dev Disk.
+ * @param batch Batch.
+ * @return Number of failed requests of the batch, 0 on success.
+ */
+int ds_wait(struct ds_device *dev, struct ds_batch *batch){
+	unsigned long start;
+	int failed;
+
+	if(dev->scheduler != DS_SCHED_FIFO){
+		pthread_mutex_lock(&dev->sched_lock);
+		ds_dispatch(dev);
+		pthread_mutex_unlock(&dev->sched_lock);
+	}
+
+	if(dev->requests == NULL){
+		return batch->failed;
+	}
+
+	start = os_io_begin();
+	pthread_mutex_lock(&dev->aio_lock);
+	if(dev->backend == DS_BACKEND_URING){
+		ds_uring_flush(dev);
+	}
+	while(batch->pending > 0){
+		pthread_cond_wait(&dev->aio_done, &dev->aio_lock);
+	}
+	failed = batch->failed;
+	pthread_mutex_unlock(&dev->aio_lock);
+	os_io_end(start);
+
+	return failed;
+}
+
+/**
+ * Disk Simulator Backend.
+ *
+ * @param dev Disk.
+ * @return Backend in use, DS_BACKEND_URING may have fallen back to DS_BACKEND_THREADS.
+ */
+int ds_backend(struct ds_device *dev){
+	return dev->backend;
+}
+
+/**
+ * Disk Simulator Flush.
+ *
+ * Make every completed write durable.
+ *
+ * @param dev Disk.
+ * @return 0 if success, otherwise error.
+ */
+int ds_flush(struct ds_device *dev){
+	__atomic_fetch_add(&dev->stats.flushes, 1, __ATOMIC_RELAXED);
+
+	if(dev->map != NULL && msync(dev->map, dev->size, MS_SYNC) != 0){
+		perror("msync: ");
+		return 1;
+	}
+
+	if(fdatasync(dev->fd) != 0){
+		perror("fdatasync: ");
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Disk Simulator Statistics.
+ *
+ * @param dev Disk.
+ * @param stats Output counters since ds_open.
+ */
+void ds_get_stats(struct ds_device *dev, struct ds_stats *stats){
+	stats->reads = __atomic_load_n(&dev->stats.reads, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&dev->stats.writes, __ATOMIC_RELAXED);
+	stats->sectors_read = __atomic_load_n(&dev->stats.sectors_read, __ATOMIC_RELAXED);
+	stats->sectors_written = __atomic_load_n(&dev->stats.sectors_written, __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&dev->stats.flushes, __ATOMIC_RELAXED);
+	stats->sim_ns = __atomic_load_n(&dev->stats.sim_ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Disk Simulator Timing Model Parse.
+ *
+ * A model is "hdd" (7200 rpm disk) or "ssd", optionally followed by
+ * comma separated overrides: overhead, seek_min and seek_max in
+ * microseconds, rpm, rate in MB/s. E.g. "hdd,rpm=5400,seek_max=20000".
+ *
+ * @param spec Model description.
+ * @param model Output model.
+ * @return 0 on success.
+ */
+int ds_model_parse(char *spec, struct ds_model *model){
+	static const struct ds_model hdd = {50, 500, 15000, 7200, 150};
+	static const struct ds_model ssd = {25, 0, 0, 0, 500};
+	char buf[256], *opt, *value, *save;
+	double v;
+
+	if(strlen(spec) >= sizeof(buf)){
+		return 1;
+	}
+	strcpy(buf, spec);
+
+	opt = strtok_r(buf, ",", &save);
+	if(opt != NULL && !strcmp(opt, "hdd")){
+		*model = hdd;
+	}else if(opt != NULL && !strcmp(opt, "ssd")){
+		*model = ssd;
+	}else{
+		return 1;
+	}
+
+	while( (opt = strtok_r(NULL, ",", &save)) != NULL){
+		if( (value = strchr(opt, '=')) == NULL){
+			return 1;
+		}
+		*value++ = '\0';
+		if( (v = atof(value)) < 0){
+			return 1;
+		}
+
+		if( !strcmp(opt, "overhead")){
+			model->overhead_us = v;
+		}else if( !strcmp(opt, "seek_min")){
+			model->seek_min_us = v;
+		}else if( !strcmp(opt, "seek_max")){
+			model->seek_max_us = v;
+		}else if( !strcmp(opt, "rpm")){
+			model->rpm = v;
+		}else if( !strcmp(opt, "rate") && v > 0){
+			model->rate_mb_s = v;
+		}else{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Disk Simulator Scheduler Parse.
+ *
+ * @param name "fifo", "scan" or "deadline".
+ * @return DS_SCHED_FIFO, DS_SCHED_SCAN or DS_SCHED_DEADLINE, -1 if unknown.
+ */
+int ds_sched_parse(char *name){
+	if( !strcmp(name, "fifo")){
+		return DS_SCHED_FIFO;
+	}
+	if( !strcmp(name, "scan")){
+		return DS_SCHED_SCAN;
+	}
+	if( !strcmp(name, "deadline")){
+		return DS_SCHED_DEADLINE;
+	}
+
+	return -1;
+}
+
+/**
+ * Disk Simulator Set Model.
+ *
+ * Charge every following request the simulated time of a timing model,
+ * reported as sim_ns by ds_get_stats, and order the asynchronous requests
+ * with a scheduler. No request may be running.
+ *
+ * @param dev Disk.
+ * @param model Timing model, NULL to charge nothing.
+ * @param scheduler DS_SCHED_FIFO, DS_SCHED_SCAN or DS_SCHED_DEADLINE.
+ */
+void ds_set_model(struct ds_device *dev, struct ds_model *model, int scheduler){
+	dev->timed = model != NULL;
+	if(model != NULL){
+		dev->model = *model;
+	}
+	dev->scheduler = scheduler;
+}
+
+/**
+ * Disk Simulator Size.
+ *
+ * @param dev Disk.
+ * @return Size of the open disk in bytes.
+ */
+uint64_t ds_size(struct ds_device *dev){
+	return dev->size;
+}
+
+/**
+ * Disk Simulator Close.
+ *
+ * Stop disk simulation and release the disk. A memory mapped file is
+ * synced before unmapping.
+ *
+ * @param dev Disk, may be NULL.
+ */
+void ds_close(struct ds_device *dev){
+	if(dev == NULL){
+		return;
+	}
+
+	if(dev->requests != NULL){
+		ds_aio_stop(dev);
+	}
+
+	if(dev->map != NULL){
+		msync(dev->map, dev->size, MS_SYNC);
+		munmap(dev->map, dev->size);
+	}
+
+	if(dev->fd >= 0){
+		close(dev->fd);
+	}
+
+	pthread_mutex_destroy(&dev->sim_lock);
+	pthread_mutex_destroy(&dev->sched_lock);
+	free(dev);
 }
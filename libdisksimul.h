@@ -1,13 +1,86 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 
+/* I/O backends. */
+#define DS_BACKEND_FILE		0	/**< pread/pwrite on the image file. */
+#define DS_BACKEND_MMAP		1	/**< Whole file mapped in memory. */
+#define DS_BACKEND_URING	2	/**< File, asynchronous requests through io_uring. */
+#define DS_BACKEND_THREADS	3	/**< File, asynchronous requests on a thread pool. */
 
-int ds_init(char* filename, int sector_size, int number_sectors, int format);
-int ds_read_sector(int sector_number, void *data, int sector_size);
-int ds_write_sector(int sector_number, void *data, int sector_size);
-void ds_stop();
+/* Maximum number of buffers in a scatter/gather request. */
+#define DS_MAX_IOV		1024
 
+/* Asynchronous requests in flight on one disk. */
+#define DS_QUEUE_DEPTH		64
+
+/* I/O schedulers of the asynchronous requests, see ds_set_model. */
+#define DS_SCHED_FIFO		0	/**< Submission order. */
+#define DS_SCHED_SCAN		1	/**< Elevator, sweeping up and down the disk. */
+#define DS_SCHED_DEADLINE	2	/**< Elevator, expired requests first. */
+
+/* Open simulation file, see ds_open. */
+struct ds_device;
+
+/**
+ * Disk counters.
+ */
+struct ds_stats{
+	unsigned long reads;		/**< Read requests. */
+	unsigned long writes;		/**< Write requests. */
+	unsigned long sectors_read;	/**< Sectors read. */
+	unsigned long sectors_written;	/**< Sectors written. */
+	unsigned long flushes;		/**< ds_flush calls. */
+	unsigned long sim_ns;		/**< Simulated disk time, with a timing model. */
+};
+
+/**
+ * Disk timing model, see ds_model_parse.
+ *
+ * A request costs overhead_us plus its length at rate_mb_s. A request that
+ * does not start where the previous one ended also pays a seek, growing
+ * with the square root of the distance from seek_min_us to seek_max_us
+ * across the whole disk, and half a revolution.
+ */
+struct ds_model{
+	double overhead_us;		/**< Command overhead of every request. */
+	double seek_min_us;		/**< Shortest seek. */
+	double seek_max_us;		/**< Seek across the whole disk. */
+	int rpm;			/**< Rotation speed, 0 for none. */
+	double rate_mb_s;		/**< Transfer rate. */
+};
+
+/**
+ * Group of asynchronous requests waited for together, see ds_submit_read.
+ */
+struct ds_batch{
+	int pending;			/**< Requests not completed yet. */
+	int failed;			/**< Failed requests. */
+};
+
+struct ds_device *ds_open(char* filename, int sector_size, uint64_t number_sectors, int format, int io_backend);
+int ds_read_sector(struct ds_device *dev, uint64_t sector_number, void *data, int sector_size);
+int ds_write_sector(struct ds_device *dev, uint64_t sector_number, void *data, int sector_size);
+int ds_read_sectors(struct ds_device *dev, uint64_t first_sector, int count, void *data, int sector_size);
+int ds_write_sectors(struct ds_device *dev, uint64_t first_sector, int count, void *data, int sector_size);
+int ds_readv_sectors(struct ds_device *dev, uint64_t first_sector, const struct iovec *iov, int iovcnt, int sector_size);
+int ds_writev_sectors(struct ds_device *dev, uint64_t first_sector, const struct iovec *iov, int iovcnt, int sector_size);
+void *ds_sector_ptr(struct ds_device *dev, uint64_t sector_number, int sector_size);
+int ds_send(struct ds_device *dev, uint64_t first_sector, size_t bytes, int fd, int sector_size);
+void ds_batch_init(struct ds_batch *batch);
+int ds_submit_read(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size);
+int ds_submit_write(struct ds_device *dev, struct ds_batch *batch, uint64_t first_sector, int count, void *data, int sector_size);
+int ds_wait(struct ds_device *dev, struct ds_batch *batch);
+int ds_backend(struct ds_device *dev);
+int ds_flush(struct ds_device *dev);
+void ds_get_stats(struct ds_device *dev, struct ds_stats *stats);
+int ds_model_parse(char *spec, struct ds_model *model);
+int ds_sched_parse(char *name);
+void ds_set_model(struct ds_device *dev, struct ds_model *model, int scheduler);
+uint64_t ds_size(struct ds_device *dev);
+void ds_close(struct ds_device *dev);
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+/* LZ compression of file chunks.
+ *
+ * A byte-oriented LZ77 in the style of LZ4, fast enough to run on every
+ * write: a block is a list of sequences, each a token byte, literals, and
+ * a match copied from up to 64 KB back. The token holds the literal
+ * length in its high nibble and the match length minus LZ_MIN_MATCH in
+ * its low nibble; 15 means more length bytes follow, each added until one
+ * is below 255. The offset is two bytes, little endian.
+ *
+ * The block does not record its lengths: the decoder is given the length
+ * of the output and stops there, so a block can be padded to a sector.
+ */
+
+/* Shortest match. */
+#define LZ_MIN_MATCH	4
+
+/* Bytes at the end always sent as literals, so a match never reads past the input. */
+#define LZ_LAST_LITERALS	5
+
+/* Farthest match. */
+#define LZ_MAX_OFFSET	65535
+
+/* Hash table of the compressor, positions of 4-byte sequences. */
+#define LZ_HASH_BITS	12
+
+/* Past every 2^LZ_SKIP_SHIFT literals in a row, the search skips one more byte. */
+#define LZ_SKIP_SHIFT	6
+
+
+static uint32_t read32(const unsigned char *p){
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static uint32_t hash32(uint32_t v){
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Write a length past the 15 of its nibble.
+ * @return Next output byte, NULL if it does not fit.
+ */
+static unsigned char *put_length(unsigned char *op, unsigned char *end, size_t len){
+	for(; len >= 255; len -= 255){
+		if(op >= end){
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if(op >= end){
+		return NULL;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+/**
+ * @brief Write one sequence: literals, then a match unless match_len is 0.
+ * @return Next output byte, NULL if it does not fit.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end, const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len){
+	unsigned char *token = op++;
+	size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	if(token >= end){
+		return NULL;
+	}
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+	if(lit_len >= 15 && (op = put_length(op, end, lit_len - 15)) == NULL){
+		return NULL;
+	}
+
+	if(lit_len > (size_t)(end - op)){
+		return NULL;
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if(match_len == 0){
+		return op;
+	}
+
+	if(end - op < 2){
+		return NULL;
+	}
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	if(m >= 15 && (op = put_length(op, end, m - 15)) == NULL){
+		return NULL;
+	}
+
+	return op;
+}
+
+/**
+ * @brief Compress a block.
+ * @param in Input.
+ * @param n Input bytes.
+ * @param out Output.
+ * @param cap Room in out.
+ * @return Compressed bytes, 0 if they do not fit in cap.
+ */
+size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out, size_t cap){
+	uint32_t table[1 << LZ_HASH_BITS];
+	const unsigned char *ip = in, *anchor = in, *ref;
+	const unsigned char *limit = n > LZ_LAST_LITERALS + LZ_MIN_MATCH ? in + n - LZ_LAST_LITERALS : in;
+	unsigned char *op = out, *end = out + cap;
+	size_t len, step;
+	uint32_t h;
+
+	memset(table, 0xff, sizeof(table));
+
+	while(ip + LZ_MIN_MATCH <= limit){
+		h = hash32(read32(ip));
+		ref = table[h] != UINT32_MAX ? in + table[h] : NULL;
+		table[h] = ip - in;
+
+		/* Data that does not compress is skipped faster and faster. */
+		if(ref == NULL || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)){
+			if( (step = 1 + ((ip - anchor) >> LZ_SKIP_SHIFT)) > (size_t)(limit - ip)){
+				break;
+			}
+			ip += step;
+			continue;
+		}
+
+		for(len = LZ_MIN_MATCH; ip + len < limit && ref[len] == ip[len]; len++);
+
+		if( (op = put_sequence(op, end, anchor, ip - anchor, ip - ref, len)) == NULL){
+			return 0;
+		}
+		ip += len;
+		anchor = ip;
+	}
+
+	/* The rest as literals. */
+	if(anchor < in + n && (op = put_sequence(op, end, anchor, in + n - anchor, 0, 0)) == NULL){
+		return 0;
+	}
+
+	return op - out;
+}
+
+/**
+ * @brief Read a length past the 15 of its nibble.
+ * @return 0 on success, 1 past the end of the input.
+ */
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *len){
+	unsigned char b;
+
+	do{
+		if(*ip >= end){
+			return 1;
+		}
+		b = *(*ip)++;
+		*len += b;
+	}while(b == 255);
+
+	return 0;
+}
+
+/**
+ * @brief Decompress a block.
+ * @param in Compressed block, may be followed by padding.
+ * @param n Input bytes, padding included.
+ * @param out Output.
+ * @param out_len Bytes the block decompresses to.
+ * @return 0 on success, 1 if the block is corrupt.
+ */
+int lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t out_len){
+	const unsigned char *ip = in, *in_end = in + n;
+	unsigned char *op = out, *out_end = out + out_len;
+	size_t lit_len, match_len, offset, i;
+	unsigned char token;
+
+	while(op < out_end){
+		if(ip >= in_end){
+			return 1;
+		}
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if(lit_len == 15 && get_length(&ip, in_end, &lit_len) != 0){
+			return 1;
+		}
+		if(lit_len > (size_t)(in_end - ip) || lit_len > (size_t)(out_end - op)){
+			return 1;
+		}
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if(op == out_end){
+			break;
+		}
+
+		if(in_end - ip < 2){
+			return 1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		match_len = token & 15;
+		if(match_len == 15 && get_length(&ip, in_end, &match_len) != 0){
+			return 1;
+		}
+		match_len += LZ_MIN_MATCH;
+
+		if(offset == 0 || offset > (size_t)(op - out) || match_len > (size_t)(out_end - op)){
+			return 1;
+		}
+
+		/* Byte by byte when the match overlaps its own output. */
+		if(offset >= match_len){
+			memcpy(op, op - offset, match_len);
+		}else{
+			for(i = 0; i < match_len; i++){
+				op[i] = op[i - offset];
+			}
+		}
+		op += match_len;
+	}
+
+	return 0;
+}
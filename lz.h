@@ -0,0 +1,6 @@
+/* LZ compression of file chunks. */
+
+#include <stddef.h>
+
+size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out, size_t cap);
+int lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t out_len);
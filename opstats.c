@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "opstats.h"
+
+/* Per-operation statistics.
+ *
+ * Every fs_* operation runs between os_begin and os_end. While it runs,
+ * os_current points to its counters, on the caller's stack, which the disk,
+ * the sector cache and the dentry cache update without any lock: each
+ * thread only touches its own operation. os_end adds them to the table of
+ * the disk and records the latency. With statistics off the table is
+ * NULL, os_current stays NULL and every hook is a single test.
+ *
+ * Requests made by the journal checkpoint thread belong to no operation
+ * and are not counted here, only in ds_get_stats.
+ */
+
+__thread struct os_counters *os_current = NULL;
+
+const char *os_names[OS_OPS] = {"create", "read", "del", "ls", "mkdir", "rmdir", "sync", "write"};
+
+/**
+ * Statistics of one open disk.
+ */
+struct os_table{
+	struct os_stats stats;		/**< Counters of the finished operations. */
+	pthread_mutex_t lock;		/**< Protects stats. */
+};
+
+
+/**
+ * @brief Create an empty table.
+ * @return Table, NULL on error.
+ */
+struct os_table *os_init(){
+	struct os_table *t;
+
+	if( (t = calloc(1, sizeof(struct os_table))) == NULL){
+		perror("calloc()");
+		return NULL;
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+
+	return t;
+}
+
+/**
+ * @brief Start counting an operation on the calling thread.
+ * @param t Table, NULL when statistics are off.
+ * @param op Running operation, on the caller's stack.
+ */
+void os_begin(struct os_table *t, struct os_op *op){
+	if(t == NULL){
+		return;
+	}
+
+	memset(&op->counters, 0, sizeof(struct os_counters));
+	op->outer = os_current;
+	op->start = os_clock();
+	os_current = &op->counters;
+}
+
+/**
+ * @brief Finish an operation and add it to the table.
+ *
+ * An operation called by another one is only counted on its own.
+ *
+ * @param t Table, NULL when statistics are off.
+ * @param op Operation given to os_begin.
+ * @param type OS_CREATE ... OS_WRITE.
+ * @param ret Return value of the operation, counted as failed if not 0.
+ * @return ret.
+ */
+int os_end(struct os_table *t, struct os_op *op, int type, int ret){
+	struct os_counters *sum, *c = &op->counters;
+	unsigned long elapsed;
+	int bucket;
+
+	if(t == NULL){
+		return ret;
+	}
+
+	elapsed = os_clock() - op->start;
+	os_current = op->outer;
+
+	for(bucket = 0; bucket < OS_BUCKETS - 1 && (elapsed / 1000) >> bucket != 0; bucket++);
+
+	pthread_mutex_lock(&t->lock);
+
+	sum = &t->stats.op[type];
+	sum->ops++;
+	sum->failed += ret != 0;
+	sum->reads += c->reads;
+	sum->writes += c->writes;
+	sum->sectors_read += c->sectors_read;
+	sum->sectors_written += c->sectors_written;
+	sum->bytes_read += c->bytes_read;
+	sum->bytes_written += c->bytes_written;
+	sum->cache_hits += c->cache_hits;
+	sum->cache_misses += c->cache_misses;
+	sum->dentry_hits += c->dentry_hits;
+	sum->dentry_misses += c->dentry_misses;
+	sum->seeks += c->seeks;
+	sum->seek_distance += c->seek_distance;
+	sum->io_ns += c->io_ns;
+	sum->total_ns += elapsed;
+	if(elapsed > sum->max_ns){
+		sum->max_ns = elapsed;
+	}
+	sum->latency[bucket]++;
+
+	pthread_mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Get the statistics.
+ * @param t Table.
+ * @param stats Output statistics since os_init or os_reset.
+ */
+void os_get(struct os_table *t, struct os_stats *stats){
+	pthread_mutex_lock(&t->lock);
+	*stats = t->stats;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * @brief Clear the statistics.
+ * @param t Table.
+ */
+void os_reset(struct os_table *t){
+	pthread_mutex_lock(&t->lock);
+	memset(&t->stats, 0, sizeof(struct os_stats));
+	pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * @brief Latency under which a fraction of the operations finished.
+ * @param c Counters.
+ * @param fraction Between 0 and 1.
+ * @return Upper bound of the bucket, in microseconds.
+ */
+static unsigned long percentile(struct os_counters *c, double fraction){
+	unsigned long seen = 0;
+	int b;
+
+	for(b = 0; b < OS_BUCKETS - 1; b++){
+		seen += c->latency[b];
+		if(seen >= fraction * c->ops){
+			break;
+		}
+	}
+
+	return 1ul << b;
+}
+
+/**
+ * @brief Print the statistics.
+ *
+ * The human output has one line per operation type that ran, then the
+ * latency histogram of each. The JSON output is one object with a member
+ * per operation type, the histogram as an array of bucket counts.
+ *
+ * @param out Output.
+ * @param stats Statistics.
+ * @param json 1 for JSON, 0 for text.
+ */
+void os_print(FILE *out, struct os_stats *stats, int json){
+	struct os_counters *c;
+	int i, b, last, first = 1;
+
+	if(json){
+		fprintf(out, "{");
+		for(i = 0; i < OS_OPS; i++){
+			c = &stats->op[i];
+			if(c->ops == 0){
+				continue;
+			}
+			fprintf(out, "%s\"%s\":{\"ops\":%lu,\"failed\":%lu,\"reads\":%lu,\"writes\":%lu,"
+				"\"sectors_read\":%lu,\"sectors_written\":%lu,\"bytes_read\":%lu,\"bytes_written\":%lu,"
+				"\"cache_hits\":%lu,\"cache_misses\":%lu,\"dentry_hits\":%lu,\"dentry_misses\":%lu,"
+				"\"seeks\":%lu,\"seek_distance\":%lu,\"io_ns\":%lu,\"total_ns\":%lu,\"max_ns\":%lu,\"latency_us_log2\":[",
+				first ? "" : ",", os_names[i], c->ops, c->failed, c->reads, c->writes,
+				c->sectors_read, c->sectors_written, c->bytes_read, c->bytes_written,
+				c->cache_hits, c->cache_misses, c->dentry_hits, c->dentry_misses,
+				c->seeks, c->seek_distance, c->io_ns, c->total_ns, c->max_ns);
+			for(last = OS_BUCKETS - 1; last > 0 && c->latency[last] == 0; last--);
+			for(b = 0; b <= last; b++){
+				fprintf(out, "%s%lu", b ? "," : "", c->latency[b]);
+			}
+			fprintf(out, "]}");
+			first = 0;
+		}
+		fprintf(out, "}\n");
+		return;
+	}
+
+	fprintf(out, "%-7s %7s %6s %9s %9s %7s %7s %9s %11s %9s %9s %9s %9s\n", "op", "count", "failed",
+		"sect rd", "sect wr", "hits", "misses", "seeks", "avg seek", "avg us", "io us", "p50 us", "p99 us");
+	for(i = 0; i < OS_OPS; i++){
+		c = &stats->op[i];
+		if(c->ops == 0){
+			continue;
+		}
+		fprintf(out, "%-7s %7lu %6lu %9lu %9lu %7lu %7lu %9lu %11.1f %9.1f %9.1f %9lu %9lu\n", os_names[i],
+			c->ops, c->failed, c->sectors_read, c->sectors_written,
+			c->cache_hits + c->dentry_hits, c->cache_misses + c->dentry_misses,
+			c->seeks, c->seeks ? (double)c->seek_distance / c->seeks : 0.0,
+			c->total_ns / 1e3 / c->ops, c->io_ns / 1e3 / c->ops,
+			percentile(c, 0.5), percentile(c, 0.99));
+	}
+
+	for(i = 0; i < OS_OPS; i++){
+		c = &stats->op[i];
+		if(c->ops == 0){
+			continue;
+		}
+		fprintf(out, "%s latency:", os_names[i]);
+		for(b = 0; b < OS_BUCKETS; b++){
+			if(c->latency[b] != 0){
+				fprintf(out, " <%luus:%lu", 1ul << b, c->latency[b]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
+
+/**
+ * @brief Release the table.
+ * @param t Table, may be NULL.
+ */
+void os_stop(struct os_table *t){
+	if(t == NULL){
+		return;
+	}
+
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
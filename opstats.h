@@ -0,0 +1,164 @@
+/* Per-operation I/O statistics and latency histograms. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Operations, see os_names. */
+#define OS_CREATE	0
+#define OS_READ		1
+#define OS_DEL		2
+#define OS_LS		3
+#define OS_MKDIR	4
+#define OS_RMDIR	5
+#define OS_SYNC		6
+#define OS_WRITE	7
+#define OS_OPS		8
+
+/* Latency buckets: bucket 0 counts operations under 1 us, bucket b
+ * operations of 2^(b-1) to 2^b us, the last one everything slower. */
+#define OS_BUCKETS	32
+
+/**
+ * Counters of one operation type, or of one running operation.
+ */
+struct os_counters{
+	unsigned long ops;		/**< Operations. */
+	unsigned long failed;		/**< Operations that returned an error. */
+	unsigned long reads;		/**< Disk read requests. */
+	unsigned long writes;		/**< Disk write requests. */
+	unsigned long sectors_read;	/**< Sectors read from the disk. */
+	unsigned long sectors_written;	/**< Sectors written to the disk. */
+	unsigned long bytes_read;	/**< Bytes read from the disk. */
+	unsigned long bytes_written;	/**< Bytes written to the disk. */
+	unsigned long cache_hits;	/**< Sector cache reads served from memory. */
+	unsigned long cache_misses;	/**< Sector cache reads that went to the disk. */
+	unsigned long dentry_hits;	/**< Path lookups served by the dentry cache. */
+	unsigned long dentry_misses;	/**< Path lookups that read the directory. */
+	unsigned long seeks;		/**< Requests not starting where the previous one ended. */
+	unsigned long seek_distance;	/**< Sum of the seek distances, in sectors. */
+	unsigned long io_ns;		/**< Time spent in disk requests. */
+	unsigned long total_ns;		/**< Wall time of the operations. */
+	unsigned long max_ns;		/**< Slowest operation. */
+	unsigned long latency[OS_BUCKETS];	/**< Latency histogram. */
+};
+
+/**
+ * Statistics of every operation type.
+ */
+struct os_stats{
+	struct os_counters op[OS_OPS];	/**< Indexed by OS_CREATE ... OS_WRITE. */
+};
+
+/**
+ * Running operation, on the stack of the caller of os_begin.
+ */
+struct os_op{
+	struct os_counters counters;	/**< Counters of this operation. */
+	struct os_counters *outer;	/**< os_current of the caller, for operations that call each other. */
+	unsigned long start;		/**< Start time in nanoseconds. */
+};
+
+/* Statistics of one open disk, see os_init. */
+struct os_table;
+
+/**
+ * Running operation of the calling thread, NULL when statistics are off.
+ * Disk requests and cache lookups made by the thread are counted here.
+ */
+extern __thread struct os_counters *os_current;
+
+extern const char *os_names[OS_OPS];
+
+struct os_table *os_init();
+void os_begin(struct os_table *t, struct os_op *op);
+int os_end(struct os_table *t, struct os_op *op, int type, int ret);
+void os_get(struct os_table *t, struct os_stats *stats);
+void os_reset(struct os_table *t);
+void os_print(FILE *out, struct os_stats *stats, int json);
+void os_stop(struct os_table *t);
+
+static inline unsigned long os_clock(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/**
+ * @brief Count a disk request for the running operation.
+ * @param head Position after the previous request of the disk, updated.
+ * @param first_sector First sector of the request.
+ * @param bytes Length of the request in bytes.
+ * @param sector_size Sector size in bytes.
+ * @param write 1 for a write, 0 for a read.
+ */
+static inline void os_count_io(uint64_t *head, uint64_t first_sector, size_t bytes, int sector_size, int write){
+	struct os_counters *op = os_current;
+	uint64_t prev;
+
+	if(op == NULL){
+		return;
+	}
+
+	prev = __atomic_exchange_n(head, first_sector + bytes / sector_size, __ATOMIC_RELAXED);
+	if(prev != first_sector){
+		op->seeks++;
+		op->seek_distance += prev > first_sector ? prev - first_sector : first_sector - prev;
+	}
+
+	if(write){
+		op->writes++;
+		op->sectors_written += bytes / sector_size;
+		op->bytes_written += bytes;
+	}else{
+		op->reads++;
+		op->sectors_read += bytes / sector_size;
+		op->bytes_read += bytes;
+	}
+}
+
+/**
+ * @brief Start timing a disk request.
+ * @return Start time, 0 when statistics are off.
+ */
+static inline unsigned long os_io_begin(){
+	return os_current != NULL ? os_clock() : 0;
+}
+
+/**
+ * @brief Add the time of a disk request to the running operation.
+ * @param start Value returned by os_io_begin.
+ */
+static inline void os_io_end(unsigned long start){
+	if(start != 0 && os_current != NULL){
+		os_current->io_ns += os_clock() - start;
+	}
+}
+
+/**
+ * @brief Count a sector cache lookup for the running operation.
+ */
+static inline void os_count_cache(int hit){
+	if(os_current != NULL){
+		if(hit){
+			os_current->cache_hits++;
+		}else{
+			os_current->cache_misses++;
+		}
+	}
+}
+
+/**
+ * @brief Count a dentry cache lookup for the running operation.
+ */
+static inline void os_count_dentry(int hit){
+	if(os_current != NULL){
+		if(hit){
+			os_current->dentry_hits++;
+		}else{
+			os_current->dentry_misses++;
+		}
+	}
+}
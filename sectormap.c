@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "sectormap.h"
+
+/* Sector map images.
+ *
+ * The map is drawn as a square of cells, in sector order from the top
+ * left, each cell scaled up to a block of pixels so small disks stay
+ * readable. A .pgm path gives a binary greyscale PGM, anything else an
+ * 8-bit palette PNG. The PNG is written with stored (uncompressed)
+ * deflate blocks, which needs no compression library; a map is at most a
+ * few hundred kilobytes either way.
+ */
+
+/* Width of the image in pixels the cells are scaled up to, about. */
+#define SM_IMAGE_WIDTH	512
+
+/* Palette index of the pixels past the last cell. */
+#define SM_PAD		4
+
+/* Largest stored deflate block. */
+#define SM_BLOCK	65535
+
+static const unsigned char palette[5][3] = {
+	{255, 255, 255},	/* SM_FREE, white. */
+	{ 70, 110, 180},	/* SM_DATA, blue. */
+	{230, 140,  30},	/* SM_META, orange. */
+	{165, 195, 235},	/* SM_PARTIAL, light blue. */
+	{200, 200, 200},	/* SM_PAD, grey. */
+};
+
+static const unsigned char grey[5] = {255, 0, 96, 176, 224};
+
+/**
+ * PNG output, with the checksums of the running chunk and zlib stream.
+ */
+struct png_out{
+	FILE *f;			/**< Output file. */
+	uint32_t crc;			/**< CRC-32 of the chunk so far. */
+	uint32_t adler_a;		/**< Adler-32 sums of the image data so far. */
+	uint32_t adler_b;
+};
+
+static uint32_t crc_table[256];
+
+
+static void crc_init(){
+	uint32_t c;
+	int n, k;
+
+	for(n = 0; n < 256; n++){
+		for(c = n, k = 0; k < 8; k++){
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[n] = c;
+	}
+}
+
+static void png_bytes(struct png_out *out, const unsigned char *p, size_t n){
+	size_t i;
+
+	for(i = 0; i < n; i++){
+		out->crc = crc_table[(out->crc ^ p[i]) & 0xff] ^ (out->crc >> 8);
+	}
+	fwrite(p, 1, n, out->f);
+}
+
+static void png_u32(struct png_out *out, uint32_t v){
+	unsigned char b[4] = {v >> 24, v >> 16, v >> 8, v};
+
+	png_bytes(out, b, 4);
+}
+
+/**
+ * @brief Start a chunk, its data follows.
+ */
+static void chunk_begin(struct png_out *out, char *type, uint32_t length){
+	png_u32(out, length);
+	out->crc = 0xffffffffu;
+	png_bytes(out, (unsigned char*)type, 4);
+}
+
+static void chunk_end(struct png_out *out){
+	uint32_t crc = out->crc ^ 0xffffffffu;
+
+	png_u32(out, crc);
+}
+
+/**
+ * @brief Image data bytes, added to the Adler-32 sum.
+ */
+static void png_data(struct png_out *out, const unsigned char *p, size_t n){
+	size_t i;
+
+	for(i = 0; i < n; i++){
+		out->adler_a = (out->adler_a + p[i]) % 65521;
+		out->adler_b = (out->adler_b + out->adler_a) % 65521;
+	}
+	png_bytes(out, p, n);
+}
+
+/**
+ * @brief Pixels of one image row.
+ * @param row Output, one palette index per pixel.
+ */
+static void draw_row(unsigned char *row, uint64_t y, unsigned char *cells, uint64_t n_cells, uint64_t side, int scale){
+	uint64_t x, cell;
+
+	for(x = 0; x < side * scale; x++){
+		cell = (y / scale) * side + x / scale;
+		row[x] = cell < n_cells ? cells[cell] : SM_PAD;
+	}
+}
+
+static int write_pgm(FILE *f, unsigned char *cells, uint64_t n_cells, uint64_t side, int scale){
+	unsigned char *row;
+	uint64_t x, y, width = side * scale, height = (n_cells + side - 1) / side * scale;
+
+	if( (row = malloc(width)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	fprintf(f, "P5\n%lu %lu\n255\n", (unsigned long)width, (unsigned long)height);
+	for(y = 0; y < height; y++){
+		draw_row(row, y, cells, n_cells, side, scale);
+		for(x = 0; x < width; x++){
+			row[x] = grey[row[x]];
+		}
+		fwrite(row, 1, width, f);
+	}
+
+	free(row);
+
+	return 0;
+}
+
+static int write_png(FILE *f, unsigned char *cells, uint64_t n_cells, uint64_t side, int scale){
+	static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	struct png_out out = {f, 0, 1, 0};
+	unsigned char *row, hdr[5];
+	uint64_t y, width = side * scale, height = (n_cells + side - 1) / side * scale;
+	uint64_t raw = height * (width + 1), blocks = (raw + SM_BLOCK - 1) / SM_BLOCK, left = SM_BLOCK, n, done;
+	unsigned char ihdr[5] = {8, 3, 0, 0, 0};
+	unsigned char zlib[2] = {0x78, 0x01};
+	uint32_t adler;
+
+	if(raw > 0xffffffffu / 2 || (row = malloc(width + 1)) == NULL){
+		perror("malloc()");
+		return 1;
+	}
+
+	crc_init();
+	fwrite(signature, 1, sizeof(signature), f);
+
+	chunk_begin(&out, "IHDR", 13);
+	png_u32(&out, width);
+	png_u32(&out, height);
+	png_bytes(&out, ihdr, sizeof(ihdr));
+	chunk_end(&out);
+
+	chunk_begin(&out, "PLTE", sizeof(palette));
+	png_bytes(&out, &palette[0][0], sizeof(palette));
+	chunk_end(&out);
+
+	/* zlib header, stored blocks of rows (filter 0, then the pixels), Adler-32. */
+	chunk_begin(&out, "IDAT", 2 + raw + 5 * blocks + 4);
+	png_bytes(&out, zlib, sizeof(zlib));
+
+	for(y = 0; y < height; y++){
+		row[0] = 0;
+		draw_row(row + 1, y, cells, n_cells, side, scale);
+
+		for(done = 0; done < width + 1; done += n){
+			if(left == SM_BLOCK){
+				n = raw < SM_BLOCK ? raw : SM_BLOCK;
+				hdr[0] = raw == n;
+				hdr[1] = n;
+				hdr[2] = n >> 8;
+				hdr[3] = ~n;
+				hdr[4] = ~n >> 8;
+				png_bytes(&out, hdr, sizeof(hdr));
+				left = 0;
+			}
+			n = width + 1 - done < SM_BLOCK - left ? width + 1 - done : SM_BLOCK - left;
+			png_data(&out, row + done, n);
+			left += n;
+			raw -= n;
+		}
+	}
+
+	adler = (out.adler_b << 16) | out.adler_a;
+	png_u32(&out, adler);
+	chunk_end(&out);
+
+	chunk_begin(&out, "IEND", 0);
+	chunk_end(&out);
+
+	free(row);
+
+	return 0;
+}
+
+/**
+ * @brief Write a sector map image.
+ * @param path Output file, PGM if it ends with ".pgm", PNG otherwise.
+ * @param cells Class of each cell, SM_FREE ... SM_PARTIAL.
+ * @param n_cells Number of cells.
+ * @return 0 on success.
+ */
+int sm_write(char *path, unsigned char *cells, uint64_t n_cells){
+	uint64_t side;
+	size_t len = strlen(path);
+	int scale, ret;
+	FILE *f;
+
+	if(n_cells == 0){
+		return 1;
+	}
+
+	side = (uint64_t)ceil(sqrt((double)n_cells));
+	scale = side < SM_IMAGE_WIDTH ? SM_IMAGE_WIDTH / side : 1;
+
+	if( (f = fopen(path, "wb")) == NULL){
+		perror("fopen()");
+		return 1;
+	}
+
+	if(len > 4 && !strcmp(path + len - 4, ".pgm")){
+		ret = write_pgm(f, cells, n_cells, side, scale);
+	}else{
+		ret = write_png(f, cells, n_cells, side, scale);
+	}
+
+	if(fclose(f) != 0){
+		perror("fclose()");
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,11 @@
+/* Sector map images. */
+
+#include <stdint.h>
+
+/* Cell classes, one byte per cell of the map. */
+#define SM_FREE		0	/**< Every sector free. */
+#define SM_DATA		1	/**< Every sector used, mostly by file data. */
+#define SM_META		2	/**< Mostly metadata: superblock, bitmap, journal, directories, extent tables. */
+#define SM_PARTIAL	3	/**< Some sectors used, some free. */
+
+int sm_write(char *path, unsigned char *cells, uint64_t n_cells);
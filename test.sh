@@ -18,6 +18,27 @@
 # 16) Delete /home/user/earth.jpg
 # 17) Rmdir /home/user/
 # 18) ls /
+# 19) Batch: mkdir, create and read back in one process
+# 20) Read /beach.jpg through the mmap backend and check MD5
+# 21) Create and delete /galaxy.jpg, free space must come back
+# 22) Format a 4K sector disk, read beach.jpg back and check MD5
+# 23) 100 entries with long names in one directory, then remove them
+# 24) mkdir on a second disk image, the default disk must not see it
+# 25) Multi-threaded stress run
+# 26) Import a host directory tree, read a nested file back and check MD5
+# 27) Create and read back through the io_uring and thread pool backends, check MD5
+# 28) Crash after a sync: the journal is replayed, check sun.jpg MD5
+# 29) Quick benchmark run, CSV output and baseline comparison
+# 30) Per-operation statistics, text and JSON
+# 31) Timing model with the SCAN and deadline schedulers, check MD5 and simulated time
+# 32) Sector map as PNG and PGM, with the fragmentation report
+# 33) Defragment a disk with holes, with a budget then to the end, check MD5
+# 34) Create from a pipe and read back to a pipe and to a file, check MD5 and size
+# 35) Byte ranges of beach.jpg, inside a sector, across sectors and past the end
+# 36) Append to a file, overwrite across sectors and write past the end, check MD5 and size
+# 37) Small files inline and packed, check MD5, the sectors they take and growing to extents
+# 38) Compressed files: fewer sectors than raw, check MD5, ranges, writes and the disk default, a fragmented disk
+# 39) Map and defragment a tree 60 directories deep, check MD5
 
 echo "########### Test 1 #############"
 #./simulfs -format
@@ -130,3 +151,594 @@ echo ""
 echo "########### Test 18 #############"
 ./simulfs -ls /
 
+echo ""
+echo "########### Test 19 #############"
+OMD5=$(md5sum images/earth.jpg | awk '{print $1}')
+
+./simulfs -batch - <<EOF
+# one mount for the whole script
+mkdir /batch
+create images/earth.jpg /batch/earth.jpg
+read images/recovered/earth.jpg /batch/earth.jpg
+ls /batch
+EOF
+
+CMD5=$(md5sum images/recovered/earth.jpg | awk '{print $1}')
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "batch earth.jpg MD5 error!"
+	exit 1
+fi;
+
+echo "Batch passed!"
+
+echo ""
+echo "########### Test 20 #############"
+OMD5=$(md5sum images/beach.jpg | awk '{print $1}')
+
+./simulfs -mmap -read images/recovered/beach.jpg /beach.jpg
+
+CMD5=$(md5sum images/recovered/beach.jpg | awk '{print $1}')
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "mmap beach.jpg MD5 error!"
+	exit 1
+fi;
+
+echo "Read /beach.jpg with -mmap passed!"
+
+echo ""
+echo "########### Test 21 #############"
+FREE1=$(./simulfs -map images/recovered/map.pgm | grep "Free space")
+
+./simulfs -create images/galaxy.jpg /galaxy.jpg
+./simulfs -del /galaxy.jpg
+
+FREE2=$(./simulfs -map images/recovered/map.pgm | grep "Free space")
+
+if [ "$FREE1" != "$FREE2" ]; then
+	echo "free space error: $FREE1 / $FREE2"
+	exit 1
+fi;
+
+echo "Free space after delete passed!"
+
+echo ""
+echo "########### Test 22 #############"
+OMD5=$(md5sum images/beach.jpg | awk '{print $1}')
+
+./simulfs -format 4K 8M
+./simulfs -create images/beach.jpg /beach.jpg
+./simulfs -read images/recovered/beach.jpg /beach.jpg
+
+CMD5=$(md5sum images/recovered/beach.jpg | awk '{print $1}')
+
+./simulfs -format
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "4K sectors beach.jpg MD5 error!"
+	exit 1
+fi;
+
+echo "4K sector disk passed!"
+
+echo ""
+echo "########### Test 23 #############"
+i=0
+{
+	echo "mkdir /many"
+	while [ $i -lt 100 ]; do
+		echo "create sector_map.gnuplot /many/a_long_file_name_to_fill_the_buckets_$i.jpg"
+		i=$((i+1))
+	done
+} | ./simulfs -batch - > /dev/null
+
+COUNT=$(./simulfs -ls /many | grep -c "^f ")
+
+i=0
+{
+	while [ $i -lt 100 ]; do
+		echo "del /many/a_long_file_name_to_fill_the_buckets_$i.jpg"
+		i=$((i+1))
+	done
+	echo "rmdir /many"
+} | ./simulfs -batch - > /dev/null
+
+if [ "$COUNT" != "100" ] || ./simulfs -ls /many > /dev/null; then
+	echo "large directory error: $COUNT entries"
+	exit 1
+fi;
+
+echo "Large directory passed!"
+
+echo ""
+echo "########### Test 24 #############"
+DISK2=images/recovered/second.fs
+
+./simulfs -disk $DISK2 -format 4K 4M
+./simulfs -disk $DISK2 -mkdir /second
+
+if ! ./simulfs -disk $DISK2 -ls / | grep -q "^d second" || ./simulfs -ls / | grep -q "^d second"; then
+	echo "second disk error!"
+	exit 1
+fi;
+
+rm -f $DISK2
+
+echo "Second disk image passed!"
+
+echo ""
+echo "########### Test 25 #############"
+if ! ./fs_stress 4 20; then
+	echo "multi-threaded stress error!"
+	exit 1
+fi;
+
+echo "Multi-threaded stress passed!"
+
+echo ""
+echo "########### Test 26 #############"
+TREE=images/recovered/tree
+OMD5=$(md5sum images/sun.jpg | awk '{print $1}')
+
+mkdir -p $TREE/sub
+cp images/beach.jpg images/galaxy.jpg $TREE/
+cp images/sun.jpg $TREE/sub/
+
+./simulfs -format 4K 16M
+./simulfs -import $TREE /tree 2
+./simulfs -read images/recovered/sun.jpg /tree/sub/sun.jpg
+
+CMD5=$(md5sum images/recovered/sun.jpg | awk '{print $1}')
+
+rm -rf $TREE
+./simulfs -format
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "import sun.jpg MD5 error!"
+	exit 1
+fi;
+
+echo "Directory import passed!"
+
+echo ""
+echo "########### Test 27 #############"
+OMD5=$(md5sum images/manhattan.jpg | awk '{print $1}')
+
+for BACKEND in -uring -threads; do
+	./simulfs $BACKEND -create images/manhattan.jpg /async.jpg
+	./simulfs $BACKEND -read images/recovered/async.jpg /async.jpg
+	./simulfs $BACKEND -del /async.jpg
+
+	CMD5=$(md5sum images/recovered/async.jpg | awk '{print $1}')
+
+	if [ "$OMD5" != "$CMD5" ]; then
+		echo "$BACKEND manhattan.jpg MD5 error!"
+		exit 1
+	fi;
+done
+
+echo "Asynchronous backends passed!"
+
+echo ""
+echo "########### Test 28 #############"
+OMD5=$(md5sum images/sun.jpg | awk '{print $1}')
+
+./simulfs -batch - <<EOF
+mkdir /crash
+create images/sun.jpg /crash/sun.jpg
+sync
+abort
+EOF
+
+if ! ./simulfs -ls /crash | grep -q "^Journal: replayed"; then
+	echo "journal replay error!"
+	exit 1
+fi;
+
+./simulfs -read images/recovered/sun.jpg /crash/sun.jpg
+./simulfs -del /crash/sun.jpg
+./simulfs -rmdir /crash
+
+CMD5=$(md5sum images/recovered/sun.jpg | awk '{print $1}')
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "journal sun.jpg MD5 error!"
+	exit 1
+fi;
+
+echo "Journal replay passed!"
+
+echo ""
+echo "########### Test 29 #############"
+if ! ./fs_bench -quick -o images/recovered/bench.csv; then
+	echo "benchmark error!"
+	exit 1
+fi;
+
+if ! head -1 images/recovered/bench.csv | grep -q "^workload,phase,ops,seconds,ops_per_s" ||
+   [ "$(grep -c "^deep,mix," images/recovered/bench.csv)" != "1" ]; then
+	echo "benchmark CSV error!"
+	exit 1
+fi;
+
+# Timings vary, only check that the baseline is read.
+if ! ./fs_bench -quick -workload small -baseline images/recovered/bench.csv -tolerance 100 | grep -q "^small *create"; then
+	echo "benchmark baseline error!"
+	exit 1
+fi;
+
+echo "Benchmark passed!"
+
+echo ""
+echo "########### Test 30 #############"
+./simulfs -stats-json -create images/sun.jpg /stats.jpg > images/recovered/stats.txt
+
+if ! grep -q '^{"create":{"ops":1,"failed":0,' images/recovered/stats.txt; then
+	echo "JSON statistics error!"
+	exit 1
+fi;
+
+if ! ./simulfs -stats -del /stats.jpg | grep -q "^del  *1  *0 "; then
+	echo "statistics error!"
+	exit 1
+fi;
+
+echo "Statistics passed!"
+
+echo ""
+echo "########### Test 31 #############"
+OMD5=$(md5sum images/galaxy.jpg | awk '{print $1}')
+
+for SCHED in scan deadline; do
+	if ! ./simulfs -model hdd -sched $SCHED -create images/galaxy.jpg /timed.jpg | grep -q "^Simulated disk: .* [1-9][0-9.]* ms"; then
+		echo "$SCHED simulated time error!"
+		exit 1
+	fi;
+
+	./simulfs -model ssd,rate=1000 -sched $SCHED -read images/recovered/timed.jpg /timed.jpg
+	./simulfs -del /timed.jpg
+
+	CMD5=$(md5sum images/recovered/timed.jpg | awk '{print $1}')
+
+	if [ "$OMD5" != "$CMD5" ]; then
+		echo "$SCHED galaxy.jpg MD5 error!"
+		exit 1
+	fi;
+done
+
+echo "Timing model passed!"
+
+echo ""
+echo "########### Test 32 #############"
+./simulfs -create images/earth.jpg /map.jpg
+./simulfs -map images/recovered/map.png > images/recovered/map.txt
+./simulfs -map images/recovered/map.pgm
+./simulfs -del /map.jpg
+
+if [ "$(head -c 4 images/recovered/map.png | tail -c 3)" != "PNG" ]; then
+	echo "PNG sector map error!"
+	exit 1
+fi;
+
+if [ "$(head -n 1 images/recovered/map.pgm)" != "P5" ]; then
+	echo "PGM sector map error!"
+	exit 1
+fi;
+
+if ! grep -q "^Fragmentation score: files [0-9.]*%, free space [0-9.]*%" images/recovered/map.txt; then
+	echo "fragmentation report error!"
+	exit 1
+fi;
+
+echo "Sector map passed!"
+
+echo ""
+echo "########### Test 33 #############"
+DISK3=images/recovered/defrag.fs
+./simulfs -disk $DISK3 -format
+
+for i in $(seq 1 16); do
+	echo "create images/galaxy.jpg /g$i.jpg"
+done | ./simulfs -disk $DISK3 -batch -
+
+for i in 1 3 5 7 9 11 13; do
+	echo "del /g$i.jpg"
+done | ./simulfs -disk $DISK3 -batch -
+
+# Only fits in two of the holes.
+./simulfs -disk $DISK3 -create images/beach.jpg /beach.jpg
+
+if ! ./simulfs -disk $DISK3 -defrag 100 | grep -q "stopped by the budget"; then
+	echo "defrag budget error!"
+	exit 1
+fi;
+
+if ! ./simulfs -disk $DISK3 -defrag | grep -q "^After: files 0.0% (10 extents for 10 files)"; then
+	echo "defrag error!"
+	exit 1
+fi;
+
+OMD5=$(md5sum images/beach.jpg | awk '{print $1}')
+./simulfs -disk $DISK3 -read images/recovered/defrag.jpg /beach.jpg
+CMD5=$(md5sum images/recovered/defrag.jpg | awk '{print $1}')
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "defragmented beach.jpg MD5 error!"
+	exit 1
+fi;
+
+rm -f $DISK3
+
+echo "Defrag passed!"
+
+echo ""
+echo "########### Test 34 #############"
+OMD5=$(md5sum < images/beach.jpg)
+
+cat images/beach.jpg | ./simulfs -create - /pipe.jpg
+
+CMD5=$(./simulfs -read - /pipe.jpg 2>/dev/null | md5sum)
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "pipe beach.jpg MD5 error!"
+	exit 1
+fi;
+
+./simulfs -read - /pipe.jpg > images/recovered/pipe.jpg 2>/dev/null
+./simulfs -del /pipe.jpg
+
+CMD5=$(md5sum < images/recovered/pipe.jpg)
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "stdout beach.jpg MD5 error!"
+	exit 1
+fi;
+
+if ! cat images/sun.jpg | ./simulfs -create - /pipe.jpg || ! ./simulfs -ls / | grep -q "^f pipe.jpg	13526 bytes"; then
+	echo "pipe size error!"
+	exit 1
+fi;
+
+./simulfs -del /pipe.jpg
+
+echo "Pipes passed!"
+
+echo ""
+echo "########### Test 35 #############"
+./simulfs -create images/beach.jpg /range.jpg
+
+for RANGE in "0 10" "511 2" "12345 50000" "110000 5000"; do
+	set -- $RANGE
+	OMD5=$(tail -c +$(($1 + 1)) images/beach.jpg | head -c $2 | md5sum)
+	CMD5=$(./simulfs -read-range - /range.jpg $1 $2 2>/dev/null | md5sum)
+
+	if [ "$OMD5" != "$CMD5" ]; then
+		echo "range $1 $2 MD5 error!"
+		exit 1
+	fi;
+done
+
+./simulfs -read-range images/recovered/range.jpg /range.jpg 100K 1M
+./simulfs -del /range.jpg
+
+if [ "$(wc -c < images/recovered/range.jpg)" -ne $((110790 - 102400)) ]; then
+	echo "range past the end error!"
+	exit 1
+fi;
+
+echo "Range reads passed!"
+
+echo ""
+echo "########### Test 36 #############"
+GROW=images/recovered/grow.jpg
+./simulfs -create images/sun.jpg /grow.jpg
+./simulfs -append images/beach.jpg /grow.jpg
+cat images/sun.jpg images/beach.jpg > $GROW.want
+
+# 100 bytes across a sector boundary, from stdin.
+head -c 100 images/beach.jpg | ./simulfs -write - /grow.jpg 1000
+{ head -c 1000 $GROW.want; head -c 100 images/beach.jpg; tail -c +1101 $GROW.want; } > $GROW.tmp
+mv $GROW.tmp $GROW.want
+
+# Past the end, the gap reads as zeros.
+./simulfs -write images/sun.jpg /grow.jpg 130000
+{ cat $GROW.want; head -c $((130000 - 124316)) /dev/zero; cat images/sun.jpg; } > $GROW.tmp
+mv $GROW.tmp $GROW.want
+
+./simulfs -read $GROW /grow.jpg
+OMD5=$(md5sum < $GROW.want)
+CMD5=$(md5sum < $GROW)
+
+if [ "$OMD5" != "$CMD5" ]; then
+	echo "grow.jpg MD5 error!"
+	exit 1
+fi;
+
+if ! ./simulfs -ls / | grep -q "^f grow.jpg	143526 bytes"; then
+	echo "grow.jpg size error!"
+	exit 1
+fi;
+
+if ./simulfs -append images/sun.jpg /missing.jpg; then
+	echo "append to a missing file error!"
+	exit 1
+fi;
+
+./simulfs -del /grow.jpg
+rm -f $GROW.want
+
+echo "In-place writes passed!"
+
+echo ""
+echo "########### Test 37 #############"
+SMALL=images/recovered/small
+
+if ! ./simulfs -create test.txt /tiny.txt | grep -q "^Inline"; then
+	echo "test.txt not inline error!"
+	exit 1
+fi;
+
+# Sixteen 100 byte files share pack sectors, a pipe included.
+head -c 100 images/beach.jpg > $SMALL.want
+if ! ./simulfs -create - /packed0.jpg < $SMALL.want | grep -q "^Packed"; then
+	echo "packed file error!"
+	exit 1
+fi;
+FIRST=$(./simulfs -create $SMALL.want /packed1.jpg | sed -n 's/^Packed, free sectors: //p')
+for N in 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do
+	LAST=$(./simulfs -create $SMALL.want /packed$N.jpg | sed -n 's/^Packed, free sectors: //p')
+done
+
+if [ $((FIRST - LAST)) -gt 5 ]; then
+	echo "packed files took $((FIRST - LAST)) sectors error!"
+	exit 1
+fi;
+
+for F in tiny.txt:test.txt packed0.jpg:$SMALL.want packed15.jpg:$SMALL.want; do
+	./simulfs -read $SMALL /${F%%:*}
+	if [ "$(md5sum < $SMALL)" != "$(md5sum < ${F#*:})" ]; then
+		echo "${F%%:*} MD5 error!"
+		exit 1
+	fi;
+done
+
+# Growing past a pack sector moves the file to extents.
+./simulfs -append images/beach.jpg /packed7.jpg
+./simulfs -read $SMALL /packed7.jpg
+if [ "$(md5sum < $SMALL)" != "$(cat $SMALL.want images/beach.jpg | md5sum)" ]; then
+	echo "packed7.jpg MD5 error!"
+	exit 1
+fi;
+
+./simulfs -del /tiny.txt
+for N in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do
+	./simulfs -del /packed$N.jpg
+done
+rm -f $SMALL.want
+
+echo "Small files passed!"
+
+echo ""
+echo "########### Test 38 #############"
+LZ=images/recovered/lz.c
+
+# The same text raw, compressed, then raw again: the sectors each one takes.
+A=$(./simulfs -create filesystem.c /raw.c | sed -n 's/.*free sectors: //p')
+B=$(./simulfs -z -create filesystem.c /lz.c | sed -n 's/^Compressed in [0-9]* chunks, free sectors: //p')
+C=$(./simulfs -create filesystem.c /raw2.c | sed -n 's/.*free sectors: //p')
+
+if [ -z "$B" ] || [ $((A - B)) -ge $((B - C)) ]; then
+	echo "compressed file took $((A - B)) sectors, raw $((B - C)) error!"
+	exit 1
+fi;
+
+./simulfs -read $LZ /lz.c
+if [ "$(md5sum < $LZ)" != "$(md5sum < filesystem.c)" ]; then
+	echo "lz.c MD5 error!"
+	exit 1
+fi;
+
+for RANGE in "0 10" "32760 20" "40000 50000"; do
+	set -- $RANGE
+	OMD5=$(tail -c +$(($1 + 1)) filesystem.c | head -c $2 | md5sum)
+	CMD5=$(./simulfs -read-range - /lz.c $1 $2 2>/dev/null | md5sum)
+
+	if [ "$OMD5" != "$CMD5" ]; then
+		echo "compressed range $1 $2 MD5 error!"
+		exit 1
+	fi;
+done
+
+# Writes go through the chunks, the file stays compressed.
+./simulfs -append test.sh /lz.c
+head -c 100 images/beach.jpg | ./simulfs -write - /lz.c 32700
+{ head -c 32700 filesystem.c; head -c 100 images/beach.jpg; tail -c +32801 filesystem.c; cat test.sh; } > $LZ.want
+./simulfs -read $LZ /lz.c
+if [ "$(md5sum < $LZ)" != "$(md5sum < $LZ.want)" ]; then
+	echo "written lz.c MD5 error!"
+	exit 1
+fi;
+
+# Compression kept as the default of the disk.
+./simulfs -compress on
+if ! ./simulfs -create test.sh /lz.sh | grep -q "^Compressed"; then
+	echo "compression default error!"
+	exit 1
+fi;
+./simulfs -compress off
+if ./simulfs -create test.sh /raw.sh | grep -q "^Compressed"; then
+	echo "compression off error!"
+	exit 1
+fi;
+
+for F in raw.c lz.c raw2.c lz.sh raw.sh; do
+	./simulfs -del /$F
+done
+rm -f $LZ.want
+
+# Holes of 40 sectors, shorter than a chunk: a file is stored as is, a pipe fails.
+FRAG=images/recovered/frag.fs
+./simulfs -disk $FRAG -format 512 1M
+for N in $(seq 1 60); do
+	echo "create images/earth.jpg /e$N"
+done > $FRAG.txt
+for N in $(seq 1 2 60); do
+	echo "del /e$N"
+done >> $FRAG.txt
+./simulfs -disk $FRAG -batch $FRAG.txt > /dev/null
+
+if ./simulfs -disk $FRAG -z -create images/beach.jpg /beach.jpg | grep -q "^Compressed"; then
+	echo "fragmented compressed file error!"
+	exit 1
+fi;
+./simulfs -disk $FRAG -read $LZ /beach.jpg
+if [ "$(md5sum < $LZ)" != "$(md5sum < images/beach.jpg)" ]; then
+	echo "fragmented beach.jpg MD5 error!"
+	exit 1
+fi;
+
+if ! cat images/beach.jpg | ./simulfs -disk $FRAG -z -create - /pipe.jpg | grep -q "^Error: No free run"; then
+	echo "fragmented compressed pipe error!"
+	exit 1
+fi;
+
+rm -f $FRAG $FRAG.txt
+
+echo "Compressed files passed!"
+
+echo ""
+echo "########### Test 39 #############"
+DEEP=images/recovered/deep.fs
+./simulfs -disk $DEEP -format 512 8M
+
+# Sixty nested directories, a hole then a file at the bottom.
+DIR=""
+for N in $(seq 1 60); do
+	DIR="$DIR/d$N"
+	echo "mkdir $DIR"
+done > $DEEP.txt
+echo "create images/beach.jpg $DIR/hole.jpg" >> $DEEP.txt
+echo "create images/sun.jpg $DIR/sun.jpg" >> $DEEP.txt
+echo "del $DIR/hole.jpg" >> $DEEP.txt
+./simulfs -disk $DEEP -batch $DEEP.txt > /dev/null
+
+if ! ./simulfs -disk $DEEP -map $DEEP.pgm; then
+	echo "deep tree map error!"
+	exit 1
+fi;
+
+if ! ./simulfs -disk $DEEP -defrag | grep -q "^Moved 1 files and 61 directories"; then
+	echo "deep tree defrag error!"
+	exit 1
+fi;
+
+./simulfs -disk $DEEP -read images/recovered/deep.jpg $DIR/sun.jpg
+if [ "$(md5sum < images/recovered/deep.jpg)" != "$(md5sum < images/sun.jpg)" ]; then
+	echo "deep tree sun.jpg MD5 error!"
+	exit 1
+fi;
+
+rm -f $DEEP $DEEP.txt $DEEP.pgm images/recovered/deep.jpg
+
+echo "Deep tree passed!"